@@ -0,0 +1,129 @@
+#pragma once
+#include "mem.h"
+#include "Types.h"
+
+// Bump allocator that hands out memory from a few large blocks and frees
+// them all at once. Used for a ChunkColumn's block entities so they are one
+// or two heap allocations instead of dozens, and unloading is a single free.
+class Arena {
+ public:
+  struct Block {
+    Block *next;
+    int size;
+    int used;
+  };
+
+  // Blocks after the first are at least this big
+  int growSize = 16 * 1024;
+  int blockCount = 0;
+  int bytesReserved = 0;
+
+  Arena() {}
+
+  Arena(int initialSize) { this->addBlock(initialSize); }
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns uninitialized memory, or null if the heap is exhausted
+  void *allocate(int size, int alignment = 8) {
+    Block *block = this->head;
+    if (block) {
+      int start = align(block->used, alignment);
+      if (start + size <= block->size) {
+        block->used = start + size;
+        return payload(block) + start;
+      }
+    }
+    block = this->addBlock(size > this->growSize ? size : this->growSize);
+    if (!block) return nullptr;
+    int start = align(block->used, alignment);
+    block->used = start + size;
+    return payload(block) + start;
+  }
+
+  template <typename T>
+  T *allocate(int count) {
+    return (T *)this->allocate(count * sizeof(T), alignof(T));
+  }
+
+  template <typename T>
+  T *allocateZeroed(int count) {
+    auto ptr = this->allocate<T>(count);
+    if (ptr) memset(ptr, 0, count * sizeof(T));
+    return ptr;
+  }
+
+  // Makes room for at least `size` more bytes in the current block, so the
+  // following allocations are contiguous
+  bool reserve(int size) {
+    if (this->head && this->head->size - this->head->used >= size) return true;
+    return this->addBlock(size) != nullptr;
+  }
+
+  int bytesUsed() {
+    int used = 0;
+    for (Block *b = this->head; b; b = b->next) used += b->used;
+    return used;
+  }
+
+  // Frees every block but the first, which is usually sized for what the
+  // owner typically needs, and rewinds it to its first `retain` bytes. Anything allocated
+  // before that point stays valid.
+  void reset(int retain = 0) {
+    if (!this->first) return;
+    Block *block = this->head;
+    while (block != this->first) {
+      Block *next = block->next;
+      this->bytesReserved -= block->size;
+      this->blockCount--;
+      Deallocate(block);
+      block = next;
+    }
+    this->head = this->first;
+    this->first->next = nullptr;
+    this->first->used = retain;
+  }
+
+  void release() {
+    Block *block = this->head;
+    while (block) {
+      Block *next = block->next;
+      Deallocate(block);
+      block = next;
+    }
+    this->head = nullptr;
+    this->first = nullptr;
+    this->blockCount = 0;
+    this->bytesReserved = 0;
+  }
+
+  ~Arena() { this->release(); }
+
+ private:
+  // Newest block, which allocations come from
+  Block *head = nullptr;
+  Block *first = nullptr;
+
+  static inline int align(int value, int alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+  }
+
+  static inline u8 *payload(Block *block) {
+    return (u8 *)block + align(sizeof(Block), 16);
+  }
+
+  Block *addBlock(int size) {
+    int headerSize = align(sizeof(Block), 16);
+    auto block = (Block *)malloc(headerSize + size);
+    if (!block) return nullptr;
+    block->size = size;
+    block->used = 0;
+    block->next = this->head;
+    this->head = block;
+    if (!this->first) this->first = block;
+    this->blockCount++;
+    this->bytesReserved += size;
+    return block;
+  }
+};
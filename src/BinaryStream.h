@@ -1,5 +1,5 @@
 #pragma once
-#include "Mem.h"
+#include "mem.h"
 #include "Types.h"
 
 class BinaryStream {
@@ -14,7 +14,8 @@ class BinaryStream {
   BinaryStream(int size) {
     weAllocated = true;
     this->data = Allocate<unsigned char>(size);
-    this->size = size;
+    // Out of memory: an empty stream, which reserve() may still grow
+    this->size = this->data ? size : 0;
   }
 
   BinaryStream(void *data, int size) {
@@ -22,8 +23,17 @@ class BinaryStream {
     this->size = size;
   }
 
+  // Past the end reads as zeros; callers compare readPosition with size to
+  // tell
   void read(void *data, int size) {
-    memcpy(data, this->data + this->readPosition, size);
+    int available = this->size - this->readPosition;
+    if (available < 0 || this->readPosition < 0) available = 0;
+    if (size <= available) {
+      memcpy(data, this->data + this->readPosition, size);
+    } else {
+      if (available) memcpy(data, this->data + this->readPosition, available);
+      memset((u8 *)data + available, 0, size - available);
+    }
     this->readPosition += size;
   }
 
@@ -47,6 +57,20 @@ class BinaryStream {
     memcpy(strm.data, this->data + byteOffset, this->writePosition);
   }
 
+  // Grows the buffer to hold at least `capacity` bytes. Only streams that own
+  // their buffer can grow.
+  bool reserve(int capacity) {
+    if (capacity <= this->size) return true;
+    if (!weAllocated) return false;
+    int newSize = this->size * 2;
+    if (newSize < capacity) newSize = capacity;
+    auto grown = (unsigned char *)reallocate(this->data, this->size, newSize);
+    if (!grown) return false;
+    this->data = grown;
+    this->size = newSize;
+    return true;
+  }
+
   void skip(int size) { this->readPosition += size; }
 
   i64 readLongLE() {
@@ -138,7 +162,11 @@ class BinaryStream {
   }
 
   unsigned char readByte() {
-    assert((this->readPosition + 1) < this->size, "Reading overflow");
+    if (this->readPosition >= this->size || this->readPosition < 0) {
+      assert(false, "Reading overflow");
+      this->readPosition++;
+      return 0;
+    }
     return this->data[this->readPosition++];
   }
 
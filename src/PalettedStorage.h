@@ -1,6 +1,6 @@
 #pragma once
 #include "BinaryStream.h"
-#include "Mem.h"
+#include "mem.h"
 #include "Types.h"
 
 template <typename Word = unsigned int>
@@ -15,6 +15,7 @@ class PalettedStorage {
   int mask = 0;
   int byteSize = 0;
   Word *words = nullptr;
+  bool weAllocated = false;
 
   PalettedStorage() {}
 
@@ -22,7 +23,9 @@ class PalettedStorage {
     init(bitsPerBlock, capacity);
   }
 
-  void init(int bitsPerBlock, int capacity = 4096) {
+  // With `storage`, the words live in caller owned memory (an arena or a
+  // stack buffer) that must hold at least wordsCountFor(...) words
+  void init(int bitsPerBlock, int capacity = 4096, Word *storage = nullptr) {
     this->bitsPerBlock = bitsPerBlock;
     this->blocksPerWord = FLOOR(wordBitSize / (float)bitsPerBlock);
     this->paddingPerWord = wordBitSize % bitsPerBlock;
@@ -30,7 +33,14 @@ class PalettedStorage {
     this->byteSize = this->wordsCount * wordByteSize;
     this->mask = (1 << bitsPerBlock) - 1;
 
-    this->words = Allocate<Word>(this->wordsCount);
+    if (this->weAllocated) Deallocate(this->words);
+    this->weAllocated = !storage;
+    this->words = storage ? storage : Allocate<Word>(this->wordsCount);
+  }
+
+  static int wordsCountFor(int bitsPerBlock, int capacity = 4096) {
+    int blocksPerWord = (int)(sizeof(Word) * 8) / bitsPerBlock;
+    return (capacity + blocksPerWord - 1) / blocksPerWord;
   }
 
   void read(BinaryStream &stream) { stream.read(this->words, this->byteSize); }
@@ -39,28 +49,67 @@ class PalettedStorage {
     stream.write(this->words, this->byteSize);
   }
 
+  // Words as big endian longs, the way Java Edition sends them
+  void readBE(BinaryStream &stream) {
+    static_assert(sizeof(Word) == 8, "Java Edition words are longs");
+    this->read(stream);
+    for (int i = 0; i < this->wordsCount; i++) {
+      this->words[i] = __builtin_bswap64(this->words[i]);
+    }
+  }
+
+  void writeBE(BinaryStream &stream) {
+    static_assert(sizeof(Word) == 8, "Java Edition words are longs");
+    for (int i = 0; i < this->wordsCount; i++) {
+      stream.writeULongBE(this->words[i]);
+    }
+  }
+
   int readBits(int index, int offset) {
     return (this->words[index] >> offset) & this->mask;
   }
 
   void writeBits(int index, int offset, int data) {
     assert(index < this->wordsCount, "writing overflow");
-    this->words[index] &= ~(this->mask << offset);
-    this->words[index] |= (data & this->mask) << offset;
+    this->words[index] &= ~((Word)this->mask << offset);
+    this->words[index] |= (Word)(data & this->mask) << offset;
   }
 
   int get(int index) {
-    int ix = FLOOR(index / this->blocksPerWord);
-    int offset = (ix % blocksPerWord) * this->bitsPerBlock;
+    int ix = index / this->blocksPerWord;
+    int offset = (index % this->blocksPerWord) * this->bitsPerBlock;
     return readBits(ix, offset);
   }
 
   void set(int index, int data) {
-    int ix = FLOOR(index / this->blocksPerWord);
-    int offset = (ix % blocksPerWord) * this->bitsPerBlock;
+    int ix = index / this->blocksPerWord;
+    int offset = (index % this->blocksPerWord) * this->bitsPerBlock;
     writeBits(ix, offset, data);
   }
 
+  // Bulk set()/get() of the first `count` values, a word at a time
+  void pack(const u16 *values, int count) {
+    int i = 0;
+    for (int w = 0; w < this->wordsCount; w++) {
+      Word word = 0;
+      for (int j = 0; j < this->blocksPerWord && i < count; j++, i++) {
+        word |= (Word)values[i] << (j * this->bitsPerBlock);
+      }
+      this->words[w] = word;
+    }
+  }
+
+  void unpack(u16 *values, int count) {
+    int i = 0;
+    for (int w = 0; w < this->wordsCount; w++) {
+      Word word = this->words[w];
+      for (int j = 0; j < this->blocksPerWord && i < count; j++, i++) {
+        values[i] = word & this->mask;
+        word >>= this->bitsPerBlock;
+      }
+    }
+  }
+
   void dump() {
     for (int i = 0; i < this->wordsCount; i++) {
       for (int j = 0; j < wordByteSize; j++) {
@@ -70,5 +119,7 @@ class PalettedStorage {
     printf("\n");
   }
 
-  ~PalettedStorage() { Deallocate(this->words); }
+  ~PalettedStorage() {
+    if (this->weAllocated) Deallocate(this->words);
+  }
 };
@@ -1,3 +1,262 @@
 #pragma once
+#include "Types.h"
 
-class Registry {};
\ No newline at end of file
+// Block state registry backed by a compact blob made from minecraft-data by
+// tools/genRegistry.js. The tables are used in place: loading checks the
+// header and that every table lies within the blob, then points into it, so
+// the blob must outlive the Registry.
+//
+// All integers are little endian and every table is 4 byte aligned.
+
+const u32 REGISTRY_MAGIC = 0x4752434d;  // "MCRG"
+const u32 REGISTRY_VERSION = 1;
+
+enum BlockStateFlag : u8 {
+  STATE_AIR = 1,
+  // Has a collision box
+  STATE_SOLID = 2,
+  STATE_FLUID = 4,
+  // Lets light or sight through (glass, leaves, air...)
+  STATE_TRANSPARENT = 8,
+  // A full, non-transparent cube: hides the faces of its neighbours
+  STATE_OPAQUE_CUBE = 16
+};
+
+struct RegistryHeader {
+  u32 magic;
+  u32 version;
+  u32 stateCount;
+  u32 blockCount;
+  u32 propertyCount;
+  u32 valueCount;
+  // Per state tables
+  u32 stateFlagsOffset;       // u8, BlockStateFlag
+  u32 stateLightOffset;       // u8, filtered light << 4 | emitted light
+  u32 stateBlockOffset;       // u16, block index
+  u32 statePropertiesOffset;  // u32, packed property value indices
+  // Per block tables
+  u32 blocksOffset;      // RegistryBlock
+  u32 propertiesOffset;  // RegistryProperty
+  u32 valuesOffset;      // u32 string offsets of property values
+  u32 stringsOffset;     // u8 length prefixed strings
+  // Name lookup: hash-and-displace perfect hash over block names
+  u32 hashSize;
+  u32 hashBucketCount;
+  u32 hashDisplacementsOffset;  // u32 per bucket
+  u32 hashSlotsOffset;          // u16 block index per slot
+};
+
+struct RegistryBlock {
+  u32 name;
+  u16 minStateId;
+  u16 maxStateId;
+  u16 defaultStateId;
+  u16 firstProperty;
+  u8 propertyCount;
+  u8 padding[3];
+};
+
+struct RegistryProperty {
+  u32 name;
+  u16 firstValue;
+  u8 valueCount;
+  // Position of this property's value index in the state's packed bitfield
+  u8 shift;
+  u8 bits;
+  u8 padding[3];
+};
+
+// FNV-1a, seeded for the perfect hash. Must match tools/genRegistry.js.
+inline u32 registryHash(u32 seed, const char *data, int length) {
+  u32 hash = 2166136261u ^ seed;
+  for (int i = 0; i < length; i++) {
+    hash ^= (u8)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+class Registry {
+ public:
+  const RegistryHeader *header = nullptr;
+  int stateCount = 0;
+  int blockCount = 0;
+
+  Registry() {}
+
+  // Returns false if the blob is not a registry this build understands
+  bool load(const u8 *blob, int length) {
+    if (length < (int)sizeof(RegistryHeader)) return false;
+    auto header = (const RegistryHeader *)blob;
+    if (header->magic != REGISTRY_MAGIC ||
+        header->version != REGISTRY_VERSION) {
+      return false;
+    }
+    u32 states = header->stateCount;
+    if (!fits(header->stateFlagsOffset, states, 1, length) ||
+        !fits(header->stateLightOffset, states, 1, length) ||
+        !fits(header->stateBlockOffset, states, 2, length) ||
+        !fits(header->statePropertiesOffset, states, 4, length) ||
+        !fits(header->blocksOffset, header->blockCount, sizeof(RegistryBlock),
+              length) ||
+        !fits(header->propertiesOffset, header->propertyCount,
+              sizeof(RegistryProperty), length) ||
+        !fits(header->valuesOffset, header->valueCount, 4, length) ||
+        !fits(header->stringsOffset, 0, 1, length) ||
+        !fits(header->hashDisplacementsOffset, header->hashBucketCount, 4,
+              length) ||
+        !fits(header->hashSlotsOffset, header->hashSize, 2, length)) {
+      return false;
+    }
+    if (!header->hashBucketCount) return false;
+    this->base = blob;
+    this->header = header;
+    this->stateCount = header->stateCount;
+    this->blockCount = header->blockCount;
+    this->flags = blob + header->stateFlagsOffset;
+    this->light = blob + header->stateLightOffset;
+    this->stateBlocks = (const u16 *)(blob + header->stateBlockOffset);
+    this->stateProperties = (const u32 *)(blob + header->statePropertiesOffset);
+    this->blocks = (const RegistryBlock *)(blob + header->blocksOffset);
+    this->properties = (const RegistryProperty *)(blob + header->propertiesOffset);
+    this->values = (const u32 *)(blob + header->valuesOffset);
+    this->strings = blob + header->stringsOffset;
+    this->displacements = (const u32 *)(blob + header->hashDisplacementsOffset);
+    this->slots = (const u16 *)(blob + header->hashSlotsOffset);
+    return true;
+  }
+
+  inline bool isValid(int stateId) {
+    return (u32)stateId < (u32)this->stateCount;
+  }
+
+  inline u8 getFlags(int stateId) {
+    return isValid(stateId) ? this->flags[stateId] : 0;
+  }
+
+  inline bool isAir(int stateId) { return getFlags(stateId) & STATE_AIR; }
+  inline bool isSolid(int stateId) { return getFlags(stateId) & STATE_SOLID; }
+  inline bool isFluid(int stateId) { return getFlags(stateId) & STATE_FLUID; }
+  inline bool isTransparent(int stateId) {
+    return getFlags(stateId) & STATE_TRANSPARENT;
+  }
+  inline bool isOpaqueCube(int stateId) {
+    return getFlags(stateId) & STATE_OPAQUE_CUBE;
+  }
+
+  // How much light this state removes as light passes through it, 0-15
+  inline int getOpacity(int stateId) {
+    return isValid(stateId) ? this->light[stateId] >> 4 : 0;
+  }
+
+  inline int getEmission(int stateId) {
+    return isValid(stateId) ? this->light[stateId] & 0xf : 0;
+  }
+
+  inline int getBlockIndex(int stateId) {
+    return isValid(stateId) ? this->stateBlocks[stateId] : -1;
+  }
+
+  inline const RegistryBlock *getBlock(int stateId) {
+    return isValid(stateId) ? &this->blocks[this->stateBlocks[stateId]]
+                            : nullptr;
+  }
+
+  // All of a state's property value indices, packed per RegistryProperty
+  inline u32 getPropertyBits(int stateId) {
+    return isValid(stateId) ? this->stateProperties[stateId] : 0;
+  }
+
+  // Index into the block's nth property's values, or -1
+  int getPropertyValue(int stateId, int property) {
+    auto block = this->getBlock(stateId);
+    if (!block || property >= block->propertyCount) return -1;
+    auto &prop = this->properties[block->firstProperty + property];
+    return (this->stateProperties[stateId] >> prop.shift) &
+           ((1 << prop.bits) - 1);
+  }
+
+  const RegistryProperty *getProperty(int blockIndex, int property) {
+    auto &block = this->blocks[blockIndex];
+    if (property >= block.propertyCount) return nullptr;
+    return &this->properties[block.firstProperty + property];
+  }
+
+  // Strings are not null terminated
+  const char *getString(u32 offset, out int &length) {
+    length = this->strings[offset];
+    return (const char *)this->strings + offset + 1;
+  }
+
+  const char *getBlockName(int blockIndex, out int &length) {
+    return this->getString(this->blocks[blockIndex].name, length);
+  }
+
+  const char *getPropertyValueName(const RegistryProperty *prop, int value,
+                                   out int &length) {
+    return this->getString(this->values[prop->firstValue + value], length);
+  }
+
+  // Block index by name, with or without the "minecraft:" namespace, or -1
+  int findBlock(const char *name, int length) {
+    if (length > 10 && !this->compare(name, "minecraft:", 10)) {
+      name += 10;
+      length -= 10;
+    }
+    if (!this->header || !this->header->hashSize) return -1;
+    u32 bucket = registryHash(0, name, length) % this->header->hashBucketCount;
+    u32 slot = registryHash(this->displacements[bucket], name, length) %
+               this->header->hashSize;
+    int index = this->slots[slot];
+    if (index == 0xffff) return -1;
+
+    int nameLength;
+    auto blockName = this->getBlockName(index, nameLength);
+    if (nameLength != length || this->compare(name, blockName, length)) {
+      return -1;
+    }
+    return index;
+  }
+
+  int getDefaultStateId(const char *name, int length) {
+    int index = this->findBlock(name, length);
+    return index < 0 ? -1 : this->blocks[index].defaultStateId;
+  }
+
+ private:
+  const u8 *base = nullptr;
+  const u8 *flags = nullptr;
+  const u8 *light = nullptr;
+  const u16 *stateBlocks = nullptr;
+  const u32 *stateProperties = nullptr;
+  const RegistryBlock *blocks = nullptr;
+  const RegistryProperty *properties = nullptr;
+  const u32 *values = nullptr;
+  const u8 *strings = nullptr;
+  const u32 *displacements = nullptr;
+  const u16 *slots = nullptr;
+
+  // Whether `count` entries of `size` bytes at `offset` are in a blob of
+  // `length` bytes, and aligned as the format promises
+  static bool fits(u32 offset, u32 count, u32 size, int length) {
+    return offset % 4 == 0 && (u64)offset + (u64)count * size <= (u64)length;
+  }
+
+  static int compare(const char *a, const char *b, int length) {
+    for (int i = 0; i < length; i++) {
+      if (a[i] != b[i]) return 1;
+    }
+    return 0;
+  }
+};
+
+// Air check that still works before a registry has been loaded, when only
+// the vanilla air state (0) is known
+inline bool isAirState(Registry *registry, int stateId) {
+  return registry ? registry->isAir(stateId) : stateId == 0;
+}
+
+// Likewise, treating every state but air as a full cube without a registry
+inline bool isOpaqueCubeState(Registry *registry, int stateId) {
+  return registry ? registry->isOpaqueCube(stateId) : stateId != 0;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+// Native builds may be called from several threads, wasm builds only when
+// built with WALLOC_THREADS (shared memory). Otherwise locks compile away.
+#if !defined(WEBASSEMBLY) || defined(WALLOC_THREADS)
+#define MCW_THREADS 1
+#define MCW_THREAD_LOCAL thread_local
+#else
+#define MCW_THREAD_LOCAL
+#endif
+
+// Reference counts shared across threads. atomicAdd returns the new value.
+inline int atomicAdd(int *value, int delta) {
+#ifdef MCW_THREADS
+  return __atomic_add_fetch(value, delta, __ATOMIC_ACQ_REL);
+#else
+  return *value += delta;
+#endif
+}
+
+inline int atomicLoad(int *value) {
+#ifdef MCW_THREADS
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#else
+  return *value;
+#endif
+}
+
+inline void atomicStore(int *value, int newValue) {
+#ifdef MCW_THREADS
+  __atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+#else
+  *value = newValue;
+#endif
+}
+
+// For short critical sections only; waiters spin
+class SpinLock {
+ public:
+  void lock() {
+#ifdef MCW_THREADS
+    while (__atomic_exchange_n(&this->locked, 1, __ATOMIC_ACQUIRE)) {
+      while (__atomic_load_n(&this->locked, __ATOMIC_RELAXED)) {
+      }
+    }
+#endif
+  }
+
+  void unlock() {
+#ifdef MCW_THREADS
+    __atomic_store_n(&this->locked, 0, __ATOMIC_RELEASE);
+#endif
+  }
+
+ private:
+  int locked = 0;
+};
+
+class LockGuard {
+ public:
+  LockGuard(SpinLock &lock) : lock(lock) { lock.lock(); }
+  ~LockGuard() { this->lock.unlock(); }
+
+  LockGuard(const LockGuard &) = delete;
+  LockGuard &operator=(const LockGuard &) = delete;
+
+ private:
+  SpinLock &lock;
+};
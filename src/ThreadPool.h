@@ -0,0 +1,201 @@
+#pragma once
+// Native builds only. Include before Types.h: its `out` macro breaks some
+// standard headers.
+#ifndef WEBASSEMBLY
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// Work stealing pool for batch calls. Each worker owns a deque of index
+// ranges: it takes work from the back of its own and steals from the front of
+// the others' when it runs dry, so a few slow chunks don't hold up a batch.
+// The calling thread works on its batch too instead of just waiting.
+//
+// Workers get STACK_SIZE stacks where threads can be given one (pthreads);
+// std::thread's default is as little as 512KB on macOS. On Windows they get
+// the executable's default, which the README covers.
+class ThreadPool {
+ public:
+  // Chunk encoding keeps ~1MB buffers on the stack
+  static const size_t STACK_SIZE = 4 << 20;
+
+  ThreadPool(int threads = 0) {
+    if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+    // The caller takes part, so n threads of parallelism need n - 1 workers
+    int workers = threads > 1 ? threads - 1 : 0;
+    this->queues = std::vector<Queue>(workers + 1);
+    // A worker that fails to start leaves its queue to be stolen from
+    for (int i = 0; i < workers; i++) this->startWorker(i);
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(this->sleepLock);
+      this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (auto &thread : this->threads) {
+#ifdef _WIN32
+      thread.join();
+#else
+      pthread_join(thread, nullptr);
+#endif
+    }
+  }
+
+  int getThreadCount() { return (int)this->threads.size() + 1; }
+
+  // Runs fn(i) for every i in [0, count) and returns once all have finished.
+  // Safe to call from several threads at once.
+  void parallelFor(int count, const std::function<void(int)> &fn) {
+    if (count <= 0) return;
+    int threads = this->getThreadCount();
+    if (threads == 1 || count == 1) {
+      for (int i = 0; i < count; i++) fn(i);
+      return;
+    }
+
+    // Several ranges per thread so stealing can even out uneven chunks
+    int grain = count / (threads * 4);
+    if (grain < 1) grain = 1;
+    Job job{fn, {0}};
+    int queue = 0;
+    for (int begin = 0; begin < count; begin += grain) {
+      int end = begin + grain < count ? begin + grain : count;
+      job.pending.fetch_add(1, std::memory_order_relaxed);
+      this->push(queue, {&job, begin, end});
+      queue = (queue + 1) % (int)this->queues.size();
+    }
+    this->wake.notify_all();
+
+    // The last queue belongs to callers
+    int self = (int)this->queues.size() - 1;
+    while (job.pending.load(std::memory_order_acquire)) {
+      Task task;
+      if (this->take(self, task)) {
+        this->run(task);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  struct Job {
+    const std::function<void(int)> &fn;
+    std::atomic<int> pending;
+  };
+
+  struct Task {
+    Job *job = nullptr;
+    int begin = 0;
+    int end = 0;
+  };
+
+  struct Queue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<Queue> queues;
+#ifdef _WIN32
+  std::vector<std::thread> threads;
+#else
+  std::vector<pthread_t> threads;
+#endif
+  std::mutex sleepLock;
+  std::condition_variable wake;
+  std::atomic<int> queued{0};
+  bool stopping = false;
+
+  struct WorkerStart {
+    ThreadPool *pool;
+    int self;
+  };
+
+  void startWorker(int self) {
+#ifdef _WIN32
+    this->threads.emplace_back([this, self] { this->workerLoop(self); });
+#else
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, STACK_SIZE);
+    auto start = new WorkerStart{this, self};
+    pthread_t thread;
+    if (pthread_create(&thread, &attributes, runWorker, start)) {
+      delete start;
+    } else {
+      this->threads.push_back(thread);
+    }
+    pthread_attr_destroy(&attributes);
+#endif
+  }
+
+  static void *runWorker(void *argument) {
+    auto start = (WorkerStart *)argument;
+    start->pool->workerLoop(start->self);
+    delete start;
+    return nullptr;
+  }
+
+  void push(int queue, const Task &task) {
+    {
+      std::lock_guard<std::mutex> lock(this->queues[queue].lock);
+      this->queues[queue].tasks.push_back(task);
+    }
+    std::lock_guard<std::mutex> lock(this->sleepLock);
+    this->queued.fetch_add(1, std::memory_order_release);
+  }
+
+  // From the back of our own queue, else the front of someone else's
+  bool take(int self, Task &task) {
+    int count = (int)this->queues.size();
+    for (int i = 0; i < count; i++) {
+      auto &queue = this->queues[(self + i) % count];
+      std::lock_guard<std::mutex> lock(queue.lock);
+      if (queue.tasks.empty()) continue;
+      if (i == 0) {
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+      } else {
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+      }
+      this->queued.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+  void run(const Task &task) {
+    for (int i = task.begin; i < task.end; i++) task.job->fn(i);
+    task.job->pending.fetch_sub(1, std::memory_order_release);
+  }
+
+  void workerLoop(int self) {
+    while (true) {
+      Task task;
+      if (this->take(self, task)) {
+        this->run(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(this->sleepLock);
+      this->wake.wait(lock, [this] {
+        return this->stopping ||
+               this->queued.load(std::memory_order_acquire) > 0;
+      });
+      if (this->stopping) return;
+    }
+  }
+};
+#endif
@@ -25,8 +25,11 @@ struct Vec3 {
   }
 };
 
+using Vec3i = Vec3;
+
 #ifdef _WIN32
 static inline int __builtin_clz(unsigned x) { return (int)__lzcnt(x); }
 #endif
 
-inline int log2ceil(int n) { return 32 - __builtin_clz(n - 1); }
\ No newline at end of file
+// clz(0) is only defined on wasm, so 1 is special cased
+inline int log2ceil(int n) { return n <= 1 ? 0 : 32 - __builtin_clz(n - 1); }
\ No newline at end of file
@@ -0,0 +1,223 @@
+#pragma once
+#include "SubChunk.h"
+
+// A Bedrock Edition overworld chunk: 24 sub chunks (y = -64 to 319) and a
+// biome per block, kept in ChunkSections like Java Edition columns. Read from
+// and written to the network LevelChunk payload, and LevelDB's per sub chunk
+// (SubChunkPrefix) and Data3D (heightmap and biomes) values.
+class LevelChunk {
+ public:
+  static const int NUM_SUB_CHUNKS = 24;
+  // Sub chunk index of y = 0
+  static const int CO = 4;
+
+  int x;
+  int z;
+  Registry *registry;
+  SubChunk subChunks[NUM_SUB_CHUNKS];
+  // Allocated on first use; a missing one is all biome 0
+  ChunkSection *biomes[NUM_SUB_CHUNKS] = {};
+  // From Data3D, kept as read
+  short heightMap[256] = {};
+  // Border blocks and block entities following the biomes in the network
+  // payload, passed through as they are
+  u8 *trailer = nullptr;
+  int trailerLength = 0;
+
+  LevelChunk(Registry *registry, int x = 0, int z = 0)
+      : x(x), z(z), registry(registry) {
+    for (int i = 0; i < NUM_SUB_CHUNKS; i++) {
+      this->subChunks[i].registry = registry;
+    }
+  }
+
+  LevelChunk(const LevelChunk &) = delete;
+  LevelChunk &operator=(const LevelChunk &) = delete;
+
+  // x and z within the chunk, y in the world. -1 if the layer doesn't exist.
+  int getBlockId(const Vec3i &pos, int layer) {
+    int s = (pos.y >> 4) + CO;
+    if (s < 0 || s >= NUM_SUB_CHUNKS || layer < 0) return -1;
+    auto &subChunk = this->subChunks[s];
+    if (layer >= subChunk.layerCount) return -1;
+    return subChunk.layers[layer]->getBlockStateId(pos);
+  }
+
+  // Adds the layer if need be. False if y or the layer is out of range.
+  bool setBlockId(const Vec3i &pos, int layer, int id) {
+    int s = (pos.y >> 4) + CO;
+    if (s < 0 || s >= NUM_SUB_CHUNKS) return false;
+    auto section = this->subChunks[s].getLayer(layer);
+    if (!section) return false;
+    section->setBlockStateId(pos, id);
+    return true;
+  }
+
+  int getBiomeId(const Vec3i &pos) {
+    int s = (pos.y >> 4) + CO;
+    if (s < 0 || s >= NUM_SUB_CHUNKS || !this->biomes[s]) return 0;
+    return this->biomes[s]->getBlockStateId(pos);
+  }
+
+  bool setBiomeId(const Vec3i &pos, int biome) {
+    int s = (pos.y >> 4) + CO;
+    if (s < 0 || s >= NUM_SUB_CHUNKS) return false;
+    auto section = this->getBiomes(s);
+    if (!section) return false;
+    section->setBlockStateId(pos, biome);
+    return true;
+  }
+
+  // Sub chunks above the highest one with blocks in it needn't be sent
+  int getSubChunkCount() {
+    int count = NUM_SUB_CHUNKS;
+    while (count && !this->subChunks[count - 1].layerCount) count--;
+    return count;
+  }
+
+  // A sub chunk as sent in a SubChunk packet (network) or stored under a
+  // SubChunkPrefix key (disk), at `sectionY` unless its header says
+  // otherwise. False if malformed or out of range.
+  bool readSubChunk(BinaryStream &stream, int sectionY,
+                    BedrockEncoding encoding, DiskPalette *blockStates) {
+    // Version 9 has y after the version and layer count
+    int start = stream.readPosition;
+    if (start + 2 < stream.size && stream.data[start] == 9) {
+      sectionY = (i8)stream.data[start + 2];
+    }
+    int s = sectionY + CO;
+    if (s < 0 || s >= NUM_SUB_CHUNKS) return false;
+    auto &subChunk = this->subChunks[s];
+    if (!subChunk.read(stream, encoding, blockStates, sectionY)) {
+      subChunk.layerCount = 0;
+      return false;
+    }
+    return true;
+  }
+
+  void writeSubChunk(BinaryStream &stream, int sectionY, int version,
+                     BedrockEncoding encoding, DiskPalette *blockStates) {
+    auto &subChunk = this->subChunks[sectionY + CO];
+    subChunk.write(stream, version, encoding, blockStates, sectionY);
+  }
+
+  // The LevelChunk packet's payload as sent without sub chunk requests:
+  // `subChunkCount` sub chunks from the bottom, a biome storage per sub
+  // chunk, then border blocks and block entities
+  bool readPayload(BinaryStream &stream, int subChunkCount) {
+    if (subChunkCount < 0 || subChunkCount > NUM_SUB_CHUNKS) return false;
+    for (int i = 0; i < NUM_SUB_CHUNKS; i++) {
+      this->subChunks[i].layerCount = 0;
+    }
+    for (int i = 0; i < subChunkCount; i++) {
+      if (!this->readSubChunk(stream, i - CO, BEDROCK_NETWORK, nullptr)) {
+        return false;
+      }
+    }
+    if (!this->readBiomes(stream, BEDROCK_NETWORK)) return false;
+
+    Deallocate(this->trailer);
+    this->trailer = nullptr;
+    this->trailerLength = stream.size - stream.readPosition;
+    if (this->trailerLength <= 0) {
+      this->trailerLength = 0;
+      return true;
+    }
+    this->trailer = Allocate<u8>(this->trailerLength);
+    if (!this->trailer) {
+      this->trailerLength = 0;
+      return false;
+    }
+    memcpy(this->trailer, stream.data + stream.readPosition,
+           this->trailerLength);
+    stream.readPosition = stream.size;
+    return true;
+  }
+
+  // getSubChunkCount() sub chunks, in sub chunk format `version` (8 or 9)
+  void writePayload(BinaryStream &stream, int version) {
+    int count = this->getSubChunkCount();
+    for (int i = 0; i < count; i++) {
+      this->writeSubChunk(stream, i - CO, version, BEDROCK_NETWORK, nullptr);
+    }
+    this->writeBiomes(stream, BEDROCK_NETWORK);
+    if (this->trailer) {
+      stream.write(this->trailer, this->trailerLength);
+    } else {
+      stream.writeByte(0);  // No border blocks
+    }
+  }
+
+  int getPayloadMaxSize() {
+    int size = NUM_SUB_CHUNKS * BEDROCK_STORAGE_MAX_SIZE + 1;
+    for (int i = 0; i < NUM_SUB_CHUNKS; i++) {
+      size += this->subChunks[i].getMaxSize();
+    }
+    return size + this->trailerLength;
+  }
+
+  // LevelDB's Data3D value: 256 little endian shorts of heightmap, then a
+  // biome storage per sub chunk with little endian int IDs
+  bool readData3D(BinaryStream &stream) {
+    if (stream.size - stream.readPosition < 512) return false;
+    for (int i = 0; i < 256; i++) this->heightMap[i] = stream.readShortLE();
+    return this->readBiomes(stream, BEDROCK_DISK);
+  }
+
+  void writeData3D(BinaryStream &stream) {
+    for (int i = 0; i < 256; i++) stream.writeShortLE(this->heightMap[i]);
+    this->writeBiomes(stream, BEDROCK_DISK);
+  }
+
+  int getData3DMaxSize() {
+    return 512 + NUM_SUB_CHUNKS * BEDROCK_STORAGE_MAX_SIZE;
+  }
+
+  ~LevelChunk() {
+    for (int i = 0; i < NUM_SUB_CHUNKS; i++) Deallocate(this->biomes[i]);
+    Deallocate(this->trailer);
+  }
+
+ private:
+  ChunkSection *getBiomes(int s) {
+    if (!this->biomes[s]) {
+      AllocScope scope(ALLOC_SECTIONS);
+      auto memory = Allocate<ChunkSection>(1);
+      if (!memory) return nullptr;
+      // Allocate zeroes, so this is all biome 0
+      this->biomes[s] = new (memory) ChunkSection(nullptr);
+    }
+    return this->biomes[s];
+  }
+
+  // A storage per sub chunk, each possibly a repeat of the one below
+  bool readBiomes(BinaryStream &stream, BedrockEncoding encoding) {
+    for (int i = 0; i < NUM_SUB_CHUNKS; i++) {
+      auto section = this->getBiomes(i);
+      if (!section) return false;
+      auto previous = i ? this->biomes[i - 1] : nullptr;
+      if (!readBedrockStorage(stream, encoding, nullptr, *section, previous)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void writeBiomes(BinaryStream &stream, BedrockEncoding encoding) {
+    for (int i = 0; i < NUM_SUB_CHUNKS; i++) {
+      auto section = this->getBiomes(i);
+      auto previous = i ? this->biomes[i - 1] : nullptr;
+      if (!section) {
+        // Out of memory: all biome 0, as it would read back
+        stream.writeByte(encoding == BEDROCK_NETWORK);
+        if (encoding == BEDROCK_NETWORK) {
+          writeZigZagVarInt(stream, 0);
+        } else {
+          stream.writeIntLE(0);
+        }
+        continue;
+      }
+      writeBedrockStorage(stream, encoding, nullptr, *section, previous);
+    }
+  }
+};
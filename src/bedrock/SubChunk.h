@@ -0,0 +1,349 @@
+#pragma once
+#include "../Arena.h"
+#include "../mcutil/nbt.h"
+#include "../pc/ChunkSection.h"
+#ifndef WEBASSEMBLY
+#include <new>
+#endif
+
+// Bedrock Edition sub chunks (blocks, version 8 and 9) and biome storages,
+// decoded into the same ChunkSection the Java Edition code uses. A storage is
+// a header byte (bits per index << 1, low bit set for the network form),
+// the indices packed into little endian u32 words the way PalettedStorage
+// packs them (no index spans two words, so 3, 5 and 6 bit words have padding
+// bits), then the palette.
+//
+// Bedrock orders blocks x, z, y (y changes fastest); ChunkSection orders them
+// y, z, x, and the two are converted while packing. IDs are stored as they
+// are in ChunkSection's shorts: runtime IDs on the network (not the hashed
+// kind), DiskPalette IDs on disk. A section without a registry counts ID 0 as
+// air, which only affects its occupancy count.
+
+// No memcmp in the wasm build
+inline bool bytesEqual(const void *a, const void *b, int length) {
+  auto x = (const u8 *)a;
+  auto y = (const u8 *)b;
+  for (int i = 0; i < length; i++) {
+    if (x[i] != y[i]) return false;
+  }
+  return true;
+}
+
+enum BedrockEncoding {
+  // Palette entries are zigzag varints (runtime IDs, biome IDs)
+  BEDROCK_NETWORK = 0,
+  // Palette entries are little endian NBT compounds (block states) or
+  // little endian ints (biomes), counts are little endian ints
+  BEDROCK_DISK = 1
+};
+
+// Block states as stored on disk, little endian NBT compounds, given IDs in
+// the order they are first seen. Sections decoded with the same DiskPalette
+// share IDs, and writing turns the IDs back into the same compounds.
+class DiskPalette {
+ public:
+  static const int MAX_ENTRIES = 32768;
+
+  int count = 0;
+
+  DiskPalette() {}
+
+  DiskPalette(const DiskPalette &) = delete;
+  DiskPalette &operator=(const DiskPalette &) = delete;
+
+  // ID of the compound, added if new. -1 if out of IDs or memory.
+  int add(const u8 *nbt, int length) {
+    u32 hash = hashBytes(nbt, length);
+    if (this->count * 2 >= this->slotCount && !this->grow()) return -1;
+    int mask = this->slotCount - 1;
+    for (int slot = hash & mask;; slot = (slot + 1) & mask) {
+      int id = this->slots[slot] - 1;
+      if (id < 0) {
+        if (this->count >= MAX_ENTRIES) return -1;
+        auto data = this->arena.allocate<u8>(length);
+        if (!data) return -1;
+        memcpy(data, (void *)nbt, length);
+        this->entries[this->count] = {hash, length, data};
+        this->slots[slot] = ++this->count;
+        return this->count - 1;
+      }
+      auto &entry = this->entries[id];
+      if (entry.hash == hash && entry.length == length &&
+          bytesEqual(entry.data, nbt, length)) {
+        return id;
+      }
+    }
+  }
+
+  // The compound for `id`, or null
+  const u8 *get(int id, out int &length) {
+    if (id < 0 || id >= this->count) return nullptr;
+    length = this->entries[id].length;
+    return this->entries[id].data;
+  }
+
+  ~DiskPalette() {
+    Deallocate(this->entries);
+    Deallocate(this->slots);
+  }
+
+ private:
+  struct Entry {
+    u32 hash;
+    int length;
+    u8 *data;
+  };
+
+  Arena arena;
+  Entry *entries = nullptr;
+  // Open addressing, ID + 1 per slot
+  int *slots = nullptr;
+  int slotCount = 0;
+
+  bool grow() {
+    int slotCount = this->slotCount ? this->slotCount * 2 : 256;
+    auto slots = Allocate<int>(slotCount);
+    auto entries = Allocate<Entry>(slotCount / 2);
+    if (!slots || !entries) {
+      Deallocate(slots);
+      Deallocate(entries);
+      return false;
+    }
+    if (this->count) {
+      memcpy(entries, this->entries, this->count * sizeof(Entry));
+    }
+    for (int i = 0; i < this->count; i++) {
+      int slot = entries[i].hash & (slotCount - 1);
+      while (slots[slot]) slot = (slot + 1) & (slotCount - 1);
+      slots[slot] = i + 1;
+    }
+    Deallocate(this->entries);
+    Deallocate(this->slots);
+    this->entries = entries;
+    this->slots = slots;
+    this->slotCount = slotCount;
+    return true;
+  }
+
+  static u32 hashBytes(const u8 *data, int length) {
+    u32 hash = 2166136261u;
+    for (int i = 0; i < length; i++) hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+  }
+};
+
+// Swaps between Bedrock's x, z, y order and ChunkSection's y, z, x. Its own
+// inverse.
+inline int transposeBedrockIndex(int index) {
+  return (index & 0xf) << 8 | (index & 0xf0) | index >> 8;
+}
+
+// Bits per index Bedrock allows, at least `bits`
+inline int getBedrockStorageBits(int bits) {
+  if (bits <= 6) return bits;
+  return bits <= 8 ? 8 : 16;
+}
+
+inline int readZigZagVarInt(BinaryStream &stream) {
+  u32 value = stream.readUVarInt();
+  return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+inline void writeZigZagVarInt(BinaryStream &stream, int value) {
+  stream.writeUVarInt((u32)value << 1 ^ (u32)(value >> 31));
+}
+
+// Reads one storage into `section`. `blockStates` reads disk palette entries
+// as NBT; without it they are ints (biomes). A storage may say it repeats the
+// one before it, `previous`. False if malformed.
+inline bool readBedrockStorage(BinaryStream &stream, BedrockEncoding encoding,
+                               DiskPalette *blockStates,
+                               out ChunkSection &section,
+                               const ChunkSection *previous = nullptr) {
+  if (stream.readPosition >= stream.size) return false;
+  int bits = stream.readByte() >> 1;
+  if (bits == 0x7f) {
+    if (!previous) return false;
+    auto registry = section.registry;
+    section = *previous;
+    section.registry = registry;
+    return true;
+  }
+  if (bits != getBedrockStorageBits(bits) || bits > 16) return false;
+
+  u16 indices[4096];
+  if (bits) {
+    u32 words[2048];
+    PalettedStorage<u32> storage;
+    storage.init(bits, 4096, words);
+    if (stream.readPosition + storage.byteSize > stream.size) return false;
+    storage.read(stream);
+    storage.unpack(indices, 4096);
+  } else {
+    memset(indices, 0, sizeof(indices));
+  }
+
+  bool network = encoding == BEDROCK_NETWORK;
+  int paletteLength = 1;
+  if (bits) {
+    paletteLength = network ? readZigZagVarInt(stream) : stream.readIntLE();
+  }
+  if (paletteLength < 1 || paletteLength > 4096) return false;
+  short palette[4096];
+  for (int i = 0; i < paletteLength; i++) {
+    int id;
+    if (network) {
+      id = readZigZagVarInt(stream);
+    } else if (blockStates) {
+      int start = stream.readPosition;
+      if (!skipNBT(stream, true, true)) return false;
+      id = blockStates->add(stream.data + start, stream.readPosition - start);
+    } else {
+      id = stream.readIntLE();
+    }
+    if (id < 0 || id > 0x7fff || stream.readPosition > stream.size) {
+      return false;
+    }
+    palette[i] = id;
+  }
+
+  u16 counts[4096];
+  for (int i = 0; i < paletteLength; i++) counts[i] = 0;
+  for (int i = 0; i < 4096; i++) {
+    u16 index = indices[i] < paletteLength ? indices[i] : 0;
+    section.blocks[transposeBedrockIndex(i)] = palette[index];
+    counts[index]++;
+  }
+  section.setPalette(palette, counts, paletteLength);
+  return true;
+}
+
+// Writes `section` as one storage, or as a repeat of `previous` if they hold
+// the same
+inline void writeBedrockStorage(BinaryStream &stream, BedrockEncoding encoding,
+                                DiskPalette *blockStates,
+                                ChunkSection &section,
+                                const ChunkSection *previous = nullptr) {
+  bool network = encoding == BEDROCK_NETWORK;
+  if (previous &&
+      bytesEqual(previous->blocks, section.blocks, sizeof(section.blocks))) {
+    stream.writeByte(0x7f << 1 | network);
+    return;
+  }
+
+  short blocks[4096];
+  for (int i = 0; i < 4096; i++) {
+    blocks[i] = section.blocks[transposeBedrockIndex(i)];
+  }
+  u16 palette[4096];
+  u16 indices[4096];
+  int paletteLength = ChunkSection::buildPalette(blocks, palette, indices);
+  int bits = getBedrockStorageBits(log2ceil(paletteLength));
+
+  stream.writeByte(bits << 1 | network);
+  if (bits) {
+    u32 words[2048];
+    PalettedStorage<u32> storage;
+    storage.init(bits, 4096, words);
+    storage.pack(indices, 4096);
+    storage.write(stream);
+    if (network) {
+      writeZigZagVarInt(stream, paletteLength);
+    } else {
+      stream.writeIntLE(paletteLength);
+    }
+  }
+  for (int i = 0; i < paletteLength; i++) {
+    int length;
+    const u8 *nbt;
+    if (network) {
+      writeZigZagVarInt(stream, palette[i]);
+    } else if (blockStates && (nbt = blockStates->get(palette[i], length))) {
+      stream.write((void *)nbt, length);
+    } else {
+      stream.writeIntLE(palette[i]);
+    }
+  }
+}
+
+// Upper bound on writeBedrockStorage's output. Disk block states are as long
+// as their compounds, which this leaves out.
+const int BEDROCK_STORAGE_MAX_SIZE = 1 + 2048 * 4 + 5 + 4096 * 5;
+
+// One sub chunk: a block storage per layer, the second usually holding water
+// in waterlogged blocks
+class SubChunk {
+ public:
+  static const int MAX_LAYERS = 4;
+
+  ChunkSection *layers[MAX_LAYERS] = {};
+  int layerCount = 0;
+  Registry *registry = nullptr;
+
+  SubChunk() {}
+
+  SubChunk(const SubChunk &) = delete;
+  SubChunk &operator=(const SubChunk &) = delete;
+
+  // Layer `layer`, created if need be (null if out of memory). Layers below
+  // it are created too, all air.
+  ChunkSection *getLayer(int layer) {
+    if (layer < 0 || layer >= MAX_LAYERS) return nullptr;
+    for (int i = this->layerCount; i <= layer; i++) {
+      auto memory = this->layers[i];
+      if (!memory) {
+        AllocScope scope(ALLOC_SECTIONS);
+        memory = Allocate<ChunkSection>(1);
+        if (!memory) return nullptr;
+      } else {
+        memset((void *)memory, 0, sizeof(ChunkSection));
+      }
+      this->layers[i] = new (memory) ChunkSection(this->registry);
+      this->layerCount = i + 1;
+    }
+    return this->layers[layer];
+  }
+
+  // Version 1, 8 or 9. `y` is set from a version 9 header and left alone
+  // otherwise. False if malformed, leaving the layers undefined.
+  bool read(BinaryStream &stream, BedrockEncoding encoding,
+            DiskPalette *blockStates, out int &y) {
+    if (stream.readPosition >= stream.size) return false;
+    int version = stream.readByte();
+    int count = 1;
+    if (version == 8 || version == 9) {
+      count = stream.readByte();
+      if (version == 9) y = (i8)stream.readByte();
+    } else if (version != 1) {
+      return false;
+    }
+    if (count > MAX_LAYERS) return false;
+
+    this->layerCount = 0;
+    for (int i = 0; i < count; i++) {
+      auto layer = this->getLayer(i);
+      if (!layer) return false;
+      if (!readBedrockStorage(stream, encoding, blockStates, *layer)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Version 8, or 9 with `y` in the header
+  void write(BinaryStream &stream, int version, BedrockEncoding encoding,
+             DiskPalette *blockStates, int y) {
+    stream.writeByte(version);
+    stream.writeByte(this->layerCount);
+    if (version == 9) stream.writeByte((u8)y);
+    for (int i = 0; i < this->layerCount; i++) {
+      writeBedrockStorage(stream, encoding, blockStates, *this->layers[i]);
+    }
+  }
+
+  int getMaxSize() { return 3 + this->layerCount * BEDROCK_STORAGE_MAX_SIZE; }
+
+  ~SubChunk() {
+    for (int i = 0; i < MAX_LAYERS; i++) Deallocate(this->layers[i]);
+  }
+};
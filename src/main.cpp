@@ -1,4 +1,18 @@
+#include "ThreadPool.h"
+#include "bedrock/LevelChunk.h"
+#include "pc/AntiXray.h"
 #include "pc/ChunkColumn.h"
+#include "pc/ColumnCache.h"
+#include "pc/ColumnPool.h"
+#include "pc/FindBlocks.h"
+#include "pc/Mesher.h"
+#include "pc/PacketQueue.h"
+#include "pc/PacketRewriter.h"
+#include "pc/Raycast.h"
+#include "pc/SnapshotFile.h"
+#include "pc/VisibleSections.h"
+#include "pc/World.h"
+#include "Sync.h"
 
 // Some simple bindings curtsey of copilot
 
@@ -8,13 +22,998 @@
 #define EXPORT(name) name
 #endif
 
+// Used by every column loaded after mcw_loadRegistry
+static Registry *defaultRegistry = nullptr;
+
+// Released columns are decoded into again by the load functions. Allocated on
+// first use so there is no static destructor to register.
+static ColumnPool *columnPool = nullptr;
+static SpinLock columnPoolLock;
+
+static ColumnPool *getColumnPool() {
+  LockGuard guard(columnPoolLock);
+  if (!columnPool) columnPool = new ColumnPool();
+  return columnPool;
+}
+
+// Deflaters keep state between calls, so each thread gets its own
+#ifndef WEBASSEMBLY
+// Freed as the thread exits, so pool workers that mcw_setThreadCount
+// replaces don't leak theirs
+struct ThreadDeflaters {
+  Deflater *levels[3] = {};
+
+  Deflater *&operator[](int level) { return this->levels[level]; }
+
+  ~ThreadDeflaters() {
+    for (auto deflater : this->levels) delete deflater;
+  }
+};
+static thread_local ThreadDeflaters deflaters;
+#else
+// Freed by mcw_threadExit
+static MCW_THREAD_LOCAL Deflater *deflaters[3];
+#endif
+
+template <typename Protocol = Protocol118>
+static u8 *writeCompressedChunkPacket(
+    ChunkColumn *chunkColumn, int level, int *outLength,
+    const SectionFilter &filter = SectionFilter()) {
+  if (level < DEFLATE_STORE || level > DEFLATE_BALANCED) {
+    level = DEFLATE_BALANCED;
+  }
+  if (!deflaters[level]) deflaters[level] = new Deflater((DeflateLevel)level);
+
+  u8 *buffer;
+  chunkColumn->writeCompressedChunkPacket<Protocol>(*deflaters[level], buffer,
+                                                    *outLength, filter);
+  return buffer;
+}
+
+template <typename Protocol = Protocol118>
+static u8 *writeChangesSince(ChunkColumn *chunkColumn, u32 since,
+                             int threshold, int *outLength) {
+  *outLength = 0;
+  auto &changes = chunkColumn->changes;
+  if (!changes.covers(since)) {
+    *outLength = -1;
+    return nullptr;
+  }
+  if (changes.find(since) == changes.count) return nullptr;
+  AllocScope scope(ALLOC_SCRATCH);
+  BinaryStream stream(chunkColumn->getChangesMaxSize(since));
+  if (!chunkColumn->writeChangesSince<Protocol>(since, threshold, stream)) {
+    *outLength = -1;
+    return nullptr;
+  }
+  auto result = (u8 *)malloc(stream.writePosition);
+  if (!result) return nullptr;
+  *outLength = stream.save(result);
+  return result;
+}
+
+template <typename Protocol = Protocol118>
+static int rewriterLoad(void *rewriter, u8 *buffer, int length) {
+  auto packetRewriter = (PacketRewriter<Protocol> *)rewriter;
+  packetRewriter->registry = defaultRegistry;
+  return packetRewriter->load(buffer, length);
+}
+
+template <typename Protocol = Protocol118>
+static u8 *rewriterWrite(void *rewriter, int *outLength) {
+  auto packetRewriter = (PacketRewriter<Protocol> *)rewriter;
+  AllocScope scope(ALLOC_SCRATCH);
+  BinaryStream stream(packetRewriter->getMaxSize());
+  packetRewriter->write(stream);
+  auto result = (u8 *)malloc(stream.writePosition);
+  if (!result) return nullptr;
+  *outLength = stream.save(result);
+  return result;
+}
+
+#ifndef WEBASSEMBLY
+static ThreadPool *threadPool = nullptr;
+static SpinLock threadPoolLock;
+
+static ThreadPool *getThreadPool() {
+  LockGuard guard(threadPoolLock);
+  if (!threadPool) threadPool = new ThreadPool();
+  return threadPool;
+}
+#endif
+
+// See pc118_createQueue
+static PacketQueue *packetQueue = nullptr;
+
+template <typename Protocol>
+static ChunkColumn *loadQueuedPacket(const QueuedPacket &packet) {
+  auto pool = getColumnPool();
+  if (packet.flags & QUEUE_COMPRESSED) {
+    return pool->readCompressedChunkPacket<Protocol>(defaultRegistry,
+                                                     packet.data, packet.length);
+  }
+  return pool->readChunkPacket<Protocol>(defaultRegistry, packet.data,
+                                         packet.length);
+}
+
+// Decodes a packet taken off the queue with the codec for its protocol,
+// setting its status
+static ChunkColumn *loadQueuedPacket(QueuedPacket &packet) {
+  if (packet.status != QUEUE_OK) return nullptr;
+  ChunkColumn *column;
+  switch (packet.protocol) {
+    case 0:
+    case PROTOCOL_1_18:
+    case PROTOCOL_1_18_2:
+      column = loadQueuedPacket<Protocol118>(packet);
+      break;
+    case PROTOCOL_1_19:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_19>>(packet);
+      break;
+    case PROTOCOL_1_19_2:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_19_2>>(packet);
+      break;
+    case PROTOCOL_1_19_3:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_19_3>>(packet);
+      break;
+    case PROTOCOL_1_19_4:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_19_4>>(packet);
+      break;
+    case PROTOCOL_1_20:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_20>>(packet);
+      break;
+    case PROTOCOL_1_20_2:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_20_2>>(packet);
+      break;
+    case PROTOCOL_1_20_3:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_20_3>>(packet);
+      break;
+    case PROTOCOL_1_20_5:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_20_5>>(packet);
+      break;
+    case PROTOCOL_1_21:
+      column = loadQueuedPacket<ProtocolTraits<PROTOCOL_1_21>>(packet);
+      break;
+    default:
+      packet.status = QUEUE_UNSUPPORTED_PROTOCOL;
+      return nullptr;
+  }
+  if (!column) packet.status = QUEUE_DECODE_FAILED;
+  return column;
+}
+
+// The native library is built with -fvisibility=hidden; everything in the
+// extern "C" block below is its exported API
+#if !defined(WEBASSEMBLY) && !defined(_WIN32)
+#pragma GCC visibility push(default)
+#endif
+
 extern "C" {
 
+#ifdef WALLOC_THREADS
+// Shared memory builds. Workers instantiate the module with the same memory;
+// each one needs its own stack before calling anything else. Call this on the
+// main thread and set the worker's exported __stack_pointer global to the
+// result. Chunk encoding keeps ~1MB buffers on the stack, so give it 4MB.
+void *EXPORT(mcw_allocThreadStack)(int size) {
+  auto stack = (u8 *)malloc(size);
+  if (!stack) return nullptr;
+  return (void *)((size_t)(stack + size) & ~(size_t)15);
+}
+
+// Then call this first thing on the worker
+void EXPORT(mcw_threadInit)() { walloc_thread_init(); }
+
+// And this before the worker goes away
+void EXPORT(mcw_threadExit)() {
+  for (auto &deflater : deflaters) {
+    delete deflater;
+    deflater = nullptr;
+  }
+  walloc_thread_exit();
+}
+#endif
+
+// Loads a blob made by tools/genRegistry.js. The blob is used in place and
+// must not be freed while the registry is in use.
+void *EXPORT(mcw_loadRegistry)(u8 *blob, int length) {
+  auto registry = new Registry();
+  if (!registry->load(blob, length)) {
+    delete registry;
+    return nullptr;
+  }
+  defaultRegistry = registry;
+  return registry;
+}
+
+int EXPORT(mcw_getStateFlags)(void *registry, int stateId) {
+  return ((Registry *)registry)->getFlags(stateId);
+}
+
+// filtered light << 4 | emitted light
+int EXPORT(mcw_getStateLight)(void *registry, int stateId) {
+  auto r = (Registry *)registry;
+  return r->getOpacity(stateId) << 4 | r->getEmission(stateId);
+}
+
+// Default state ID for a block name, or -1
+int EXPORT(mcw_getDefaultStateId)(void *registry, const char *name,
+                                  int length) {
+  return ((Registry *)registry)->getDefaultStateId(name, length);
+}
+
 void *EXPORT(pc118_loadChunkPacket)(u8 *buffer, int length) {
-  auto cc = ChunkColumn::readChunkPacket(0, buffer, length);
+  auto cc = getColumnPool()->readChunkPacket(defaultRegistry, buffer, length);
+  return cc;
+}
+
+// Frees a column returned by any of the load functions
+void EXPORT(pc118_freeChunk)(void *cc) { delete (ChunkColumn *)cc; }
+
+// Like pc118_freeChunk, but keeps the column for the next load to reuse
+void EXPORT(pc118_releaseChunk)(void *cc) {
+  getColumnPool()->release((ChunkColumn *)cc);
+}
+
+// A copy of the column that shares its sections until either side writes to
+// one. Can be encoded on another thread while the column keeps changing; free
+// it with pc118_freeChunk or pc118_releaseChunk.
+void *EXPORT(pc118_snapshotChunk)(void *cc) {
+  return ((ChunkColumn *)cc)->snapshot();
+}
+
+// Decodes a chunk packet over an existing column, replacing its contents.
+// Returns 0 if the packet could not be read.
+int EXPORT(pc118_decodeInto)(void *cc, u8 *buffer, int length) {
+  return ((ChunkColumn *)cc)->decodeInto(buffer, length);
+}
+
+void EXPORT(pc118_setPoolRetention)(int retention) {
+  getColumnPool()->setRetention(retention);
+}
+
+// Writes hits, misses and retained column count to `stats`
+void EXPORT(pc118_getPoolStats)(int *stats) {
+  auto pool = getColumnPool();
+  stats[0] = pool->hits;
+  stats[1] = pool->misses;
+  stats[2] = pool->retained;
+}
+
+// `buffer` holds the packet as framed with compression on: varint data length
+// then the zlib compressed packet ID + data
+void *EXPORT(pc118_loadCompressedChunkPacket)(u8 *buffer, int length) {
+  auto cc = getColumnPool()->readCompressedChunkPacket(defaultRegistry, buffer,
+                                                       length);
+  return cc;
+}
+
+// A cache that keeps at most `budget` bytes of columns, packing the least
+// recently used ones. level: -1 packed only, else a deflate level as in
+// pc118_writeCompressedChunkPacket.
+void *EXPORT(pc118_newColumnCache)(size_t budget, int level) {
+  return new ColumnCache(getColumnPool(), budget, level);
+}
+
+// Frees the cache and every column in it
+void EXPORT(pc118_freeColumnCache)(void *cache) { delete (ColumnCache *)cache; }
+
+// Hands a loaded column to the cache. Returns the handle to get it back by.
+void *EXPORT(pc118_cacheAdd)(void *cache, void *cc) {
+  return ((ColumnCache *)cache)->add((ChunkColumn *)cc);
+}
+
+// The column for a handle, usable with the other pc118_ calls until the next
+// call on the same cache
+void *EXPORT(pc118_cacheGet)(void *cache, void *entry) {
+  return ((ColumnCache *)cache)->get((ColumnCache::Entry *)entry);
+}
+
+// Removes the column from the cache and frees it
+void EXPORT(pc118_cacheRemove)(void *cache, void *entry) {
+  ((ColumnCache *)cache)->remove((ColumnCache::Entry *)entry);
+}
+
+void EXPORT(pc118_setCacheBudget)(void *cache, size_t budget) {
+  ((ColumnCache *)cache)->setBudget(budget);
+}
+
+// Writes hot count, cold count, hot bytes, cold bytes, demotions and
+// expansions to `stats`
+void EXPORT(pc118_getCacheStats)(void *cache, size_t *stats) {
+  auto c = (ColumnCache *)cache;
+  stats[0] = c->hotCount;
+  stats[1] = c->coldCount;
+  stats[2] = c->hotBytes;
+  stats[3] = c->coldBytes;
+  stats[4] = c->demotions;
+  stats[5] = c->expansions;
+}
+
+// Saves columns to one buffer laid out as they sit in memory, so they can be
+// loaded back without decoding (see src/pc/SnapshotFile.h). The file only
+// opens in a build with the same layout.
+u8 *EXPORT(pc118_writeSnapshotFile)(void **columns, int count,
+                                    size_t *outLength) {
+  auto list = (ChunkColumn **)columns;
+  size_t size = SnapshotFile::getSize(list, count);
+  auto result = (u8 *)malloc(size);
+  *outLength = result ? size : 0;
+  if (result) SnapshotFile::write(list, count, result);
+  return result;
+}
+
+// `buffer` (copied into memory or, natively, mmap'd) is used in place and
+// must outlive the file and every column loaded from it. Null if it isn't a
+// snapshot file this build can read.
+void *EXPORT(pc118_openSnapshotFile)(u8 *buffer, size_t length) {
+  auto file = new SnapshotFile();
+  if (!file->open(buffer, length, defaultRegistry)) {
+    delete file;
+    return nullptr;
+  }
+  return file;
+}
+
+void EXPORT(pc118_closeSnapshotFile)(void *file) {
+  delete (SnapshotFile *)file;
+}
+
+int EXPORT(pc118_getSnapshotColumnCount)(void *file) {
+  return ((SnapshotFile *)file)->getColumnCount();
+}
+
+// Writes column i's x, z to `position`
+int EXPORT(pc118_getSnapshotColumnPosition)(void *file, int i, int *position) {
+  return ((SnapshotFile *)file)->getColumnPosition(i, position[0], position[1]);
+}
+
+// Index of the column at x, z, or -1
+int EXPORT(pc118_findSnapshotColumn)(void *file, int x, int z) {
+  return ((SnapshotFile *)file)->findColumn(x, z);
+}
+
+// Column i using the file's sections where they are; a section is copied out
+// the first time it is written to. The buffer must be writable.
+void *EXPORT(pc118_loadSnapshotColumn)(void *file, int i) {
+  return ((SnapshotFile *)file)->loadColumn(i);
+}
+
+// Column i with its own copy of the sections
+void *EXPORT(pc118_copySnapshotColumn)(void *file, int i) {
+  return ((SnapshotFile *)file)->copyColumn(i);
+}
+
+// A set of loaded columns addressed in world coordinates. Columns given to a
+// world are owned by it; unloading releases them to the pool.
+void *EXPORT(pc118_newWorld)() { return new World(getColumnPool()); }
+
+void EXPORT(pc118_freeWorld)(void *world) { delete (World *)world; }
+
+// Adds a loaded column at its chunk x, z, replacing (and releasing) any
+// column already there. Returns 0 if the world is out of memory, in which
+// case the column is still the caller's.
+int EXPORT(pc118_worldAddChunk)(void *world, void *cc) {
+  auto replaced = ((World *)world)->addColumn((ChunkColumn *)cc);
+  if (replaced == cc) return 0;
+  if (replaced) getColumnPool()->release(replaced);
+  return 1;
+}
+
+// Loads a chunk packet straight into the world. Returns the column, or null
+// if the packet could not be read or the world is out of memory.
+void *EXPORT(pc118_worldLoadChunkPacket)(void *world, u8 *buffer, int length,
+                                         int compressed) {
+  auto pool = getColumnPool();
+  auto cc = compressed
+                ? pool->readCompressedChunkPacket(defaultRegistry, buffer, length)
+                : pool->readChunkPacket(defaultRegistry, buffer, length);
+  if (cc && !pc118_worldAddChunk(world, cc)) {
+    pool->release(cc);
+    return nullptr;
+  }
   return cc;
 }
 
+// Returns 0 if no column was loaded at chunk x, z
+int EXPORT(pc118_worldUnloadChunk)(void *world, int x, int z) {
+  auto cc = ((World *)world)->removeColumn(x, z);
+  if (!cc) return 0;
+  getColumnPool()->release(cc);
+  return 1;
+}
+
+// The column at chunk x, z, or null
+void *EXPORT(pc118_worldGetChunk)(void *world, int x, int z) {
+  return ((World *)world)->getColumn(x, z);
+}
+
+int EXPORT(pc118_worldGetChunkCount)(void *world) {
+  return ((World *)world)->count;
+}
+
+// World coordinates; -1 where nothing is loaded
+int EXPORT(pc118_worldGetBlockStateId)(void *world, int x, int y, int z) {
+  return ((World *)world)->getBlockStateId(x, y, z);
+}
+
+// Returns 0 where nothing is loaded
+int EXPORT(pc118_worldSetBlockStateId)(void *world, int x, int y, int z,
+                                       int stateId) {
+  return ((World *)world)->setBlockStateId(x, y, z, stateId);
+}
+
+// `positions` holds `count` x, y, z triples
+void EXPORT(pc118_worldGetBlockStateIds)(void *world, int *positions,
+                                         int count, int *stateIds) {
+  ((World *)world)->getBlockStateIds(positions, count, stateIds);
+}
+
+// Returns how many of the positions were loaded and set
+int EXPORT(pc118_worldSetBlockStateIds)(void *world, int *positions,
+                                        int *stateIds, int count) {
+  return ((World *)world)->setBlockStateIds(positions, stateIds, count);
+}
+
+// Casts a ray through the world's loaded blocks. A block is hit if its state
+// flags include any of requireFlags (any block if 0) and none of
+// excludeFlags. Fills `hit` (x, y, z, face, state ID, then distance as a
+// float; state ID -1 on a miss) and returns whether anything was hit.
+int EXPORT(pc118_raycast)(void *world, float originX, float originY,
+                          float originZ, float directionX, float directionY,
+                          float directionZ, float maxDistance,
+                          int requireFlags, int excludeFlags,
+                          RaycastHit *hit) {
+  float origin[3] = {originX, originY, originZ};
+  float direction[3] = {directionX, directionY, directionZ};
+  return raycast(*(World *)world, origin, direction, maxDistance,
+                 {requireFlags, excludeFlags}, *hit);
+}
+
+// `rays` holds 6 floats per ray, origin then direction; `hits` gets one
+// RaycastHit each. Returns how many hit.
+int EXPORT(pc118_raycastBatch)(void *world, float *rays, int count,
+                               float maxDistance, int requireFlags,
+                               int excludeFlags, RaycastHit *hits) {
+  return raycastBatch(*(World *)world, rays, count, maxDistance,
+                      {requireFlags, excludeFlags}, hits);
+}
+
+// Finds up to `maxResults` blocks in any of the `stateCount` states, within
+// `radius` of (x, y, z), and writes them nearest first to `results` as
+// x, y, z, state ID quads. Returns how many were found.
+int EXPORT(pc118_findBlocks)(void *world, int *stateIds, int stateCount,
+                             int x, int y, int z, int radius, int maxResults,
+                             BlockMatch *results) {
+  if (radius < 0) return 0;
+  int center[3] = {x, y, z};
+  int min[3] = {x - radius, y - radius, z - radius};
+  int max[3] = {x + radius, y + radius, z + radius};
+  BlockFinder finder(stateIds, stateCount);
+  return finder.find(*(World *)world, min, max, center, radius, maxResults,
+                     results);
+}
+
+// Same within a box: `box` holds min x, y, z then max x, y, z, inclusive.
+// Results are still sorted by distance from (x, y, z).
+int EXPORT(pc118_findBlocksInBox)(void *world, int *stateIds, int stateCount,
+                                  int *box, int x, int y, int z,
+                                  int maxResults, BlockMatch *results) {
+  int center[3] = {x, y, z};
+  BlockFinder finder(stateIds, stateCount);
+  return finder.find(*(World *)world, box, box + 3, center, -1, maxResults,
+                     results);
+}
+
+// Edits blocks in chunk packets passing through, re-encoding only the
+// sections that change. See PacketRewriter.
+void *EXPORT(pc118_newPacketRewriter)() {
+  return new PacketRewriter<>(defaultRegistry);
+}
+
+void EXPORT(pc118_freePacketRewriter)(void *rewriter) {
+  delete (PacketRewriter<> *)rewriter;
+}
+
+// Indexes a chunk packet (as for pc118_loadChunkPacket). The buffer must stay
+// alive and unchanged until pc118_rewriterWrite. Returns 0 if it could not be
+// read.
+int EXPORT(pc118_rewriterLoad)(void *rewriter, u8 *buffer, int length) {
+  return rewriterLoad(rewriter, buffer, length);
+}
+
+int EXPORT(pc118_rewriterGetBlockStateId)(void *rewriter, int x, int y,
+                                          int z) {
+  return ((PacketRewriter<> *)rewriter)->getBlockStateId(x, y, z);
+}
+
+int EXPORT(pc118_rewriterSetBlockStateId)(void *rewriter, int x, int y, int z,
+                                          int stateId) {
+  return ((PacketRewriter<> *)rewriter)->setBlockStateId(x, y, z, stateId);
+}
+
+// The edited packet in a new buffer
+u8 *EXPORT(pc118_rewriterWrite)(void *rewriter, int *outLength) {
+  return rewriterWrite(rewriter, outLength);
+}
+
+// Ore obfuscation applied while writing chunk packets. mode is an
+// AntiXrayMode; world, if not null, supplies neighbouring columns.
+void *EXPORT(pc118_newAntiXray)(int mode, void *world) {
+  auto antiXray = new AntiXray();
+  antiXray->mode = (AntiXrayMode)mode;
+  antiXray->world = (World *)world;
+  return antiXray;
+}
+
+void EXPORT(pc118_freeAntiXray)(void *antiXray) { delete (AntiXray *)antiXray; }
+
+// Nothing at or above maxY is touched. deepHideState is used below y = 0 in
+// hide mode, or -1 for hideState everywhere.
+void EXPORT(pc118_configureAntiXray)(void *antiXray, int maxY, int hideState,
+                                     int deepHideState) {
+  auto config = (AntiXray *)antiXray;
+  config->maxY = maxY;
+  config->hideState = hideState;
+  config->deepHideState = deepHideState;
+}
+
+// list: 0 hidden (the ores), 1 replaceable, 2 decoys. See AntiXray.
+void EXPORT(pc118_setAntiXrayStates)(void *antiXray, int list,
+                                     int *stateIds, int count) {
+  auto config = (AntiXray *)antiXray;
+  if (list == 0) config->setHidden(stateIds, count);
+  if (list == 1) config->setReplaceable(stateIds, count);
+  if (list == 2) config->setDecoys(stateIds, count);
+}
+
+u8 *EXPORT(pc118_writeObfuscatedChunkPacket)(void *antiXray, void *cc,
+                                             int *outLength) {
+  u8 *buffer;
+  ((ChunkColumn *)cc)->writeChunkPacket(buffer, *outLength,
+                                        ((AntiXray *)antiXray)->getFilter());
+  return buffer;
+}
+
+u8 *EXPORT(pc118_writeObfuscatedCompressedChunkPacket)(void *antiXray,
+                                                       void *cc, int level,
+                                                       int *outLength) {
+  return writeCompressedChunkPacket((ChunkColumn *)cc, level, outLength,
+                                    ((AntiXray *)antiXray)->getFilter());
+}
+
+// Obfuscates a chunk packet (as for pc118_loadChunkPacket) for proxies that
+// don't keep the column. Only sections with something to hide are decoded
+// and re-encoded; heightmaps, block entities and light are copied as they
+// are. Null if it could not be read.
+u8 *EXPORT(pc118_obfuscateChunkPacket)(void *antiXray, u8 *buffer, int length,
+                                       int *outLength) {
+  PacketRewriter<> rewriter(defaultRegistry);
+  if (!rewriter.load(buffer, length)) return nullptr;
+  if (!((AntiXray *)antiXray)->obfuscate(rewriter)) return nullptr;
+  return rewriterWrite(&rewriter, outLength);
+}
+
+// Render meshes for the viewer, see Mesher for the vertex format
+void *EXPORT(pc118_newMesher)() { return new Mesher(); }
+
+void EXPORT(pc118_freeMesher)(void *mesher) { delete (Mesher *)mesher; }
+
+// Meshes one section into the caller's buffers (maxVertices vertices of two
+// u32s, maxIndices u32 indices). Returns the quad count, or -1 if the buffers
+// are too small.
+int EXPORT(pc118_meshSection)(void *mesher, void *world, int cx, int sectionY,
+                              int cz, bool greedy, u32 *vertices,
+                              int maxVertices, u32 *indices, int maxIndices) {
+  auto sectionMesher = (Mesher *)mesher;
+  sectionMesher->greedy = greedy;
+  return sectionMesher->mesh(*(World *)world, cx, sectionY, cz, vertices,
+                             maxVertices, indices, maxIndices);
+}
+
+// Which faces of a section see each other, a bit per face pair (see
+// ChunkSection::getVisibility)
+int EXPORT(pc118_getSectionVisibility)(void *cc, int sectionY) {
+  return ((ChunkColumn *)cc)->getSectionVisibility(sectionY);
+}
+
+// Sections that may be visible from a camera in section cx, sy, cz, as x, y,
+// z triples nearest first. Returns how many were written.
+int EXPORT(pc118_findVisibleSections)(void *world, int cx, int sy, int cz,
+                                      int radius, int *sections,
+                                      int maxSections) {
+  return findVisibleSections(*(World *)world, cx, sy, cz, radius,
+                             (SectionPos *)sections, maxSections);
+}
+
+// The chunk codec for later protocol versions, as prefix_loadChunkPacket and
+// so on. Each behaves like its pc118_ namesake on the same columns; only the
+// packets differ.
+#define PROTOCOL_EXPORTS(prefix, Protocol)                                    \
+  void *EXPORT(prefix##_loadChunkPacket)(u8 * buffer, int length) {          \
+    return getColumnPool()->readChunkPacket<Protocol>(defaultRegistry,       \
+                                                      buffer, length);       \
+  }                                                                          \
+  void *EXPORT(prefix##_loadCompressedChunkPacket)(u8 * buffer, int length) { \
+    return getColumnPool()->readCompressedChunkPacket<Protocol>(             \
+        defaultRegistry, buffer, length);                                    \
+  }                                                                          \
+  int EXPORT(prefix##_decodeInto)(void *cc, u8 *buffer, int length) {        \
+    return ((ChunkColumn *)cc)->decodeInto<Protocol>(buffer, length);        \
+  }                                                                          \
+  u8 *EXPORT(prefix##_writeChunkPacket)(void *cc, int *outLength) {          \
+    u8 *buffer;                                                              \
+    ((ChunkColumn *)cc)->writeChunkPacket<Protocol>(buffer, *outLength);     \
+    return buffer;                                                           \
+  }                                                                          \
+  u8 *EXPORT(prefix##_writeCompressedChunkPacket)(void *cc, int level,       \
+                                                  int *outLength) {          \
+    return writeCompressedChunkPacket<Protocol>((ChunkColumn *)cc, level,    \
+                                                outLength);                  \
+  }                                                                          \
+  u8 *EXPORT(prefix##_writeChangesSince)(void *cc, u32 since, int threshold, \
+                                         int *outLength) {                   \
+    return writeChangesSince<Protocol>((ChunkColumn *)cc, since, threshold,  \
+                                       outLength);                           \
+  }                                                                          \
+  void *EXPORT(prefix##_newPacketRewriter)() {                               \
+    return new PacketRewriter<Protocol>(defaultRegistry);                    \
+  }                                                                          \
+  void EXPORT(prefix##_freePacketRewriter)(void *rewriter) {                 \
+    delete (PacketRewriter<Protocol> *)rewriter;                             \
+  }                                                                          \
+  int EXPORT(prefix##_rewriterLoad)(void *rewriter, u8 *buffer, int length) { \
+    return rewriterLoad<Protocol>(rewriter, buffer, length);                 \
+  }                                                                          \
+  int EXPORT(prefix##_rewriterGetBlockStateId)(void *rewriter, int x, int y, \
+                                               int z) {                      \
+    return ((PacketRewriter<Protocol> *)rewriter)->getBlockStateId(x, y, z); \
+  }                                                                          \
+  int EXPORT(prefix##_rewriterSetBlockStateId)(void *rewriter, int x, int y, \
+                                               int z, int stateId) {         \
+    return ((PacketRewriter<Protocol> *)rewriter)                            \
+        ->setBlockStateId(x, y, z, stateId);                                 \
+  }                                                                          \
+  u8 *EXPORT(prefix##_rewriterWrite)(void *rewriter, int *outLength) {       \
+    return rewriterWrite<Protocol>(rewriter, outLength);                     \
+  }
+
+PROTOCOL_EXPORTS(pc119, ProtocolTraits<PROTOCOL_1_19>)
+PROTOCOL_EXPORTS(pc1192, ProtocolTraits<PROTOCOL_1_19_2>)
+PROTOCOL_EXPORTS(pc1193, ProtocolTraits<PROTOCOL_1_19_3>)
+PROTOCOL_EXPORTS(pc1194, ProtocolTraits<PROTOCOL_1_19_4>)
+PROTOCOL_EXPORTS(pc120, ProtocolTraits<PROTOCOL_1_20>)
+PROTOCOL_EXPORTS(pc1202, ProtocolTraits<PROTOCOL_1_20_2>)
+PROTOCOL_EXPORTS(pc1203, ProtocolTraits<PROTOCOL_1_20_3>)
+PROTOCOL_EXPORTS(pc1205, ProtocolTraits<PROTOCOL_1_20_5>)
+PROTOCOL_EXPORTS(pc121, ProtocolTraits<PROTOCOL_1_21>)
+
+// Bedrock Edition chunks (see src/bedrock/LevelChunk.h). Block and biome IDs
+// are network runtime IDs, or IDs from a DiskPalette for sub chunks read from
+// disk; either way they must be below 32768.
+void *EXPORT(bedrock_newChunk)(int x, int z) {
+  return new LevelChunk(nullptr, x, z);
+}
+
+void EXPORT(bedrock_freeChunk)(void *chunk) { delete (LevelChunk *)chunk; }
+
+// Gives each distinct NBT block state read from disk an ID, shared by every
+// sub chunk read with the same palette
+void *EXPORT(bedrock_newDiskPalette)() { return new DiskPalette(); }
+
+void EXPORT(bedrock_freeDiskPalette)(void *palette) {
+  delete (DiskPalette *)palette;
+}
+
+// The little endian NBT compound behind an ID, or null
+const u8 *EXPORT(bedrock_getDiskPaletteEntry)(void *palette, int id,
+                                              int *outLength) {
+  return ((DiskPalette *)palette)->get(id, *outLength);
+}
+
+// The ID of a compound, added if new; for blocks set from outside
+int EXPORT(bedrock_addDiskPaletteEntry)(void *palette, u8 *nbt, int length) {
+  return ((DiskPalette *)palette)->add(nbt, length);
+}
+
+// The payload of a LevelChunk packet sent with `subChunkCount` sub chunks
+// (not using sub chunk requests). Returns 0 if it could not be read.
+int EXPORT(bedrock_loadLevelChunk)(void *chunk, u8 *buffer, int length,
+                                   int subChunkCount) {
+  BinaryStream stream(buffer, length);
+  return ((LevelChunk *)chunk)->readPayload(stream, subChunkCount);
+}
+
+// How many sub chunks bedrock_writeLevelChunk writes, for the packet header
+int EXPORT(bedrock_getSubChunkCount)(void *chunk) {
+  return ((LevelChunk *)chunk)->getSubChunkCount();
+}
+
+// version: sub chunk format, 8 or 9
+u8 *EXPORT(bedrock_writeLevelChunk)(void *chunk, int version, int *outLength) {
+  auto levelChunk = (LevelChunk *)chunk;
+  AllocScope scope(ALLOC_SCRATCH);
+  BinaryStream stream(levelChunk->getPayloadMaxSize());
+  levelChunk->writePayload(stream, version);
+  auto result = (u8 *)malloc(stream.writePosition);
+  if (!result) return nullptr;
+  *outLength = stream.save(result);
+  return result;
+}
+
+// One sub chunk, from a SubChunk packet entry or, with a DiskPalette, a
+// LevelDB SubChunkPrefix value. A version 9 header's y overrides sectionY.
+int EXPORT(bedrock_loadSubChunk)(void *chunk, int sectionY, u8 *buffer,
+                                 int length, void *palette) {
+  BinaryStream stream(buffer, length);
+  auto encoding = palette ? BEDROCK_DISK : BEDROCK_NETWORK;
+  return ((LevelChunk *)chunk)
+      ->readSubChunk(stream, sectionY, encoding, (DiskPalette *)palette);
+}
+
+u8 *EXPORT(bedrock_writeSubChunk)(void *chunk, int sectionY, int version,
+                                  void *palette, int *outLength) {
+  auto levelChunk = (LevelChunk *)chunk;
+  int s = sectionY + LevelChunk::CO;
+  *outLength = 0;
+  if (s < 0 || s >= LevelChunk::NUM_SUB_CHUNKS) return nullptr;
+  auto diskPalette = (DiskPalette *)palette;
+  int size = levelChunk->subChunks[s].getMaxSize();
+  if (diskPalette) {
+    // Room for every compound in every layer's palette
+    for (int i = 0; i < diskPalette->count; i++) {
+      int entryLength;
+      diskPalette->get(i, entryLength);
+      size += entryLength * levelChunk->subChunks[s].layerCount;
+    }
+  }
+  AllocScope scope(ALLOC_SCRATCH);
+  BinaryStream stream(size);
+  levelChunk->writeSubChunk(stream, sectionY, version,
+                            palette ? BEDROCK_DISK : BEDROCK_NETWORK,
+                            diskPalette);
+  auto result = (u8 *)malloc(stream.writePosition);
+  if (!result) return nullptr;
+  *outLength = stream.save(result);
+  return result;
+}
+
+// LevelDB's Data3D value: heightmap and biomes
+int EXPORT(bedrock_loadData3D)(void *chunk, u8 *buffer, int length) {
+  BinaryStream stream(buffer, length);
+  return ((LevelChunk *)chunk)->readData3D(stream);
+}
+
+u8 *EXPORT(bedrock_writeData3D)(void *chunk, int *outLength) {
+  auto levelChunk = (LevelChunk *)chunk;
+  AllocScope scope(ALLOC_SCRATCH);
+  BinaryStream stream(levelChunk->getData3DMaxSize());
+  levelChunk->writeData3D(stream);
+  auto result = (u8 *)malloc(stream.writePosition);
+  if (!result) return nullptr;
+  *outLength = stream.save(result);
+  return result;
+}
+
+// layer 0 is the blocks, 1 usually water in waterlogged ones. -1 if the sub
+// chunk has no such layer.
+int EXPORT(bedrock_getBlockId)(void *chunk, int x, int y, int z, int layer) {
+  return ((LevelChunk *)chunk)->getBlockId({x, y, z}, layer);
+}
+
+int EXPORT(bedrock_setBlockId)(void *chunk, int x, int y, int z, int layer,
+                               int id) {
+  return ((LevelChunk *)chunk)->setBlockId({x, y, z}, layer, id);
+}
+
+// Bedrock biomes are per block
+int EXPORT(bedrock_getBiomeId)(void *chunk, int x, int y, int z) {
+  return ((LevelChunk *)chunk)->getBiomeId({x, y, z});
+}
+
+int EXPORT(bedrock_setBiomeId)(void *chunk, int x, int y, int z, int biome) {
+  return ((LevelChunk *)chunk)->setBiomeId({x, y, z}, biome);
+}
+
+#ifdef WEBASSEMBLY
+// Fills a walloc_stats (see walloc.h for the field order). Per tag numbers
+// are only kept in builds with -DWALLOC_TRACE.
+void EXPORT(mcw_getHeapStats)(walloc_stats *stats) { walloc_get_stats(stats); }
+#endif
+
+// Inflates a zlib or gzip stream into a new buffer, or returns null
+u8 *EXPORT(mcw_inflate)(u8 *buffer, int length, int *outLength) {
+  AllocScope scope(ALLOC_SCRATCH);
+  BinaryStream stream(length * 4);
+  if (inflate(buffer, length, stream, INFLATE_AUTO) != INFLATE_OK) {
+    return nullptr;
+  }
+  auto result = (u8 *)malloc(stream.writePosition);
+  if (!result) return nullptr;
+  *outLength = stream.save(result);
+  return result;
+}
+
+// Inflates a chunk from an Anvil region file sector: big endian length,
+// compression type (1 gzip, 2 zlib, 3 none) then the payload.
+u8 *EXPORT(mcw_inflateRegionChunk)(u8 *buffer, int length, int *outLength) {
+  if (length < 5) return nullptr;
+  int payloadLength = (buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 |
+                       buffer[3]) - 1;
+  u8 compression = buffer[4];
+  if (payloadLength < 0 || payloadLength > length - 5) return nullptr;
+  if (compression == 3) {
+    AllocScope scope(ALLOC_SCRATCH);
+    auto result = (u8 *)malloc(payloadLength);
+    if (!result) return nullptr;
+    memcpy(result, buffer + 5, payloadLength);
+    *outLength = payloadLength;
+    return result;
+  }
+  if (compression != 1 && compression != 2) return nullptr;
+  return mcw_inflate(buffer + 5, payloadLength, outLength);
+}
+
+u8 *EXPORT(pc118_writeChunkPacket)(void *cc, int *outLength) {
+  auto chunkColumn = (ChunkColumn *)cc;
+  u8 *buffer;
+  chunkColumn->writeChunkPacket(buffer, *outLength);
+  return buffer;
+}
+
+// level: 0 stored, 1 fast (RLE), 2 balanced. Output is framed like
+// pc118_loadCompressedChunkPacket's input.
+u8 *EXPORT(pc118_writeCompressedChunkPacket)(void *cc, int level,
+                                             int *outLength) {
+  return writeCompressedChunkPacket((ChunkColumn *)cc, level, outLength);
+}
+
+#ifndef WEBASSEMBLY
+// Native only: batches spread over a thread pool with one thread per core by
+// default. Must not be called while the pool is being resized.
+void EXPORT(mcw_setThreadCount)(int threads) {
+  LockGuard guard(threadPoolLock);
+  delete threadPool;
+  threadPool = new ThreadPool(threads);
+}
+
+// Loads `count` chunk packets, compressed framing if `compressed`, into
+// `columns`. Failed ones are left null. Returns how many loaded.
+int EXPORT(pc118_loadChunkPacketBatch)(u8 **buffers, int *lengths, int count,
+                                       int compressed, void **columns) {
+  auto pool = getColumnPool();
+  std::atomic<int> loaded{0};
+  getThreadPool()->parallelFor(count, [&](int i) {
+    columns[i] = compressed ? pool->readCompressedChunkPacket(
+                                  defaultRegistry, buffers[i], lengths[i])
+                            : pool->readChunkPacket(defaultRegistry,
+                                                    buffers[i], lengths[i]);
+    if (columns[i]) loaded.fetch_add(1, std::memory_order_relaxed);
+  });
+  return loaded;
+}
+
+// Encodes `count` columns into new buffers. A negative level writes the
+// uncompressed packet (pc118_writeChunkPacket), otherwise like
+// pc118_writeCompressedChunkPacket.
+void EXPORT(pc118_writeChunkPacketBatch)(void **columns, int count, int level,
+                                         u8 **buffers, int *lengths) {
+  getThreadPool()->parallelFor(count, [&](int i) {
+    auto chunkColumn = (ChunkColumn *)columns[i];
+    if (level < 0) {
+      chunkColumn->writeChunkPacket(buffers[i], lengths[i]);
+    } else {
+      buffers[i] = writeCompressedChunkPacket(chunkColumn, level, &lengths[i]);
+    }
+  });
+}
+#endif
+
+// Sets up the packet queue (src/pc/PacketQueue.h): a ring of at least
+// `frameBytes` for the host to write chunk packets into, and one of
+// `completionCount` entries for their results. Replaces any earlier queue,
+// freeing it. Returns the PacketQueueShared block both sides work through,
+// or null if out of memory.
+void *EXPORT(pc118_createQueue)(int frameBytes, int completionCount) {
+  delete packetQueue;
+  packetQueue = new PacketQueue(frameBytes, completionCount);
+  if (!packetQueue->shared) {
+    delete packetQueue;
+    packetQueue = nullptr;
+    return nullptr;
+  }
+  return packetQueue->shared;
+}
+
+void EXPORT(pc118_freeQueue)() {
+  delete packetQueue;
+  packetQueue = nullptr;
+}
+
+// Decodes up to `maxItems` queued packets and posts a completion for each:
+// the column (free or release it as any other) and a QueueStatus. Stops
+// early when the completion ring is full. Natively each batch is decoded on
+// the thread pool. Returns how many completions were posted.
+int EXPORT(pc118_drainQueue)(int maxItems) {
+  if (!packetQueue) return 0;
+  const int BATCH = 64;
+  QueuedPacket packets[BATCH];
+  ChunkColumn *columns[BATCH];
+  int drained = 0;
+  while (drained < maxItems) {
+    int wanted = maxItems - drained < BATCH ? maxItems - drained : BATCH;
+    int count = packetQueue->take(packets, wanted);
+    if (!count) break;
+#ifndef WEBASSEMBLY
+    getThreadPool()->parallelFor(
+        count, [&](int i) { columns[i] = loadQueuedPacket(packets[i]); });
+#else
+    for (int i = 0; i < count; i++) columns[i] = loadQueuedPacket(packets[i]);
+#endif
+    for (int i = 0; i < count; i++) {
+      packetQueue->complete(packets[i], columns[i]);
+    }
+    packetQueue->release();
+    drained += count;
+  }
+  return drained;
+}
+
+// Non-air block count of each section, bottom up
+void EXPORT(pc118_getSectionOccupancy)(void *cc, int *counts) {
+  auto chunkColumn = (ChunkColumn *)cc;
+  for (int i = 0; i < chunkColumn->numSections; i++) {
+    counts[i] = chunkColumn->sections[i]->occupiedBlocks;
+  }
+}
+
+// Box around the non-air blocks of the section at section Y `sectionY` as
+// min x, y, z then max x, y, z in section coordinates. Returns 0 if the
+// section is empty.
+int EXPORT(pc118_getSectionBounds)(void *cc, int sectionY, int *bounds) {
+  return ((ChunkColumn *)cc)->getSectionBounds(sectionY, bounds);
+}
+
+// How many blocks of each state the column holds. Fills up to `maxEntries`
+// state IDs and counts; returns the number of distinct states.
+int EXPORT(pc118_getBlockCounts)(void *cc, int *stateIds, int *counts,
+                                 int maxEntries) {
+  return ((ChunkColumn *)cc)->countStates(stateIds, counts, maxEntries);
+}
+
+// Block change tracking, off by default. Subscribers remember the sequence
+// number they last synced to and ask for what changed since.
+void EXPORT(pc118_setChangeTracking)(void *cc, bool enabled) {
+  ((ChunkColumn *)cc)->changes.enabled = enabled;
+}
+
+u32 EXPORT(pc118_getChangeSeq)(void *cc) {
+  return ((ChunkColumn *)cc)->changes.seq;
+}
+
+// Block Update / Multi Block Change packets for the changes after `since`,
+// each framed as varint length + packet ID + data. Returns null with
+// *outLength 0 if nothing changed, or null with *outLength -1 if the whole
+// chunk should be resent instead (more than `threshold` changes in a section,
+// or the changes were trimmed).
+u8 *EXPORT(pc118_writeChangesSince)(void *cc, u32 since, int threshold,
+                                    int *outLength) {
+  return writeChangesSince((ChunkColumn *)cc, since, threshold, outLength);
+}
+
+// World x, y, z of the blocks changed after `since`, up to `maxPositions`.
+// Returns how many changed, or -1 if the changes were trimmed.
+int EXPORT(pc118_getChangesSince)(void *cc, u32 since, int *positions,
+                                  int maxPositions) {
+  return ((ChunkColumn *)cc)->getChangedPositions(since, positions,
+                                                  maxPositions);
+}
+
+// Drops changes up to `upTo` once every subscriber has synced past them
+void EXPORT(pc118_trimChanges)(void *cc, u32 upTo) {
+  ((ChunkColumn *)cc)->changes.trim(upTo);
+}
+
 int EXPORT(pc118_getBlockStateId)(void *cc, int x, int y, int z) {
   auto chunkColumn = (ChunkColumn *)cc;
   return chunkColumn->getBlockStateId({x, y, z});
@@ -46,14 +1045,25 @@ void EXPORT(pc118_setBlockLight)(void *cc, int x, int y, int z,
   chunkColumn->setBlockLight({x, y, z}, blockLight);
 }
 
-int EXPORT(pc118_getBiomeId)(void *cc, int x, int z) {
+// Biomes are stored per 4x4x4 blocks; x, y, z are block coordinates as for
+// block states
+int EXPORT(pc118_getBiomeId)(void *cc, int x, int y, int z) {
+  auto chunkColumn = (ChunkColumn *)cc;
+  return chunkColumn->getBiomeId({x, y, z});
+}
+
+void EXPORT(pc118_setBiomeId)(void *cc, int x, int y, int z, int biomeId) {
   auto chunkColumn = (ChunkColumn *)cc;
-  return chunkColumn->getBiomeId({x, z});
+  chunkColumn->setBiomeId({x, y, z}, biomeId);
 }
 
-void EXPORT(pc118_setBiomeId)(void *cc, int x, int z, int biomeId) {
+// Fills `biomes` with the column's whole 4x(numSections * 4)x4 biome grid,
+// 4x96x4 for a 1.18 overworld column, indexed (quartY * 4 + quartZ) * 4 +
+// quartX from the bottom. Returns how many were written.
+int EXPORT(pc118_getBiomeIds)(void *cc, int *biomes) {
   auto chunkColumn = (ChunkColumn *)cc;
-  chunkColumn->setBiomeId({x, z}, biomeId);
+  chunkColumn->getBiomeIds(biomes);
+  return chunkColumn->numSections * BiomeSection::SIZE;
 }
 
 int EXPORT(pc118_hasBlockEntity)(void *cc, int x, int y, int z) {
@@ -75,4 +1085,8 @@ void EXPORT(pc118_setBlockEntity)(void *cc, int x, int y, int z, const i8 *tag,
   auto chunkColumn = (ChunkColumn *)cc;
   chunkColumn->setBlockEntity({x, y, z}, {tag, tagLength});
 }
-}
\ No newline at end of file
+}
+
+#if !defined(WEBASSEMBLY) && !defined(_WIN32)
+#pragma GCC visibility pop
+#endif
@@ -19,7 +19,38 @@ enum NBTTag : u8 {
 };
 const int MAX_TAG = 12;
 
-void skipNBTPayload(BinaryStream &stream, NBTTag &type) {
+// Java Edition NBT is big endian; Bedrock's on disk NBT is little endian
+inline int readNBTLength(BinaryStream &stream, bool littleEndian) {
+  return littleEndian ? stream.readIntLE() : stream.readIntBE();
+}
+
+inline int readNBTNameLength(BinaryStream &stream, bool littleEndian) {
+  return littleEndian ? stream.readUShortLE() : stream.readUShortBE();
+}
+
+// Vanilla's limit too
+const int MAX_NBT_DEPTH = 512;
+
+// Leaves the stream past its end, which the callers take as malformed
+inline void failNBT(BinaryStream &stream) {
+  stream.readPosition = stream.size + 1;
+}
+
+// A negative count would seek backwards, possibly forever
+inline void skipNBTArray(BinaryStream &stream, int count, int width) {
+  if (count < 0 || count > (stream.size - stream.readPosition) / width) {
+    failNBT(stream);
+    return;
+  }
+  stream.skip(count * width);
+}
+
+void skipNBTPayload(BinaryStream &stream, NBTTag &type,
+                    bool littleEndian = false, int depth = 0) {
+  if (depth > MAX_NBT_DEPTH) {
+    failNBT(stream);
+    return;
+  }
   switch (type) {
     case TAG_End:
       break;
@@ -42,33 +73,38 @@ void skipNBTPayload(BinaryStream &stream, NBTTag &type) {
       stream.skip(8);
       break;
     case TAG_Byte_Array:
-      stream.skip(2);
-      stream.skip(stream.readShortBE());
+      skipNBTArray(stream, readNBTLength(stream, littleEndian), 1);
       break;
     case TAG_String:
-      stream.skip(2);
-      stream.skip(stream.readShortBE());
+      stream.skip(readNBTNameLength(stream, littleEndian));
       break;
     case TAG_List: {
       auto listType = (NBTTag)stream.readByte();
-      auto listLength = stream.readIntBE();
-      for (int i = 0; i < listLength; i++) {
-        skipNBTPayload(stream, listType);
+      auto listLength = readNBTLength(stream, littleEndian);
+      // Elements must take up bytes, or a long list spins without progress
+      if (listLength > 0 && (listType == TAG_End || listType > MAX_TAG)) {
+        failNBT(stream);
+        break;
+      }
+      for (int i = 0; i < listLength && stream.readPosition < stream.size;
+           i++) {
+        skipNBTPayload(stream, listType, littleEndian, depth + 1);
       }
       break;
     }
     case TAG_Compound: {
-      while (true) {
+      while (stream.readPosition < stream.size) {
         auto tagType = (NBTTag)stream.readByte();
         if (tagType == TAG_End) {
           break;
-        } else if (tagType <= MAX_TAG) {
-          auto tagNameLen = stream.readShortBE();
-          stream.skip(tagNameLen);
-          skipNBTPayload(stream, tagType);
+        } else if (tagType <= MAX_TAG && stream.readPosition < stream.size) {
+          stream.skip(readNBTNameLength(stream, littleEndian));
+          skipNBTPayload(stream, tagType, littleEndian, depth + 1);
         } else {
           assert(false, "Invalid tag type");
           // throw "Invalid tag type";
+          failNBT(stream);
+          break;
         }
       }
       // stream.skip(2);
@@ -76,10 +112,10 @@ void skipNBTPayload(BinaryStream &stream, NBTTag &type) {
       break;
     }
     case TAG_Int_Array:
-      stream.skip(stream.readIntBE() * 4);
+      skipNBTArray(stream, readNBTLength(stream, littleEndian), 4);
       break;
     case TAG_Long_Array:
-      stream.skip(stream.readIntBE() * 8);
+      skipNBTArray(stream, readNBTLength(stream, littleEndian), 8);
       break;
     default:
       assert(false, "Unknown tag type");
@@ -87,15 +123,16 @@ void skipNBTPayload(BinaryStream &stream, NBTTag &type) {
   }
 }
 
-bool skipNBT(BinaryStream &stream) {
+// `named` false for network NBT from 1.20.2 on, whose root tag has no name
+bool skipNBT(BinaryStream &stream, bool named = true,
+             bool littleEndian = false) {
   auto tagType = (NBTTag)stream.readByte();
   if (tagType == TAG_End) {
     return true;
   } else if (tagType <= MAX_TAG) {
-    auto tagNameLen = stream.readShortBE();
-    stream.skip(tagNameLen);
-    skipNBTPayload(stream, tagType);
-    return true;
+    if (named) stream.skip(readNBTNameLength(stream, littleEndian));
+    skipNBTPayload(stream, tagType, littleEndian);
+    return stream.readPosition <= stream.size;
   } else {
     assert(false, "Invalid tag type");
     return false;
@@ -103,6 +140,14 @@ bool skipNBT(BinaryStream &stream) {
   }
 }
 
+void writeNBTTagHeader(BinaryStream &stream, NBTTag type, const char *name) {
+  int nameLength = 0;
+  while (name[nameLength]) nameLength++;
+  stream.writeByte(type);
+  stream.writeShortBE(nameLength);
+  stream.write((void *)name, nameLength);
+}
+
 void getNBT(BinaryStream &stream, out char *buffer, out int len) {
   auto startingPosition = stream.readPosition;
   skipNBT(stream);
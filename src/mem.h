@@ -1,11 +1,24 @@
 #pragma once
 
 #ifndef WEBASSEMBLY
-#include <assert.h>
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// Same contract as the wasm build's assert: the condition is always evaluated
+// (some have side effects) and takes an optional message. Failures are only
+// reported, in debug builds.
+inline void mcwAssert(bool condition, const char *message = nullptr) {
+#ifndef NDEBUG
+  if (!condition) {
+    fprintf(stderr, "mcw: assertion failed%s%s\n", message ? ": " : "",
+            message ? message : "");
+  }
+#endif
+}
+#undef assert
+#define assert(...) mcwAssert(__VA_ARGS__)
+
 template <typename T>
 inline T *Allocate(int size) {
   return static_cast<T *>(calloc(size, sizeof(T)));
@@ -27,9 +40,21 @@ void *reallocate(void *ptr, size_t old_size, size_t new_size) {
 extern "C" {
 
 void* memset(void* dest, int val, size_t len) {
+#ifdef __wasm_bulk_memory__
+  // Lowers to a single memory.fill
+  __builtin_memset(dest, val, len);
+#else
   auto ptr = (unsigned char*)dest;
+  // Byte stores up to alignment, then whole words
+  while (len && ((size_t)ptr & 7)) {
+    *ptr++ = val;
+    len--;
+  }
+  unsigned long long word = (unsigned char)val * 0x0101010101010101ull;
+  for (; len >= 8; len -= 8, ptr += 8) *(unsigned long long*)ptr = word;
   while (len-- > 0)
     *ptr++ = val;
+#endif
   return dest;
 }
 
@@ -62,6 +87,8 @@ void *realloc(void *ptr, size_t originalLength, size_t newLength) {
     return malloc(newLength);
   } else if (newLength <= originalLength) {
     return ptr;
+  } else if (walloc_expand(ptr, newLength)) {
+    return ptr;
   } else {
     assert((ptr) && (newLength > originalLength));
     void *ptrNew = malloc(newLength);
@@ -80,10 +107,7 @@ template <typename T>
 inline T *Allocate(int size) {
   auto allocSize = size * sizeof(T);
   auto allocated = (char *)malloc(allocSize);
-  // zero out the memory
-  for (int i = 0; i < allocSize; i++) {
-    allocated[i] = 0;
-  }
+  if (allocated) memset(allocated, 0, allocSize);
   return reinterpret_cast<T *>(allocated);
 }
 
@@ -96,6 +120,34 @@ void* operator new(unsigned long size) {
   return ptr;
 }
 
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, unsigned long size) noexcept { free(ptr); }
+
+// Placement new, for constructing into arena memory
+inline void *operator new(unsigned long size, void *ptr) noexcept { return ptr; }
+
 #define WASM_EXPORT __attribute__((visibility("default")))
 
 #endif
+
+// Subsystems that heap usage is attributed to in WALLOC_TRACE builds
+enum AllocTag {
+  ALLOC_UNTAGGED,
+  // Section storage: sections, biomes and light, a new column's in one block
+  ALLOC_SECTIONS,
+  ALLOC_BLOCK_ENTITIES,
+  // Short lived buffers: packet encoding and decoding, (de)compression
+  ALLOC_SCRATCH
+};
+
+// Tags allocations made while in scope. Free in untraced builds.
+struct AllocScope {
+#if defined(WEBASSEMBLY) && defined(WALLOC_TRACE)
+  unsigned previous;
+  AllocScope(AllocTag tag) : previous(walloc_set_tag(tag)) {}
+  ~AllocScope() { walloc_set_tag(this->previous); }
+#else
+  AllocScope(AllocTag) {}
+#endif
+};
@@ -0,0 +1,324 @@
+#pragma once
+#include "PacketRewriter.h"
+#include "World.h"
+
+enum AntiXrayMode {
+  // Hidden states that can't be seen become hideState (deepHideState below
+  // y = 0), so ores look like the stone around them
+  ANTI_XRAY_HIDE = 0,
+  // Hidden and replaceable states that can't be seen become a random decoy,
+  // so real ores are lost among fake ones
+  ANTI_XRAY_RANDOMIZE = 1
+};
+
+// Obfuscates ores in chunk packets as they are written, leaving the columns
+// themselves alone, or in packets already encoded (through PacketRewriter).
+// A block counts as seen if any of its six neighbours is air or transparent,
+// including neighbours across section and column borders; neighbour columns
+// are looked up in `world` if one is set, and a missing neighbour hides.
+//
+// Exposure is worked out a 16x16 layer at a time on bitmasks, four rows of
+// 16 blocks to a 64 bit word, so one section is a few hundred word
+// operations on top of a pass over its blocks. Sections whose palette has
+// nothing to hide are skipped without looking at their blocks.
+//
+// Decoys are picked by a generator seeded from the section position, so a
+// chunk sent twice looks the same both times.
+class AntiXray {
+ public:
+  AntiXrayMode mode = ANTI_XRAY_HIDE;
+  // Nothing at or above this world y is touched
+  int maxY = 64;
+  int hideState = 1;
+  // -1 to use hideState everywhere
+  int deepHideState = -1;
+  // For blocks across column borders, optional
+  World *world = nullptr;
+
+  AntiXray() {
+    memset(this->hiddenBits, 0, sizeof(this->hiddenBits));
+    memset(this->replaceableBits, 0, sizeof(this->replaceableBits));
+  }
+
+  AntiXray(const AntiXray &) = delete;
+  AntiXray &operator=(const AntiXray &) = delete;
+
+  // The ores
+  void setHidden(const int *stateIds, int count) {
+    setStates(this->hiddenBits, stateIds, count);
+  }
+
+  // Also replaced with decoys when randomizing, usually stone and the like
+  void setReplaceable(const int *stateIds, int count) {
+    setStates(this->replaceableBits, stateIds, count);
+  }
+
+  // What randomize picks from; with none set, the hidden states themselves
+  void setDecoys(const int *stateIds, int count) {
+    this->decoyCount = 0;
+    for (int i = 0; i < count && this->decoyCount < MAX_DECOYS; i++) {
+      if (stateIds[i] < 0 || stateIds[i] >= MAX_STATES) continue;
+      this->decoys[this->decoyCount++] = stateIds[i];
+    }
+  }
+
+  SectionFilter getFilter() {
+    SectionFilter filter;
+    filter.apply = apply;
+    filter.context = this;
+    return filter;
+  }
+
+  // Fills `blocks` with section `index` of `column` as it should be sent.
+  // Returns false if nothing in it needs hiding.
+  bool obfuscate(ChunkColumn &column, int index, out short *blocks) {
+    auto below = index > 0 ? column.sections[index - 1] : nullptr;
+    auto above =
+        index < column.numSections - 1 ? column.sections[index + 1] : nullptr;
+    return this->obfuscate(*column.sections[index], below, above, column.x,
+                           column.z, index, index - column.co, blocks);
+  }
+
+  // Obfuscates the packet loaded in `rewriter`: sections with something to
+  // hide are re-encoded, the rest of the packet (heightmaps, biomes, block
+  // entities and light) is passed through. False if a section could not be
+  // decoded.
+  template <typename Protocol>
+  bool obfuscate(PacketRewriter<Protocol> &rewriter) {
+    AllocScope scope(ALLOC_SCRATCH);
+    // A section's neighbours are looked at as sent, so each section's blocks
+    // are held back until the one above it has been worked out
+    auto blocks = Allocate<short>(2 * 4096);
+    if (!blocks) return false;
+    short *pending = blocks;
+    short *current = blocks + 4096;
+    int pendingIndex = -1;
+    bool ok = true;
+    for (int i = 0; i < NUM_SECTIONS && ok; i++) {
+      if ((i - Protocol::CO) * 16 >= this->maxY) break;
+      auto section = rewriter.getSection(i);
+      auto below = i > 0 ? rewriter.getSection(i - 1) : nullptr;
+      auto above = i < NUM_SECTIONS - 1 ? rewriter.getSection(i + 1) : nullptr;
+      if (!section || (i > 0 && !below) || (i < NUM_SECTIONS - 1 && !above)) {
+        ok = false;
+        break;
+      }
+      bool changed = this->obfuscate(*section, below, above, rewriter.x,
+                                     rewriter.z, i, i - Protocol::CO, current);
+      if (pendingIndex >= 0) {
+        ok = rewriter.setSectionBlocks(pendingIndex, pending);
+      }
+      pendingIndex = changed ? i : -1;
+      short *swap = pending;
+      pending = current;
+      current = swap;
+    }
+    if (ok && pendingIndex >= 0) {
+      ok = rewriter.setSectionBlocks(pendingIndex, pending);
+    }
+    Deallocate(blocks);
+    return ok;
+  }
+
+ private:
+  // `below` and `above` are the sections next to it in the column, null past
+  // the bottom or top of the world
+  bool obfuscate(ChunkSection &section, ChunkSection *below,
+                 ChunkSection *above, int x, int z, int index, int sectionY,
+                 out short *blocks) {
+    if (section.isEmpty() || sectionY * 16 >= this->maxY) return false;
+    bool randomize = this->mode == ANTI_XRAY_RANDOMIZE;
+    if (randomize && !this->decoyCount && !this->hiddenCount) return false;
+    if (section.paletteLength >= 0) {
+      bool any = false;
+      for (int i = 0; i < section.paletteLength && !any; i++) {
+        any = this->isCandidate(section.palette[i], randomize);
+      }
+      if (!any) return false;
+    }
+
+    auto registry = section.registry;
+    u64 open[16][4];
+    u64 candidates[16][4];
+    bool anyCandidate = false;
+    for (int y = 0; y < 16; y++) {
+      for (int w = 0; w < 4; w++) {
+        const short *row = &section.blocks[y << 8 | w << 6];
+        u64 openWord = 0;
+        u64 candidateWord = 0;
+        for (int i = 0; i < 64; i++) {
+          openWord |= (u64)isOpen(registry, row[i]) << i;
+          candidateWord |= (u64)this->isCandidate(row[i], randomize) << i;
+        }
+        open[y][w] = openWord;
+        candidates[y][w] = candidateWord;
+        anyCandidate |= candidateWord != 0;
+      }
+    }
+    if (!anyCandidate) return false;
+
+    // What lies across each face of the section. Above the world is open
+    // sky, below it is bedrock.
+    u64 belowLayer[4] = {0, 0, 0, 0};
+    u64 aboveLayer[4] = {~0ull, ~0ull, ~0ull, ~0ull};
+    if (below) getLayer(*below, 15, belowLayer);
+    if (above) getLayer(*above, 0, aboveLayer);
+    // Per y: a bit per z for the x faces, a bit per x for the z faces
+    u16 west[16] = {};
+    u16 east[16] = {};
+    u16 north[16] = {};
+    u16 south[16] = {};
+    if (this->world) {
+      if (auto neighbour = this->world->getColumn(x - 1, z)) {
+        getColumnFace(neighbour, index, 15, true, west);
+      }
+      if (auto neighbour = this->world->getColumn(x + 1, z)) {
+        getColumnFace(neighbour, index, 0, true, east);
+      }
+      if (auto neighbour = this->world->getColumn(x, z - 1)) {
+        getColumnFace(neighbour, index, 15, false, north);
+      }
+      if (auto neighbour = this->world->getColumn(x, z + 1)) {
+        getColumnFace(neighbour, index, 0, false, south);
+      }
+    }
+
+    memcpy(blocks, section.blocks, sizeof(section.blocks));
+    u32 random = hash(x, sectionY, z) | 1;
+    bool deep = this->deepHideState >= 0 && sectionY < 0;
+    int hideState = deep ? this->deepHideState : this->hideState;
+    bool changed = false;
+    for (int y = 0; y < 16 && sectionY * 16 + y < this->maxY; y++) {
+      for (int w = 0; w < 4; w++) {
+        u64 hidden = candidates[y][w];
+        if (!hidden) continue;
+        u64 exposed = exposure(open, belowLayer, aboveLayer, west[y],
+                               east[y], north[y], south[y], y, w);
+        hidden &= ~exposed;
+        while (hidden) {
+          int i = y << 8 | w << 6 | __builtin_ctzll(hidden);
+          hidden &= hidden - 1;
+          if (randomize) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            blocks[i] = this->pickDecoy(random);
+          } else {
+            blocks[i] = hideState;
+          }
+          changed = true;
+        }
+      }
+    }
+    return changed;
+  }
+
+  static const int MAX_STATES = 32768;
+  static const int MAX_DECOYS = 64;
+  // The lowest bit of each 16 bit row, and the highest
+  static const u64 ROW_LOW = 0x0001000100010001ull;
+  static const u64 ROW_HIGH = 0x8000800080008000ull;
+
+  u8 hiddenBits[MAX_STATES / 8];
+  u8 replaceableBits[MAX_STATES / 8];
+  short hiddenStates[MAX_DECOYS];
+  int hiddenCount = 0;
+  short decoys[MAX_DECOYS];
+  int decoyCount = 0;
+
+  static bool apply(void *context, ChunkColumn &column, int section,
+                    out short *blocks) {
+    return ((AntiXray *)context)->obfuscate(column, section, blocks);
+  }
+
+  void setStates(u8 *bits, const int *stateIds, int count) {
+    memset(bits, 0, MAX_STATES / 8);
+    bool hidden = bits == this->hiddenBits;
+    if (hidden) this->hiddenCount = 0;
+    for (int i = 0; i < count; i++) {
+      int stateId = stateIds[i];
+      if (stateId < 0 || stateId >= MAX_STATES) continue;
+      bits[stateId >> 3] |= 1 << (stateId & 7);
+      if (hidden && this->hiddenCount < MAX_DECOYS) {
+        this->hiddenStates[this->hiddenCount++] = stateId;
+      }
+    }
+  }
+
+  static inline bool hasState(const u8 *bits, int stateId) {
+    return (u32)stateId < MAX_STATES && bits[stateId >> 3] & (1 << (stateId & 7));
+  }
+
+  inline bool isCandidate(int stateId, bool randomize) {
+    return hasState(this->hiddenBits, stateId) ||
+           (randomize && hasState(this->replaceableBits, stateId));
+  }
+
+  inline short pickDecoy(u32 random) {
+    if (this->decoyCount) return this->decoys[random % this->decoyCount];
+    return this->hiddenStates[random % this->hiddenCount];
+  }
+
+  // Lets sight through
+  static inline bool isOpen(Registry *registry, int stateId) {
+    if (!registry) return stateId == 0;
+    return registry->getFlags(stateId) & (STATE_AIR | STATE_TRANSPARENT);
+  }
+
+  // Open bits of one y layer of a section, in the same layout as exposure()
+  static void getLayer(ChunkSection &section, int y, out u64 layer[4]) {
+    auto registry = section.registry;
+    for (int w = 0; w < 4; w++) {
+      const short *row = &section.blocks[y << 8 | w << 6];
+      u64 word = 0;
+      for (int i = 0; i < 64; i++) word |= (u64)isOpen(registry, row[i]) << i;
+      layer[w] = word;
+    }
+  }
+
+  // Open bits of a neighbour column's face at x (alongX) or z = `edge`, per y
+  static void getColumnFace(ChunkColumn *column, int index, int edge,
+                            bool alongX, out u16 face[16]) {
+    if (index >= column->numSections) return;
+    auto &section = *column->sections[index];
+    auto registry = section.registry;
+    for (int y = 0; y < 16; y++) {
+      u16 bits = 0;
+      for (int i = 0; i < 16; i++) {
+        int block = alongX ? section.blocks[y << 8 | i << 4 | edge]
+                           : section.blocks[y << 8 | edge << 4 | i];
+        bits |= isOpen(registry, block) << i;
+      }
+      face[y] = bits;
+    }
+  }
+
+  // Blocks of word `w` of layer `y` (z = 4w to 4w + 3, 16 x each) with an
+  // open neighbour
+  static inline u64 exposure(const u64 open[16][4], const u64 below[4],
+                             const u64 above[4], u16 west, u16 east,
+                             u16 north, u16 south, int y, int w) {
+    u64 word = open[y][w];
+    // x - 1 and x + 1 within each row, then across the column borders
+    u64 exposed = (word << 1 & ~ROW_LOW) | (word >> 1 & ~ROW_HIGH);
+    exposed |= spreadRows(west >> (w * 4) & 0xf);
+    exposed |= spreadRows(east >> (w * 4) & 0xf) << 15;
+    // z - 1 and z + 1: the neighbouring row is 16 bits over, maybe in the
+    // next word or past the section
+    exposed |= word << 16 | (w ? open[y][w - 1] >> 48 : (u64)north);
+    exposed |= word >> 16 | (w < 3 ? open[y][w + 1] << 48 : (u64)south << 48);
+    exposed |= y ? open[y - 1][w] : below[w];
+    exposed |= y < 15 ? open[y + 1][w] : above[w];
+    return exposed;
+  }
+
+  // Four bits to the lowest bit of each of four 16 bit rows
+  static inline u64 spreadRows(u64 bits) {
+    return (bits & 1) | (bits & 2) << 15 | (bits & 4) << 30 | (bits & 8) << 45;
+  }
+
+  static inline u32 hash(int x, int y, int z) {
+    u32 h = (u32)x * 0x9e3779b1u ^ (u32)y * 0x85ebca77u ^ (u32)z * 0xc2b2ae3du;
+    return h ^ (h >> 16);
+  }
+};
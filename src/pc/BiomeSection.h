@@ -2,97 +2,237 @@
 #include "../PalettedStorage.h"
 #include "../Registry.h"
 
+// A section's 4x4x4 biomes, one per 4x4x4 blocks ("quart"), kept as a
+// palette and packed indices the way the network sends them. Indices are
+// log2ceil(paletteLength) bits, so a section of one biome (most of them) is
+// just palette[0] and no words.
+//
+// Positions are quart coordinates, 0-3 each; ChunkColumn converts from
+// blocks.
 class BiomeSection {
  public:
-  short blocks[64]{0};
-  short palette[64]{0};
-  int paletteLength = 0;
+  static const int SIZE = 4 * 4 * 4;
+  // The network format switches from a palette to global IDs above this
+  static const int MAX_INDIRECT_BITS = 3;
+  // Bits per global ID when writing: 1.18 has 61 biomes. More are used if
+  // an ID needs them.
+  static const int DIRECT_BITS = 6;
+
+  short palette[SIZE]{0};
+  int paletteLength = 1;
+  int bitsPerEntry = 0;
+  // 6 bits at most (64 entries), 10 to a word
+  u64 words[7]{0};
 
   Registry *registry = nullptr;
 
   BiomeSection() {}
   BiomeSection(Registry *registry) : registry(registry) {}
 
-  inline bool isEmpty() { return paletteLength == 0; }
+  inline bool isUniform() { return !this->bitsPerEntry; }
 
-  inline int getIndex(const Vec3i &pos) {
+  static inline int getIndex(const Vec3i &pos) {
     return (pos.y << 4) | (pos.z << 2) | pos.x;
   }
 
+  int getBiomeId(const Vec3i &pos) {
+    if (!this->bitsPerEntry) return this->palette[0];
+    return this->palette[this->getEntry(getIndex(pos))];
+  }
+
   void setBiomeId(const Vec3i &pos, int biome) {
-    blocks[getIndex(pos)] = biome;
+    int index = getIndex(pos);
+    for (int i = 0; i < this->paletteLength; i++) {
+      if (this->palette[i] != biome) continue;
+      if (this->bitsPerEntry) this->setEntry(index, i);
+      return;
+    }
+    // New to the palette, which may need more bits
+    short biomes[SIZE];
+    this->getBiomeIds(biomes);
+    biomes[index] = biome;
+    this->setBiomeIds(biomes);
   }
 
-  int getBiomeId(const Vec3i &pos) { return blocks[getIndex(pos)]; }
+  // All 64 biomes in index order (y, then z, then x)
+  template <typename T>
+  void getBiomeIds(out T *biomes) {
+    if (!this->bitsPerEntry) {
+      for (int i = 0; i < SIZE; i++) biomes[i] = this->palette[0];
+      return;
+    }
+    u16 indices[SIZE];
+    this->unpack(indices);
+    for (int i = 0; i < SIZE; i++) biomes[i] = this->palette[indices[i]];
+  }
+
+  void setBiomeIds(const short *biomes) {
+    u16 indices[SIZE];
+    this->paletteLength = buildPalette(biomes, this->palette, indices);
+    this->bitsPerEntry = log2ceil(this->paletteLength);
+    this->pack(indices);
+  }
 
   void read(BinaryStream &stream) {
     u8 bitsPerBlock = stream.readByte();
-    assert(bitsPerBlock < 16);
-
     if (!bitsPerBlock) {
-      this->paletteLength = 1;
       this->palette[0] = stream.readVarInt();
-      assert(stream.readByte() == 0,
+      this->paletteLength = 1;
+      this->bitsPerEntry = 0;
+      assert(stream.readVarInt() == 0,
              "Expected to read 0 length data for 1 length palette");
       return;
     }
 
-    this->paletteLength = stream.readVarInt();
-    for (int i = 0; i < this->paletteLength; i++) {
-      this->palette[i] = stream.readVarInt();
+    short palette[SIZE];
+    int paletteLength = 0;
+    bool direct = bitsPerBlock > MAX_INDIRECT_BITS;
+    if (!direct) {
+      paletteLength = stream.readVarInt();
+      for (int i = 0; i < paletteLength; i++) {
+        int biome = stream.readVarInt();
+        if (i < SIZE) palette[i] = biome;
+      }
     }
 
-    auto dataLength = stream.readVarInt();
-    auto storage = PalettedStorage<u64>(bitsPerBlock, 4 * 4 * 4);
-    assert(dataLength == storage.wordsCount,
-           "biome palette dataLength does not match expected");
-    // printf("Biome data len %d %d ; palette len %d\n", dataLength,
-    // storage.byteSize, paletteLength);
-    storage.read(stream);
-
-    for (int i = 0; i < 4 * 4 * 4; i++) {
-      blocks[i] = storage.get(i);
+    int dataLength = stream.readVarInt();
+    if (bitsPerBlock > 16 || dataLength != wordsCount(bitsPerBlock)) {
+      assert(false, "biome palette dataLength does not match expected");
+      stream.skip(dataLength * 8);
+      return;
     }
-  }
-
-  void write(BinaryStream &stream) {
-    // Build palette
-    u8 counts[256]{0};
-    u16 palette[64]{0};
-    u16 positionInPalette[64]{0};
-    int paletteLength = 0;
-
-    for (int i = 0; i < 64; i++) {
-      auto block = blocks[i];
-      if (++counts[block] == 1) {
-        positionInPalette[block] = paletteLength;
-        palette[paletteLength++] = block;
+    u64 words[SIZE];
+    PalettedStorage<u64> storage;
+    storage.init(bitsPerBlock, SIZE, words);
+    storage.readBE(stream);
+
+    // Indices are into the sent palette, or are the biomes themselves
+    u16 indices[SIZE];
+    short biomes[SIZE];
+    storage.unpack(indices, SIZE);
+    for (int i = 0; i < SIZE; i++) {
+      int entry = indices[i];
+      if (direct) {
+        biomes[i] = entry;
+      } else {
+        biomes[i] = entry < paletteLength && entry < SIZE ? palette[entry] : 0;
       }
     }
-    // Write palette
-
-    auto bitsPerBlock = log2ceil(paletteLength);
+    this->setBiomeIds(biomes);
+  }
 
-    if (!bitsPerBlock) {
+  void write(BinaryStream &stream) {
+    // Palette entries no longer in use are dropped
+    short biomes[SIZE];
+    short palette[SIZE];
+    u16 indices[SIZE];
+    this->getBiomeIds(biomes);
+    int paletteLength = buildPalette(biomes, palette, indices);
+
+    if (paletteLength == 1) {
       stream.writeByte(0);             // bits per block
       stream.writeVarInt(palette[0]);  // palette
       stream.writeByte(0);             // data length
       return;
     }
 
-    stream.writeByte(bitsPerBlock);
+    int bitsPerBlock = log2ceil(paletteLength);
+    if (bitsPerBlock > MAX_INDIRECT_BITS) {
+      int maxBiome = 0;
+      for (int i = 0; i < paletteLength; i++) {
+        if (palette[i] > maxBiome) maxBiome = palette[i];
+      }
+      bitsPerBlock = log2ceil(maxBiome + 1);
+      if (bitsPerBlock < DIRECT_BITS) bitsPerBlock = DIRECT_BITS;
+      for (int i = 0; i < SIZE; i++) indices[i] = biomes[i];
+      stream.writeByte(bitsPerBlock);
+    } else {
+      stream.writeByte(bitsPerBlock);
+      stream.writeVarInt(paletteLength);
+      for (int i = 0; i < paletteLength; i++) {
+        stream.writeVarInt(palette[i]);
+      }
+    }
 
-    stream.writeVarInt(paletteLength);
-    for (int i = 0; i < paletteLength; i++) {
-      stream.writeVarInt(palette[i]);
+    u64 words[SIZE];
+    PalettedStorage<u64> storage;
+    storage.init(bitsPerBlock, SIZE, words);
+    stream.writeVarInt(storage.wordsCount);  // data length
+    storage.pack(indices, SIZE);
+    storage.writeBE(stream);
+  }
+
+  // Compact in-memory form used by ColumnCache: the palette, then the packed
+  // words as they are
+  void writePacked(BinaryStream &stream) {
+    stream.writeUVarInt(this->paletteLength);
+    for (int i = 0; i < this->paletteLength; i++) {
+      stream.writeUVarInt((u16)this->palette[i]);
+    }
+    if (this->bitsPerEntry) {
+      stream.write(this->words, wordsCount(this->bitsPerEntry) * sizeof(u64));
     }
+  }
 
-    auto storage = PalettedStorage<u64>(bitsPerBlock, 4 * 4 * 4);
-    stream.writeVarInt(storage.wordsCount);  // palette length
-    for (int i = 0; i < 64; i++) {
-      storage.set(i, positionInPalette[blocks[i]]);
+  void readPacked(BinaryStream &stream) {
+    int paletteLength = stream.readUVarInt();
+    if (paletteLength < 1 || paletteLength > SIZE) paletteLength = 1;
+    this->paletteLength = paletteLength;
+    for (int i = 0; i < paletteLength; i++) {
+      this->palette[i] = stream.readUVarInt();
+    }
+    this->bitsPerEntry = log2ceil(paletteLength);
+    if (this->bitsPerEntry) {
+      stream.read(this->words, wordsCount(this->bitsPerEntry) * sizeof(u64));
     }
+  }
 
-    storage.write(stream);
+ private:
+  static inline int wordsCount(int bits) {
+    int perWord = 64 / bits;
+    return (SIZE + perWord - 1) / perWord;
+  }
+
+  inline int getEntry(int index) {
+    int perWord = 64 / this->bitsPerEntry;
+    int shift = (index % perWord) * this->bitsPerEntry;
+    u64 mask = (1u << this->bitsPerEntry) - 1;
+    return (this->words[index / perWord] >> shift) & mask;
+  }
+
+  inline void setEntry(int index, int entry) {
+    int perWord = 64 / this->bitsPerEntry;
+    int shift = (index % perWord) * this->bitsPerEntry;
+    u64 mask = (u64)((1u << this->bitsPerEntry) - 1) << shift;
+    auto &word = this->words[index / perWord];
+    word = (word & ~mask) | ((u64)entry << shift);
+  }
+
+  void pack(const u16 *indices) {
+    for (int w = 0; w < 7; w++) this->words[w] = 0;
+    if (!this->bitsPerEntry) return;
+    PalettedStorage<u64> storage;
+    storage.init(this->bitsPerEntry, SIZE, this->words);
+    storage.pack(indices, SIZE);
+  }
+
+  void unpack(out u16 *indices) {
+    PalettedStorage<u64> storage;
+    storage.init(this->bitsPerEntry, SIZE, this->words);
+    storage.unpack(indices, SIZE);
+  }
+
+  // Distinct biomes in order of first use, and each position's index among
+  // them
+  static int buildPalette(const short *biomes, out short *palette,
+                          out u16 *indices) {
+    int paletteLength = 0;
+    for (int i = 0; i < SIZE; i++) {
+      int entry = 0;
+      while (entry < paletteLength && palette[entry] != biomes[i]) entry++;
+      if (entry == paletteLength) palette[paletteLength++] = biomes[i];
+      indices[i] = entry;
+    }
+    return paletteLength;
   }
-};
\ No newline at end of file
+};
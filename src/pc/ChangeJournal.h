@@ -0,0 +1,104 @@
+#pragma once
+#include "../mem.h"
+#include "../Types.h"
+
+// Block changes made to a column, in order, each stamped with a sequence
+// number so several subscribers can each ask for what changed since they
+// last looked. Only positions are kept; the current state is read from the
+// column when the changes are encoded.
+class ChangeJournal {
+ public:
+  struct Change {
+    u32 seq;
+    // Block index in the section, y << 8 | z << 4 | x
+    u16 index;
+    u8 section;
+  };
+
+  // Off by default, so columns nobody watches pay nothing
+  bool enabled = false;
+  // Sequence number of the latest change, 0 before the first
+  u32 seq = 0;
+  // Changes up to and including this one are no longer held
+  u32 trimmedSeq = 0;
+
+  Change *changes = nullptr;
+  int count = 0;
+
+  // Past this the oldest half is dropped; subscribers that far behind need
+  // the whole chunk anyway
+  static const int MAX_CHANGES = 1 << 16;
+
+  ChangeJournal() {}
+
+  ChangeJournal(const ChangeJournal &) = delete;
+  ChangeJournal &operator=(const ChangeJournal &) = delete;
+
+  inline void record(int section, int index) {
+    if (!this->enabled) return;
+    if (this->count == this->capacity && !this->grow()) {
+      // Out of memory. Dropping the change alone would have subscribers
+      // told they are up to date; this has them resend the chunk instead.
+      this->clear();
+      return;
+    }
+    this->changes[this->count++] = {++this->seq, (u16)index, (u8)section};
+  }
+
+  // Whether everything after `since` is still held
+  bool covers(u32 since) { return since >= this->trimmedSeq; }
+
+  // Index of the first change after `since`
+  int find(u32 since) {
+    int lo = 0;
+    int hi = this->count;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (this->changes[mid].seq <= since) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // Drops changes up to and including `upTo`, once every subscriber has
+  // seen them
+  void trim(u32 upTo) {
+    int first = this->find(upTo);
+    if (!first) return;
+    this->trimmedSeq = this->changes[first - 1].seq;
+    this->count -= first;
+    for (int i = 0; i < this->count; i++) {
+      this->changes[i] = this->changes[first + i];
+    }
+  }
+
+  // Forgets all changes, for when the whole column is replaced. The sequence
+  // moves on so every existing subscriber is told to resend the chunk.
+  void clear() {
+    this->trimmedSeq = ++this->seq;
+    this->count = 0;
+  }
+
+  ~ChangeJournal() { free(this->changes); }
+
+ private:
+  int capacity = 0;
+
+  bool grow() {
+    if (this->capacity == MAX_CHANGES) {
+      this->trim(this->changes[MAX_CHANGES / 2 - 1].seq);
+      return true;
+    }
+    int capacity = this->capacity ? this->capacity * 2 : 256;
+    auto changes = (Change *)reallocate(this->changes,
+                                        this->capacity * sizeof(Change),
+                                        capacity * sizeof(Change));
+    if (!changes) return false;
+    this->changes = changes;
+    this->capacity = capacity;
+    return true;
+  }
+};
@@ -1,33 +1,63 @@
 #pragma once
+#include "../Arena.h"
 #include "../Block.h"
 #include "../Registry.h"
 #include "../Types.h"
 #include "../mcutil/nbt.h"
+#include "../zlib/Deflate.h"
+#include "../zlib/Inflate.h"
 #include "BiomeSection.h"
+#include "ChangeJournal.h"
 #include "ChunkSection.h"
-#ifndef WEBASSEMBLY
-#include <new>
-#endif
+#include "Protocol.h"
+#include "SectionStorage.h"
 
 const int SectionWidth = 16;
 const int SectionHeight = 16;
 
 const int NUM_SECTIONS = 24;
 
+// Decoder tracing, off unless built with -DMCW_DEBUG
+#ifdef MCW_DEBUG
 #define DEBUG_LOG printf
+#else
+#define DEBUG_LOG(...)
+#endif
+
+class ChunkColumn;
+
+// Substitutes the blocks a section is written to a packet with, without
+// touching the column (see AntiXray). `apply` fills `blocks` and returns
+// true, or returns false to have the section written as it is.
+struct SectionFilter {
+  bool (*apply)(void *context, ChunkColumn &column, int section,
+                out short *blocks) = nullptr;
+  void *context = nullptr;
+};
 
 class ChunkColumn {
  public:
-  ChunkSection sections[NUM_SECTIONS];
-  BiomeSection biomes[NUM_SECTIONS];
+  // Block entities and their tags, freed together with the column
+  Arena arena;
+
+  // Sections, biomes and light, possibly shared with snapshots. The arrays
+  // below point into these; anything that writes through them must call
+  // makeWritable first.
+  SectionStorage *storage[NUM_SECTIONS];
+  ChunkSection *sections[NUM_SECTIONS];
+  BiomeSection *biomes[NUM_SECTIONS];
   PalettedStorage<int> skyLights[NUM_SECTIONS];
   PalettedStorage<int> blockLights[NUM_SECTIONS];
 
   struct {
     BlockEntity *list = 0;
     int count = 0;
+    int capacity = 0;
   } blockEntities;
 
+  // Block changes for subscribers, see writeChangesSince
+  ChangeJournal changes;
+
   Registry *registry;
   // Chunk offset (to handle negative Y)
   int co;
@@ -41,16 +71,104 @@ class ChunkColumn {
   int x;
   int z;
 
-  ChunkColumn(Registry *registry, int x = 0, int z = 0) {
+  // Link in ColumnPool's list of released columns
+  ChunkColumn *poolNext = nullptr;
+
+  static const int LIGHT_WORDS = SectionStorage::LIGHT_WORDS;
+
+  ChunkColumn(Registry *registry, int x = 0, int z = 0)
+      : ChunkColumn(registry, x, z,
+                    SectionStorage::allocate(NUM_SECTIONS, registry)) {}
+
+  // A column over NUM_SECTIONS storages laid out one after another, taking
+  // over a reference to each
+  ChunkColumn(Registry *registry, int x, int z, SectionStorage *storage) {
+    AllocScope scope(ALLOC_BLOCK_ENTITIES);
+    this->arena.reserve(getInitialArenaSize());
     this->registry = registry;
     this->x = x;
     this->z = z;
     this->co = 4;
     this->numSections = NUM_SECTIONS;
 
+    assert(storage, "Out of memory allocating chunk column");
+    for (int i = 0; i < NUM_SECTIONS; i++) this->attach(i, &storage[i]);
+  }
+
+  // Readies a used column to be decoded into again: drops block entities,
+  // but leaves the section, biome and light contents alone since decodeInto
+  // overwrites them
+  void reset(Registry *registry, int x = 0, int z = 0) {
+    this->registry = registry;
+    this->x = x;
+    this->z = z;
+    this->blockLightMask = 0;
+    this->skyLightMask = 0;
+    this->blockEntities.list = nullptr;
+    this->blockEntities.count = 0;
+    this->blockEntities.capacity = 0;
+    this->arena.reset();
+    this->changes.enabled = false;
+    this->changes.clear();
+    this->unshareAll();
     for (int i = 0; i < NUM_SECTIONS; i++) {
-      this->skyLights[i].init(4, 4096);
-      this->blockLights[i].init(4, 4096);
+      this->sections[i]->registry = registry;
+      this->biomes[i]->registry = registry;
+    }
+  }
+
+  ~ChunkColumn() {
+    for (int i = 0; i < NUM_SECTIONS; i++) this->storage[i]->release();
+  }
+
+  // Room for a handful of block entities before the arena has to grow
+  static int getInitialArenaSize() { return 64 + 4096; }
+
+  // Heap bytes behind the column, counting storage shared with snapshots in
+  // full
+  size_t getMemoryUsage() {
+    return sizeof(ChunkColumn) + this->arena.bytesReserved +
+           NUM_SECTIONS * sizeof(SectionStorage);
+  }
+
+  // A frozen copy of the column that copies no sections up front: the two
+  // share section storage, and the first write to a shared section on either
+  // side gives that side its own copy. Take snapshots on the thread that
+  // writes to the column; the snapshot itself can then be read or encoded on
+  // any thread. Free it like any other column.
+  //
+  // The sections' bounds and visibility are worked out first, since they are
+  // cached in the section and neither side stores them once it's shared.
+  ChunkColumn *snapshot() {
+    int bounds[6];
+    for (int y = -co; y < numSections - co; y++) {
+      this->getSectionBounds(y, bounds);
+      this->getSectionVisibility(y);
+    }
+    return new ChunkColumn(*this);
+  }
+
+  // Gives the column its own copy of section `index` if it is shared, ahead
+  // of writing to it. False if out of memory.
+  inline bool makeWritable(int index) {
+    if (!this->storage[index]->isShared()) return true;
+    auto copy = this->storage[index]->copy();
+    if (!copy) return false;
+    this->storage[index]->release();
+    this->attach(index, copy);
+    return true;
+  }
+
+  // Ahead of overwriting every section: shared storage is swapped for fresh
+  // storage rather than copied
+  void unshareAll() {
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+      if (!this->storage[i]->isShared()) continue;
+      auto fresh = SectionStorage::allocate(1, this->registry);
+      assert(fresh, "Out of memory allocating chunk section");
+      if (!fresh) continue;
+      this->storage[i]->release();
+      this->attach(i, fresh);
     }
   }
 
@@ -69,11 +187,26 @@ class ChunkColumn {
     }
   }
 
-  ChunkSection getChunkSection(int chunkY) {
-    return this->sections[co + chunkY];
+  // For reading; call makeWritable(co + chunkY) before writing through it
+  ChunkSection &getChunkSection(int chunkY) {
+    return *this->sections[co + chunkY];
+  }
+
+  BiomeSection &getBiomeSection(int chunkY) {
+    return *this->biomes[co + chunkY];
   }
 
-  BiomeSection getBiomeSection(int chunkY) { return this->biomes[co + chunkY]; }
+  // ChunkSection::getBounds and getVisibility, cached only if the section
+  // isn't shared with a snapshot
+  bool getSectionBounds(int chunkY, out int bounds[6]) {
+    auto storage = this->storage[co + chunkY];
+    return storage->section.getBounds(bounds, !storage->isShared());
+  }
+
+  u16 getSectionVisibility(int chunkY) {
+    auto storage = this->storage[co + chunkY];
+    return storage->section.getVisibility(!storage->isShared());
+  }
 
   Block getFullBlock(const Vec3i &pos) {
     // clang-format off
@@ -100,12 +233,21 @@ class ChunkColumn {
   }
 
   int getBlockStateId(const Vec3i &pos) {
-    auto section = this->getChunkSection(pos.y >> 4);
+    auto &section = this->getChunkSection(pos.y >> 4);
     return section.getBlockStateId({pos.x, pos.y & 0xf, pos.z});
   }
 
+  // Biomes are per 4x4x4 blocks
   int getBiomeId(const Vec3i &pos) {
-    return this->biomes[co + (pos.y >> 4)].getBiomeId(pos);
+    return this->biomes[co + (pos.y >> 4)]->getBiomeId(toQuart(pos));
+  }
+
+  // Every biome in the column, 64 per section from the bottom up, each in
+  // BiomeSection::getIndex order: numSections * 64 in all
+  void getBiomeIds(out int *biomes) {
+    for (int i = 0; i < this->numSections; i++) {
+      this->biomes[i]->getBiomeIds(biomes + i * BiomeSection::SIZE);
+    }
   }
 
   int getBlockLight(const Vec3i &pos) {
@@ -138,27 +280,172 @@ class ChunkColumn {
   }
 
   void removeBlockEntity(const Vec3i &pos) {
-    auto newList = (BlockEntity *)malloc(sizeof(BlockEntity) *
-                                         (this->blockEntities.count - 1));
-    for (int i = 0, j = 0; i < this->blockEntities.count; i++) {
+    // The tag stays in the arena until the column is freed
+    int j = 0;
+    for (int i = 0; i < this->blockEntities.count; i++) {
       auto &blockEntity = this->blockEntities.list[i];
-      if (blockEntity.position == pos) {
-        newList[j++] = blockEntity;
+      if (!(blockEntity.position == pos)) {
+        this->blockEntities.list[j++] = blockEntity;
       }
     }
-    free(this->blockEntities.list);
-    this->blockEntities.list = newList;
-    this->blockEntities.count--;
+    this->blockEntities.count = j;
   }
 
   void setBlockStateId(const Vec3i &pos, int stateId) {
-    auto section = this->getChunkSection(pos.y >> 4);
-    section.setBlockStateId({pos.x, pos.y & 0xf, pos.z}, stateId);
+    int s = co + (pos.y >> 4);
+    int index = this->sections[s]->getIndex(pos);
+    if (this->sections[s]->blocks[index] == stateId) return;
+    if (!this->makeWritable(s)) return;
+    this->sections[s]->setBlockStateId({pos.x, pos.y & 0xf, pos.z}, stateId);
+    this->changes.record(s, index);
+  }
+
+  // Marks which blocks changed after `since`: a bit per block index in each
+  // section's bitmap, and a count of them per section. Returns the total.
+  int collectChanges(u32 since, out u32 bitmaps[NUM_SECTIONS][128],
+                     out int counts[NUM_SECTIONS]) {
+    memset(bitmaps, 0, NUM_SECTIONS * 128 * sizeof(u32));
+    for (int s = 0; s < NUM_SECTIONS; s++) counts[s] = 0;
+    int total = 0;
+    auto &journal = this->changes;
+    for (int i = journal.find(since); i < journal.count; i++) {
+      auto &change = journal.changes[i];
+      u32 &word = bitmaps[change.section][change.index >> 5];
+      u32 bit = 1u << (change.index & 31);
+      if (word & bit) continue;
+      word |= bit;
+      counts[change.section]++;
+      total++;
+    }
+    return total;
+  }
+
+  // World positions (x, y, z triples) of the blocks changed after `since`,
+  // up to `maxPositions`. Returns how many changed, or -1 if the journal no
+  // longer goes back that far.
+  int getChangedPositions(u32 since, out int *positions, int maxPositions) {
+    if (!this->changes.covers(since)) return -1;
+    u32 bitmaps[NUM_SECTIONS][128];
+    int counts[NUM_SECTIONS];
+    int total = this->collectChanges(since, bitmaps, counts);
+    int written = 0;
+    for (int s = 0; s < NUM_SECTIONS && written < maxPositions; s++) {
+      if (!counts[s]) continue;
+      for (int w = 0; w < 128 && written < maxPositions; w++) {
+        for (u32 bits = bitmaps[s][w]; bits && written < maxPositions;
+             bits &= bits - 1) {
+          int index = w << 5 | __builtin_ctz(bits);
+          positions[written * 3] = (this->x << 4) + (index & 0xf);
+          positions[written * 3 + 1] = ((s - co) << 4) + (index >> 8);
+          positions[written * 3 + 2] = (this->z << 4) + ((index >> 4) & 0xf);
+          written++;
+        }
+      }
+    }
+    return total;
+  }
+
+  // Upper bound on writeChangesSince's output
+  int getChangesMaxSize(u32 since) {
+    int changed = this->changes.count - this->changes.find(since);
+    return 64 + NUM_SECTIONS * 24 + changed * 10;
+  }
+
+  // Encodes the block changes after `since` as Block Update (one block in a
+  // section) and Multi Block Change packets, each framed as varint length,
+  // packet ID then data, uncompressed. Returns false if the client needs the
+  // whole chunk instead: the journal doesn't go back to `since`, or some
+  // section has more than `threshold` changed blocks.
+  template <typename Protocol = Protocol118>
+  bool writeChangesSince(u32 since, int threshold, BinaryStream &stream) {
+    if (!this->changes.covers(since)) return false;
+    u32 bitmaps[NUM_SECTIONS][128];
+    int counts[NUM_SECTIONS];
+    this->collectChanges(since, bitmaps, counts);
+    for (int s = 0; s < NUM_SECTIONS; s++) {
+      if (counts[s] > threshold) return false;
+    }
+
+    u8 packetBuffer[64];
+    for (int s = 0; s < NUM_SECTIONS; s++) {
+      if (!counts[s]) continue;
+      auto &section = *this->sections[s];
+      i64 sectionX = this->x;
+      i64 sectionY = s - co;
+      i64 sectionZ = this->z;
+
+      if (counts[s] == 1) {
+        int index = 0;
+        for (int w = 0; w < 128; w++) {
+          if (bitmaps[s][w]) {
+            index = w << 5 | __builtin_ctz(bitmaps[s][w]);
+            break;
+          }
+        }
+        i64 blockX = (sectionX << 4) + (index & 0xf);
+        i64 blockY = (sectionY << 4) + (index >> 8);
+        i64 blockZ = (sectionZ << 4) + ((index >> 4) & 0xf);
+        BinaryStream packet(packetBuffer, sizeof(packetBuffer));
+        packet.writeVarInt(Protocol::BLOCK_UPDATE_PACKET_ID);
+        packet.writeLongBE((blockX & 0x3ffffff) << 38 |
+                           (blockZ & 0x3ffffff) << 12 | (blockY & 0xfff));
+        packet.writeVarInt(section.blocks[index]);
+        stream.writeVarInt(packet.writePosition);
+        stream.write(packet.data, packet.writePosition);
+        continue;
+      }
+
+      // Frame length goes in front, so size the entries first
+      int entriesLength = 0;
+      for (int w = 0; w < 128; w++) {
+        for (u32 bits = bitmaps[s][w]; bits; bits &= bits - 1) {
+          int index = w << 5 | __builtin_ctz(bits);
+          entriesLength += varLongSize(getSectionChangeEntry(section, index));
+        }
+      }
+      BinaryStream header(packetBuffer, sizeof(packetBuffer));
+      header.writeVarInt(Protocol::SECTION_BLOCKS_UPDATE_PACKET_ID);
+      header.writeLongBE((sectionX & 0x3fffff) << 42 |
+                         (sectionZ & 0x3fffff) << 20 | (sectionY & 0xfffff));
+      if (Protocol::HAS_TRUST_EDGES) {
+        header.writeByte(0);  // Don't suppress light updates
+      }
+      header.writeVarInt(counts[s]);
+      stream.writeVarInt(header.writePosition + entriesLength);
+      stream.write(header.data, header.writePosition);
+      for (int w = 0; w < 128; w++) {
+        for (u32 bits = bitmaps[s][w]; bits; bits &= bits - 1) {
+          int index = w << 5 | __builtin_ctz(bits);
+          stream.writeVarLong(getSectionChangeEntry(section, index));
+        }
+      }
+    }
+    return true;
+  }
+
+  // State ID << 12 | x << 8 | z << 4 | y
+  static inline i64 getSectionChangeEntry(ChunkSection &section, int index) {
+    int x = index & 0xf, y = index >> 8, z = (index >> 4) & 0xf;
+    return (i64)(u16)section.blocks[index] << 12 | x << 8 | z << 4 | y;
+  }
+
+  static inline int varLongSize(i64 value) {
+    int size = 1;
+    while ((u64)value >= 0x80) {
+      value = (u64)value >> 7;
+      size++;
+    }
+    return size;
   }
 
   void setBiomeId(const Vec3i &pos, int biomeId) {
-    auto section = this->getBiomeSection(pos.y >> 4);
-    section.setBiomeId({pos.x, pos.y & 0xf, pos.z}, biomeId);
+    if (!this->makeWritable(co + (pos.y >> 4))) return;
+    auto &section = this->getBiomeSection(pos.y >> 4);
+    section.setBiomeId(toQuart(pos), biomeId);
+  }
+
+  static inline Vec3i toQuart(const Vec3i &pos) {
+    return {(pos.x & 0xf) >> 2, (pos.y & 0xf) >> 2, (pos.z & 0xf) >> 2};
   }
 
   int getLightIndex(const Vec3i &pos) {
@@ -166,30 +453,49 @@ class ChunkColumn {
   }
 
   void setBlockLight(const Vec3i &pos, int blockLight) {
+    if (!this->makeWritable(co + (pos.y >> 4))) return;
     this->blockLights[co + (pos.y >> 4)].set(getLightIndex(pos), blockLight);
   }
 
   void setSkyLight(const Vec3i &pos, int skyLight) {
+    if (!this->makeWritable(co + (pos.y >> 4))) return;
     this->skyLights[co + (pos.y >> 4)].set(getLightIndex(pos), skyLight);
   }
 
   void setBlockEntity(const Vec3i &pos, BlockEntity blockEntity) {
+    AllocScope scope(ALLOC_BLOCK_ENTITIES);
+    // Keep our own copy of the tag, the caller's buffer may not outlive us
+    auto tag = (i8 *)this->arena.allocate(blockEntity.tagLength, 1);
+    assert(tag != NULL);
+    memcpy(tag, blockEntity.tag, blockEntity.tagLength);
+    blockEntity.tag = tag;
+    blockEntity.position = pos;
+
     for (int i = 0; i < this->blockEntities.count; i++) {
       if (this->blockEntities.list[i].position == pos) {
         this->blockEntities.list[i] = blockEntity;
         return;
       }
     }
-    this->blockEntities.list = (BlockEntity *)reallocate(
-        this->blockEntities.list,
-        sizeof(BlockEntity) * (this->blockEntities.count),
-        sizeof(BlockEntity) * (this->blockEntities.count + 1));
-    assert(this->blockEntities.list != NULL);
-    blockEntity.position = pos;
+    if (this->blockEntities.count == this->blockEntities.capacity) {
+      int capacity = this->blockEntities.capacity * 2;
+      if (!capacity) capacity = 8;
+      auto list = this->arena.allocate<BlockEntity>(capacity);
+      assert(list != NULL);
+      if (this->blockEntities.count) {
+        memcpy(list, this->blockEntities.list,
+               sizeof(BlockEntity) * this->blockEntities.count);
+      }
+      this->blockEntities.list = list;
+      this->blockEntities.capacity = capacity;
+    }
     this->blockEntities.list[this->blockEntities.count++] = blockEntity;
   }
 
-  void writeNetworkSerializedTerrain(out u8 *&buffer, out int &bufferSize) {
+  void writeNetworkSerializedTerrain(
+      out u8 *&buffer, out int &bufferSize,
+      const SectionFilter &filter = SectionFilter()) {
+    AllocScope scope(ALLOC_SCRATCH);
     // This may seem expensive, but it's really cheap. We allocate the max size
     // possible on a CC on the stack (which is just moving stack pointer) then
     // we copy it over to the heap with the known size.
@@ -199,11 +505,7 @@ class ChunkColumn {
 
     u8 tempBuffer[max_size];
     BinaryStream stream(tempBuffer, max_size);
-
-    for (int i = 0; i < this->numSections; i++) {
-      this->sections[i].write(stream);
-      this->biomes[i].write(stream);
-    }
+    this->writeNetworkSerializedTerrain(stream, filter);
 
     buffer = (u8 *)malloc(stream.writePosition);
     bufferSize = stream.writePosition;
@@ -212,26 +514,43 @@ class ChunkColumn {
     return;
   }
 
-  void loadNetworkSerializedTerrain(BinaryStream &stream) {
+  void writeNetworkSerializedTerrain(
+      BinaryStream &stream, const SectionFilter &filter = SectionFilter()) {
+    short filtered[4096];
+    for (int i = 0; i < this->numSections; i++) {
+      if (filter.apply && filter.apply(filter.context, *this, i, filtered)) {
+        this->sections[i]->write(stream, filtered);
+      } else {
+        this->sections[i]->write(stream);
+      }
+      this->biomes[i]->write(stream);
+    }
+  }
+
+  // False if a section is malformed or the data runs out
+  bool loadNetworkSerializedTerrain(BinaryStream &stream) {
     for (int i = 0; i < this->numSections; i++) {
-      this->sections[i].read(stream);
-      this->biomes[i].read(stream);
-      printf("Done %d %d\n", i, stream.readPosition);
+      // Light is kept, so shared storage has to be copied
+      if (!this->makeWritable(i)) return false;
+      if (!this->sections[i]->read(stream)) return false;
+      this->biomes[i]->read(stream);
+      DEBUG_LOG("Done %d %d\n", i, stream.readPosition);
     }
-    printf("Read net terrain %d / %d\n", stream.readPosition, stream.size);
+    DEBUG_LOG("Read net terrain %d / %d\n", stream.readPosition, stream.size);
     // stream.dumpRemaining();
+    return stream.readPosition <= stream.size;
   }
 
-  void loadNetworkSerializedTerrain(u8 *buffer, int bufferSize) {
+  bool loadNetworkSerializedTerrain(u8 *buffer, int bufferSize) {
     BinaryStream stream(buffer, bufferSize);
-    this->loadNetworkSerializedTerrain(stream);
+    return this->loadNetworkSerializedTerrain(stream);
   }
 
   void writeNetworkSerializedLights(BinaryStream &stream) {
     // ok, could be done with less code but Copilot came up with this and it's
     // actually more efficient :D
     int skyLights = 0;
-    for (int i = 0; i < this->numSections + 1; i++) {
+    for (int i = 0; i < this->numSections; i++) {
       auto mask = 1 << i;
       if (skyLightMask & mask) {
         skyLights++;
@@ -239,7 +558,7 @@ class ChunkColumn {
     }
     stream.writeVarInt(skyLights);
 
-    for (int i = 0; i < this->numSections + 1; i++) {
+    for (int i = 0; i < this->numSections; i++) {
       auto mask = 1 << i;
       if (skyLightMask & mask) {
         stream.writeVarInt(2048);
@@ -269,13 +588,18 @@ class ChunkColumn {
   void loadNetworkSerializedLights(u8 *skyLight, int skyLightLength,
                                    u8 *blockLight, int blockLightLength,
                                    u64 skyLightMask, u64 blockLightMask) {
-    BinaryStream skyStream(skyLight, skyLightLength);
-    BinaryStream blockStream(blockLight, blockLightLength);
+    // Lengths are in arrays of 2048 bytes
+    BinaryStream skyStream(skyLight, skyLightLength * 2048);
+    BinaryStream blockStream(blockLight, blockLightLength * 2048);
 
     // toss the stupid extraneous light data because we don't store it
     this->blockLightMask = blockLightMask << 38 >> 38 >> 1;
     this->skyLightMask = skyLightMask << 38 >> 38 >> 1;
 
+    for (int i = 0; i < this->numSections; i++) {
+      if (!this->makeWritable(i)) return;
+    }
+
     int skyY = 0;
     int blockY = 0;
     for (int i = 0; i < this->numSections + 2; i++) {
@@ -284,6 +608,16 @@ class ChunkColumn {
       // light data is sent for +/- 1 real world height, ignore those
       bool outOfBoundsWeTrack = i == 0 || i == (this->numSections + 1);
 
+      // A reused column may still hold light from its last chunk
+      if (!outOfBoundsWeTrack && !(skyLightMask & sectionMask)) {
+        auto &storage = this->skyLights[currentY];
+        memset(storage.words, 0, storage.byteSize);
+      }
+      if (!outOfBoundsWeTrack && !(blockLightMask & sectionMask)) {
+        auto &storage = this->blockLights[currentY];
+        memset(storage.words, 0, storage.byteSize);
+      }
+
       if (skyLightMask & sectionMask) {
         if (outOfBoundsWeTrack) {
           skyStream.skip(2048);
@@ -292,7 +626,7 @@ class ChunkColumn {
           this->skyLights[currentY].read(skyStream);
         }
 
-        printf("reading skylight at y=%d\n", i - co);
+        DEBUG_LOG("reading skylight at y=%d\n", i - co);
       }
       if (blockLightMask & sectionMask) {
         if (outOfBoundsWeTrack) {
@@ -302,94 +636,421 @@ class ChunkColumn {
           this->blockLights[currentY].read(blockStream);
         }
 
-        printf("reading blocklight at y=%d\n", i - co);
+        DEBUG_LOG("reading blocklight at y=%d\n", i - co);
       }
     }
   }
 
-  void writeSimpleHeightMap(BinaryStream &stream) {
-    // TODO: actually we can't finish this until we implement the Registry
-    // here... to know what ID an air block is auto bitsPerBlock =
-    // log2ceil(this->numSections << 4); assert(bitsPerBlock == 9, "bitsPerBlock
-    // is %d but expected 9",
-    //        bitsPerBlock);
-    // PalettedStorage<u64> storage(bitsPerBlock);
-    // for (int x = 0; x < 16; x++) {
-    //   for (int z = 0; z < 16; z++) {
-    //     for (int y = maxY; y > minY; y++) {
-    //       if (this->getBlockStateId({x, y, z}) != 0) {
-    //         stream.writeVarInt(y);
-    //         break;
-    //       }
-    //     }
-    //   }
-    // }
+  // Block counts per state over the whole column. Writes up to `maxEntries`
+  // and returns how many distinct states there are.
+  int countStates(out int *stateIds, out int *counts, int maxEntries) {
+    // Sparse set from state to entry, as in ChunkSection::buildPalette
+    u16 entryOf[65536];
+    u16 states[4096];
+    int totals[4096];
+    int length = 0;
+    auto add = [&](u16 state, int count) {
+      int entry = entryOf[state];
+      if (entry >= length || states[entry] != state) {
+        if (length == 4096) return;
+        entry = length++;
+        entryOf[state] = entry;
+        states[entry] = state;
+        totals[entry] = 0;
+      }
+      totals[entry] += count;
+    };
+    for (int s = 0; s < this->numSections; s++) {
+      auto &section = *this->sections[s];
+      if (section.paletteLength >= 0) {
+        for (int i = 0; i < section.paletteLength; i++) {
+          add(section.palette[i], section.paletteCounts[i]);
+        }
+      } else {
+        for (int i = 0; i < 4096; i++) add(section.blocks[i], 1);
+      }
+    }
+    for (int i = 0; i < length && i < maxEntries; i++) {
+      stateIds[i] = states[i];
+      counts[i] = totals[i];
+    }
+    return length;
   }
 
-  void writeChunkPacket(out u8 *&buffer, out int &bufferSize) {
+  // Height (relative to minY) above the highest matching block in each x, z
+  // column, indexed z * 16 + x. MOTION_BLOCKING counts solids and fluids,
+  // WORLD_SURFACE anything but air. Needs a registry.
+  void computeHeightMap(bool motionBlocking, out u16 heights[256]) {
+    for (int i = 0; i < 256; i++) heights[i] = 0;
+    int remaining = 256;
+    for (int s = this->numSections - 1; s >= 0 && remaining; s--) {
+      auto &section = *this->sections[s];
+      // Neither heightmap stops at air
+      if (section.isEmpty()) continue;
+      for (int i = 0; i < 256; i++) {
+        if (heights[i]) continue;
+        for (int y = 15; y >= 0; y--) {
+          u8 flags = this->registry->getFlags(section.blocks[y << 8 | i]);
+          bool matches = motionBlocking ? flags & (STATE_SOLID | STATE_FLUID)
+                                        : !(flags & STATE_AIR);
+          if (matches) {
+            heights[i] = (s << 4) + y + 1;
+            remaining--;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  // Heightmaps as a network NBT compound of packed long arrays. Without a
+  // registry we can't tell what air is, so an empty compound is sent.
+  template <typename Protocol = Protocol118>
+  void writeHeightMaps(BinaryStream &stream) {
+    if (!this->registry) {
+      stream.writeByte(NBTTag::TAG_End);
+      return;
+    }
+    const int bitsPerEntry = log2ceil(this->numSections * 16 + 1);
+    const int entriesPerLong = 64 / bitsPerEntry;
+    const int longs = (256 + entriesPerLong - 1) / entriesPerLong;
+
+    if (Protocol::NAMED_NBT_ROOT) {
+      writeNBTTagHeader(stream, TAG_Compound, "");
+    } else {
+      stream.writeByte(TAG_Compound);
+    }
+    const char *names[] = {"MOTION_BLOCKING", "WORLD_SURFACE"};
+    for (int k = 0; k < 2; k++) {
+      u16 heights[256];
+      this->computeHeightMap(k == 0, heights);
+      writeNBTTagHeader(stream, TAG_Long_Array, names[k]);
+      stream.writeIntBE(longs);
+      for (int l = 0; l < longs; l++) {
+        u64 packed = 0;
+        for (int e = 0; e < entriesPerLong; e++) {
+          int i = l * entriesPerLong + e;
+          if (i < 256) packed |= (u64)heights[i] << (e * bitsPerEntry);
+        }
+        stream.writeULongBE(packed);
+      }
+    }
+    stream.writeByte(TAG_End);
+  }
+
+  template <typename Protocol = Protocol118>
+  void writeChunkPacket(out u8 *&buffer, out int &bufferSize,
+                        const SectionFilter &filter = SectionFilter()) {
+    AllocScope scope(ALLOC_SCRATCH);
     u8 *terrainData;
     int terrainLength = 0;
-    this->writeNetworkSerializedTerrain(terrainData, terrainLength);
+    this->writeNetworkSerializedTerrain(terrainData, terrainLength, filter);
 
     const int max_size = 1'000'000;
 
     u8 tempBuffer[max_size];
     BinaryStream stream(tempBuffer, max_size);
 
+    this->writeChunkPacketHeader<Protocol>(stream, terrainLength);
+    stream.write(terrainData, terrainLength);
+
+    free(terrainData);
+
+    this->writeChunkPacketTrailer<Protocol>(stream);
+
+    buffer = (u8 *)malloc(stream.writePosition);
+    bufferSize = stream.writePosition;
+    stream.save(buffer);
+
+    return;
+  }
+
+  // Everything up to and including the terrain length
+  template <typename Protocol = Protocol118>
+  void writeChunkPacketHeader(BinaryStream &stream, int terrainLength) {
     stream.writeIntBE(x);
     stream.writeIntBE(z);
-    stream.writeByte(NBTTag::TAG_End);
+    this->writeHeightMaps<Protocol>(stream);
 
     stream.writeVarInt(terrainLength);
-    stream.write(terrainData, terrainLength);
-
-    free(terrainData);
+  }
 
+  // Block entities and light, everything after the terrain
+  template <typename Protocol = Protocol118>
+  void writeChunkPacketTrailer(BinaryStream &stream) {
     stream.writeVarInt(this->blockEntities.count);
     for (int i = 0; i < this->blockEntities.count; i++) {
       auto &entity = this->blockEntities.list[i];
       stream.write((u8 *)entity.tag, entity.tagLength);
     }
 
-    stream.writeByte(0);  // Trust edge lighting
+    if (Protocol::HAS_TRUST_EDGES) {
+      stream.writeByte(0);  // Trust edge lighting
+    }
 
-    stream.writeVarInt(1);  // Sky light length
-    stream.writeULongBE(skyLightMask);
-    stream.writeVarInt(1);  // Block light length
-    stream.writeULongBE(blockLightMask);
-    // no idea what the point of "air masks" are
-    stream.writeVarInt(1);  // Air mask length
-    stream.writeULongBE(~skyLightMask);
-    stream.writeVarInt(1);  // Block mask length
-    stream.writeULongBE(~blockLightMask);
+    // Bit 0 of the masks is the section below the world. Sections we have
+    // no light for are sent as all dark.
+    u64 sections = (1ull << this->numSections) - 1;
+    writeLightMask(stream, (u64)skyLightMask << 1);
+    writeLightMask(stream, (u64)blockLightMask << 1);
+    writeLightMask(stream, (sections & ~skyLightMask) << 1);
+    writeLightMask(stream, (sections & ~blockLightMask) << 1);
 
     this->writeNetworkSerializedLights(stream);
+  }
 
-    buffer = (u8 *)malloc(stream.writePosition);
-    bufferSize = stream.writePosition;
-    stream.save(buffer);
+  // A BitSet: varint long count, then the longs. Column heights of up to 62
+  // sections fit one long.
+  static void writeLightMask(BinaryStream &stream, u64 mask) {
+    stream.writeVarInt(mask ? 1 : 0);
+    if (mask) stream.writeULongBE(mask);
+  }
 
-    return;
+  static u64 readLightMask(BinaryStream &stream) {
+    int longs = stream.readVarInt();
+    if (longs <= 0) return 0;
+    u64 mask = stream.readLongBE();
+    stream.skip((longs - 1) * 8);
+    return mask;
+  }
+
+  int getChunkPacketTrailerMaxSize() {
+    int size = 64 + 2 * (NUM_SECTIONS + 2) * (2048 + 3);
+    for (int i = 0; i < this->blockEntities.count; i++) {
+      size += this->blockEntities.list[i].tagLength;
+    }
+    return size;
+  }
+
+  // Writes the packet as framed with compression on: varint uncompressed
+  // length, then the zlib compressed packet ID + data. The header, terrain and
+  // trailer are fed to the deflater as separate segments rather than being
+  // joined into one buffer first. The Deflater can be reused across calls.
+  template <typename Protocol = Protocol118>
+  void writeCompressedChunkPacket(
+      Deflater &deflater, out u8 *&buffer, out int &bufferSize,
+      const SectionFilter &filter = SectionFilter()) {
+    AllocScope scope(ALLOC_SCRATCH);
+    const int max_size = 1'000'000;
+    u8 terrainBuffer[max_size];
+    BinaryStream terrain(terrainBuffer, max_size);
+    this->writeNetworkSerializedTerrain(terrain, filter);
+
+    u8 headerBuffer[1024];
+    BinaryStream header(headerBuffer, sizeof(headerBuffer));
+    header.writeVarInt(Protocol::CHUNK_DATA_PACKET_ID);
+    this->writeChunkPacketHeader<Protocol>(header, terrain.writePosition);
+
+    BinaryStream trailer(this->getChunkPacketTrailerMaxSize());
+    this->writeChunkPacketTrailer<Protocol>(trailer);
+
+    int dataLength =
+        header.writePosition + terrain.writePosition + trailer.writePosition;
+    // Chunk data usually compresses at least 4:1
+    BinaryStream compressed(dataLength / 4 + 64);
+    compressed.writeVarInt(dataLength);
+    deflater.begin(compressed);
+    deflater.write(header.data, header.writePosition);
+    deflater.write(terrain.data, terrain.writePosition);
+    deflater.write(trailer.data, trailer.writePosition);
+    deflater.finish();
+
+    // Hand the compressed buffer over to the caller
+    compressed.weAllocated = false;
+    buffer = compressed.data;
+    bufferSize = compressed.writePosition;
+  }
+
+  // Compact form for columns parked in a ColumnCache. Sections are palette
+  // packed, uniform light arrays shrink to one byte, and unlike the packet
+  // everything round trips. Words are in native order, so it is not meant to
+  // leave the process.
+  void writeCompact(BinaryStream &stream) {
+    stream.writeIntBE(this->x);
+    stream.writeIntBE(this->z);
+    stream.writeULongBE(this->skyLightMask);
+    stream.writeULongBE(this->blockLightMask);
+    for (int i = 0; i < this->numSections; i++) {
+      this->sections[i]->writePacked(stream);
+      this->biomes[i]->writePacked(stream);
+      writeCompactLight(stream, this->skyLights[i]);
+      writeCompactLight(stream, this->blockLights[i]);
+    }
+    stream.writeUVarInt(this->blockEntities.count);
+    for (int i = 0; i < this->blockEntities.count; i++) {
+      auto &entity = this->blockEntities.list[i];
+      stream.writeIntBE(entity.position.x);
+      stream.writeIntBE(entity.position.y);
+      stream.writeIntBE(entity.position.z);
+      stream.writeUVarInt(entity.tagLength);
+      stream.write((u8 *)entity.tag, entity.tagLength);
+    }
+  }
+
+  // Overwrites everything, like decodeInto
+  bool readCompact(BinaryStream &stream) {
+    this->changes.clear();
+    this->unshareAll();
+    this->x = stream.readIntBE();
+    this->z = stream.readIntBE();
+    this->skyLightMask = stream.readULongBE();
+    this->blockLightMask = stream.readULongBE();
+    for (int i = 0; i < this->numSections; i++) {
+      this->sections[i]->readPacked(stream);
+      this->biomes[i]->readPacked(stream);
+      readCompactLight(stream, this->skyLights[i]);
+      readCompactLight(stream, this->blockLights[i]);
+    }
+    int blockEntitiesCount = stream.readUVarInt();
+    for (int i = 0; i < blockEntitiesCount; i++) {
+      Vec3i pos;
+      pos.x = stream.readIntBE();
+      pos.y = stream.readIntBE();
+      pos.z = stream.readIntBE();
+      int tagLength = stream.readUVarInt();
+      if (stream.readPosition + tagLength > stream.size) return false;
+      // Copied into the arena
+      this->setBlockEntity(
+          pos, BlockEntity((i8 *)stream.data + stream.readPosition, tagLength));
+      stream.skip(tagLength);
+    }
+    return stream.readPosition <= stream.size;
+  }
+
+  // Upper bound on writeCompact's output
+  int getCompactMaxSize() {
+    // Worst case section: 4096 palette entries of 3 bytes, 12 bits each
+    int sectionMax = 4096 * 3 + 2 + 4096 * 12 / 8;
+    int biomeMax = 1 + 64 * 3 * 2;
+    int lightMax = 2 * (1 + LIGHT_WORDS * sizeof(int));
+    int size = 32 + this->numSections * (sectionMax + biomeMax + lightMax) + 5;
+    for (int i = 0; i < this->blockEntities.count; i++) {
+      size += 12 + 5 + this->blockEntities.list[i].tagLength;
+    }
+    return size;
   }
 
+  static void writeCompactLight(BinaryStream &stream,
+                                PalettedStorage<int> &light) {
+    // All 4096 nibbles the same is common: full sky light above the ground
+    // and none below it
+    int first = light.words[0];
+    bool uniform = ((first >> 4) & 0x0fffffff) == (first & 0x0fffffff);
+    for (int i = 1; uniform && i < light.wordsCount; i++) {
+      uniform = light.words[i] == first;
+    }
+    if (uniform) {
+      stream.writeByte(first & 0xf);
+    } else {
+      stream.writeByte(0x10);
+      light.write(stream);
+    }
+  }
+
+  static void readCompactLight(BinaryStream &stream,
+                               PalettedStorage<int> &light) {
+    int value = stream.readByte();
+    if (value == 0x10) {
+      light.read(stream);
+      return;
+    }
+    int word = (int)(value * 0x11111111u);
+    for (int i = 0; i < light.wordsCount; i++) light.words[i] = word;
+  }
+
+  template <typename Protocol = Protocol118>
   static ChunkColumn *readChunkPacket(Registry *registry, u8 *buffer, int len) {
     BinaryStream stream(buffer, len);
+    return readChunkPacket<Protocol>(registry, stream);
+  }
 
-    int x = stream.readIntBE();
-    int z = stream.readIntBE();
-    auto heightmaps = skipNBT(stream);
-    if (!heightmaps) {
-      // nbt reading error
+  // Reads a chunk packet body as framed with compression enabled: a varint
+  // uncompressed length (0 if sent uncompressed), then the zlib stream of the
+  // packet ID and data. The inflated bytes go straight to the decoder.
+  template <typename Protocol = Protocol118>
+  static ChunkColumn *readCompressedChunkPacket(Registry *registry, u8 *buffer,
+                                                int len) {
+    ChunkColumn *chunk = new ChunkColumn(registry);
+    if (!chunk->decodeCompressedInto<Protocol>(buffer, len)) {
+      delete chunk;
+      return nullptr;
+    }
+    return chunk;
+  }
+
+  template <typename Protocol = Protocol118>
+  static ChunkColumn *readChunkPacket(Registry *registry,
+                                      BinaryStream &stream) {
+    ChunkColumn *chunk = new ChunkColumn(registry);
+    if (!chunk->decodeInto<Protocol>(stream)) {
+      delete chunk;
       return nullptr;
     }
+    return chunk;
+  }
+
+  // Largest uncompressed length decodeCompressedInto accepts, the client's
+  // own limit
+  static const int MAX_PACKET_LENGTH = 8 << 20;
+
+  template <typename Protocol = Protocol118>
+  bool decodeCompressedInto(u8 *buffer, int len) {
+    AllocScope scope(ALLOC_SCRATCH);
+    BinaryStream framed(buffer, len);
+    auto dataLength = framed.readVarInt();
+    if (dataLength == 0) {
+      framed.readVarInt();  // packet ID
+      return this->decodeInto<Protocol>(framed);
+    }
+    if (dataLength < 0 || dataLength > MAX_PACKET_LENGTH) return false;
+
+    auto inflated = Allocate<u8>(dataLength);
+    if (!inflated) return false;
+    // Not ours to grow, so inflating stops at the declared length
+    BinaryStream stream(inflated, dataLength);
+    auto status = inflate(buffer + framed.readPosition,
+                          len - framed.readPosition, stream, INFLATE_ZLIB);
+    bool decoded = false;
+    if (status != INFLATE_OK || stream.writePosition != dataLength) {
+      DEBUG_LOG("cc: inflate failed %d\n", status);
+    } else {
+      stream.readVarInt();  // packet ID
+      decoded = this->decodeInto<Protocol>(stream);
+    }
+    Deallocate(inflated);
+    return decoded;
+  }
 
-    ChunkColumn *chunk = new ChunkColumn(registry, x, z);
+  template <typename Protocol = Protocol118>
+  bool decodeInto(u8 *buffer, int len) {
+    BinaryStream stream(buffer, len);
+    return this->decodeInto<Protocol>(stream);
+  }
+
+  // Decodes a chunk packet over this column's existing storage. Every section,
+  // biome and light array is overwritten, so a column fresh out of reset()
+  // needs no clearing first.
+  template <typename Protocol = Protocol118>
+  bool decodeInto(BinaryStream &stream) {
+    this->changes.clear();
+    this->unshareAll();
+    this->x = stream.readIntBE();
+    this->z = stream.readIntBE();
+    auto heightmaps = skipNBT(stream, Protocol::NAMED_NBT_ROOT);
+    if (!heightmaps) {
+      // nbt reading error
+      return false;
+    }
 
     // The extra zeros at the end are a pain to deal with... we have to skip
     // them here.
     auto chunkPayloadSize = stream.readVarInt();
+    if (chunkPayloadSize < 0 ||
+        chunkPayloadSize > stream.size - stream.readPosition) {
+      return false;
+    }
     auto expectedNewPosition = stream.readPosition + chunkPayloadSize;
-    chunk->loadNetworkSerializedTerrain(stream);
+    if (!this->loadNetworkSerializedTerrain(stream)) return false;
     // Extraneous zeros at the end of the payload need to be accounted for
     DEBUG_LOG("cc: skip %d bytes\n", expectedNewPosition - stream.readPosition);
     stream.readPosition = expectedNewPosition;
@@ -398,56 +1059,77 @@ class ChunkColumn {
 
     auto blockEntitiesCount = stream.readVarInt();
     for (int i = 0; i < blockEntitiesCount; i++) {
-      auto sXZ = stream.readByte();
-      auto sY = stream.readShortBE();
-      auto blockEntityType = stream.readVarInt();
-      auto blockEntityNbt = skipNBT(stream);
+      stream.readByte();     // Packed x and z
+      stream.readShortBE();  // y
+      stream.readVarInt();   // Type
+      if (!skipNBT(stream, Protocol::NAMED_NBT_ROOT)) return false;
     }
-    auto trustEdges = stream.readByte();
+    if (Protocol::HAS_TRUST_EDGES) stream.readByte();  // Trust edges
 
-    u64 skyLightMask = 0, blockLightMask = 0;
+    u64 skyLightMask = readLightMask(stream);
+    u64 blockLightMask = readLightMask(stream);
+    readLightMask(stream);  // Empty sky light
+    readLightMask(stream);  // Empty block light
 
-    auto skyLightMaskLen = stream.readVarInt();
-    if (skyLightMaskLen) {
-      skyLightMask = stream.readLongBE();
-    }
-
-    auto blockLightMaskLen = stream.readVarInt();
-    if (blockLightMaskLen) {
-      blockLightMask = stream.readLongBE();
-    }
-
-    auto emptySkyLightMaskLen = stream.readVarInt();
-    if (emptySkyLightMaskLen) {
-      stream.readLongBE();
-    }
-    auto emptyBlockLightMaskLen = stream.readVarInt();
-    if (emptyBlockLightMaskLen) {
-      stream.readLongBE();
-    }
-
-    u8 skylight[2048 * 24];
-    u8 blocklight[2048 * 24];
+    // One array per section, and one each for below and above the world
+    const int maxArrays = NUM_SECTIONS + 2;
+    u8 skylight[2048 * maxArrays];
+    u8 blocklight[2048 * maxArrays];
 
     auto skyLightLength = stream.readVarInt();
+    if (skyLightLength < 0 || skyLightLength > maxArrays) return false;
     for (int i = 0; i < skyLightLength; i++) {
       auto skyLightLen = stream.readVarInt();
-      assert(skyLightLen == 2048);
+      if (skyLightLen != 2048) return false;
       stream.read(&skylight[2048 * i], skyLightLen);
     }
     auto blockLightLength = stream.readVarInt();
+    if (blockLightLength < 0 || blockLightLength > maxArrays) return false;
     for (int i = 0; i < blockLightLength; i++) {
       auto blockLightLen = stream.readVarInt();
-      assert(blockLightLen == 2048);
+      if (blockLightLen != 2048) return false;
       stream.read(&blocklight[2048 * i], blockLightLen);
     }
 
-    chunk->loadNetworkSerializedLights(skylight, skyLightLength, blocklight,
+    this->loadNetworkSerializedLights(skylight, skyLightLength, blocklight,
                                        blockLightLength, skyLightMask,
                                        blockLightMask);
 
     // printf("At %d / %d\n", stream.readPosition, stream.size);
     // stream.dumpRemaining();
-    return chunk;
+    return stream.readPosition <= stream.size;
+  }
+
+ private:
+  // Shares the source's storage, see snapshot()
+  ChunkColumn(const ChunkColumn &source) {
+    AllocScope scope(ALLOC_BLOCK_ENTITIES);
+    this->arena.reserve(getInitialArenaSize());
+    this->registry = source.registry;
+    this->x = source.x;
+    this->z = source.z;
+    this->co = source.co;
+    this->numSections = source.numSections;
+    this->minY = source.minY;
+    this->maxY = source.maxY;
+    this->skyLightMask = source.skyLightMask;
+    this->blockLightMask = source.blockLightMask;
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+      source.storage[i]->retain();
+      this->attach(i, source.storage[i]);
+    }
+    // Block entities are few and small; the tags are copied
+    for (int i = 0; i < source.blockEntities.count; i++) {
+      auto &blockEntity = source.blockEntities.list[i];
+      this->setBlockEntity(blockEntity.position, BlockEntity(&blockEntity));
+    }
+  }
+
+  void attach(int index, SectionStorage *storage) {
+    this->storage[index] = storage;
+    this->sections[index] = &storage->section;
+    this->biomes[index] = &storage->biome;
+    this->skyLights[index].init(4, 4096, storage->skyLight);
+    this->blockLights[index].init(4, 4096, storage->blockLight);
   }
 };
@@ -4,78 +4,252 @@
 
 struct ChunkSection {
   short blocks[4096];
-  int empty = true;
-  int occupiedBlocks;
+  // Non-air blocks, kept up to date by every set
+  int occupiedBlocks = 0;
+
+  // The distinct states in blocks and how many of each, kept exact by every
+  // set. Length -1 once a section holds more than PALETTE_MAX states; the
+  // blocks have to be looked at then (occupiedBlocks is still exact).
+  static const int PALETTE_MAX = 64;
+  short palette[PALETTE_MAX]{0};
+  u16 paletteCounts[PALETTE_MAX]{4096};
+  int paletteLength = 1;
 
   Registry *registry = nullptr;
 
+  // The network format sends palettes with 4 to 8 bits per block, and global
+  // IDs with no palette above that
+  static const int MIN_INDIRECT_BITS = 4;
+  static const int MAX_INDIRECT_BITS = 8;
+  // Bits per global ID: 1.18 to 1.21 all have between 2^14 and 2^15 states
+  static const int DIRECT_BITS = 15;
+
   ChunkSection() {}
 
   ChunkSection(Registry *registry) : registry(registry) {}
 
-  inline bool isEmpty() { return empty; }
+  inline bool isEmpty() { return occupiedBlocks == 0; }
 
   inline int getIndex(const Vec3i &pos) {
     return (pos.y & 0xf) << 8 | (pos.z & 0xf) << 4 | (pos.x & 0xf);
   }
 
   void setBlockStateId(const Vec3i &pos, int stateId) {
-    blocks[getIndex(pos)] = stateId;
+    int index = getIndex(pos);
+    int previous = blocks[index];
+    if (previous == stateId) return;
+    blocks[index] = stateId;
+
+    bool wasAir = isAirState(registry, previous);
+    bool isAir = isAirState(registry, stateId);
+    if (isOpaqueCubeState(registry, previous) !=
+        isOpaqueCubeState(registry, stateId)) {
+      visibilityDirty = true;
+    }
+    occupiedBlocks += wasAir - isAir;
+    if (!isAir && !boundsDirty) {
+      this->extendBounds(pos.x & 0xf, pos.y & 0xf, pos.z & 0xf);
+    } else if (!wasAir && this->onBoundsEdge(pos)) {
+      // May have been the last block holding the box out; recomputed lazily
+      boundsDirty = true;
+    }
+
+    if (paletteLength < 0) return;
+    for (int i = 0; i < paletteLength; i++) {
+      if (palette[i] == previous && !--paletteCounts[i]) {
+        paletteLength--;
+        palette[i] = palette[paletteLength];
+        paletteCounts[i] = paletteCounts[paletteLength];
+        break;
+      }
+    }
+    for (int i = 0; i < paletteLength; i++) {
+      if (palette[i] == stateId) {
+        paletteCounts[i]++;
+        return;
+      }
+    }
+    if (paletteLength == PALETTE_MAX) {
+      paletteLength = -1;
+      return;
+    }
+    palette[paletteLength] = stateId;
+    paletteCounts[paletteLength++] = 1;
+  }
+
+  // False only if no block is in this state
+  inline bool mayContain(int stateId) {
+    if (paletteLength < 0) return true;
+    for (int i = 0; i < paletteLength; i++) {
+      if (palette[i] == stateId) return true;
+    }
+    return false;
+  }
+
+  // Box around the non-air blocks as min x, y, z then max x, y, z (section
+  // local, inclusive). False if the section is empty. With `cache` false a
+  // stale box is worked out without storing it, leaving the section as it
+  // is (for storage shared with other threads, see ChunkColumn).
+  bool getBounds(out int bounds[6], bool cache = true) {
+    if (this->isEmpty()) return false;
+    u8 computed[6];
+    const u8 *box = this->bounds;
+    if (boundsDirty) {
+      this->computeBounds(computed);
+      box = computed;
+      if (cache) {
+        memcpy(this->bounds, computed, sizeof(computed));
+        boundsDirty = false;
+      }
+    }
+    for (int i = 0; i < 6; i++) bounds[i] = box[i];
+    return true;
+  }
+
+  // Which faces of the section see each other through blocks that aren't
+  // opaque cubes: bit facePairBit(a, b) is set if some path of such blocks
+  // touches both face a and face b (faces in BlockFace order). Worked out
+  // by a flood fill the first time it's asked for after the blocks change;
+  // `cache` as for getBounds.
+  u16 getVisibility(bool cache = true) {
+    if (!visibilityDirty) return visibility;
+    u16 computed = this->computeVisibility();
+    if (cache) {
+      visibility = computed;
+      visibilityDirty = false;
+    }
+    return computed;
+  }
+
+  // Bit of the face pair a, b (a != b) in getVisibility(), 0-14
+  static inline int facePairBit(int a, int b) {
+    if (a > b) {
+      int swap = a;
+      a = b;
+      b = swap;
+    }
+    // Pairs before a's: 5 + 4 + ... for each face below a
+    return a * (11 - a) / 2 + b - a - 1;
+  }
+
+  static const u16 ALL_FACES_VISIBLE = 0x7fff;
+
+  // Sets the palette, counts and occupancy for freshly decoded blocks from
+  // the decoder's palette and per entry counts. Unused entries are dropped.
+  void setPalette(const short *palette, const u16 *counts, int paletteLength) {
+    this->occupiedBlocks = 0;
+    int length = 0;
+    for (int i = 0; i < paletteLength; i++) {
+      if (!counts[i]) continue;
+      if (!isAirState(registry, palette[i])) this->occupiedBlocks += counts[i];
+      if (length < PALETTE_MAX) {
+        this->palette[length] = palette[i];
+        this->paletteCounts[length] = counts[i];
+      }
+      length++;
+    }
+    this->paletteLength = length <= PALETTE_MAX ? length : -1;
+    this->boundsDirty = true;
+    this->visibilityDirty = true;
+  }
+
+  // Fills `paletteOut` with the distinct states in the section and `indices`
+  // with each block's position in it. Returns the palette length.
+  int buildPalette(out u16 *paletteOut, out u16 *indices) {
+    return buildPalette(this->blocks, paletteOut, indices);
+  }
+
+  static int buildPalette(const short *blocks, out u16 *paletteOut,
+                          out u16 *indices) {
+    // Sparse set: an entry is only trusted if the palette slot it points at
+    // points back, so the table never needs clearing
+    u16 positionInPalette[65536];
+    int paletteLength = 0;
+    for (int i = 0; i < 4096; i++) {
+      u16 block = blocks[i];
+      u16 position = positionInPalette[block];
+      if (position >= paletteLength || paletteOut[position] != block) {
+        position = paletteLength++;
+        positionInPalette[block] = position;
+        paletteOut[position] = block;
+      }
+      indices[i] = position;
+    }
+    return paletteLength;
   }
 
   int getBlockStateId(const Vec3i &pos) { return blocks[getIndex(pos)]; }
 
-  void read(BinaryStream &stream) {
-    this->occupiedBlocks = stream.readShortBE();
-    // assert(occupiedBlocks <= 4096);
+  // False if the section is malformed, leaving the blocks undefined
+  bool read(BinaryStream &stream) {
+    // Sent, but we count for ourselves
+    stream.readShortBE();
     u8 bitsPerBlock = stream.readByte();
-    assert(bitsPerBlock < 16);
+    if (bitsPerBlock > 15) return false;
 
     int paletteLength;
     short palette[4096];
+    u16 counts[4096];
 
     if (!bitsPerBlock) {
       paletteLength = 1;
       palette[0] = stream.readVarInt();
       assert(stream.readByte() == 0,
              "Expected to read 0 length data for 1 length palette");
-      return;
+      for (int i = 0; i < 4096; i++) blocks[i] = palette[0];
+      counts[0] = 4096;
+      this->setPalette(palette, counts, 1);
+      return true;
     }
 
-    paletteLength = stream.readVarInt();
-    for (int i = 0; i < paletteLength; i++) {
-      palette[i] = stream.readVarInt();
+    bool direct = bitsPerBlock > MAX_INDIRECT_BITS;
+    if (!direct) {
+      paletteLength = stream.readVarInt();
+      if (paletteLength < 1 || paletteLength > 4096) return false;
+      for (int i = 0; i < paletteLength; i++) {
+        palette[i] = stream.readVarInt();
+      }
     }
 
     auto dataLength = stream.readVarInt();
-    auto storage = PalettedStorage<u64>(bitsPerBlock);
-    storage.read(stream);
+    // Max 15 bits per block is 1024 longs; decode from the stack rather than
+    // allocating per section
+    u64 words[1024];
+    PalettedStorage<u64> storage;
+    storage.init(bitsPerBlock, 4096, words);
+    if (dataLength != storage.wordsCount) return false;
+    if (stream.size - stream.readPosition < storage.byteSize) return false;
+    storage.readBE(stream);
 
-    for (int i = 0; i < 4096; i++) {
-      blocks[i] = palette[storage.get(i)];
+    u16 indices[4096];
+    storage.unpack(indices, 4096);
+    if (direct) {
+      // The indices are the states; make a palette of them
+      for (int i = 0; i < 4096; i++) blocks[i] = indices[i];
+      paletteLength = buildPalette(blocks, (u16 *)palette, indices);
     }
+    this->unpackBlocks(palette, paletteLength, indices, counts);
+    return true;
   }
 
-  void write(BinaryStream &stream) {
-    // Build palette
-    u8 counts[30'000]{0};  // assuming max block states is <30'000
-    u16 palette[4096]{0};
-    u16 positionInPalette[4096]{0};
-    int paletteLength = 0;
+  void write(BinaryStream &stream) { this->write(stream, this->blocks); }
 
-    for (int i = 0; i < 4096; i++) {
-      auto block = blocks[i];
-      if (++counts[block] == 1) {
-        positionInPalette[block] = paletteLength;
-        palette[paletteLength++] = block;
-      }
+  // Writes `blocks` in place of the section's own (see AntiXray)
+  void write(BinaryStream &stream, const short *blocks) {
+    u16 palette[4096];
+    u16 indices[4096];
+    int paletteLength = buildPalette(blocks, palette, indices);
+    // Substitutes may trade air for something else, or the other way round
+    int occupiedBlocks = this->occupiedBlocks;
+    if (blocks != this->blocks) {
+      occupiedBlocks = this->countOccupied(palette, paletteLength, indices);
     }
 
     // Write palette
     auto bitsPerBlock = log2ceil(paletteLength);
 
     if (!bitsPerBlock) {
-      stream.writeShortBE(0);          // occupied blocks
+      stream.writeShortBE(occupiedBlocks);
       stream.writeByte(0);             // bits per block
       stream.writeVarInt(palette[0]);  // palette
       stream.writeByte(0);             // data length
@@ -83,19 +257,200 @@ struct ChunkSection {
     }
 
     stream.writeShortBE(occupiedBlocks);
-    stream.writeByte(bitsPerBlock);
+    if (bitsPerBlock > MAX_INDIRECT_BITS) {
+      bitsPerBlock = DIRECT_BITS;
+      for (int i = 0; i < 4096; i++) indices[i] = blocks[i];
+      stream.writeByte(bitsPerBlock);
+    } else {
+      if (bitsPerBlock < MIN_INDIRECT_BITS) bitsPerBlock = MIN_INDIRECT_BITS;
+      stream.writeByte(bitsPerBlock);
+      stream.writeVarInt(paletteLength);
+      for (int i = 0; i < paletteLength; i++) {
+        stream.writeVarInt(palette[i]);
+      }
+    }
 
-    stream.writeVarInt(paletteLength);
+    u64 words[1024];
+    PalettedStorage<u64> storage;
+    storage.init(bitsPerBlock, 4096, words);
+    stream.writeVarInt(storage.wordsCount);  // data length
+    storage.pack(indices, 4096);
+    storage.writeBE(stream);
+  }
+
+  // Non-air blocks among palette indices
+  int countOccupied(const u16 *palette, int paletteLength,
+                    const u16 *indices) {
+    u16 counts[4096];
+    for (int i = 0; i < paletteLength; i++) counts[i] = 0;
+    for (int i = 0; i < 4096; i++) counts[indices[i]]++;
+    int occupied = 0;
     for (int i = 0; i < paletteLength; i++) {
-      stream.writeVarInt(palette[i]);
+      if (!isAirState(this->registry, palette[i])) occupied += counts[i];
     }
+    return occupied;
+  }
+
+  // Compact in-memory form used by ColumnCache: palette then packed indices
+  // in native byte order. Unlike the network form it round trips exactly.
+  void writePacked(BinaryStream &stream) {
+    u16 palette[4096];
+    u16 indices[4096];
+    int paletteLength = this->buildPalette(palette, indices);
+
+    stream.writeUVarInt(paletteLength);
+    for (int i = 0; i < paletteLength; i++) stream.writeUVarInt(palette[i]);
+    auto bitsPerBlock = log2ceil(paletteLength);
+    if (!bitsPerBlock) return;
 
-    auto storage = PalettedStorage<u64>(bitsPerBlock, 4096);
-    stream.writeVarInt(storage.wordsCount);  // palette length
+    u64 words[1024];
+    PalettedStorage<u64> storage;
+    storage.init(bitsPerBlock, 4096, words);
+    storage.pack(indices, 4096);
+    storage.write(stream);
+  }
+
+  void readPacked(BinaryStream &stream) {
+    int paletteLength = stream.readUVarInt();
+    short palette[4096];
+    u16 counts[4096];
+    for (int i = 0; i < paletteLength; i++) palette[i] = stream.readUVarInt();
+    auto bitsPerBlock = log2ceil(paletteLength);
+    if (!bitsPerBlock) {
+      for (int i = 0; i < 4096; i++) blocks[i] = palette[0];
+      counts[0] = 4096;
+      this->setPalette(palette, counts, 1);
+      return;
+    }
+
+    u64 words[1024];
+    PalettedStorage<u64> storage;
+    storage.init(bitsPerBlock, 4096, words);
+    storage.read(stream);
+    u16 indices[4096];
+    storage.unpack(indices, 4096);
+    this->unpackBlocks(palette, paletteLength, indices, counts);
+  }
+
+ private:
+  // Lazily shrunk: growing is cheap on set, shrinking needs a scan
+  u8 bounds[6] = {0, 0, 0, 0, 0, 0};
+  bool boundsDirty = true;
+  u16 visibility = ALL_FACES_VISIBLE;
+  bool visibilityDirty = true;
+
+  u16 computeVisibility() {
+    if (this->isEmpty()) return ALL_FACES_VISIBLE;
+    if (paletteLength >= 0) {
+      int opaqueStates = 0;
+      for (int i = 0; i < paletteLength; i++) {
+        opaqueStates += isOpaqueCubeState(registry, palette[i]);
+      }
+      if (opaqueStates == paletteLength) return 0;
+      if (!opaqueStates) return ALL_FACES_VISIBLE;
+    }
+
+    // Rows of 16 along x, [y][z]; a set bit is a block still to be reached
+    u16 open[16][16];
+    for (int y = 0; y < 16; y++) {
+      for (int z = 0; z < 16; z++) {
+        u16 row = 0;
+        const short *blocks = &this->blocks[y << 8 | z << 4];
+        for (int x = 0; x < 16; x++) {
+          row |= !isOpaqueCubeState(registry, blocks[x]) << x;
+        }
+        open[y][z] = row;
+      }
+    }
+
+    u16 visibility = 0;
+    u16 stack[4096];
+    for (int y = 0; y < 16; y++) {
+      for (int z = 0; z < 16; z++) {
+        while (open[y][z]) {
+          // Flood one region from its first block, noting the faces it
+          // touches
+          int x = __builtin_ctz(open[y][z]);
+          open[y][z] &= open[y][z] - 1;
+          int top = 0;
+          stack[top++] = y << 8 | z << 4 | x;
+          int faces = 0;
+          while (top) {
+            int i = stack[--top];
+            int bx = i & 0xf, by = i >> 8, bz = (i >> 4) & 0xf;
+            faces |= (by == 0) << 0 | (by == 15) << 1 | (bz == 0) << 2 |
+                     (bz == 15) << 3 | (bx == 0) << 4 | (bx == 15) << 5;
+            auto visit = [&](int nx, int ny, int nz) {
+              u16 bit = 1 << nx;
+              if (!(open[ny][nz] & bit)) return;
+              open[ny][nz] &= ~bit;
+              stack[top++] = ny << 8 | nz << 4 | nx;
+            };
+            if (bx > 0) visit(bx - 1, by, bz);
+            if (bx < 15) visit(bx + 1, by, bz);
+            if (by > 0) visit(bx, by - 1, bz);
+            if (by < 15) visit(bx, by + 1, bz);
+            if (bz > 0) visit(bx, by, bz - 1);
+            if (bz < 15) visit(bx, by, bz + 1);
+          }
+          for (int a = 0; a < 6; a++) {
+            if (!(faces & 1 << a)) continue;
+            for (int b = a + 1; b < 6; b++) {
+              if (faces & 1 << b) visibility |= 1 << facePairBit(a, b);
+            }
+          }
+          if (visibility == ALL_FACES_VISIBLE) return visibility;
+        }
+      }
+    }
+    return visibility;
+  }
+
+  void unpackBlocks(const short *palette, int paletteLength,
+                    const u16 *indices, u16 *counts) {
+    for (int i = 0; i < paletteLength; i++) counts[i] = 0;
     for (int i = 0; i < 4096; i++) {
-      storage.set(i, positionInPalette[blocks[i]]);
+      // Out of range indices would be a malformed packet
+      u16 index = indices[i] < paletteLength ? indices[i] : 0;
+      blocks[i] = palette[index];
+      counts[index]++;
     }
+    this->setPalette(palette, counts, paletteLength);
+  }
 
-    storage.write(stream);
+  inline void extendBounds(int x, int y, int z) {
+    if (this->occupiedBlocks == 1) {
+      bounds[0] = bounds[3] = x;
+      bounds[1] = bounds[4] = y;
+      bounds[2] = bounds[5] = z;
+      return;
+    }
+    if (x < bounds[0]) bounds[0] = x;
+    if (y < bounds[1]) bounds[1] = y;
+    if (z < bounds[2]) bounds[2] = z;
+    if (x > bounds[3]) bounds[3] = x;
+    if (y > bounds[4]) bounds[4] = y;
+    if (z > bounds[5]) bounds[5] = z;
+  }
+
+  inline bool onBoundsEdge(const Vec3i &pos) {
+    int x = pos.x & 0xf, y = pos.y & 0xf, z = pos.z & 0xf;
+    return x == bounds[0] || y == bounds[1] || z == bounds[2] ||
+           x == bounds[3] || y == bounds[4] || z == bounds[5];
+  }
+
+  void computeBounds(out u8 bounds[6]) {
+    int box[6] = {16, 16, 16, -1, -1, -1};
+    for (int i = 0; i < 4096; i++) {
+      if (isAirState(registry, blocks[i])) continue;
+      int x = i & 0xf, z = (i >> 4) & 0xf, y = i >> 8;
+      if (x < box[0]) box[0] = x;
+      if (y < box[1]) box[1] = y;
+      if (z < box[2]) box[2] = z;
+      if (x > box[3]) box[3] = x;
+      if (y > box[4]) box[4] = y;
+      if (z > box[5]) box[5] = z;
+    }
+    for (int i = 0; i < 6; i++) bounds[i] = box[i];
   }
 };
@@ -0,0 +1,229 @@
+#pragma once
+#include "ColumnPool.h"
+
+// Holds columns under a byte budget. Columns that go unused longest are
+// packed into their compact form (see ChunkColumn::writeCompact), optionally
+// deflated, and their storage goes back to the pool. get() expands them again
+// on the next access, so callers keep one Entry handle for the column's whole
+// life in the cache.
+//
+// Not thread safe; give each thread its own cache.
+class ColumnCache {
+ public:
+  struct Entry {
+    Registry *registry;
+    // Null while cold
+    ChunkColumn *column = nullptr;
+    // Compact form while cold, deflated unless the cache's level is negative
+    u8 *packed = nullptr;
+    int packedLength = 0;
+    int rawLength = 0;
+    // What the entry counts against the budget right now
+    size_t bytes = 0;
+    // Hot entries are kept most recently used first, cold ones unordered
+    Entry *prev = nullptr;
+    Entry *next = nullptr;
+  };
+
+  size_t budget;
+  // DeflateLevel for cold columns, or -1 to keep them uncompressed
+  int level;
+
+  int hotCount = 0;
+  int coldCount = 0;
+  size_t hotBytes = 0;
+  size_t coldBytes = 0;
+  int demotions = 0;
+  int expansions = 0;
+
+  ColumnCache(ColumnPool *pool, size_t budget, int level = DEFLATE_FAST)
+      : budget(budget), level(level), pool(pool), scratch(64 * 1024) {
+    if (this->level > DEFLATE_BALANCED) this->level = DEFLATE_BALANCED;
+  }
+
+  ColumnCache(const ColumnCache &) = delete;
+  ColumnCache &operator=(const ColumnCache &) = delete;
+
+  // Takes ownership of the column
+  Entry *add(ChunkColumn *column) {
+    auto entry = new Entry();
+    entry->registry = column->registry;
+    entry->column = column;
+    entry->bytes = getHotSize(column);
+    this->linkHot(entry);
+    this->trim(entry);
+    return entry;
+  }
+
+  // The entry's column, expanded if it was cold. The pointer is only good
+  // until the next add(), get() or setBudget(), any of which may demote it.
+  // Null if expanding failed (out of memory).
+  ChunkColumn *get(Entry *entry) {
+    if (entry->column) {
+      this->unlink(entry);
+      // Block entities may have grown the arena since it was last counted
+      entry->bytes = getHotSize(entry->column);
+      this->linkHot(entry);
+    } else if (!this->expand(entry)) {
+      return nullptr;
+    }
+    this->trim(entry);
+    return entry->column;
+  }
+
+  // Drops the entry and frees its column
+  void remove(Entry *entry) {
+    this->unlink(entry);
+    if (entry->column) this->pool->release(entry->column);
+    free(entry->packed);
+    delete entry;
+  }
+
+  void setBudget(size_t budget) {
+    this->budget = budget;
+    this->trim(nullptr);
+  }
+
+  // Demotes least recently used columns until the cache fits its budget.
+  // `keep` stays hot regardless.
+  void trim(Entry *keep) {
+    while (this->hotBytes + this->coldBytes > this->budget) {
+      auto victim = this->hotTail;
+      if (victim == keep) victim = victim->prev;
+      if (!victim || !this->demote(victim)) break;
+    }
+  }
+
+  ~ColumnCache() {
+    while (this->hotHead) this->remove(this->hotHead);
+    while (this->coldHead) this->remove(this->coldHead);
+    delete this->deflater;
+  }
+
+ private:
+  ColumnPool *pool;
+  Deflater *deflater = nullptr;
+  // Holds the uncompressed compact form while packing and unpacking. Kept
+  // across calls: at a few hundred KB, a fresh buffer each time costs more in
+  // page faults than the packing itself.
+  BinaryStream scratch;
+  Entry *hotHead = nullptr;
+  Entry *hotTail = nullptr;
+  Entry *coldHead = nullptr;
+
+  static size_t getHotSize(ChunkColumn *column) {
+    return column->getMemoryUsage();
+  }
+
+  static size_t getColdSize(Entry *entry) {
+    return sizeof(Entry) + entry->packedLength;
+  }
+
+  bool demote(Entry *entry) {
+    AllocScope scope(ALLOC_SCRATCH);
+    auto column = entry->column;
+    auto &raw = this->scratch;
+    raw.readPosition = raw.writePosition = 0;
+    if (!raw.reserve(column->getCompactMaxSize())) return false;
+    column->writeCompact(raw);
+
+    u8 *packed;
+    int packedLength;
+    if (this->level < 0) {
+      packed = (u8 *)malloc(raw.writePosition);
+      if (!packed) return false;
+      packedLength = raw.save(packed);
+    } else {
+      if (!this->deflater) {
+        this->deflater = new Deflater((DeflateLevel)this->level);
+      }
+      BinaryStream compressed(raw.writePosition / 4 + 64);
+      this->deflater->begin(compressed);
+      this->deflater->write(raw.data, raw.writePosition);
+      this->deflater->finish();
+      // Hand the compressed buffer over to the entry
+      compressed.weAllocated = false;
+      packed = compressed.data;
+      packedLength = compressed.writePosition;
+    }
+
+    this->unlink(entry);
+    this->pool->release(column);
+    entry->column = nullptr;
+    entry->packed = packed;
+    entry->packedLength = packedLength;
+    entry->rawLength = raw.writePosition;
+    entry->bytes = getColdSize(entry);
+    this->linkCold(entry);
+    this->demotions++;
+    return true;
+  }
+
+  bool expand(Entry *entry) {
+    AllocScope scope(ALLOC_SCRATCH);
+    auto column = this->pool->acquire(entry->registry);
+    bool ok;
+    if (this->level < 0) {
+      BinaryStream stream(entry->packed, entry->packedLength);
+      ok = column->readCompact(stream);
+    } else {
+      auto &stream = this->scratch;
+      stream.readPosition = stream.writePosition = 0;
+      ok = stream.reserve(entry->rawLength) &&
+           inflate(entry->packed, entry->packedLength, stream,
+                   INFLATE_ZLIB) == INFLATE_OK &&
+           stream.writePosition == entry->rawLength &&
+           column->readCompact(stream);
+    }
+    if (!ok) {
+      this->pool->release(column);
+      return false;
+    }
+
+    this->unlink(entry);
+    free(entry->packed);
+    entry->packed = nullptr;
+    entry->packedLength = 0;
+    entry->rawLength = 0;
+    entry->column = column;
+    entry->bytes = getHotSize(column);
+    this->linkHot(entry);
+    this->expansions++;
+    return true;
+  }
+
+  void linkHot(Entry *entry) {
+    entry->prev = nullptr;
+    entry->next = this->hotHead;
+    if (this->hotHead) this->hotHead->prev = entry;
+    this->hotHead = entry;
+    if (!this->hotTail) this->hotTail = entry;
+    this->hotCount++;
+    this->hotBytes += entry->bytes;
+  }
+
+  void linkCold(Entry *entry) {
+    entry->prev = nullptr;
+    entry->next = this->coldHead;
+    if (this->coldHead) this->coldHead->prev = entry;
+    this->coldHead = entry;
+    this->coldCount++;
+    this->coldBytes += entry->bytes;
+  }
+
+  void unlink(Entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    if (entry->column) {
+      if (this->hotHead == entry) this->hotHead = entry->next;
+      if (this->hotTail == entry) this->hotTail = entry->prev;
+      this->hotCount--;
+      this->hotBytes -= entry->bytes;
+    } else {
+      if (this->coldHead == entry) this->coldHead = entry->next;
+      this->coldCount--;
+      this->coldBytes -= entry->bytes;
+    }
+    entry->prev = entry->next = nullptr;
+  }
+};
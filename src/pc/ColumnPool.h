@@ -0,0 +1,100 @@
+#pragma once
+#include "../Sync.h"
+#include "ChunkColumn.h"
+
+// Keeps released columns around so loading a chunk can decode over an old
+// column's storage instead of allocating and zeroing ~200KB each time.
+class ColumnPool {
+ public:
+  // How many released columns to hold on to; the rest are freed
+  int retention = 16;
+  int hits = 0;
+  int misses = 0;
+  int retained = 0;
+
+  ColumnPool() {}
+
+  ColumnPool(const ColumnPool &) = delete;
+  ColumnPool &operator=(const ColumnPool &) = delete;
+
+  // A released column ready to be decoded into, or a new one. The contents
+  // of a reused column are stale until it is decoded over.
+  ChunkColumn *acquire(Registry *registry, int x = 0, int z = 0) {
+    this->lock.lock();
+    auto column = this->head;
+    if (!column) {
+      this->misses++;
+      this->lock.unlock();
+      return new ChunkColumn(registry, x, z);
+    }
+    this->hits++;
+    this->head = column->poolNext;
+    this->retained--;
+    this->lock.unlock();
+    column->poolNext = nullptr;
+    column->reset(registry, x, z);
+    return column;
+  }
+
+  void release(ChunkColumn *column) {
+    if (!column) return;
+    this->lock.lock();
+    if (this->retained >= this->retention) {
+      this->lock.unlock();
+      delete column;
+      return;
+    }
+    column->poolNext = this->head;
+    this->head = column;
+    this->retained++;
+    this->lock.unlock();
+  }
+
+  void setRetention(int retention) {
+    ChunkColumn *evicted = nullptr;
+    this->lock.lock();
+    this->retention = retention < 0 ? 0 : retention;
+    while (this->retained > this->retention) {
+      auto column = this->head;
+      this->head = column->poolNext;
+      this->retained--;
+      column->poolNext = evicted;
+      evicted = column;
+    }
+    this->lock.unlock();
+
+    // Free outside the lock
+    while (evicted) {
+      auto next = evicted->poolNext;
+      delete evicted;
+      evicted = next;
+    }
+  }
+
+  template <typename Protocol = Protocol118>
+  ChunkColumn *readChunkPacket(Registry *registry, u8 *buffer, int len) {
+    auto column = this->acquire(registry);
+    if (!column->decodeInto<Protocol>(buffer, len)) {
+      this->release(column);
+      return nullptr;
+    }
+    return column;
+  }
+
+  template <typename Protocol = Protocol118>
+  ChunkColumn *readCompressedChunkPacket(Registry *registry, u8 *buffer,
+                                         int len) {
+    auto column = this->acquire(registry);
+    if (!column->decodeCompressedInto<Protocol>(buffer, len)) {
+      this->release(column);
+      return nullptr;
+    }
+    return column;
+  }
+
+  ~ColumnPool() { this->setRetention(0); }
+
+ private:
+  ChunkColumn *head = nullptr;
+  SpinLock lock;
+};
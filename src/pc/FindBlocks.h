@@ -0,0 +1,305 @@
+#pragma once
+#include "World.h"
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct BlockMatch {
+  int x;
+  int y;
+  int z;
+  int stateId;
+};
+
+// Finds blocks in any of a set of states within a box (inclusive world
+// coordinates), optionally also within `radius` of `center`, and returns up
+// to `maxResults` of them nearest `center` first.
+//
+// A section is only scanned if its palette (ChunkSection::palette)
+// include a target, which is what makes this cheap: most sections hold a
+// handful of states and never have to be looked at block by block. Sections
+// further away than everything found so far are skipped too once
+// `maxResults` have been found.
+class BlockFinder {
+ public:
+  BlockFinder(const int *stateIds, int stateCount) {
+    memset(this->targetBits, 0, sizeof(this->targetBits));
+    for (int i = 0; i < stateCount; i++) {
+      int stateId = stateIds[i];
+      if (stateId < 0 || stateId >= MAX_STATES) continue;
+      if (this->isTarget(stateId)) continue;
+      this->targetBits[stateId >> 3] |= 1 << (stateId & 7);
+      if (this->targetCount < MAX_TARGETS) {
+        this->targets[this->targetCount] = stateId;
+      }
+      this->targetCount++;
+    }
+  }
+
+  // Returns how many were written to `results`
+  int find(World &world, const int min[3], const int max[3],
+           const int center[3], int radius, int maxResults,
+           out BlockMatch *results) {
+    if (maxResults <= 0 || !this->targetCount) return 0;
+    this->center[0] = center[0];
+    this->center[1] = center[1];
+    this->center[2] = center[2];
+    this->radiusSq = radius >= 0 ? (i64)radius * radius : -1;
+    this->heap = results;
+    this->heapSize = 0;
+    this->heapCapacity = maxResults;
+
+    // Visit sections in rings of growing distance from the center's section,
+    // so near matches fill the heap early and the search can stop as soon as
+    // a ring can't hold anything nearer
+    int home[3];
+    int lo[3];
+    int hi[3];
+    int rings = 0;
+    for (int a = 0; a < 3; a++) {
+      home[a] = center[a] >> 4;
+      lo[a] = min[a] >> 4;
+      hi[a] = max[a] >> 4;
+      int far = home[a] - lo[a] > hi[a] - home[a] ? home[a] - lo[a]
+                                                  : hi[a] - home[a];
+      if (far > rings) rings = far;
+    }
+    for (int r = 0; r <= rings; r++) {
+      if (r > 0) {
+        // Every block in ring r is at least this far from the center
+        i64 nearest = (i64)((r - 1) * 16 + 1) * ((r - 1) * 16 + 1);
+        if (this->radiusSq >= 0 && nearest > this->radiusSq) break;
+        if (this->isFull() && nearest >= this->distanceSq(this->heap[0])) {
+          break;
+        }
+      }
+      int x0 = home[0] - r > lo[0] ? home[0] - r : lo[0];
+      int x1 = home[0] + r < hi[0] ? home[0] + r : hi[0];
+      int z0 = home[2] - r > lo[2] ? home[2] - r : lo[2];
+      int z1 = home[2] + r < hi[2] ? home[2] + r : hi[2];
+      for (int cx = x0; cx <= x1; cx++) {
+        for (int cz = z0; cz <= z1; cz++) {
+          bool edge = cx == home[0] - r || cx == home[0] + r ||
+                      cz == home[2] - r || cz == home[2] + r;
+          auto column = world.getColumn(cx, cz);
+          if (!column) continue;
+          if (edge) {
+            for (int sy = home[1] - r; sy <= home[1] + r; sy++) {
+              this->visit(column, cx, sy, cz, min, max);
+            }
+          } else {
+            this->visit(column, cx, home[1] - r, cz, min, max);
+            if (r) this->visit(column, cx, home[1] + r, cz, min, max);
+          }
+        }
+      }
+    }
+
+    // Heap sort in place, nearest first
+    int count = this->heapSize;
+    while (this->heapSize > 1) {
+      auto last = this->heap[--this->heapSize];
+      this->heap[this->heapSize] = this->heap[0];
+      this->heap[0] = last;
+      this->siftDown(0);
+    }
+    return count;
+  }
+
+ private:
+  static const int MAX_STATES = 32768;
+  // Targets compared with SIMD; with more than this a bitmap lookup is used
+  static const int MAX_TARGETS = 8;
+
+  u8 targetBits[MAX_STATES / 8];
+  short targets[MAX_TARGETS];
+  int targetCount = 0;
+
+  int center[3];
+  i64 radiusSq;
+  // Max-heap on distance, so the worst of the best so far is at the top
+  BlockMatch *heap;
+  int heapSize;
+  int heapCapacity;
+
+  inline bool isTarget(int stateId) {
+    return (u32)stateId < MAX_STATES &&
+           this->targetBits[stateId >> 3] & (1 << (stateId & 7));
+  }
+
+  inline i64 distanceSq(int x, int y, int z) {
+    i64 dx = x - this->center[0];
+    i64 dy = y - this->center[1];
+    i64 dz = z - this->center[2];
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+  inline i64 distanceSq(const BlockMatch &match) {
+    return this->distanceSq(match.x, match.y, match.z);
+  }
+
+  // Nearest point of the box to the center
+  i64 boxDistanceSq(const int box[6]) {
+    int nearest[3];
+    for (int a = 0; a < 3; a++) {
+      int c = this->center[a];
+      nearest[a] = c < box[a] ? box[a] : c > box[a + 3] ? box[a + 3] : c;
+    }
+    return this->distanceSq(nearest[0], nearest[1], nearest[2]);
+  }
+
+  bool isFull() { return this->heapSize == this->heapCapacity; }
+
+  void visit(ChunkColumn *column, int cx, int sy, int cz, const int min[3],
+             const int max[3]) {
+    int box[6] = {cx << 4, sy << 4, cz << 4,
+                  (cx << 4) + 15, (sy << 4) + 15, (cz << 4) + 15};
+    int minY = min[1] > column->minY ? min[1] : column->minY;
+    int maxY = max[1] < column->maxY - 1 ? max[1] : column->maxY - 1;
+    if (box[1] < minY) box[1] = minY;
+    if (box[4] > maxY) box[4] = maxY;
+    for (int a = 0; a < 3; a += 2) {
+      if (box[a] < min[a]) box[a] = min[a];
+      if (box[a + 3] > max[a]) box[a + 3] = max[a];
+    }
+    if (box[1] > box[4] || box[0] > box[3] || box[2] > box[5]) return;
+    this->scanSection(column->getChunkSection(sy), box);
+  }
+
+  void scanSection(ChunkSection &section, const int box[6]) {
+    // Which targets can be in here at all
+    short candidates[MAX_TARGETS];
+    int candidateCount = 0;
+    bool useBitmap = false;
+    if (section.paletteLength >= 0) {
+      for (int i = 0; i < section.paletteLength; i++) {
+        int stateId = section.palette[i];
+        if (!this->isTarget(stateId)) continue;
+        if (candidateCount == MAX_TARGETS) {
+          useBitmap = true;
+          break;
+        }
+        candidates[candidateCount++] = stateId;
+      }
+      if (!candidateCount) return;
+    } else if (this->targetCount > MAX_TARGETS) {
+      useBitmap = true;
+    } else {
+      candidateCount = this->targetCount;
+      for (int i = 0; i < candidateCount; i++) {
+        candidates[i] = this->targets[i];
+      }
+    }
+
+    i64 sectionDistanceSq = this->boxDistanceSq(box);
+    if (this->radiusSq >= 0 && sectionDistanceSq > this->radiusSq) return;
+    if (this->isFull() &&
+        sectionDistanceSq >= this->distanceSq(this->heap[0])) {
+      return;
+    }
+
+    int baseX = box[0] & ~0xf;
+    int baseY = box[1] & ~0xf;
+    int baseZ = box[2] & ~0xf;
+    for (int y = box[1] & 0xf; y <= (box[4] & 0xf); y++) {
+      for (int z = box[2] & 0xf; z <= (box[5] & 0xf); z++) {
+        const short *row = &section.blocks[y << 8 | z << 4];
+        u32 matches = useBitmap ? this->matchRowBitmap(row)
+                                : matchRow(row, candidates, candidateCount);
+        // Only the columns inside the box
+        matches &= 0xffffu << (box[0] & 0xf);
+        matches &= 0xffffu >> (15 - (box[3] & 0xf));
+        while (matches) {
+          int x = __builtin_ctz(matches);
+          matches &= matches - 1;
+          this->add({baseX + x, baseY + y, baseZ + z, row[x]});
+        }
+      }
+    }
+  }
+
+  // Bit x set where row[x] is one of the candidates
+  static inline u32 matchRow(const short *row, const short *candidates,
+                             int candidateCount) {
+#if defined(__wasm_simd128__)
+    v128_t lo = wasm_v128_load(row);
+    v128_t hi = wasm_v128_load(row + 8);
+    v128_t matchLo = wasm_i16x8_splat(0);
+    v128_t matchHi = wasm_i16x8_splat(0);
+    for (int i = 0; i < candidateCount; i++) {
+      v128_t target = wasm_i16x8_splat(candidates[i]);
+      matchLo = wasm_v128_or(matchLo, wasm_i16x8_eq(lo, target));
+      matchHi = wasm_v128_or(matchHi, wasm_i16x8_eq(hi, target));
+    }
+    return wasm_i16x8_bitmask(matchLo) | wasm_i16x8_bitmask(matchHi) << 8;
+#elif defined(__SSE2__)
+    __m128i lo = _mm_loadu_si128((const __m128i *)row);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(row + 8));
+    __m128i matchLo = _mm_setzero_si128();
+    __m128i matchHi = _mm_setzero_si128();
+    for (int i = 0; i < candidateCount; i++) {
+      __m128i target = _mm_set1_epi16(candidates[i]);
+      matchLo = _mm_or_si128(matchLo, _mm_cmpeq_epi16(lo, target));
+      matchHi = _mm_or_si128(matchHi, _mm_cmpeq_epi16(hi, target));
+    }
+    // Narrow the lanes to bytes so movemask gives one bit per block
+    return _mm_movemask_epi8(_mm_packs_epi16(matchLo, matchHi));
+#else
+    u32 matches = 0;
+    for (int x = 0; x < 16; x++) {
+      for (int i = 0; i < candidateCount; i++) {
+        if (row[x] == candidates[i]) matches |= 1 << x;
+      }
+    }
+    return matches;
+#endif
+  }
+
+  inline u32 matchRowBitmap(const short *row) {
+    u32 matches = 0;
+    for (int x = 0; x < 16; x++) {
+      if (this->isTarget(row[x])) matches |= 1 << x;
+    }
+    return matches;
+  }
+
+  void add(const BlockMatch &match) {
+    i64 distance = this->distanceSq(match);
+    if (this->radiusSq >= 0 && distance > this->radiusSq) return;
+    if (!this->isFull()) {
+      // Sift up
+      int i = this->heapSize++;
+      while (i) {
+        int parent = (i - 1) / 2;
+        if (this->distanceSq(this->heap[parent]) >= distance) break;
+        this->heap[i] = this->heap[parent];
+        i = parent;
+      }
+      this->heap[i] = match;
+      return;
+    }
+    if (distance >= this->distanceSq(this->heap[0])) return;
+    this->heap[0] = match;
+    this->siftDown(0);
+  }
+
+  void siftDown(int i) {
+    auto item = this->heap[i];
+    i64 distance = this->distanceSq(item);
+    while (true) {
+      int child = 2 * i + 1;
+      if (child >= this->heapSize) break;
+      if (child + 1 < this->heapSize &&
+          this->distanceSq(this->heap[child + 1]) >
+              this->distanceSq(this->heap[child])) {
+        child++;
+      }
+      if (this->distanceSq(this->heap[child]) <= distance) break;
+      this->heap[i] = this->heap[child];
+      i = child;
+    }
+    this->heap[i] = item;
+  }
+};
@@ -0,0 +1,319 @@
+#pragma once
+#include "Raycast.h"
+
+// Builds a section's render mesh: a quad for every block face not hidden by
+// an opaque neighbour, with ambient occlusion and smooth light per vertex.
+// Neighbours across the section's borders (including diagonal ones, for AO)
+// come from the world; unloaded neighbours count as air, so the mesh is
+// closed at the edge of the loaded area.
+//
+// Each vertex is two u32s, ready to use as an interleaved WebGL buffer:
+//   0: x | y << 5 | z << 10 (0-16, section relative) | face << 15 |
+//      ao << 18 (0 darkest to 3 unoccluded) | block light << 20 |
+//      sky light << 24
+//   1: state ID | u << 16 | v << 21 (texture coordinates in blocks, which
+//      run past 1 on merged quads)
+// Quads are two triangles of u32 indices, counter-clockwise seen from
+// outside, split along the diagonal that keeps AO interpolation even.
+//
+// In greedy mode adjacent faces of full cubes with the same state, AO and
+// light are merged into one quad.
+class Mesher {
+ public:
+  bool greedy = false;
+
+  // Meshes section `sectionY` of the column at cx, cz into the caller's
+  // buffers (`maxVertices` vertices of two u32s, `maxIndices` indices).
+  // Returns the number of quads (4 vertices, 6 indices each), 0 if the column
+  // isn't loaded, or -1 if the buffers are too small.
+  int mesh(World &world, int cx, int sectionY, int cz, out u32 *vertices,
+           int maxVertices, out u32 *indices, int maxIndices) {
+    this->vertices = vertices;
+    this->indices = indices;
+    this->maxQuads = maxVertices / 4 < maxIndices / 6 ? maxVertices / 4
+                                                      : maxIndices / 6;
+    this->quadCount = 0;
+    this->overflow = false;
+
+    auto column = world.getColumn(cx, cz);
+    if (!column) return 0;
+    int index = sectionY + column->co;
+    if (index < 0 || index >= column->numSections) return 0;
+    auto &section = *column->sections[index];
+    if (section.isEmpty()) return 0;
+
+    this->registry = column->registry;
+    this->fill(world, cx, sectionY, cz);
+    this->cull();
+    for (int face = 0; face < 6; face++) this->meshFace(face);
+    return this->overflow ? -1 : this->quadCount;
+  }
+
+ private:
+  // Padded by one block on every side
+  static const int SIZE = 18;
+  // Bits 1-16 of a row, the section's own blocks
+  static const u32 INNER = 0x1fffe;
+
+  Registry *registry;
+  u16 states[SIZE * SIZE * SIZE];
+  // Sky light << 4 | block light
+  u8 light[SIZE * SIZE * SIZE];
+  // Rows along x by [y + 1][z + 1], bit x + 1 set for opaque cubes and for
+  // anything that isn't air
+  u32 opaque[SIZE][SIZE];
+  u32 present[SIZE][SIZE];
+  // Faces to draw, per face in the same layout (inner rows only)
+  u32 visible[6][SIZE][SIZE];
+
+  u32 *vertices;
+  u32 *indices;
+  int maxQuads;
+  int quadCount;
+  bool overflow;
+
+  // Per face: the axis it faces along, +1 or -1, and the two axes spanning
+  // it, ordered so that u x v points out of the face
+  struct FaceAxes {
+    int axis;
+    int sign;
+    int u;
+    int v;
+  };
+  static constexpr FaceAxes AXES[6] = {
+      {1, -1, 2, 0},  // FACE_DOWN
+      {1, 1, 2, 0},   // FACE_UP
+      {2, -1, 0, 1},  // FACE_NORTH
+      {2, 1, 0, 1},   // FACE_SOUTH
+      {0, -1, 1, 2},  // FACE_WEST
+      {0, 1, 1, 2}    // FACE_EAST
+  };
+
+  static inline int cell(int x, int y, int z) {
+    return ((y + 1) * SIZE + (z + 1)) * SIZE + (x + 1);
+  }
+
+  inline bool isOpaque(int x, int y, int z) {
+    return this->opaque[y + 1][z + 1] >> (x + 1) & 1;
+  }
+
+  inline bool isOpaqueCube(int stateId) {
+    if (!this->registry) return stateId != 0;
+    return this->registry->isOpaqueCube(stateId);
+  }
+
+  void fill(World &world, int cx, int sectionY, int cz) {
+    ChunkColumn *columns[3][3];
+    for (int dz = 0; dz < 3; dz++) {
+      for (int dx = 0; dx < 3; dx++) {
+        columns[dz][dx] = world.getColumn(cx + dx - 1, cz + dz - 1);
+      }
+    }
+    for (int y = -1; y <= 16; y++) {
+      int worldY = sectionY * 16 + y;
+      for (int z = -1; z <= 16; z++) {
+        u32 opaqueRow = 0;
+        u32 presentRow = 0;
+        for (int x = -1; x <= 16; x++) {
+          auto column = columns[(z + 16) >> 4][(x + 16) >> 4];
+          int stateId = 0;
+          int lightLevel = 0xf0;
+          bool solid = false;
+          if (column && worldY < column->minY) {
+            // Below the world
+            solid = true;
+            lightLevel = 0;
+          } else if (column && worldY < column->maxY) {
+            Vec3i pos = {x & 0xf, worldY, z & 0xf};
+            stateId = column->getBlockStateId(pos);
+            lightLevel = column->getSkyLight(pos) << 4 |
+                         column->getBlockLight(pos);
+            solid = this->isOpaqueCube(stateId);
+          }
+          int i = cell(x, y, z);
+          this->states[i] = stateId;
+          this->light[i] = lightLevel;
+          opaqueRow |= (u32)solid << (x + 1);
+          presentRow |= (u32)(solid || !isAirState(this->registry, stateId))
+                        << (x + 1);
+        }
+        this->opaque[y + 1][z + 1] = opaqueRow;
+        this->present[y + 1][z + 1] = presentRow;
+      }
+    }
+  }
+
+  void cull() {
+    for (int y = 0; y < 16; y++) {
+      for (int z = 0; z < 16; z++) {
+        u32 row = this->present[y + 1][z + 1] & INNER;
+        auto &o = this->opaque;
+        u32 faces[6] = {row & ~o[y][z + 1],     row & ~o[y + 2][z + 1],
+                        row & ~o[y + 1][z],     row & ~o[y + 1][z + 2],
+                        row & ~(o[y + 1][z + 1] << 1),
+                        row & ~(o[y + 1][z + 1] >> 1)};
+        for (int face = 0; face < 6; face++) {
+          // Faces between two blocks of the same see-through state, like
+          // glass or water, aren't drawn either
+          u32 see = faces[face] & ~o[y + 1][z + 1];
+          while (see) {
+            int x = __builtin_ctz(see) - 1;
+            see &= see - 1;
+            int d[3] = {0, 0, 0};
+            d[AXES[face].axis] = AXES[face].sign;
+            if (this->states[cell(x, y, z)] ==
+                this->states[cell(x + d[0], y + d[1], z + d[2])]) {
+              faces[face] &= ~(1u << (x + 1));
+            }
+          }
+          this->visible[face][y + 1][z + 1] = faces[face];
+        }
+      }
+    }
+  }
+
+  // AO and smooth light for each corner of a face, packed as the greedy
+  // merge key: state + 1 | ao << 16 (2 bits per corner) | light << 24 (8 bits
+  // per corner). Corners go (0, 0), (1, 0), (1, 1), (0, 1) in u, v.
+  u64 getFaceKey(int face, const int pos[3]) {
+    auto &axes = AXES[face];
+    int front[3] = {pos[0], pos[1], pos[2]};
+    front[axes.axis] += axes.sign;
+    const int corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+    u64 key = this->states[cell(pos[0], pos[1], pos[2])] + 1;
+    for (int c = 0; c < 4; c++) {
+      int side1[3] = {front[0], front[1], front[2]};
+      int side2[3] = {front[0], front[1], front[2]};
+      int corner[3] = {front[0], front[1], front[2]};
+      side1[axes.u] += corners[c][0];
+      side2[axes.v] += corners[c][1];
+      corner[axes.u] += corners[c][0];
+      corner[axes.v] += corners[c][1];
+      bool s1 = this->isOpaque(side1[0], side1[1], side1[2]);
+      bool s2 = this->isOpaque(side2[0], side2[1], side2[2]);
+      bool cn = this->isOpaque(corner[0], corner[1], corner[2]);
+      int ao = s1 && s2 ? 0 : 3 - (s1 + s2 + cn);
+
+      // Average over the open blocks around the corner; light doesn't get
+      // through the corner block when both sides are shut
+      int sky = 0;
+      int block = 0;
+      int count = 0;
+      auto add = [&](const int *p) {
+        u8 value = this->light[cell(p[0], p[1], p[2])];
+        sky += value >> 4;
+        block += value & 0xf;
+        count++;
+      };
+      add(front);
+      if (!s1) add(side1);
+      if (!s2) add(side2);
+      if (!cn && !(s1 && s2)) add(corner);
+      int lightLevel = (sky / count) << 4 | (block / count);
+
+      key |= (u64)ao << (16 + c * 2);
+      key |= (u64)lightLevel << (24 + c * 8);
+    }
+    return key;
+  }
+
+  void meshFace(int face) {
+    auto &axes = AXES[face];
+    u64 keys[16][16];
+    for (int d = 0; d < 16; d++) {
+      bool any = false;
+      for (int j = 0; j < 16; j++) {
+        for (int i = 0; i < 16; i++) {
+          int pos[3];
+          pos[axes.axis] = d;
+          pos[axes.u] = i;
+          pos[axes.v] = j;
+          bool shown = this->visible[face][pos[1] + 1][pos[2] + 1] >>
+                           (pos[0] + 1) & 1;
+          keys[j][i] = shown ? this->getFaceKey(face, pos) : 0;
+          any |= shown;
+        }
+      }
+      if (any) this->emitSlice(face, d, keys);
+    }
+  }
+
+  // Emits the faces of one slice, merging runs of equal keys into rectangles
+  // when greedy
+  void emitSlice(int face, int d, u64 keys[16][16]) {
+    auto &axes = AXES[face];
+    for (int j = 0; j < 16; j++) {
+      for (int i = 0; i < 16;) {
+        u64 key = keys[j][i];
+        if (!key) {
+          i++;
+          continue;
+        }
+        int width = 1;
+        int height = 1;
+        if (this->greedy && this->isOpaqueCube((int)(key & 0xffff) - 1)) {
+          while (i + width < 16 && keys[j][i + width] == key) width++;
+          while (j + height < 16) {
+            bool rowMatches = true;
+            for (int k = 0; k < width && rowMatches; k++) {
+              rowMatches = keys[j + height][i + k] == key;
+            }
+            if (!rowMatches) break;
+            height++;
+          }
+          for (int h = 0; h < height; h++) {
+            for (int k = 0; k < width; k++) keys[j + h][i + k] = 0;
+          }
+        }
+        int pos[3];
+        pos[axes.axis] = d;
+        pos[axes.u] = i;
+        pos[axes.v] = j;
+        this->emitQuad(face, pos, width, height, key);
+        i += width;
+      }
+    }
+  }
+
+  void emitQuad(int face, const int pos[3], int width, int height, u64 key) {
+    if (this->quadCount == this->maxQuads) {
+      this->overflow = true;
+      return;
+    }
+    auto &axes = AXES[face];
+    u32 stateId = (u32)(key & 0xffff) - 1;
+    const int corners[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+    u32 base = this->quadCount * 4;
+    u32 *vertex = this->vertices + base * 2;
+    int ao[4];
+    for (int c = 0; c < 4; c++) {
+      int p[3] = {pos[0], pos[1], pos[2]};
+      if (axes.sign > 0) p[axes.axis]++;
+      int du = corners[c][0] * width;
+      int dv = corners[c][1] * height;
+      p[axes.u] += du;
+      p[axes.v] += dv;
+      ao[c] = key >> (16 + c * 2) & 3;
+      u32 lightLevel = key >> (24 + c * 8) & 0xff;
+      vertex[c * 2] = p[0] | p[1] << 5 | p[2] << 10 | face << 15 |
+                      ao[c] << 18 | lightLevel << 20;
+      vertex[c * 2 + 1] = stateId | du << 16 | dv << 21;
+    }
+
+    // Split along the diagonal between the brighter corners
+    int first = ao[0] + ao[2] < ao[1] + ao[3] ? 1 : 0;
+    int a = first;
+    int b = (first + 1) & 3;
+    int c = (first + 2) & 3;
+    int e = (first + 3) & 3;
+    u32 *index = this->indices + this->quadCount * 6;
+    if (axes.sign > 0) {
+      u32 order[6] = {base + a, base + b, base + c, base + a, base + c, base + e};
+      for (int k = 0; k < 6; k++) index[k] = order[k];
+    } else {
+      u32 order[6] = {base + a, base + c, base + b, base + a, base + e, base + c};
+      for (int k = 0; k < 6; k++) index[k] = order[k];
+    }
+    this->quadCount++;
+  }
+};
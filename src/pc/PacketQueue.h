@@ -0,0 +1,213 @@
+#pragma once
+#include "../Sync.h"
+#include "../Types.h"
+#include "../mem.h"
+
+// Chunk packets handed over in bulk: the host writes framed packets into a
+// ring in our memory, and pc118_drainQueue decodes whatever is pending in one
+// call, posting a Completion per packet to a second ring for the host to
+// read back. One producer and one consumer on each ring. The packets are
+// decoded where they lie, so a packet costs one copy into the ring and no
+// allocation or call of its own.
+//
+// Both rings and their indices live in one allocation laid out as
+// PacketQueueShared, which the host reads and writes directly. Indices are
+// free running counts (bytes for frames, entries for completions) that wrap
+// at 2^32; capacities are powers of two, so the offset is index & (capacity
+// - 1).
+//
+// A frame is a FrameHeader then `length` bytes, padded to a multiple of 8.
+// A frame never wraps: if it doesn't fit before the end of the ring, the
+// producer writes a length of FRAME_PAD there and starts it at offset 0.
+
+enum QueueStatus {
+  QUEUE_OK = 0,
+  // Not a chunk packet this protocol version can read
+  QUEUE_DECODE_FAILED = 1,
+  QUEUE_UNSUPPORTED_PROTOCOL = 2,
+  // A frame ran past what the producer had written. The rest of the ring is
+  // dropped, since frames after it can't be found.
+  QUEUE_BAD_FRAME = 3
+};
+
+// Frame flags
+enum QueueFlags {
+  // Compression framing, as for pc118_loadCompressedChunkPacket
+  QUEUE_COMPRESSED = 1
+};
+
+struct FrameHeader {
+  int length;
+  // Anything; passed back in the completion
+  int id;
+  // Protocol number (see Protocol.h), or 0 for 1.18
+  int protocol;
+  int flags;
+};
+
+// 12 bytes in wasm, 16 natively
+struct Completion {
+  // The decoded column, or null
+  void *column;
+  int id;
+  int status;
+};
+
+// The producer's and consumer's indices are a cache line apart, so neither
+// side's stores keep invalidating the line the other is writing
+struct PacketQueueShared {
+  // Written by the host
+  int frameHead;
+  int completionTail;
+  int hostPadding[14];
+  // Written by pc118_drainQueue
+  int frameTail;
+  int completionHead;
+  int drainPadding[14];
+  // Set at creation
+  int frameCapacity;
+  int completionCapacity;
+  u8 *frames;
+  Completion *completions;
+};
+
+// A frame taken off the ring, pointing into it until released
+struct QueuedPacket {
+  u8 *data;
+  int length;
+  int id;
+  int protocol;
+  int flags;
+  int status;
+};
+
+class PacketQueue {
+ public:
+  static const int FRAME_PAD = -1;
+  static const int MAX_FRAME_CAPACITY = 1 << 30;
+
+  PacketQueueShared *shared = nullptr;
+
+  // Capacities are rounded up to powers of two. Check `shared` for null
+  // (out of memory) before use.
+  PacketQueue(int frameBytes, int completionCount) {
+    if (frameBytes < 64) frameBytes = 64;
+    if (frameBytes > MAX_FRAME_CAPACITY) frameBytes = MAX_FRAME_CAPACITY;
+    int frameCapacity = roundUpToPowerOf2(frameBytes);
+    int completionCapacity =
+        roundUpToPowerOf2(completionCount < 1 ? 1 : completionCount);
+    AllocScope scope(ALLOC_SCRATCH);
+    this->shared = Allocate<PacketQueueShared>(1);
+    auto frames = Allocate<u8>(frameCapacity);
+    auto completions = Allocate<Completion>(completionCapacity);
+    if (!this->shared || !frames || !completions) {
+      Deallocate(this->shared);
+      Deallocate(frames);
+      Deallocate(completions);
+      this->shared = nullptr;
+      return;
+    }
+    this->shared->frameCapacity = frameCapacity;
+    this->shared->completionCapacity = completionCapacity;
+    this->shared->frames = frames;
+    this->shared->completions = completions;
+  }
+
+  PacketQueue(const PacketQueue &) = delete;
+  PacketQueue &operator=(const PacketQueue &) = delete;
+
+  ~PacketQueue() {
+    if (!this->shared) return;
+    Deallocate(this->shared->frames);
+    Deallocate(this->shared->completions);
+    Deallocate(this->shared);
+  }
+
+  // Producer side, for native hosts; the wasm host writes frames itself the
+  // same way. False if the ring hasn't room.
+  bool push(int id, int protocol, int flags, const u8 *data, int length) {
+    auto shared = this->shared;
+    u32 capacity = shared->frameCapacity;
+    u32 head = shared->frameHead;
+    u32 tail = atomicLoad(&shared->frameTail);
+    u32 size = sizeof(FrameHeader) + (((u32)length + 7) & ~7u);
+    u32 offset = head & (capacity - 1);
+    u32 toEnd = capacity - offset;
+    u32 needed = size + (toEnd < size ? toEnd : 0);
+    if (length < 0 || size > capacity || capacity - (head - tail) < needed) {
+      return false;
+    }
+    if (toEnd < size) {
+      ((FrameHeader *)(shared->frames + offset))->length = FRAME_PAD;
+      head += toEnd;
+      offset = 0;
+    }
+    auto header = (FrameHeader *)(shared->frames + offset);
+    *header = {length, id, protocol, flags};
+    memcpy(header + 1, (void *)data, length);
+    atomicStore(&shared->frameHead, head + size);
+    return true;
+  }
+
+  // Up to `maxPackets` pending frames, fewer if the completion ring can't
+  // take that many. They stay in the ring until release().
+  int take(out QueuedPacket *packets, int maxPackets) {
+    auto shared = this->shared;
+    u32 capacity = shared->frameCapacity;
+    u32 head = atomicLoad(&shared->frameHead);
+    u32 tail = shared->frameTail;
+    u32 completionsFree =
+        shared->completionCapacity -
+        ((u32)shared->completionHead - atomicLoad(&shared->completionTail));
+    if ((u32)maxPackets > completionsFree) maxPackets = completionsFree;
+
+    int count = 0;
+    if (head - tail > capacity && maxPackets > 0) {
+      packets[count++] = {nullptr, 0, -1, 0, 0, QUEUE_BAD_FRAME};
+      tail = head;
+    }
+    while (count < maxPackets && tail != head) {
+      u32 offset = tail & (capacity - 1);
+      u32 toEnd = capacity - offset;
+      auto header = (FrameHeader *)(shared->frames + offset);
+      // Frames are whole multiples of 8, so at least a length fits here
+      bool aligned = !(offset & 7);
+      if (aligned && header->length == FRAME_PAD && head - tail >= toEnd) {
+        tail += toEnd;
+        continue;
+      }
+      u32 size = sizeof(FrameHeader) + (((u32)header->length + 7) & ~7u);
+      if (!aligned || header->length < 0 || size > toEnd ||
+          size > head - tail) {
+        packets[count++] = {nullptr, 0, -1, 0, 0, QUEUE_BAD_FRAME};
+        tail = head;
+        break;
+      }
+      packets[count++] = {(u8 *)(header + 1), header->length, header->id,
+                          header->protocol,   header->flags,  QUEUE_OK};
+      tail += size;
+    }
+    this->takenTail = tail;
+    return count;
+  }
+
+  // Posts the outcome of a taken packet
+  void complete(const QueuedPacket &packet, void *column) {
+    auto shared = this->shared;
+    u32 index = this->completionHead++ & (shared->completionCapacity - 1);
+    shared->completions[index] = {column, packet.id, packet.status};
+  }
+
+  // Makes the completions posted so far visible to the host, then hands the
+  // space of the frames taken back to it
+  void release() {
+    atomicStore(&this->shared->completionHead, (int)this->completionHead);
+    atomicStore(&this->shared->frameTail, this->takenTail);
+  }
+
+ private:
+  u32 completionHead = 0;
+  u32 takenTail = 0;
+
+  static int roundUpToPowerOf2(int n) { return 1 << log2ceil(n); }
+};
@@ -0,0 +1,205 @@
+#pragma once
+#include "ChunkColumn.h"
+
+// Edits blocks in a chunk packet without decoding or re-encoding the rest of
+// it. load() walks the terrain once to find where each section starts; only
+// sections that are written to get decoded, and write() splices their new
+// encoding between runs of the original bytes, fixing up the terrain length.
+// Heightmaps, biomes, block entities and light are passed through as they
+// are.
+//
+// The packet is the same as the matching decodeInto takes (no packet ID) and
+// is not copied: it must stay alive and unchanged until write(). Reusable for
+// any number of packets of its protocol version.
+template <typename Protocol = Protocol118>
+class PacketRewriter {
+ public:
+  Registry *registry;
+  // Chunk coordinates of the loaded packet
+  int x = 0;
+  int z = 0;
+
+  PacketRewriter(Registry *registry) : registry(registry) {}
+
+  PacketRewriter(const PacketRewriter &) = delete;
+  PacketRewriter &operator=(const PacketRewriter &) = delete;
+
+  // False if the packet could not be indexed
+  bool load(u8 *packet, int length) {
+    this->packet = nullptr;
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+      this->decoded[i] = false;
+      this->modified[i] = false;
+    }
+
+    BinaryStream stream(packet, length);
+    if (length < 8) return false;
+    this->x = stream.readIntBE();
+    this->z = stream.readIntBE();
+    if (!skipNBT(stream, Protocol::NAMED_NBT_ROOT)) return false;
+    this->terrainLengthStart = stream.readPosition;
+    int terrainLength = stream.readVarInt();
+    this->terrainStart = stream.readPosition;
+    this->terrainEnd = this->terrainStart + terrainLength;
+    if (terrainLength < 0 || this->terrainEnd > length) return false;
+
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+      this->sectionStart[i] = stream.readPosition;
+      stream.skip(2);  // non-air count
+      if (!skipContainer(stream, this->terrainEnd,
+                         ChunkSection::MAX_INDIRECT_BITS)) {
+        return false;
+      }
+      this->biomeStart[i] = stream.readPosition;
+      if (!skipContainer(stream, this->terrainEnd,
+                         BiomeSection::MAX_INDIRECT_BITS)) {
+        return false;
+      }
+    }
+    this->packet = packet;
+    this->length = length;
+    return true;
+  }
+
+  // x and z within the chunk, y in the world as for ChunkColumn. -1 if
+  // nothing is loaded.
+  int getBlockStateId(int x, int y, int z) {
+    int s = (y >> 4) + Protocol::CO;
+    if (!this->packet || s < 0 || s >= NUM_SECTIONS) return -1;
+    auto section = this->getSection(s);
+    if (!section) return -1;
+    return section->getBlockStateId({x, y, z});
+  }
+
+  // False if nothing is loaded, y is out of range or out of memory
+  bool setBlockStateId(int x, int y, int z, int stateId) {
+    int s = (y >> 4) + Protocol::CO;
+    if (!this->packet || s < 0 || s >= NUM_SECTIONS) return false;
+    auto section = this->getSection(s);
+    if (!section) return false;
+    section->setBlockStateId({x, y, z}, stateId);
+    this->modified[s] = true;
+    return true;
+  }
+
+  // Section `s` (0 at the bottom of the world), decoded on first access. Null
+  // if nothing is loaded, s is out of range, the section is malformed or out
+  // of memory.
+  ChunkSection *getSection(int s) {
+    if (!this->packet || s < 0 || s >= NUM_SECTIONS) return nullptr;
+    if (!this->sections[s]) {
+      AllocScope scope(ALLOC_SECTIONS);
+      auto memory = Allocate<ChunkSection>(1);
+      if (!memory) return nullptr;
+      this->sections[s] = new (memory) ChunkSection(this->registry);
+    }
+    auto section = this->sections[s];
+    if (!this->decoded[s]) {
+      section->registry = this->registry;
+      BinaryStream stream(this->packet, this->biomeStart[s]);
+      stream.readPosition = this->sectionStart[s];
+      if (!section->read(stream)) return nullptr;
+      this->decoded[s] = true;
+    }
+    return section;
+  }
+
+  // Sets every block of section `s` to `blocks`. False as for getSection.
+  bool setSectionBlocks(int s, const short *blocks) {
+    auto section = this->getSection(s);
+    if (!section) return false;
+    for (int i = 0; i < 4096; i++) {
+      if (section->blocks[i] == blocks[i]) continue;
+      section->setBlockStateId({i & 0xf, i >> 8, (i >> 4) & 0xf}, blocks[i]);
+      this->modified[s] = true;
+    }
+    return true;
+  }
+
+  // Upper bound on write()'s output
+  int getMaxSize() {
+    int size = this->length + 5;
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+      if (this->modified[i]) size += SECTION_MAX_SIZE;
+    }
+    return size;
+  }
+
+  void write(BinaryStream &stream) {
+    if (!this->packet) return;
+    // Modified sections are encoded up front, since the terrain length that
+    // precedes them depends on their size
+    AllocScope scope(ALLOC_SCRATCH);
+    int modifiedCount = 0;
+    for (int i = 0; i < NUM_SECTIONS; i++) modifiedCount += this->modified[i];
+    BinaryStream encoded(modifiedCount * SECTION_MAX_SIZE + 1);
+    int encodedEnd[NUM_SECTIONS];
+    int terrainLength = this->terrainEnd - this->terrainStart;
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+      if (!this->modified[i]) continue;
+      int start = encoded.writePosition;
+      this->sections[i]->write(encoded);
+      encodedEnd[i] = encoded.writePosition;
+      terrainLength += encoded.writePosition - start -
+                       (this->biomeStart[i] - this->sectionStart[i]);
+    }
+
+    stream.write(this->packet, this->terrainLengthStart);
+    stream.writeVarInt(terrainLength);
+    int runStart = this->terrainStart;
+    int encodedStart = 0;
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+      if (!this->modified[i]) continue;
+      stream.write(this->packet + runStart, this->sectionStart[i] - runStart);
+      stream.write(encoded.data + encodedStart, encodedEnd[i] - encodedStart);
+      encodedStart = encodedEnd[i];
+      runStart = this->biomeStart[i];
+    }
+    // Rest of the terrain, then block entities and light
+    stream.write(this->packet + runStart, this->length - runStart);
+  }
+
+  ~PacketRewriter() {
+    for (int i = 0; i < NUM_SECTIONS; i++) Deallocate(this->sections[i]);
+  }
+
+ private:
+  // Non-air count, bits, 256 palette entries of up to 3 bytes, data length
+  // and 15 bit words
+  static const int SECTION_MAX_SIZE = 2 + 1 + 5 + 256 * 3 + 5 + 1024 * 8;
+
+  u8 *packet = nullptr;
+  int length = 0;
+  int terrainLengthStart = 0;
+  int terrainStart = 0;
+  int terrainEnd = 0;
+  int sectionStart[NUM_SECTIONS];
+  int biomeStart[NUM_SECTIONS];
+
+  // Decoded on first access. The memory is kept for the next packet.
+  ChunkSection *sections[NUM_SECTIONS] = {};
+  bool decoded[NUM_SECTIONS] = {};
+  bool modified[NUM_SECTIONS] = {};
+
+  // Bits per entry, palette, then the data array, as ChunkSection::read and
+  // BiomeSection::read expect. Above `maxIndirectBits` there is no palette.
+  static bool skipContainer(BinaryStream &stream, int end,
+                            int maxIndirectBits) {
+    if (stream.readPosition >= end) return false;
+    u8 bitsPerEntry = stream.readByte();
+    if (!bitsPerEntry) {
+      stream.readVarInt();
+    } else if (bitsPerEntry <= maxIndirectBits) {
+      int paletteLength = stream.readVarInt();
+      for (int i = 0; i < paletteLength && stream.readPosition < end; i++) {
+        stream.readVarInt();
+      }
+    }
+    int dataLength = stream.readVarInt();
+    if (dataLength < 0 || dataLength > (end - stream.readPosition) / 8) {
+      return false;
+    }
+    stream.skip(dataLength * 8);
+    return stream.readPosition <= end;
+  }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+// Protocol numbers of the Java Edition releases the chunk codec speaks.
+// Releases that share a number (1.18/1.18.1, 1.20/1.20.1, 1.20.3/1.20.4,
+// 1.20.5/1.20.6, 1.21/1.21.1) share an entry.
+enum ProtocolVersion {
+  PROTOCOL_1_18 = 757,
+  PROTOCOL_1_18_2 = 758,
+  PROTOCOL_1_19 = 759,
+  PROTOCOL_1_19_2 = 760,
+  PROTOCOL_1_19_3 = 761,
+  PROTOCOL_1_19_4 = 762,
+  PROTOCOL_1_20 = 763,
+  PROTOCOL_1_20_2 = 764,
+  PROTOCOL_1_20_3 = 765,
+  PROTOCOL_1_20_5 = 766,
+  PROTOCOL_1_21 = 767
+};
+
+// Chunk Data and Update Light
+constexpr int getChunkDataPacketId(int version) {
+  switch (version) {
+    case PROTOCOL_1_18:
+    case PROTOCOL_1_18_2:
+      return 0x22;
+    case PROTOCOL_1_19:
+      return 0x1F;
+    case PROTOCOL_1_19_2:
+      return 0x21;
+    case PROTOCOL_1_19_3:
+      return 0x20;
+    case PROTOCOL_1_19_4:
+    case PROTOCOL_1_20:
+      return 0x24;
+    case PROTOCOL_1_20_2:
+    case PROTOCOL_1_20_3:
+      return 0x25;
+    case PROTOCOL_1_20_5:
+    case PROTOCOL_1_21:
+      return 0x27;
+    default:
+      return -1;
+  }
+}
+
+constexpr int getBlockUpdatePacketId(int version) {
+  switch (version) {
+    case PROTOCOL_1_18:
+    case PROTOCOL_1_18_2:
+      return 0x0C;
+    case PROTOCOL_1_19:
+    case PROTOCOL_1_19_2:
+    case PROTOCOL_1_19_3:
+      return 0x09;
+    case PROTOCOL_1_19_4:
+    case PROTOCOL_1_20:
+      return 0x0A;
+    case PROTOCOL_1_20_2:
+    case PROTOCOL_1_20_3:
+    case PROTOCOL_1_20_5:
+    case PROTOCOL_1_21:
+      return 0x09;
+    default:
+      return -1;
+  }
+}
+
+// Multi Block Change, later Update Section Blocks
+constexpr int getSectionBlocksUpdatePacketId(int version) {
+  switch (version) {
+    case PROTOCOL_1_18:
+    case PROTOCOL_1_18_2:
+      return 0x3F;
+    case PROTOCOL_1_19:
+      return 0x3D;
+    case PROTOCOL_1_19_2:
+      return 0x40;
+    case PROTOCOL_1_19_3:
+      return 0x3F;
+    case PROTOCOL_1_19_4:
+    case PROTOCOL_1_20:
+      return 0x43;
+    case PROTOCOL_1_20_2:
+      return 0x45;
+    case PROTOCOL_1_20_3:
+      return 0x47;
+    case PROTOCOL_1_20_5:
+    case PROTOCOL_1_21:
+      return 0x49;
+    default:
+      return -1;
+  }
+}
+
+// What the chunk packet reader and writers need to know about a protocol
+// version. The codec is templated on it, so each version gets its own
+// instantiation with the differences resolved at compile time; the
+// ChunkColumn they read into and write from is the same for all of them.
+template <int Version>
+struct ProtocolTraits {
+  static const int VERSION = Version;
+
+  static const int CHUNK_DATA_PACKET_ID = getChunkDataPacketId(Version);
+  static const int BLOCK_UPDATE_PACKET_ID = getBlockUpdatePacketId(Version);
+  static const int SECTION_BLOCKS_UPDATE_PACKET_ID =
+      getSectionBlocksUpdatePacketId(Version);
+  static_assert(CHUNK_DATA_PACKET_ID >= 0, "Unsupported protocol version");
+
+  // Sections below y = 0 in the overworld
+  static const int CO = 4;
+
+  // Chunk Data and Update Light has a trust edges flag before the light
+  // masks, and Multi Block Change a suppress light updates flag; both went
+  // in 1.20
+  static const bool HAS_TRUST_EDGES = Version < PROTOCOL_1_20;
+  // Root NBT tags sent over the network (heightmaps, block entity data)
+  // lost their empty name in 1.20.2
+  static const bool NAMED_NBT_ROOT = Version < PROTOCOL_1_20_2;
+};
+
+using Protocol118 = ProtocolTraits<PROTOCOL_1_18>;
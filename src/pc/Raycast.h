@@ -0,0 +1,156 @@
+#pragma once
+#include "World.h"
+
+// Block faces, in the protocol's order
+enum BlockFace {
+  FACE_NONE = -1,
+  FACE_DOWN = 0,
+  FACE_UP = 1,
+  FACE_NORTH = 2,
+  FACE_SOUTH = 3,
+  FACE_WEST = 4,
+  FACE_EAST = 5
+};
+
+struct RaycastHit {
+  int x;
+  int y;
+  int z;
+  // Face the ray entered through, FACE_NONE if it started inside the block
+  int face;
+  // -1 on a miss
+  int stateId;
+  // Along the ray, in blocks
+  float distance;
+};
+
+// What counts as a hit: a state whose registry flags include any of
+// `requireFlags` (or any state, if 0) and none of `excludeFlags`. Solid
+// blocks are {STATE_SOLID, 0}, anything but air {0, STATE_AIR}. Without a
+// registry, anything but state 0 is hit.
+struct RaycastFilter {
+  int requireFlags;
+  int excludeFlags;
+
+  inline bool matches(Registry *registry, int stateId) {
+    if (!registry) return stateId != 0;
+    u8 flags = registry->getFlags(stateId);
+    if (this->requireFlags && !(flags & this->requireFlags)) return false;
+    return !(flags & this->excludeFlags);
+  }
+};
+
+// Voxel traversal (Amanatides & Woo) through the world's loaded columns.
+// Sections known to be all air, unloaded columns and space above or below
+// the world are crossed in one step each rather than block by block.
+// Returns whether something was hit; `hit` is filled in either way.
+inline bool raycast(World &world, const float origin[3], const float direction[3],
+                    float maxDistance, RaycastFilter filter,
+                    out RaycastHit &hit) {
+  hit = {0, 0, 0, FACE_NONE, -1, 0};
+  float length = __builtin_sqrtf(direction[0] * direction[0] +
+                                 direction[1] * direction[1] +
+                                 direction[2] * direction[2]);
+  if (!(length > 0)) return false;
+
+  int voxel[3];
+  int step[3];
+  float tMax[3];
+  float tDelta[3];
+  const float infinity = __builtin_inff();
+  for (int a = 0; a < 3; a++) {
+    float d = direction[a] / length;
+    float start = __builtin_floorf(origin[a]);
+    voxel[a] = (int)start;
+    if (d > 0) {
+      step[a] = 1;
+      tDelta[a] = 1 / d;
+      tMax[a] = (start + 1 - origin[a]) * tDelta[a];
+    } else if (d < 0) {
+      step[a] = -1;
+      tDelta[a] = -1 / d;
+      tMax[a] = (origin[a] - start) * tDelta[a];
+    } else {
+      step[a] = 0;
+      tDelta[a] = infinity;
+      tMax[a] = infinity;
+    }
+  }
+  // Entering across axis a with a positive step means hitting its low face
+  const int faces[3][2] = {{FACE_WEST, FACE_EAST},
+                           {FACE_DOWN, FACE_UP},
+                           {FACE_NORTH, FACE_SOUTH}};
+
+  float t = 0;
+  int face = FACE_NONE;
+  while (t <= maxDistance) {
+    auto column = world.getColumn(voxel[0] >> 4, voxel[2] >> 4);
+    ChunkSection *section = nullptr;
+    if (column && voxel[1] >= column->minY && voxel[1] < column->maxY) {
+      section = &column->getChunkSection(voxel[1] >> 4);
+      if (section->isEmpty()) section = nullptr;
+    }
+
+    if (!section) {
+      // Nothing to hit until the ray leaves this 16^3 cell. Each axis needs
+      // n[a] steps to cross the cell's far boundary; the axis whose last step
+      // comes first is the one the ray exits through.
+      int n[3];
+      float tExit = infinity;
+      int exitAxis = 0;
+      for (int a = 0; a < 3; a++) {
+        if (!step[a]) continue;
+        int local = voxel[a] & 0xf;
+        n[a] = step[a] > 0 ? 16 - local : local + 1;
+        float tLast = tMax[a] + (n[a] - 1) * tDelta[a];
+        if (tLast < tExit) {
+          tExit = tLast;
+          exitAxis = a;
+        }
+      }
+      if (tExit > maxDistance) return false;
+      for (int a = 0; a < 3; a++) {
+        if (!step[a]) continue;
+        int steps = n[a];
+        if (a != exitAxis) {
+          // Steps on this axis that happen before the exit
+          float before = __builtin_ceilf((tExit - tMax[a]) / tDelta[a]);
+          if (before < 0) before = 0;
+          if (before < steps) steps = (int)before;
+        }
+        voxel[a] += step[a] * steps;
+        tMax[a] += steps * tDelta[a];
+      }
+      t = tExit;
+      face = faces[exitAxis][step[exitAxis] < 0];
+      continue;
+    }
+
+    int stateId = section->blocks[(voxel[1] & 0xf) << 8 |
+                                  (voxel[2] & 0xf) << 4 | (voxel[0] & 0xf)];
+    if (filter.matches(column->registry, stateId)) {
+      hit = {voxel[0], voxel[1], voxel[2], face, stateId, t};
+      return true;
+    }
+
+    int a = tMax[0] < tMax[1] ? (tMax[0] < tMax[2] ? 0 : 2)
+                              : (tMax[1] < tMax[2] ? 1 : 2);
+    t = tMax[a];
+    voxel[a] += step[a];
+    tMax[a] += tDelta[a];
+    face = faces[a][step[a] < 0];
+  }
+  return false;
+}
+
+// `rays` holds origin x, y, z then direction x, y, z for each ray. Returns
+// how many hit.
+inline int raycastBatch(World &world, const float *rays, int count,
+                        float maxDistance, RaycastFilter filter,
+                        out RaycastHit *hits) {
+  int hitCount = 0;
+  for (int i = 0; i < count; i++, rays += 6) {
+    hitCount += raycast(world, rays, rays + 3, maxDistance, filter, hits[i]);
+  }
+  return hitCount;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include "../Sync.h"
+#include "BiomeSection.h"
+#include "ChunkSection.h"
+#ifndef WEBASSEMBLY
+#include <new>
+#endif
+
+// One section's blocks, biomes and light. Reference counted so a column and
+// its snapshots can share it; whichever writes to a shared storage first
+// swaps in its own copy (see ChunkColumn::snapshot).
+//
+// Storages are allocated in blocks, a new column's 24 in one, and a block is
+// freed once none of its storages are referenced.
+struct SectionStorage {
+  // 4 bits per light value, 8 per int word
+  static const int LIGHT_WORDS = 4096 / 8;
+  // Bytes ahead of the first storage in a block
+  static const int HEADER_SIZE = 16;
+
+  ChunkSection section;
+  BiomeSection biome;
+  int skyLight[LIGHT_WORDS];
+  int blockLight[LIGHT_WORDS];
+
+  // Columns and snapshots using this storage
+  int refs;
+
+  // `count` all air, unlit storages with one reference each, or null if out
+  // of memory
+  static SectionStorage *allocate(int count, Registry *registry) {
+    AllocScope scope(ALLOC_SECTIONS);
+    auto memory = Allocate<u8>(HEADER_SIZE + count * sizeof(SectionStorage));
+    if (!memory) return nullptr;
+    auto header = (Header *)memory;
+    header->live = count;
+    auto storages = (SectionStorage *)(memory + HEADER_SIZE);
+    for (int i = 0; i < count; i++) {
+      auto storage = &storages[i];
+      new (&storage->section) ChunkSection(registry);
+      new (&storage->biome) BiomeSection(registry);
+      storage->refs = 1;
+      storage->header = header;
+    }
+    return storages;
+  }
+
+  // Bytes allocate(count) takes
+  static size_t getBlockSize(int count) {
+    return HEADER_SIZE + count * sizeof(SectionStorage);
+  }
+
+  // Readies `count` storages laid out at `memory` the way allocate lays them
+  // out, each with one reference. SnapshotFile adopts blocks inside the file
+  // and keeps that reference itself, so they are never freed and a column
+  // using one sees it as shared and copies it before writing. copyBlock hands
+  // the reference to the column instead, which frees the block on release
+  // as for allocate.
+  static SectionStorage *adopt(u8 *memory, int count, Registry *registry) {
+    auto header = (Header *)memory;
+    header->live = count;
+    auto storages = (SectionStorage *)(memory + HEADER_SIZE);
+    for (int i = 0; i < count; i++) {
+      auto storage = &storages[i];
+      storage->section.registry = registry;
+      storage->biome.registry = registry;
+      storage->refs = 1;
+      storage->header = header;
+    }
+    return storages;
+  }
+
+  // Unshared copies of `count` storages laid out one after another, made
+  // with a single memcpy. Null if out of memory.
+  static SectionStorage *copyBlock(const SectionStorage *source, int count,
+                                   Registry *registry) {
+    AllocScope scope(ALLOC_SECTIONS);
+    auto memory = Allocate<u8>(getBlockSize(count));
+    if (!memory) return nullptr;
+    memcpy(memory + HEADER_SIZE, (void *)source,
+           count * sizeof(SectionStorage));
+    return adopt(memory, count, registry);
+  }
+
+  // Copies the contents to `image`, leaving out the pointers and counts that
+  // adopt fills in. The section's cached bounds and visibility are filled in
+  // on the image, since columns loaded from it share it.
+  void writeImage(out SectionStorage *image) const {
+    memcpy((void *)image, (void *)this, sizeof(SectionStorage));
+    int bounds[6];
+    image->section.getBounds(bounds);
+    image->section.getVisibility();
+    image->section.registry = nullptr;
+    image->biome.registry = nullptr;
+    image->refs = 0;
+    image->header = nullptr;
+  }
+
+  // An unshared copy, or null if out of memory
+  SectionStorage *copy() {
+    auto copy = allocate(1, this->section.registry);
+    if (!copy) return nullptr;
+    copy->section = this->section;
+    copy->biome = this->biome;
+    memcpy(copy->skyLight, this->skyLight, sizeof(this->skyLight));
+    memcpy(copy->blockLight, this->blockLight, sizeof(this->blockLight));
+    return copy;
+  }
+
+  inline void retain() { atomicAdd(&this->refs, 1); }
+
+  inline void release() {
+    if (atomicAdd(&this->refs, -1)) return;
+    if (!atomicAdd(&this->header->live, -1)) Deallocate(this->header);
+  }
+
+  // Only meaningful to the thread that takes snapshots: nobody else can
+  // raise the count, so a storage seen unshared stays unshared
+  inline bool isShared() { return atomicLoad(&this->refs) > 1; }
+
+ private:
+  struct Header {
+    // Storages in the block still referenced
+    int live;
+  };
+  Header *header;
+};
@@ -0,0 +1,284 @@
+#pragma once
+#include "../Sync.h"
+#include "ChunkColumn.h"
+
+// Many columns in one buffer laid out the way they sit in memory, so loading
+// one skips decoding: its sections can be used where they are, or copied out
+// with one memcpy.
+//
+// Layout (native byte order, every offset from the start of the buffer):
+//   Header
+//   Index[columnCount]              position and record offset per column
+//   per column, at an offset aligned to RECORD_ALIGN:
+//     Record
+//     the storage block             SectionStorage::getBlockSize(NUM_SECTIONS)
+//                                   bytes, as SectionStorage::allocate lays it
+//                                   out, pointers and counts zeroed
+//     EntityEntry[blockEntityCount]
+//     the block entity tags
+//
+// Sections are stored as the build that wrote the file lays them out, which
+// the header records (byte order through the magic, pointer size, storage
+// size); open() turns down a file from a build that differs, such as a
+// native file in wasm.
+class SnapshotFile {
+ public:
+  // "MCWS", read back as something else on the other byte order
+  static const u32 MAGIC = 0x5357434d;
+  static const int VERSION = 1;
+  static const int RECORD_ALIGN = 16;
+
+  SnapshotFile() {}
+
+  SnapshotFile(const SnapshotFile &) = delete;
+  SnapshotFile &operator=(const SnapshotFile &) = delete;
+
+  // Bytes write() needs for `columns`
+  static size_t getSize(ChunkColumn **columns, int count) {
+    size_t size = align(sizeof(Header) + count * sizeof(Index));
+    for (int i = 0; i < count; i++) size += align(getRecordSize(columns[i]));
+    return size;
+  }
+
+  // Writes getSize() bytes to `buffer`
+  static void write(ChunkColumn **columns, int count, out u8 *buffer) {
+    auto header = (Header *)buffer;
+    memset(buffer, 0, align(sizeof(Header) + count * sizeof(Index)));
+    header->magic = MAGIC;
+    header->version = VERSION;
+    header->pointerSize = sizeof(void *);
+    header->storageSize = sizeof(SectionStorage);
+    header->sectionsPerColumn = NUM_SECTIONS;
+    header->columnCount = count;
+
+    auto index = (Index *)(buffer + sizeof(Header));
+    size_t offset = align(sizeof(Header) + count * sizeof(Index));
+    for (int i = 0; i < count; i++) {
+      index[i] = {columns[i]->x, columns[i]->z, offset};
+      offset += align(writeRecord(columns[i], buffer + offset));
+    }
+  }
+
+  // Reads the header and index of a file in `data`, which must be 8 byte
+  // aligned (malloc and mmap both are) and outlive the file and every column
+  // loaded from it. Nothing is read beyond that until a column is asked for.
+  // False if it isn't a snapshot file this build can use.
+  bool open(u8 *data, size_t length, Registry *registry) {
+    this->data = nullptr;
+    this->columnCount = 0;
+    if ((size_t)data % alignof(u64) || length < sizeof(Header)) return false;
+    auto header = (Header *)data;
+    if (header->magic != MAGIC || header->version != VERSION ||
+        header->pointerSize != sizeof(void *) ||
+        header->storageSize != sizeof(SectionStorage) ||
+        header->sectionsPerColumn != NUM_SECTIONS || header->columnCount < 0) {
+      return false;
+    }
+    // Divided rather than multiplied out, which could wrap in wasm32
+    if ((size_t)header->columnCount >
+        (length - sizeof(Header)) / sizeof(Index)) {
+      return false;
+    }
+    this->data = data;
+    this->length = length;
+    this->registry = registry;
+    this->columnCount = header->columnCount;
+    this->index = (Index *)(data + sizeof(Header));
+    return true;
+  }
+
+  int getColumnCount() { return this->columnCount; }
+
+  bool getColumnPosition(int i, out int &x, out int &z) {
+    if (i < 0 || i >= this->columnCount) return false;
+    x = this->index[i].x;
+    z = this->index[i].z;
+    return true;
+  }
+
+  // Index of the column at x, z, or -1
+  int findColumn(int x, int z) {
+    for (int i = 0; i < this->columnCount; i++) {
+      if (this->index[i].x == x && this->index[i].z == z) return i;
+    }
+    return -1;
+  }
+
+  // Column `i` over the file's own sections: nothing is copied until a
+  // section is written to, which copies just that section as for a
+  // snapshot. Writes reference counts into the file, so the buffer must be
+  // writable (a private mapping will do). Null if the record is malformed.
+  ChunkColumn *loadColumn(int i) {
+    auto record = this->getRecord(i);
+    if (!record) return nullptr;
+    auto block = (u8 *)record + sizeof(Record);
+    auto storage = (SectionStorage *)(block + SectionStorage::HEADER_SIZE);
+    this->lock.lock();
+    if (!record->adopted) {
+      SectionStorage::adopt(block, NUM_SECTIONS, this->registry);
+      record->adopted = 1;
+    }
+    this->lock.unlock();
+    for (int s = 0; s < NUM_SECTIONS; s++) storage[s].retain();
+    return this->finishColumn(record, storage);
+  }
+
+  // Column `i` with its own copy of the sections, made with one memcpy.
+  // Only reads the file. Null if the record is malformed or out of memory.
+  ChunkColumn *copyColumn(int i) {
+    auto record = this->getRecord(i);
+    if (!record) return nullptr;
+    auto block = (u8 *)record + sizeof(Record);
+    auto storage = SectionStorage::copyBlock(
+        (SectionStorage *)(block + SectionStorage::HEADER_SIZE), NUM_SECTIONS,
+        this->registry);
+    if (!storage) return nullptr;
+    return this->finishColumn(record, storage);
+  }
+
+ private:
+  struct Header {
+    u32 magic;
+    u16 version;
+    u16 pointerSize;
+    u32 storageSize;
+    u32 sectionsPerColumn;
+    int columnCount;
+    u32 reserved[3];
+  };
+
+  struct Index {
+    int x;
+    int z;
+    u64 offset;
+  };
+
+  struct Record {
+    int x;
+    int z;
+    u64 skyLightMask;
+    u64 blockLightMask;
+    // From the start of the record
+    u64 size;
+    int blockEntityCount;
+    // Set once the storages have been readied for use in place
+    int adopted;
+    u64 reserved;
+  };
+
+  struct EntityEntry {
+    Vec3i position;
+    int tagLength;
+    // From the start of the record
+    u64 tagOffset;
+  };
+
+  u8 *data = nullptr;
+  size_t length = 0;
+  Registry *registry = nullptr;
+  int columnCount = 0;
+  Index *index = nullptr;
+  SpinLock lock;
+
+  static size_t align(size_t size) {
+    return (size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+  }
+
+  static size_t getEntitiesOffset() {
+    return sizeof(Record) + SectionStorage::getBlockSize(NUM_SECTIONS);
+  }
+
+  static size_t getRecordSize(ChunkColumn *column) {
+    size_t size = getEntitiesOffset();
+    size += column->blockEntities.count * sizeof(EntityEntry);
+    for (int i = 0; i < column->blockEntities.count; i++) {
+      size += column->blockEntities.list[i].tagLength;
+    }
+    return size;
+  }
+
+  static size_t writeRecord(ChunkColumn *column, out u8 *to) {
+    size_t size = getRecordSize(column);
+    memset(to, 0, align(size));
+    auto record = (Record *)to;
+    record->x = column->x;
+    record->z = column->z;
+    record->skyLightMask = column->skyLightMask;
+    record->blockLightMask = column->blockLightMask;
+    record->size = size;
+    record->blockEntityCount = column->blockEntities.count;
+
+    auto storage =
+        (SectionStorage *)(to + sizeof(Record) + SectionStorage::HEADER_SIZE);
+    for (int s = 0; s < NUM_SECTIONS; s++) {
+      column->storage[s]->writeImage(&storage[s]);
+    }
+
+    auto entries = (EntityEntry *)(to + getEntitiesOffset());
+    size_t tagOffset =
+        getEntitiesOffset() + column->blockEntities.count * sizeof(EntityEntry);
+    for (int i = 0; i < column->blockEntities.count; i++) {
+      auto &blockEntity = column->blockEntities.list[i];
+      entries[i] = {blockEntity.position, blockEntity.tagLength, tagOffset};
+      memcpy(to + tagOffset, (void *)blockEntity.tag, blockEntity.tagLength);
+      tagOffset += blockEntity.tagLength;
+    }
+    return size;
+  }
+
+  // Record `i` if it lies within the file and its sections are sane
+  Record *getRecord(int i) {
+    if (i < 0 || i >= this->columnCount) return nullptr;
+    u64 offset = this->index[i].offset;
+    if (offset % RECORD_ALIGN || offset > this->length ||
+        this->length - offset < getEntitiesOffset()) {
+      return nullptr;
+    }
+    auto record = (Record *)(this->data + offset);
+    if (record->size < getEntitiesOffset() ||
+        record->size > this->length - offset || record->blockEntityCount < 0 ||
+        (record->size - getEntitiesOffset()) / sizeof(EntityEntry) <
+            (u64)record->blockEntityCount) {
+      return nullptr;
+    }
+
+    auto entries = (EntityEntry *)((u8 *)record + getEntitiesOffset());
+    for (int e = 0; e < record->blockEntityCount; e++) {
+      if (entries[e].tagLength < 0 || entries[e].tagOffset > record->size ||
+          record->size - entries[e].tagOffset < (u64)entries[e].tagLength) {
+        return nullptr;
+      }
+    }
+
+    // Palette lengths are trusted as array bounds later on
+    auto storage = (SectionStorage *)((u8 *)record + sizeof(Record) +
+                                      SectionStorage::HEADER_SIZE);
+    for (int s = 0; s < NUM_SECTIONS; s++) {
+      auto &section = storage[s].section;
+      auto &biome = storage[s].biome;
+      if (section.paletteLength < -1 ||
+          section.paletteLength > ChunkSection::PALETTE_MAX ||
+          biome.paletteLength < 1 ||
+          biome.paletteLength > BiomeSection::SIZE ||
+          biome.bitsPerEntry != log2ceil(biome.paletteLength)) {
+        return nullptr;
+      }
+    }
+    return record;
+  }
+
+  ChunkColumn *finishColumn(Record *record, SectionStorage *storage) {
+    auto column =
+        new ChunkColumn(this->registry, record->x, record->z, storage);
+    column->skyLightMask = record->skyLightMask;
+    column->blockLightMask = record->blockLightMask;
+    auto entries = (EntityEntry *)((u8 *)record + getEntitiesOffset());
+    for (int e = 0; e < record->blockEntityCount; e++) {
+      auto tag = (i8 *)record + entries[e].tagOffset;
+      // Copied into the column's arena
+      column->setBlockEntity(entries[e].position,
+                             BlockEntity(tag, entries[e].tagLength));
+    }
+    return column;
+  }
+};
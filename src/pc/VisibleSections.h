@@ -0,0 +1,103 @@
+#pragma once
+#include "Raycast.h"
+
+struct SectionPos {
+  int x;
+  int y;
+  int z;
+};
+
+// Sections a camera in section cx, sy, cz might see into, nearest first,
+// for renderers to skip the rest (caves behind solid rock and so on).
+//
+// A breadth first walk from the camera's section across loaded sections up
+// to `radius` columns away. It enters a neighbour only if the section it
+// is leaving connects the face it came in through to the face it leaves by
+// (ChunkSection::getVisibility), and never turns back towards the camera,
+// which is what keeps it from seeping around corners. A camera above or below
+// the world starts from the top or bottom section.
+//
+// Writes up to `maxSections` and returns how many were found.
+inline int findVisibleSections(World &world, int cx, int sy, int cz,
+                               int radius, out SectionPos *sections,
+                               int maxSections) {
+  auto camera = world.getColumn(cx, cz);
+  if (!camera || radius < 0 || maxSections <= 0) return 0;
+  int minSection = camera->minY >> 4;
+  int maxSection = (camera->maxY >> 4) - 1;
+  int entryFace = FACE_NONE;
+  if (sy > maxSection) {
+    sy = maxSection;
+    entryFace = FACE_UP;
+  } else if (sy < minSection) {
+    sy = minSection;
+    entryFace = FACE_DOWN;
+  }
+
+  struct Node {
+    int x;
+    int y;
+    int z;
+    // Face of this section the walk came in through
+    int entryFace;
+    // Directions taken so far, a bit per BlockFace
+    int directions;
+  };
+  int width = radius * 2 + 1;
+  int height = maxSection - minSection + 1;
+  int capacity = width * width * height;
+  auto queue = Allocate<Node>(capacity);
+  auto visited = Allocate<u8>((capacity + 7) / 8);
+  if (!queue || !visited) {
+    Deallocate(queue);
+    Deallocate(visited);
+    return 0;
+  }
+  auto visit = [&](int x, int y, int z) {
+    int bit = ((x - cx + radius) * width + (z - cz + radius)) * height +
+              (y - minSection);
+    bool seen = visited[bit >> 3] & (1 << (bit & 7));
+    visited[bit >> 3] |= 1 << (bit & 7);
+    return !seen;
+  };
+
+  // Step for each BlockFace, and the face it leads into
+  const int steps[6][3] = {{0, -1, 0}, {0, 1, 0},  {0, 0, -1},
+                           {0, 0, 1},  {-1, 0, 0}, {1, 0, 0}};
+  const int opposite[6] = {FACE_UP,    FACE_DOWN, FACE_SOUTH,
+                           FACE_NORTH, FACE_EAST, FACE_WEST};
+
+  int head = 0;
+  int tail = 0;
+  int found = 0;
+  queue[tail++] = {cx, sy, cz, entryFace, 0};
+  visit(cx, sy, cz);
+  while (head < tail && found < maxSections) {
+    auto node = queue[head++];
+    sections[found++] = {node.x, node.y, node.z};
+    auto column = world.getColumn(node.x, node.z);
+    u16 visibility = column->getSectionVisibility(node.y);
+
+    for (int face = 0; face < 6; face++) {
+      if (node.directions & (1 << opposite[face])) continue;
+      if (node.entryFace != FACE_NONE &&
+          !(visibility & (1 << ChunkSection::facePairBit(node.entryFace,
+                                                          face)))) {
+        continue;
+      }
+      int x = node.x + steps[face][0];
+      int y = node.y + steps[face][1];
+      int z = node.z + steps[face][2];
+      if (y < minSection || y > maxSection) continue;
+      if (x < cx - radius || x > cx + radius || z < cz - radius ||
+          z > cz + radius) {
+        continue;
+      }
+      if (!world.getColumn(x, z) || !visit(x, y, z)) continue;
+      queue[tail++] = {x, y, z, opposite[face], node.directions | 1 << face};
+    }
+  }
+  Deallocate(queue);
+  Deallocate(visited);
+  return found;
+}
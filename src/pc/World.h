@@ -0,0 +1,185 @@
+#pragma once
+#include "ColumnPool.h"
+
+// Loaded columns keyed by chunk x, z, with block access in world
+// coordinates. Lookups go through an open addressing table (linear probing,
+// backward shift deletion so there are no tombstones) behind a one entry
+// cache of the last column hit, which catches most runs of nearby queries.
+//
+// Not thread safe.
+class World {
+ public:
+  int count = 0;
+
+  World(ColumnPool *pool) : pool(pool) { this->resize(64); }
+
+  World(const World &) = delete;
+  World &operator=(const World &) = delete;
+
+  ChunkColumn *getColumn(int x, int z) {
+    if (this->last && this->lastX == x && this->lastZ == z) return this->last;
+    int i = this->find(x, z);
+    if (i < 0) return nullptr;
+    this->last = this->slots[i].column;
+    this->lastX = x;
+    this->lastZ = z;
+    return this->last;
+  }
+
+  // Adds a column at its own x, z. Returns the column it replaced, if any,
+  // which the caller now owns; out of memory hands back `column` itself.
+  // Adding a column that is already there replaces nothing.
+  ChunkColumn *addColumn(ChunkColumn *column) {
+    if ((this->count + 1) * 4 > this->capacity * 3) {
+      if (!this->resize(this->capacity * 2)) return column;
+    }
+    this->last = nullptr;
+    u32 i = hash(column->x, column->z) & this->mask;
+    while (this->slots[i].column) {
+      auto &slot = this->slots[i];
+      if (slot.x == column->x && slot.z == column->z) {
+        auto previous = slot.column;
+        slot.column = column;
+        return previous != column ? previous : nullptr;
+      }
+      i = (i + 1) & this->mask;
+    }
+    this->slots[i] = {column->x, column->z, column};
+    this->count++;
+    return nullptr;
+  }
+
+  // Takes the column out of the world and hands it back, or null if there
+  // was none at x, z
+  ChunkColumn *removeColumn(int x, int z) {
+    int found = this->find(x, z);
+    if (found < 0) return nullptr;
+    this->last = nullptr;
+    auto column = this->slots[found].column;
+    this->count--;
+
+    // Pull later entries of the probe run back over the hole
+    u32 hole = found;
+    u32 i = hole;
+    while (true) {
+      i = (i + 1) & this->mask;
+      auto &slot = this->slots[i];
+      if (!slot.column) break;
+      u32 home = hash(slot.x, slot.z) & this->mask;
+      // Only move entries whose home isn't cyclically in (hole, i]
+      if (((i - home) & this->mask) >= ((i - hole) & this->mask)) {
+        this->slots[hole] = slot;
+        hole = i;
+      }
+    }
+    this->slots[hole].column = nullptr;
+    return column;
+  }
+
+  // Calls fn(column) for every column, in no particular order
+  template <typename Fn>
+  void forEachColumn(Fn fn) {
+    for (int i = 0; i < this->capacity; i++) {
+      if (this->slots[i].column) fn(this->slots[i].column);
+    }
+  }
+
+  // -1 if the position isn't loaded
+  int getBlockStateId(int x, int y, int z) {
+    auto column = this->getColumn(x >> 4, z >> 4);
+    if (!column || y < column->minY || y >= column->maxY) return -1;
+    return column->getBlockStateId({x & 0xf, y, z & 0xf});
+  }
+
+  // False if the position isn't loaded
+  bool setBlockStateId(int x, int y, int z, int stateId) {
+    auto column = this->getColumn(x >> 4, z >> 4);
+    if (!column || y < column->minY || y >= column->maxY) return false;
+    column->setBlockStateId({x & 0xf, y, z & 0xf}, stateId);
+    return true;
+  }
+
+  // `positions` holds x, y, z triples
+  void getBlockStateIds(const int *positions, int count, out int *stateIds) {
+    for (int i = 0; i < count; i++, positions += 3) {
+      stateIds[i] =
+          this->getBlockStateId(positions[0], positions[1], positions[2]);
+    }
+  }
+
+  // Returns how many positions were loaded and set
+  int setBlockStateIds(const int *positions, const int *stateIds, int count) {
+    int set = 0;
+    for (int i = 0; i < count; i++, positions += 3) {
+      set += this->setBlockStateId(positions[0], positions[1], positions[2],
+                                   stateIds[i]);
+    }
+    return set;
+  }
+
+  // Releases every column to the pool
+  void clear() {
+    for (int i = 0; i < this->capacity; i++) {
+      if (this->slots[i].column) this->pool->release(this->slots[i].column);
+      this->slots[i].column = nullptr;
+    }
+    this->count = 0;
+    this->last = nullptr;
+  }
+
+  ~World() {
+    this->clear();
+    Deallocate(this->slots);
+  }
+
+ private:
+  struct Slot {
+    int x;
+    int z;
+    // Null for an empty slot
+    ChunkColumn *column;
+  };
+
+  ColumnPool *pool;
+  Slot *slots = nullptr;
+  int capacity = 0;
+  u32 mask = 0;
+
+  ChunkColumn *last = nullptr;
+  int lastX = 0;
+  int lastZ = 0;
+
+  static inline u32 hash(int x, int z) {
+    u32 h = (u32)x * 0x9e3779b1u ^ (u32)z * 0x85ebca77u;
+    return h ^ (h >> 15);
+  }
+
+  int find(int x, int z) {
+    u32 i = hash(x, z) & this->mask;
+    while (this->slots[i].column) {
+      if (this->slots[i].x == x && this->slots[i].z == z) return i;
+      i = (i + 1) & this->mask;
+    }
+    return -1;
+  }
+
+  bool resize(int capacity) {
+    auto slots = Allocate<Slot>(capacity);
+    if (!slots) return false;
+    auto old = this->slots;
+    int oldCapacity = this->capacity;
+    this->slots = slots;
+    this->capacity = capacity;
+    this->mask = capacity - 1;
+    this->last = nullptr;
+    for (int i = 0; i < oldCapacity; i++) {
+      auto &slot = old[i];
+      if (!slot.column) continue;
+      u32 j = hash(slot.x, slot.z) & this->mask;
+      while (slots[j].column) j = (j + 1) & this->mask;
+      slots[j] = slot;
+    }
+    Deallocate(old);
+    return true;
+  }
+};
@@ -22,13 +22,17 @@
 
 #ifdef WEBASSEMBLY
 
+#include "walloc.h"
+
 extern "C" {
 
 typedef __SIZE_TYPE__ size_t;
 typedef __UINTPTR_TYPE__ uintptr_t;
 typedef __UINT8_TYPE__ uint8_t;
 
+#ifndef NULL
 #define NULL 0
+#endif
 
 #define STATIC_ASSERT_EQ(a, b) _Static_assert((a) == (b), "eq")
 
@@ -39,6 +43,32 @@ typedef __UINT8_TYPE__ uint8_t;
 #endif
 #define ASSERT_EQ(a,b) ASSERT((a) == (b))
 
+// With WALLOC_THREADS (build with -matomics -mbulk-memory and shared memory)
+// the page, chunk and large object state is behind one spinlock, and each
+// thread keeps a cache of small objects so most mallocs and frees never
+// take it.
+#ifdef WALLOC_THREADS
+static int heap_lock;
+static inline void lock_heap(void) {
+  while (__atomic_exchange_n(&heap_lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&heap_lock, __ATOMIC_RELAXED)) {
+    }
+  }
+}
+static inline void unlock_heap(void) {
+  __atomic_store_n(&heap_lock, 0, __ATOMIC_RELEASE);
+}
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_SUB(counter, n) __atomic_fetch_sub(&(counter), (n), __ATOMIC_RELAXED)
+#define THREAD_LOCAL thread_local
+#else
+static inline void lock_heap(void) {}
+static inline void unlock_heap(void) {}
+#define STAT_ADD(counter, n) ((counter) += (n))
+#define STAT_SUB(counter, n) ((counter) -= (n))
+#define THREAD_LOCAL
+#endif
+
 static inline size_t max(size_t a, size_t b) {
   return a < b ? b : a;
 }
@@ -94,6 +124,8 @@ static const uint8_t small_object_granule_sizes[] =
 #undef SMALL_OBJECT_GRANULE_SIZE
 };
 
+STATIC_ASSERT_EQ(SMALL_OBJECT_CHUNK_KINDS, WALLOC_SIZE_CLASSES);
+
 static enum chunk_kind granules_to_chunk_kind(unsigned granules) {
 #define TEST_GRANULE_SIZE(i) if (granules <= i) return GRANULES_##i;
   FOR_EACH_SMALL_OBJECT_GRANULES(TEST_GRANULE_SIZE);
@@ -157,11 +189,29 @@ static inline struct large_object* get_large_object(void *ptr) {
 }
 
 static struct freelist *small_object_freelists[SMALL_OBJECT_CHUNK_KINDS];
-static struct large_object *large_objects;
+
+// Free large objects are kept in size segregated lists, TLSF style: objects
+// under 64 chunks get a list per chunk count, bigger ones a list per quarter
+// power of two. A bitmap of non-empty lists makes finding a fit O(1) no
+// matter how big the heap gets. The lists are doubly linked, with the back
+// link stored in the (free) payload, so any object can be unlinked in O(1).
+#define LARGE_OBJECT_EXACT_BINS 64
+#define LARGE_OBJECT_EXACT_BINS_LOG_2 6
+#define LARGE_OBJECT_BINS 160
+#define LARGE_OBJECT_BITMAP_WORDS (LARGE_OBJECT_BINS / 32)
+static struct large_object *large_object_bins[LARGE_OBJECT_BINS];
+static unsigned large_object_bitmap[LARGE_OBJECT_BITMAP_WORDS];
 
 extern unsigned char* __heap_base;
 static size_t walloc_heap_size;
 
+// Counters for walloc_get_stats
+static size_t pages_grown;
+static size_t malloc_count;
+static size_t free_count;
+static size_t large_live;
+static size_t small_live[SMALL_OBJECT_CHUNK_KINDS];
+
 static struct page*
 allocate_pages(size_t payload_size, size_t *n_allocated) {
   size_t needed = payload_size + PAGE_HEADER_SIZE;
@@ -187,6 +237,7 @@ allocate_pages(size_t payload_size, size_t *n_allocated) {
       return NULL;
     }
     walloc_heap_size += grow;
+    pages_grown += grow >> PAGE_SIZE_LOG_2;
   }
   
   struct page *ret = (struct page *)base;
@@ -203,73 +254,159 @@ allocate_chunk(struct page *page, unsigned idx, enum chunk_kind kind) {
   return page->chunks[idx].data;
 }
 
+// Bin for a large object with SIZE payload bytes, whose size with header is
+// a whole number of chunks.
+static unsigned large_object_bin(size_t size) {
+  size_t chunks = (size + LARGE_OBJECT_HEADER_SIZE) >> CHUNK_SIZE_LOG_2;
+  if (chunks < LARGE_OBJECT_EXACT_BINS) {
+    return chunks;
+  }
+  unsigned log = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(chunks);
+  unsigned sub = (chunks >> (log - 2)) & 3;
+  unsigned bin = LARGE_OBJECT_EXACT_BINS +
+    ((log - LARGE_OBJECT_EXACT_BINS_LOG_2) << 2) + sub;
+  return bin < LARGE_OBJECT_BINS ? bin : LARGE_OBJECT_BINS - 1;
+}
+
+static inline struct large_object**
+get_free_large_object_prev(struct large_object *obj) {
+  return (struct large_object**) get_large_object_payload(obj);
+}
+
+static void insert_free_large_object(struct large_object *obj) {
+  unsigned bin = large_object_bin(obj->size);
+  struct large_object *head = large_object_bins[bin];
+  obj->next = head;
+  *get_free_large_object_prev(obj) = NULL;
+  if (head) {
+    *get_free_large_object_prev(head) = obj;
+  }
+  large_object_bins[bin] = obj;
+  large_object_bitmap[bin >> 5] |= 1u << (bin & 31);
+}
+
+// OBJ's size must not have changed since it was inserted.
+static void remove_free_large_object(struct large_object *obj) {
+  unsigned bin = large_object_bin(obj->size);
+  struct large_object *prev = *get_free_large_object_prev(obj);
+  if (prev) {
+    prev->next = obj->next;
+  } else {
+    ASSERT(large_object_bins[bin] == obj);
+    large_object_bins[bin] = obj->next;
+  }
+  if (obj->next) {
+    *get_free_large_object_prev(obj->next) = prev;
+  }
+  if (!large_object_bins[bin]) {
+    large_object_bitmap[bin >> 5] &= ~(1u << (bin & 31));
+  }
+}
+
 // It's possible for splitting to produce a large object of size 248 (256 minus
 // the header size) -- i.e. spanning a single chunk.  In that case, push the
-// chunk back on the GRANULES_32 small object freelist.
-static void maybe_repurpose_single_chunk_large_objects_head(void) {
-  if (large_objects->size < CHUNK_SIZE) {
-    unsigned idx = get_chunk_index(large_objects);
-    char *ptr = allocate_chunk(get_page(large_objects), idx, GRANULES_32);
-    large_objects = large_objects->next;
+// chunk on the GRANULES_32 small object freelist instead of binning it.
+static void release_free_large_object(struct large_object *obj) {
+  if (obj->size < CHUNK_SIZE) {
+    unsigned idx = get_chunk_index(obj);
+    char *ptr = allocate_chunk(get_page(obj), idx, GRANULES_32);
     struct freelist* head = (struct freelist *)ptr;
     head->next = small_object_freelists[GRANULES_32];
     small_object_freelists[GRANULES_32] = head;
+    return;
+  }
+  allocate_chunk(get_page(obj), get_chunk_index(obj), FREE_LARGE_OBJECT);
+  insert_free_large_object(obj);
+}
+
+// The free large object directly after OBJ, if any.  Merging can't create a
+// large object that newly spans a page header, which also catches the
+// end-of-heap case; objects spanning pages always end on a page boundary.
+static struct large_object* get_free_neighbour(struct large_object *obj) {
+  char *end = get_large_object_payload(obj) + obj->size;
+  ASSERT_ALIGNED((uintptr_t)end, CHUNK_SIZE);
+  unsigned chunk = get_chunk_index(end);
+  if (chunk < FIRST_ALLOCATABLE_CHUNK) {
+    return NULL;
+  }
+  if (get_page(end)->header.chunk_kinds[chunk] != FREE_LARGE_OBJECT) {
+    return NULL;
   }
+  return (struct large_object*) end;
 }
 
-// If there have been any large-object frees since the last large object
-// allocation, go through the freelist and merge any adjacent objects.
+// Absorbs any free objects following OBJ, which must not be in a bin.
+static void merge_free_neighbours(struct large_object *obj) {
+  struct large_object *next;
+  while ((next = get_free_neighbour(obj))) {
+    remove_free_large_object(next);
+    allocate_chunk(get_page(next), get_chunk_index(next), LARGE_OBJECT);
+    obj->size += LARGE_OBJECT_HEADER_SIZE + next->size;
+  }
+}
+
+// Frees merge forwards right away. A free object directly before another one
+// can only be found by walking the heap, so that is done lazily, only when
+// the bins have no fit and there have been frees since the last walk.
 static int pending_large_object_compact = 0;
-static struct large_object**
-maybe_merge_free_large_object(struct large_object** prev) {
-  struct large_object *obj = *prev;
-  while (1) {
-    char *end = get_large_object_payload(obj) + obj->size;
-    ASSERT_ALIGNED((uintptr_t)end, CHUNK_SIZE);
-    unsigned chunk = get_chunk_index(end);
+static void
+compact_free_large_objects(void) {
+  pending_large_object_compact = 0;
+  char *start = (char*) align((uintptr_t)&__heap_base, PAGE_SIZE);
+  char *end = start + walloc_heap_size;
+  char *ptr = start + FIRST_ALLOCATABLE_CHUNK * CHUNK_SIZE;
+  while (ptr < end) {
+    unsigned chunk = get_chunk_index(ptr);
     if (chunk < FIRST_ALLOCATABLE_CHUNK) {
-      // Merging can't create a large object that newly spans the header chunk.
-      // This check also catches the end-of-heap case.
-      return prev;
+      ptr += (FIRST_ALLOCATABLE_CHUNK - chunk) * CHUNK_SIZE;
+      continue;
     }
-    struct page *page = get_page(end);
-    if (page->header.chunk_kinds[chunk] != FREE_LARGE_OBJECT) {
-      return prev;
+    uint8_t kind = get_page(ptr)->header.chunk_kinds[chunk];
+    if (kind < SMALL_OBJECT_CHUNK_KINDS) {
+      ptr += CHUNK_SIZE;
+      continue;
     }
-    struct large_object *next = (struct large_object*) end;
-
-    struct large_object **prev_prev = &large_objects, *walk = large_objects;
-    while (1) {
-      ASSERT(walk);
-      if (walk == next) {
-        obj->size += LARGE_OBJECT_HEADER_SIZE + walk->size;
-        *prev_prev = walk->next;
-        if (prev == &walk->next) {
-          prev = prev_prev;
-        }
-        break;
-      }
-      prev_prev = &walk->next;
-      walk = walk->next;
+    struct large_object *obj = (struct large_object*) ptr;
+    if (kind == FREE_LARGE_OBJECT && get_free_neighbour(obj)) {
+      remove_free_large_object(obj);
+      merge_free_neighbours(obj);
+      insert_free_large_object(obj);
     }
+    ptr = get_large_object_payload(obj) + obj->size;
   }
 }
-static void
-maybe_compact_free_large_objects(void) {
-  if (pending_large_object_compact) {
-    pending_large_object_compact = 0;
-    struct large_object **prev = &large_objects;
-    while (*prev) {
-      prev = &(*maybe_merge_free_large_object(prev))->next;
+
+// A free object with at least SIZE payload bytes, or NULL.  Every object in
+// a bin past SIZE's is big enough; in SIZE's own bin only the exact bins are
+// guaranteed to fit, so that one is searched.
+static struct large_object*
+find_free_large_object(size_t size) {
+  size_t size_with_header = align(size + LARGE_OBJECT_HEADER_SIZE, CHUNK_SIZE);
+  unsigned bin = large_object_bin(size_with_header - LARGE_OBJECT_HEADER_SIZE);
+  for (struct large_object *walk = large_object_bins[bin]; walk;
+       walk = walk->next) {
+    if (walk->size >= size) {
+      return walk;
+    }
+  }
+  for (unsigned word = (bin + 1) >> 5; word < LARGE_OBJECT_BITMAP_WORDS;
+       word++) {
+    unsigned bits = large_object_bitmap[word];
+    if (word == (bin + 1) >> 5) {
+      bits &= ~0u << ((bin + 1) & 31);
+    }
+    if (bits) {
+      return large_object_bins[(word << 5) + __builtin_ctz(bits)];
     }
   }
+  return NULL;
 }
 
 // Allocate a large object with enough space for SIZE payload bytes.  Returns a
 // large object with a header, aligned on a chunk boundary, whose payload size
 // may be larger than SIZE, and whose total size (header included) is
 // chunk-aligned.  Either a suitable allocation is found in the large object
-// freelist, or we ask the OS for some more pages and treat those pages as a
+// bins, or we ask the OS for some more pages and treat those pages as a
 // large object.  If the allocation fits in that large object and there's more
 // than an aligned chunk's worth of data free at the end, the large object is
 // split.
@@ -278,28 +415,20 @@ maybe_compact_free_large_objects(void) {
 // object.
 static struct large_object*
 allocate_large_object(size_t size) {
-  maybe_compact_free_large_objects();
-  struct large_object *best = NULL, **best_prev = &large_objects;
-  size_t best_size = -1;
-  for (struct large_object **prev = &large_objects, *walk = large_objects;
-       walk;
-       prev = &walk->next, walk = walk->next) {
-    if (walk->size >= size && walk->size < best_size) {
-      best_size = walk->size;
-      best = walk;
-      best_prev = prev;
-      if (best_size + LARGE_OBJECT_HEADER_SIZE
-          == align(size + LARGE_OBJECT_HEADER_SIZE, CHUNK_SIZE))
-        // Not going to do any better than this; just return it.
-        break;
-    }
+  struct large_object *best = find_free_large_object(size);
+  if (!best && pending_large_object_compact) {
+    compact_free_large_objects();
+    best = find_free_large_object(size);
   }
+  size_t best_size;
 
-  if (!best) {
-    // The large object freelist doesn't have an object big enough for this
-    // allocation.  Allocate one or more pages from the OS, and treat that new
-    // sequence of pages as a fresh large object.  It will be split if
-    // necessary.
+  if (best) {
+    remove_free_large_object(best);
+    best_size = best->size;
+  } else {
+    // No free object is big enough for this allocation.  Allocate one or more
+    // pages from the OS, and treat that new sequence of pages as a fresh large
+    // object.  It will be split if necessary.
     size_t size_with_header = size + sizeof(struct large_object);
     size_t n_allocated = 0;
     struct page *page = allocate_pages(size_with_header, &n_allocated);
@@ -309,7 +438,6 @@ allocate_large_object(size_t size) {
     char *ptr = allocate_chunk(page, FIRST_ALLOCATABLE_CHUNK, LARGE_OBJECT);
     best = (struct large_object *)ptr;
     size_t page_header = ptr - ((char*) page);
-    best->next = large_objects;
     best->size = best_size =
       n_allocated * PAGE_SIZE - page_header - LARGE_OBJECT_HEADER_SIZE;
     ASSERT(best_size >= size_with_header);
@@ -317,9 +445,6 @@ allocate_large_object(size_t size) {
 
   allocate_chunk(get_page(best), get_chunk_index(best), LARGE_OBJECT);
 
-  struct large_object *next = best->next;
-  *best_prev = next;
-
   size_t tail_size = (best_size - size) & ~CHUNK_MASK;
   if (tail_size) {
     // The best-fitting object has 1 or more aligned chunks free after the
@@ -337,12 +462,8 @@ allocate_large_object(size_t size) {
       ASSERT_ALIGNED((uintptr_t)end, PAGE_SIZE);
       size_t first_page_size = PAGE_SIZE - (((uintptr_t)start) & PAGE_MASK);
       struct large_object *head = best;
-      allocate_chunk(start_page, get_chunk_index(start), FREE_LARGE_OBJECT);
       head->size = first_page_size;
-      head->next = large_objects;
-      large_objects = head;
-
-      maybe_repurpose_single_chunk_large_objects_head();
+      release_free_large_object(head);
 
       struct page *next_page = start_page + 1;
       char *ptr = allocate_chunk(next_page, FIRST_ALLOCATABLE_CHUNK, LARGE_OBJECT);
@@ -371,15 +492,10 @@ allocate_large_object(size_t size) {
     }
     
     if (tail_size) {
-      struct page *page = get_page(end - tail_size);
-      char *tail_ptr = allocate_chunk(page, tail_idx, FREE_LARGE_OBJECT);
-      struct large_object *tail = (struct large_object *) tail_ptr;
-      tail->next = large_objects;
+      struct large_object *tail = (struct large_object *) (end - tail_size);
       tail->size = tail_size - LARGE_OBJECT_HEADER_SIZE;
       ASSERT_ALIGNED((uintptr_t)(get_large_object_payload(tail) + tail->size), CHUNK_SIZE);
-      large_objects = tail;
-
-      maybe_repurpose_single_chunk_large_objects_head();
+      release_free_large_object(tail);
     }
   }
 
@@ -441,33 +557,312 @@ allocate_large(size_t size) {
   return obj ? get_large_object_payload(obj) : NULL;
 }
   
-void*
-malloc(size_t size) {
+#ifdef WALLOC_THREADS
+// Small objects taken from or returned to the shared lists at a time
+#define THREAD_CACHE_BATCH 16
+#define THREAD_CACHE_LIMIT 64
+static thread_local struct freelist *thread_freelists[SMALL_OBJECT_CHUNK_KINDS];
+static thread_local unsigned thread_cached[SMALL_OBJECT_CHUNK_KINDS];
+
+static void flush_thread_cache(unsigned kind, unsigned keep) {
+  lock_heap();
+  struct freelist **loc = get_small_object_freelist((enum chunk_kind)kind);
+  while (thread_cached[kind] > keep) {
+    struct freelist *obj = thread_freelists[kind];
+    thread_freelists[kind] = obj->next;
+    thread_cached[kind]--;
+    obj->next = *loc;
+    *loc = obj;
+  }
+  unlock_heap();
+}
+#endif
+
+static void*
+allocate_small_cached(enum chunk_kind kind) {
+#ifdef WALLOC_THREADS
+  if (!thread_freelists[kind]) {
+    lock_heap();
+    for (unsigned i = 0; i < THREAD_CACHE_BATCH; i++) {
+      struct freelist *obj = (struct freelist *)allocate_small(kind);
+      if (!obj) {
+        break;
+      }
+      obj->next = thread_freelists[kind];
+      thread_freelists[kind] = obj;
+      thread_cached[kind]++;
+    }
+    unlock_heap();
+    if (!thread_freelists[kind]) {
+      return NULL;
+    }
+  }
+  struct freelist *ret = thread_freelists[kind];
+  thread_freelists[kind] = ret->next;
+  thread_cached[kind]--;
+  return ret;
+#else
+  return allocate_small(kind);
+#endif
+}
+
+static void
+free_small_cached(void *ptr, enum chunk_kind kind) {
+  struct freelist *obj = (struct freelist *)ptr;
+#ifdef WALLOC_THREADS
+  obj->next = thread_freelists[kind];
+  thread_freelists[kind] = obj;
+  if (++thread_cached[kind] > THREAD_CACHE_LIMIT) {
+    flush_thread_cache(kind, THREAD_CACHE_LIMIT / 2);
+  }
+#else
+  struct freelist **loc = get_small_object_freelist(kind);
+  obj->next = *loc;
+  *loc = obj;
+#endif
+}
+
+static void*
+walloc_malloc(size_t size) {
   size_t granules = size_to_granules(size);
   enum chunk_kind kind = granules_to_chunk_kind(granules);
-  return (kind == LARGE_OBJECT) ? allocate_large(size) : allocate_small(kind);
+  if (kind == LARGE_OBJECT) {
+    lock_heap();
+    void *ptr = allocate_large(size);
+    if (ptr) large_live += get_large_object(ptr)->size;
+    unlock_heap();
+    return ptr;
+  }
+  void *ptr = allocate_small_cached(kind);
+  if (ptr) STAT_ADD(small_live[kind], chunk_kind_to_granules(kind) * GRANULE_SIZE);
+  return ptr;
 }
 
-void
-free(void *ptr) {
-  if (!ptr) return;
+static void
+walloc_free(void *ptr) {
   struct page *page = get_page(ptr);
   unsigned chunk = get_chunk_index(ptr);
+  // A chunk's kind only changes while it is free, so this is safe unlocked
   uint8_t kind = page->header.chunk_kinds[chunk];
   if (kind == LARGE_OBJECT) {
+    lock_heap();
     struct large_object *obj = get_large_object(ptr);
-    obj->next = large_objects;
-    large_objects = obj;
-    allocate_chunk(page, chunk, FREE_LARGE_OBJECT);
+    large_live -= obj->size;
+    merge_free_neighbours(obj);
+    release_free_large_object(obj);
     pending_large_object_compact = 1;
+    unlock_heap();
   } else {
-    size_t granules = kind;
-    struct freelist **loc = get_small_object_freelist((enum chunk_kind)granules);
-    struct freelist *obj = (struct freelist *)ptr;
-    obj->next = *loc;
-    *loc = obj;
+    STAT_SUB(small_live[kind], chunk_kind_to_granules((enum chunk_kind)kind) * GRANULE_SIZE);
+    free_small_cached(ptr, (enum chunk_kind)kind);
   }
 }
 
+#ifdef WALLOC_TRACE
+// Each allocation is prefixed with the tag it was made under and its size, so
+// free can credit the right subsystem. Keeps payloads 8 byte aligned.
+struct trace_header {
+  unsigned tag;
+  unsigned size;
+};
+STATIC_ASSERT_EQ(sizeof(struct trace_header), GRANULE_SIZE);
+
+static THREAD_LOCAL unsigned current_tag;
+static size_t tag_live[WALLOC_TAGS];
+static size_t tag_allocations[WALLOC_TAGS];
+
+unsigned
+walloc_set_tag(unsigned tag) {
+  unsigned previous = current_tag;
+  current_tag = tag < WALLOC_TAGS ? tag : 0;
+  return previous;
+}
+#endif
+
+void*
+malloc(size_t size) {
+  STAT_ADD(malloc_count, 1);
+#ifdef WALLOC_TRACE
+  struct trace_header *header =
+    (struct trace_header *)walloc_malloc(size + sizeof(struct trace_header));
+  if (!header) return NULL;
+  header->tag = current_tag;
+  header->size = size;
+  STAT_ADD(tag_live[current_tag], size);
+  STAT_ADD(tag_allocations[current_tag], 1);
+  return header + 1;
+#else
+  return walloc_malloc(size);
+#endif
+}
+
+void
+free(void *ptr) {
+  if (!ptr) return;
+  STAT_ADD(free_count, 1);
+#ifdef WALLOC_TRACE
+  struct trace_header *header = ((struct trace_header *)ptr) - 1;
+  STAT_SUB(tag_live[header->tag], header->size);
+  ptr = header;
+#endif
+  walloc_free(ptr);
+}
+
+// Grows the allocation at PTR in place to hold SIZE bytes, by absorbing the
+// free large objects after it. Only done within a page; objects spanning
+// pages must end on a page boundary.
+static int
+walloc_expand_object(void *ptr, size_t size) {
+  struct page *page = get_page(ptr);
+  uint8_t kind = page->header.chunk_kinds[get_chunk_index(ptr)];
+  if (kind != LARGE_OBJECT) {
+    return size <= chunk_kind_to_granules((enum chunk_kind)kind) * GRANULE_SIZE;
+  }
+  struct large_object *obj = get_large_object(ptr);
+  if (obj->size >= size) {
+    return 1;
+  }
+
+  size_t available = obj->size;
+  struct large_object *next = get_free_neighbour(obj);
+  while (next && available < size) {
+    char *next_end = get_large_object_payload(next) + next->size;
+    if (get_page(next_end - 1) != page) {
+      break;
+    }
+    available += LARGE_OBJECT_HEADER_SIZE + next->size;
+    next = get_free_neighbour(next);
+  }
+  if (available < size) {
+    return 0;
+  }
+
+  size_t old_size = obj->size;
+  while (obj->size < size) {
+    next = get_free_neighbour(obj);
+    remove_free_large_object(next);
+    allocate_chunk(get_page(next), get_chunk_index(next), LARGE_OBJECT);
+    obj->size += LARGE_OBJECT_HEADER_SIZE + next->size;
+  }
+  // Give back whole chunks we don't need
+  size_t needed =
+    align(size + LARGE_OBJECT_HEADER_SIZE, CHUNK_SIZE) - LARGE_OBJECT_HEADER_SIZE;
+  size_t tail_size = obj->size - needed;
+  if (tail_size >= CHUNK_SIZE) {
+    struct large_object *tail =
+      (struct large_object *) (get_large_object_payload(obj) + needed);
+    tail->size = tail_size - LARGE_OBJECT_HEADER_SIZE;
+    obj->size = needed;
+    release_free_large_object(tail);
+  }
+  large_live += obj->size - old_size;
+  return 1;
+}
+
+int
+walloc_expand(void *ptr, size_t size) {
+  if (!ptr) return 0;
+#ifdef WALLOC_TRACE
+  struct trace_header *header = ((struct trace_header *)ptr) - 1;
+  lock_heap();
+  int expanded =
+    walloc_expand_object(header, size + sizeof(struct trace_header));
+  unlock_heap();
+  if (!expanded) {
+    return 0;
+  }
+  STAT_ADD(tag_live[header->tag], size - header->size);
+  header->size = size;
+  return 1;
+#else
+  lock_heap();
+  int expanded = walloc_expand_object(ptr, size);
+  unlock_heap();
+  return expanded;
+#endif
+}
+
+void
+walloc_get_stats(struct walloc_stats *stats) {
+  lock_heap();
+  // Merge neighbours first so the free lists reflect what is really reusable
+  if (pending_large_object_compact) {
+    compact_free_large_objects();
+  }
+
+  stats->heap_size = walloc_heap_size;
+  stats->pages_grown = pages_grown;
+  stats->malloc_count = malloc_count;
+  stats->free_count = free_count;
+  stats->large_live = large_live;
+  stats->large_free = 0;
+  stats->large_free_count = 0;
+  stats->largest_free = 0;
+  for (unsigned bin = 0; bin < LARGE_OBJECT_BINS; bin++) {
+    for (struct large_object *walk = large_object_bins[bin]; walk;
+         walk = walk->next) {
+      stats->large_free += walk->size;
+      stats->large_free_count++;
+      stats->largest_free = max(stats->largest_free, walk->size);
+    }
+  }
+
+  for (unsigned kind = 0; kind < SMALL_OBJECT_CHUNK_KINDS; kind++) {
+    size_t size = chunk_kind_to_granules((enum chunk_kind)kind) * GRANULE_SIZE;
+    size_t free_bytes = 0;
+    for (struct freelist *walk = small_object_freelists[kind]; walk;
+         walk = walk->next) {
+      free_bytes += size;
+    }
+    stats->small_live[kind] = small_live[kind];
+    stats->small_free[kind] = free_bytes;
+  }
+
+  unlock_heap();
+
+  for (unsigned tag = 0; tag < WALLOC_TAGS; tag++) {
+#ifdef WALLOC_TRACE
+    stats->tag_live[tag] = tag_live[tag];
+    stats->tag_allocations[tag] = tag_allocations[tag];
+#else
+    stats->tag_live[tag] = 0;
+    stats->tag_allocations[tag] = 0;
+#endif
+  }
+}
+
+#ifdef WALLOC_THREADS
+void __wasm_init_tls(void *memory);
+
+// The large object holding this thread's thread locals, as allocated
+static thread_local char *thread_tls_block;
+
+void
+walloc_thread_init(void) {
+  // Thread locals aren't usable yet, so this must not touch the caches
+  size_t tls_align = __builtin_wasm_tls_align();
+  lock_heap();
+  char *tls = (char *)allocate_large(__builtin_wasm_tls_size() + tls_align);
+  unlock_heap();
+  ASSERT(tls);
+  __wasm_init_tls((void *)align((uintptr_t)tls, tls_align));
+  thread_tls_block = tls;
+}
+
+void
+walloc_thread_exit(void) {
+  for (unsigned kind = 0; kind < SMALL_OBJECT_CHUNK_KINDS; kind++) {
+    flush_thread_cache(kind, 0);
+  }
+  // Last, as the thread locals live in it. Never counted in large_live.
+  struct large_object *obj = get_large_object(thread_tls_block);
+  lock_heap();
+  merge_free_neighbours(obj);
+  release_free_large_object(obj);
+  pending_large_object_compact = 1;
+  unlock_heap();
+}
+#endif
+
 }
 #endif
\ No newline at end of file
@@ -5,6 +5,49 @@ extern "C" {
 typedef __SIZE_TYPE__ size_t;
 void* malloc(size_t size);
 void free(void *ptr);
+
+// Small object size classes, in 8 byte granules: 1 2 3 4 5 6 8 10 16 32
+#define WALLOC_SIZE_CLASSES 10
+// Subsystems allocations are attributed to when built with WALLOC_TRACE
+#define WALLOC_TAGS 4
+
+// Every field is a size_t (u32 on wasm32), so JS can read it as a Uint32Array
+struct walloc_stats {
+  size_t heap_size;     // bytes of linear memory owned by walloc
+  size_t pages_grown;   // 64KiB pages added with memory.grow
+  size_t malloc_count;  // cumulative
+  size_t free_count;    // cumulative
+  size_t large_live;    // bytes in large objects (over 256 bytes)
+  size_t large_free;    // bytes on the large object free list
+  size_t large_free_count;
+  size_t largest_free;  // biggest large object that could be reused as is
+  size_t small_live[WALLOC_SIZE_CLASSES];
+  // On the shared free lists only: with WALLOC_THREADS, objects a thread has
+  // freed into its own cache (up to 64 per size class) are in neither count
+  size_t small_free[WALLOC_SIZE_CLASSES];
+  size_t tag_live[WALLOC_TAGS];         // bytes, WALLOC_TRACE only
+  size_t tag_allocations[WALLOC_TAGS];  // cumulative, WALLOC_TRACE only
+};
+
+void walloc_get_stats(struct walloc_stats *stats);
+
+// Grows the allocation at `ptr` in place to at least `size` bytes if the
+// memory after it is free. Returns 0 if it could not, leaving it unchanged.
+int walloc_expand(void *ptr, size_t size);
+
+#ifdef WALLOC_THREADS
+// Must be called on each worker thread before it allocates, after its stack
+// pointer has been set up. Sets up the thread's thread locals.
+void walloc_thread_init(void);
+// Returns the thread's cached small objects to the shared heap and frees its
+// thread locals. The thread must not allocate or free afterwards.
+void walloc_thread_exit(void);
+#endif
+
+#ifdef WALLOC_TRACE
+// Following allocations are attributed to `tag`. Returns the previous tag.
+unsigned walloc_set_tag(unsigned tag);
+#endif
 }
 #define NULL 0
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,265 @@
+#pragma once
+#include "../Types.h"
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__PCLMUL__) && defined(__SSE4_1__)
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+// Adler-32 (zlib streams) and CRC-32 (gzip streams). Both take the running
+// value so they can be fed in segments; start with adler32Init / crc32Init.
+
+const u32 adler32Init = 1;
+const u32 crc32Init = 0;
+
+// Largest n such that 255n(n+1)/2 + (n+1)(BASE-1) fits in 32 bits
+const int ADLER_NMAX = 5552;
+const u32 ADLER_BASE = 65521;
+
+inline u32 adler32Scalar(u32 adler, const u8 *data, int length) {
+  u32 s1 = adler & 0xffff;
+  u32 s2 = adler >> 16;
+  while (length > 0) {
+    int n = length < ADLER_NMAX ? length : ADLER_NMAX;
+    length -= n;
+    while (n >= 4) {
+      s1 += data[0];
+      s2 += s1;
+      s1 += data[1];
+      s2 += s1;
+      s1 += data[2];
+      s2 += s1;
+      s1 += data[3];
+      s2 += s1;
+      data += 4;
+      n -= 4;
+    }
+    while (n--) {
+      s1 += *data++;
+      s2 += s1;
+    }
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+  return (s2 << 16) | s1;
+}
+
+#if defined(__wasm_simd128__) || defined(__SSE2__)
+// Vectorized over 16 byte blocks. For a run of k blocks following (s1, s2):
+//   s2' = s2 + 16k * s1 + 16 * sum(prefix byte sums) + sum((16 - i) * b[i])
+// so we only need per-lane byte sums, the running prefix of those, and the
+// weighted sums, all reduced once per ADLER_NMAX bytes.
+inline u32 adler32(u32 adler, const u8 *data, int length) {
+  u32 s1 = adler & 0xffff;
+  u32 s2 = adler >> 16;
+
+  while (length >= 16) {
+    int n = length < ADLER_NMAX ? length : ADLER_NMAX;
+    int blocks = n >> 4;
+    n = blocks << 4;
+    length -= n;
+    s2 += s1 * n;
+
+#if defined(__wasm_simd128__)
+    const v128_t weightsHi = wasm_i16x8_make(16, 15, 14, 13, 12, 11, 10, 9);
+    const v128_t weightsLo = wasm_i16x8_make(8, 7, 6, 5, 4, 3, 2, 1);
+    v128_t vs1 = wasm_i32x4_splat(0);
+    v128_t vps = wasm_i32x4_splat(0);
+    v128_t vs2 = wasm_i32x4_splat(0);
+    for (int i = 0; i < blocks; i++) {
+      v128_t bytes = wasm_v128_load(data);
+      vps = wasm_i32x4_add(vps, vs1);
+      v128_t lo = wasm_u16x8_extend_low_u8x16(bytes);
+      v128_t hi = wasm_u16x8_extend_high_u8x16(bytes);
+      vs1 = wasm_i32x4_add(vs1, wasm_u32x4_extadd_pairwise_u16x8(
+                                    wasm_i16x8_add(lo, hi)));
+      vs2 = wasm_i32x4_add(vs2, wasm_i32x4_dot_i16x8(lo, weightsHi));
+      vs2 = wasm_i32x4_add(vs2, wasm_i32x4_dot_i16x8(hi, weightsLo));
+      data += 16;
+    }
+    vs2 = wasm_i32x4_add(vs2, wasm_i32x4_shl(vps, 4));
+    s1 += wasm_i32x4_extract_lane(vs1, 0) + wasm_i32x4_extract_lane(vs1, 1) +
+          wasm_i32x4_extract_lane(vs1, 2) + wasm_i32x4_extract_lane(vs1, 3);
+    s2 += wasm_i32x4_extract_lane(vs2, 0) + wasm_i32x4_extract_lane(vs2, 1) +
+          wasm_i32x4_extract_lane(vs2, 2) + wasm_i32x4_extract_lane(vs2, 3);
+#else
+    const __m128i weightsHi = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i weightsLo = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vs1 = zero;
+    __m128i vps = zero;
+    __m128i vs2 = zero;
+    for (int i = 0; i < blocks; i++) {
+      __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+      vps = _mm_add_epi32(vps, vs1);
+      vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes, zero));
+      __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(lo, weightsHi));
+      vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(hi, weightsLo));
+      data += 16;
+    }
+    vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vps, 4));
+    u32 lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, vs1);
+    s1 += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i *)lanes, vs2);
+    s2 += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+
+  return adler32Scalar((s2 << 16) | s1, data, length);
+}
+#else
+inline u32 adler32(u32 adler, const u8 *data, int length) {
+  return adler32Scalar(adler, data, length);
+}
+#endif
+
+// Slicing-by-8 tables, built at compile time
+struct Crc32Tables {
+  u32 table[8][256];
+
+  constexpr Crc32Tables() : table() {
+    for (u32 i = 0; i < 256; i++) {
+      u32 c = i;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      table[0][i] = c;
+    }
+    for (u32 i = 0; i < 256; i++) {
+      for (int t = 1; t < 8; t++) {
+        u32 c = table[t - 1][i];
+        table[t][i] = table[0][c & 0xff] ^ (c >> 8);
+      }
+    }
+  }
+};
+
+inline constexpr Crc32Tables crc32Tables{};
+
+// Operates on the inverted CRC register
+inline u32 crc32Slice8(u32 crc, const u8 *data, int length) {
+  auto &t = crc32Tables.table;
+  while (length >= 8) {
+    u32 one = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (u32)data[3] << 24);
+    u32 two = data[4] | data[5] << 8 | data[6] << 16 | (u32)data[7] << 24;
+    crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+          t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^ t[3][two & 0xff] ^
+          t[2][(two >> 8) & 0xff] ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+    data += 8;
+    length -= 8;
+  }
+  while (length--) {
+    crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__PCLMUL__) && defined(__SSE4_1__)
+// Carry-less multiply folding ("Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ", Gopal et al). Takes len >= 64, consumes a multiple of 16
+// bytes and returns how many it used. Operates on the inverted CRC register.
+inline int crc32Fold(u32 &crc, const u8 *data, int length) {
+  alignas(16) static const u64 k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const u64 k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const u64 k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const u64 poly[] = {0x01db710641, 0x01f7011641};
+  const u8 *start = data;
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  x0 = _mm_load_si128((const __m128i *)k1k2);
+  data += 64;
+  length -= 64;
+
+  while (length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i *)(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                       _mm_loadu_si128((const __m128i *)(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                       _mm_loadu_si128((const __m128i *)(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                       _mm_loadu_si128((const __m128i *)(data + 0x30)));
+    data += 64;
+    length -= 64;
+  }
+
+  // Fold the four lanes into one
+  x0 = _mm_load_si128((const __m128i *)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while (length >= 16) {
+    x2 = _mm_loadu_si128((const __m128i *)data);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    data += 16;
+    length -= 16;
+  }
+
+  // 128 -> 64 bits
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128((const __m128i *)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  crc = _mm_extract_epi32(x1, 1);
+  return data - start;
+}
+#endif
+
+inline u32 crc32(u32 crc, const u8 *data, int length) {
+  crc = ~crc;
+#if defined(__PCLMUL__) && defined(__SSE4_1__)
+  if (length >= 64) {
+    int used = crc32Fold(crc, data, length);
+    data += used;
+    length -= used;
+  }
+#endif
+  return ~crc32Slice8(crc, data, length);
+}
@@ -0,0 +1,684 @@
+#pragma once
+#include "../BinaryStream.h"
+#include "../mem.h"
+#include "../Types.h"
+#include "Checksum.h"
+
+// A small DEFLATE (RFC 1951) encoder with zlib framing. Input is fed in
+// segments with write(), so a packet can be compressed straight from the
+// pieces the packet writer produced without first joining them.
+//
+// DEFLATE_FAST only emits literals and distance-1 runs (zlib's Z_RLE), which
+// catches the long runs in packed section longs and light arrays at close to
+// memcpy speed. DEFLATE_BALANCED does lazy hash-chain matching at roughly
+// zlib level 5-6 effort.
+
+enum DeflateLevel : u8 {
+  DEFLATE_STORE = 0,
+  DEFLATE_FAST = 1,
+  DEFLATE_BALANCED = 2
+};
+
+struct DeflateTables {
+  u8 lengthSymbol[256];  // (length - 3) -> length code - 257
+  u8 distSymbol[512];    // see distanceSymbol()
+  u16 lengthBase[29];
+  u8 lengthExtra[29];
+  u16 distBase[30];
+  u8 distExtra[30];
+
+  constexpr DeflateTables()
+      : lengthSymbol(), distSymbol(), lengthBase(), lengthExtra(), distBase(),
+        distExtra() {
+    int length = 0;
+    for (int code = 0; code < 28; code++) {
+      lengthExtra[code] = code < 8 ? 0 : (code - 4) >> 2;
+      lengthBase[code] = length;
+      for (int i = 0; i < (1 << lengthExtra[code]); i++) {
+        lengthSymbol[length++] = code;
+      }
+    }
+    // 258 has its own code and overlaps the top of code 27
+    lengthSymbol[255] = 28;
+    lengthBase[28] = 255;
+    lengthExtra[28] = 0;
+
+    int dist = 0;
+    for (int code = 0; code < 16; code++) {
+      distExtra[code] = code < 4 ? 0 : (code - 2) >> 1;
+      distBase[code] = dist;
+      for (int i = 0; i < (1 << distExtra[code]); i++) {
+        distSymbol[dist++] = code;
+      }
+    }
+    dist >>= 7;
+    for (int code = 16; code < 30; code++) {
+      distExtra[code] = (code - 2) >> 1;
+      distBase[code] = dist << 7;
+      for (int i = 0; i < (1 << (distExtra[code] - 7)); i++) {
+        distSymbol[256 + dist++] = code;
+      }
+    }
+  }
+};
+
+inline constexpr DeflateTables deflateTables{};
+
+class Deflater {
+ public:
+  DeflateLevel level;
+
+  Deflater(DeflateLevel level = DEFLATE_BALANCED) : level(level) {
+    AllocScope scope(ALLOC_SCRATCH);
+    this->window = Allocate<u8>(WINDOW_SIZE * 2 + 8);
+    this->tokens = Allocate<u32>(MAX_TOKENS);
+    if (level == DEFLATE_BALANCED) {
+      this->head = Allocate<u16>(HASH_SIZE);
+      this->prev = Allocate<u16>(WINDOW_SIZE * 2);
+    }
+  }
+
+  // Starts a zlib stream appended to `output` at its writePosition. The
+  // output stream must own its buffer so it can grow.
+  void begin(BinaryStream &output) {
+    this->output = &output;
+    this->windowEnd = 0;
+    this->position = 0;
+    this->scan = 0;
+    this->blockStart = 0;
+    this->tokenCount = 0;
+    this->matchAvailable = false;
+    this->prevLength = 0;
+    this->adler = adler32Init;
+    this->bitBuf = 0;
+    this->bitCount = 0;
+    if (this->head) {
+      for (int i = 0; i < HASH_SIZE; i++) this->head[i] = 0;
+    }
+
+    // CMF: deflate with a 32K window; FLG: level hint, FCHECK
+    u8 cmf = 0x78;
+    u8 flg = this->level == DEFLATE_BALANCED ? 0x80 : 0x00;
+    flg += 31 - ((cmf << 8) | flg) % 31;
+    output.reserve(output.writePosition + 2);
+    output.writeByte(cmf);
+    output.writeByte(flg);
+  }
+
+  void write(const u8 *data, int length) {
+    this->adler = adler32(this->adler, data, length);
+    while (length > 0) {
+      if (this->windowEnd == WINDOW_SIZE * 2) this->slide();
+      int n = WINDOW_SIZE * 2 - this->windowEnd;
+      if (n > length) n = length;
+      memcpy(this->window + this->windowEnd, (void *)data, n);
+      this->windowEnd += n;
+      data += n;
+      length -= n;
+      this->compress(false);
+    }
+  }
+
+  // Flushes the final block and the Adler-32 trailer
+  void finish() {
+    this->compress(true);
+    this->flushBlock(true);
+    this->flushBits();
+    auto &output = *this->output;
+    output.reserve(output.writePosition + 4);
+    output.writeByte(this->adler >> 24);
+    output.writeByte(this->adler >> 16);
+    output.writeByte(this->adler >> 8);
+    output.writeByte(this->adler);
+  }
+
+  ~Deflater() {
+    Deallocate(this->window);
+    Deallocate(this->tokens);
+    if (this->head) Deallocate(this->head);
+    if (this->prev) Deallocate(this->prev);
+  }
+
+ private:
+  static const int WINDOW_SIZE = 32768;
+  static const int HASH_BITS = 15;
+  static const int HASH_SIZE = 1 << HASH_BITS;
+  static const int MIN_MATCH = 3;
+  static const int MAX_MATCH = 258;
+  static const int MIN_LOOKAHEAD = MAX_MATCH + MIN_MATCH + 1;
+  static const int MAX_TOKENS = 16384;
+  static const int MAX_CHAIN = 32;
+  static const int NICE_LENGTH = 128;
+  static const int GOOD_LENGTH = 8;
+  // Don't look for a better match once the pending one is this long
+  static const int MAX_LAZY = 16;
+
+  // Tokens are literals (< 256) or MATCH | (length - 3) << 16 | (dist - 1)
+  static const u32 MATCH = 0x1000000;
+
+  BinaryStream *output = nullptr;
+  u8 *window = nullptr;
+  int windowEnd = 0;
+  // End of the tokenized input; `scan` runs one ahead while a lazy match is
+  // pending. Stored blocks are cut at `position`.
+  int position = 0;
+  int scan = 0;
+  int blockStart = 0;
+
+  u16 *head = nullptr;
+  u16 *prev = nullptr;
+  bool matchAvailable = false;
+  int prevLength = 0;
+  int prevDistance = 0;
+
+  u32 *tokens = nullptr;
+  int tokenCount = 0;
+  u32 adler = adler32Init;
+
+  u64 bitBuf = 0;
+  int bitCount = 0;
+
+  // The lower half of the window is history for matches in the upper half
+  void slide() {
+    this->flushBlock(false);
+    memcpy(this->window, this->window + WINDOW_SIZE, WINDOW_SIZE);
+    this->windowEnd -= WINDOW_SIZE;
+    this->position -= WINDOW_SIZE;
+    this->scan -= WINDOW_SIZE;
+    this->blockStart -= WINDOW_SIZE;
+    if (this->head) {
+      for (int i = 0; i < HASH_SIZE; i++) {
+        this->head[i] = this->head[i] >= WINDOW_SIZE ? this->head[i] - WINDOW_SIZE : 0;
+      }
+      for (int i = 0; i < WINDOW_SIZE; i++) {
+        u16 p = this->prev[i + WINDOW_SIZE];
+        this->prev[i] = p >= WINDOW_SIZE ? p - WINDOW_SIZE : 0;
+      }
+    }
+  }
+
+  void compress(bool flush) {
+    int limit = flush ? this->windowEnd : this->windowEnd - MIN_LOOKAHEAD;
+    if (this->level == DEFLATE_STORE) {
+      this->position = this->scan = this->windowEnd;
+      if (this->position - this->blockStart >= 65535) this->flushBlock(false);
+    } else if (this->level == DEFLATE_FAST) {
+      this->compressRle(limit);
+    } else {
+      this->compressLazy(limit, flush);
+    }
+  }
+
+  void addToken(u32 token) {
+    this->tokens[this->tokenCount++] = token;
+    if (this->tokenCount == MAX_TOKENS) this->flushBlock(false);
+  }
+
+  void compressRle(int limit) {
+    u8 *w = this->window;
+    int pos = this->scan;
+    while (pos < limit) {
+      int run = 0;
+      if (pos > 0) {
+        int max = this->windowEnd - pos;
+        if (max > MAX_MATCH) max = MAX_MATCH;
+        u8 value = w[pos - 1];
+        while (run < max && w[pos + run] == value) run++;
+      }
+      if (run >= MIN_MATCH) {
+        this->position = pos + run;
+        this->addToken(MATCH | (run - MIN_MATCH) << 16);
+        pos += run;
+      } else {
+        this->position = pos + 1;
+        this->addToken(w[pos]);
+        pos++;
+      }
+    }
+    this->scan = pos;
+  }
+
+  inline u32 hashAt(int pos) {
+    u8 *w = this->window + pos;
+    return ((w[0] << 10) ^ (w[1] << 5) ^ w[2]) & (HASH_SIZE - 1);
+  }
+
+  inline int insertHash(int pos) {
+    u32 h = this->hashAt(pos);
+    int candidate = this->head[h];
+    this->prev[pos] = candidate;
+    this->head[h] = pos;
+    return candidate;
+  }
+
+  int longestMatch(int pos, int candidate, int &distance) {
+    u8 *w = this->window;
+    int maxLength = this->windowEnd - pos;
+    if (maxLength > MAX_MATCH) maxLength = MAX_MATCH;
+    int best = this->prevLength >= MIN_MATCH - 1 ? this->prevLength : MIN_MATCH - 1;
+    int chain = this->prevLength >= GOOD_LENGTH ? MAX_CHAIN >> 2 : MAX_CHAIN;
+    int minPos = pos > WINDOW_SIZE ? pos - WINDOW_SIZE : 0;
+    if (best >= maxLength) return 0;
+
+    while (candidate > minPos && chain--) {
+      u8 *a = w + pos;
+      u8 *b = w + candidate;
+      if (b[best] == a[best] && b[0] == a[0] && b[1] == a[1]) {
+        int length = 0;
+        while (length < maxLength) {
+          u64 x, y;
+          __builtin_memcpy(&x, a + length, 8);
+          __builtin_memcpy(&y, b + length, 8);
+          if (x != y) {
+            length += __builtin_ctzll(x ^ y) >> 3;
+            break;
+          }
+          length += 8;
+        }
+        if (length > maxLength) length = maxLength;
+        if (length > best) {
+          best = length;
+          distance = pos - candidate;
+          if (length >= NICE_LENGTH || length == maxLength) break;
+        }
+      }
+      candidate = this->prev[candidate];
+    }
+    return best >= MIN_MATCH ? best : 0;
+  }
+
+  // Lazy matching: a match found at pos is only taken if pos + 1 does not
+  // have a longer one.
+  void compressLazy(int limit, bool flush) {
+    u8 *w = this->window;
+    int pos = this->scan;
+    while (pos < limit) {
+      int candidate = pos + MIN_MATCH <= this->windowEnd ? this->insertHash(pos) : 0;
+      int length = 0, distance = 0;
+      if (candidate && this->prevLength < MAX_LAZY) {
+        length = this->longestMatch(pos, candidate, distance);
+      }
+
+      if (this->prevLength >= MIN_MATCH && length <= this->prevLength) {
+        int matchEnd = pos - 1 + this->prevLength;
+        this->position = matchEnd;
+        this->addToken(MATCH | (this->prevLength - MIN_MATCH) << 16 |
+                       (this->prevDistance - 1));
+        for (pos++; pos < matchEnd; pos++) {
+          if (pos + MIN_MATCH <= this->windowEnd) this->insertHash(pos);
+        }
+        this->matchAvailable = false;
+        this->prevLength = 0;
+        continue;
+      }
+      if (this->matchAvailable) {
+        this->position = pos;
+        this->addToken(w[pos - 1]);
+      }
+      this->matchAvailable = true;
+      this->prevLength = length;
+      this->prevDistance = distance;
+      pos++;
+    }
+    this->scan = pos;
+    if (flush && this->matchAvailable) {
+      this->position = pos;
+      this->addToken(w[pos - 1]);
+      this->matchAvailable = false;
+      this->prevLength = 0;
+    }
+  }
+
+  // Bit output
+
+  void putBits(u32 value, int count) {
+    this->bitBuf |= (u64)value << this->bitCount;
+    this->bitCount += count;
+    if (this->bitCount >= 32) {
+      auto &output = *this->output;
+      u32 word = (u32)this->bitBuf;
+      __builtin_memcpy(output.data + output.writePosition, &word, 4);
+      output.writePosition += 4;
+      this->bitBuf >>= 32;
+      this->bitCount -= 32;
+    }
+  }
+
+  void flushBits() {
+    auto &output = *this->output;
+    output.reserve(output.writePosition + 8);
+    while (this->bitCount > 0) {
+      output.writeByte(this->bitBuf & 0xff);
+      this->bitBuf >>= 8;
+      this->bitCount -= 8;
+    }
+    this->bitBuf = 0;
+    this->bitCount = 0;
+  }
+
+  // Huffman code construction
+
+  // Moffat & Katajainen in-place minimum redundancy code lengths. `a` holds
+  // ascending frequencies and receives code lengths (longest first).
+  static void minimumRedundancy(int *a, int n) {
+    int root, leaf, next, available, used, depth;
+    a[0] += a[1];
+    root = 0;
+    leaf = 2;
+    for (next = 1; next < n - 1; next++) {
+      if (leaf >= n || a[root] < a[leaf]) {
+        a[next] = a[root];
+        a[root++] = next;
+      } else {
+        a[next] = a[leaf++];
+      }
+      if (leaf >= n || (root < next && a[root] < a[leaf])) {
+        a[next] += a[root];
+        a[root++] = next;
+      } else {
+        a[next] += a[leaf++];
+      }
+    }
+    a[n - 2] = 0;
+    for (next = n - 3; next >= 0; next--) a[next] = a[a[next]] + 1;
+    available = 1;
+    used = depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (available > 0) {
+      while (root >= 0 && a[root] == depth) {
+        used++;
+        root--;
+      }
+      while (available > used) {
+        a[next--] = depth;
+        available--;
+      }
+      available = 2 * used;
+      depth++;
+      used = 0;
+    }
+  }
+
+  // Length limited code lengths for `count` symbols, then LSB-first codes
+  static void buildCode(const u32 *freqs, int count, int maxBits, u8 *lengths,
+                        u16 *codes) {
+    u16 symbols[288];
+    int weights[288];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+      lengths[i] = 0;
+      if (!freqs[i]) continue;
+      // Insertion sort by frequency; alphabets are at most 286 symbols
+      int j = n++;
+      while (j > 0 && freqs[symbols[j - 1]] > freqs[i]) {
+        symbols[j] = symbols[j - 1];
+        j--;
+      }
+      symbols[j] = i;
+    }
+
+    if (n == 1) {
+      lengths[symbols[0]] = 1;
+    } else if (n > 1) {
+      for (int i = 0; i < n; i++) weights[i] = freqs[symbols[i]];
+      minimumRedundancy(weights, n);
+
+      int lengthCounts[33]{0};
+      for (int i = 0; i < n; i++) lengthCounts[weights[i]]++;
+      // Push overlong codes up to maxBits, then rebalance the Kraft sum
+      for (int i = maxBits + 1; i <= 32; i++) {
+        lengthCounts[maxBits] += lengthCounts[i];
+        lengthCounts[i] = 0;
+      }
+      u32 total = 0;
+      for (int i = maxBits; i > 0; i--) total += lengthCounts[i] << (maxBits - i);
+      while (total != (1u << maxBits)) {
+        lengthCounts[maxBits]--;
+        for (int i = maxBits - 1; i > 0; i--) {
+          if (lengthCounts[i]) {
+            lengthCounts[i]--;
+            lengthCounts[i + 1] += 2;
+            break;
+          }
+        }
+        total--;
+      }
+      // Most frequent symbols get the shortest codes
+      int index = n - 1;
+      for (int len = 1; len <= maxBits; len++) {
+        for (int k = lengthCounts[len]; k > 0; k--) {
+          lengths[symbols[index--]] = len;
+        }
+      }
+    }
+
+    canonicalCodes(lengths, count, codes);
+  }
+
+  static inline int distanceSymbol(int distMinus1) {
+    return distMinus1 < 256 ? deflateTables.distSymbol[distMinus1]
+                            : deflateTables.distSymbol[256 + (distMinus1 >> 7)];
+  }
+
+  // Block output
+
+  void flushBlock(bool last) {
+    int rawLength = this->position - this->blockStart;
+    if (!last && rawLength == 0 && this->tokenCount == 0) return;
+
+    auto &t = deflateTables;
+    u32 litFreq[286]{0};
+    u32 distFreq[30]{0};
+    u32 extraBits = 0;
+    for (int i = 0; i < this->tokenCount; i++) {
+      u32 token = this->tokens[i];
+      if (token & MATCH) {
+        int ls = t.lengthSymbol[(token >> 16) & 0xff];
+        int ds = distanceSymbol(token & 0xffff);
+        litFreq[257 + ls]++;
+        distFreq[ds]++;
+        extraBits += t.lengthExtra[ls] + t.distExtra[ds];
+      } else {
+        litFreq[token]++;
+      }
+    }
+    litFreq[256] = 1;
+
+    u8 litLengths[286], distLengths[30];
+    u16 litCodes[286], distCodes[30];
+    buildCode(litFreq, 286, 15, litLengths, litCodes);
+    buildCode(distFreq, 30, 15, distLengths, distCodes);
+
+    // Trim the trailing unused codes from the transmitted tables
+    int nlit = 286, ndist = 30;
+    while (nlit > 257 && !litLengths[nlit - 1]) nlit--;
+    while (ndist > 1 && !distLengths[ndist - 1]) ndist--;
+
+    // Run length encode both tables with the code length alphabet
+    u8 all[286 + 30];
+    for (int i = 0; i < nlit; i++) all[i] = litLengths[i];
+    for (int i = 0; i < ndist; i++) all[nlit + i] = distLengths[i];
+    u16 runs[286 + 30];  // symbol | extra value << 8
+    int runCount = 0;
+    u32 clFreq[19]{0};
+    for (int i = 0, total = nlit + ndist; i < total;) {
+      int value = all[i];
+      int run = 1;
+      while (i + run < total && all[i + run] == value) run++;
+      i += run;
+      if (value == 0) {
+        while (run >= 11) {
+          int n = run > 138 ? 138 : run;
+          runs[runCount++] = 18 | (n - 11) << 8;
+          clFreq[18]++;
+          run -= n;
+        }
+        if (run >= 3) {
+          runs[runCount++] = 17 | (run - 3) << 8;
+          clFreq[17]++;
+          run = 0;
+        }
+      } else {
+        runs[runCount++] = value;
+        clFreq[value]++;
+        run--;
+        while (run >= 3) {
+          int n = run > 6 ? 6 : run;
+          runs[runCount++] = 16 | (n - 3) << 8;
+          clFreq[16]++;
+          run -= n;
+        }
+      }
+      while (run-- > 0) {
+        runs[runCount++] = value;
+        clFreq[value]++;
+      }
+    }
+    u8 clLengths[19];
+    u16 clCodes[19];
+    buildCode(clFreq, 19, 7, clLengths, clCodes);
+    static const u8 order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                 11, 4,  12, 3, 13, 2, 14, 1, 15};
+    int nclen = 19;
+    while (nclen > 4 && !clLengths[order[nclen - 1]]) nclen--;
+
+    // Pick the cheapest of dynamic, fixed and stored
+    u32 dynamicBits = 3 + 14 + nclen * 3;
+    for (int i = 0; i < 19; i++) {
+      static const u8 clExtra[19] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                     0, 0, 0, 0, 0, 0, 2, 3, 7};
+      dynamicBits += clFreq[i] * (clLengths[i] + clExtra[i]);
+    }
+    u32 fixedBits = 3;
+    for (int i = 0; i < 286; i++) {
+      dynamicBits += litFreq[i] * litLengths[i];
+      fixedBits += litFreq[i] * (i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+    }
+    for (int i = 0; i < 30; i++) {
+      dynamicBits += distFreq[i] * distLengths[i];
+      fixedBits += distFreq[i] * 5;
+    }
+    dynamicBits += extraBits;
+    fixedBits += extraBits;
+    u32 storedBits = (rawLength + 5 * (rawLength / 65535 + 1)) * 8 + 7;
+
+    // Worst case is the stored size or the Huffman size, plus table headers
+    auto &output = *this->output;
+    u32 bound = (dynamicBits < fixedBits ? fixedBits : dynamicBits);
+    if (bound < storedBits) bound = storedBits;
+    output.reserve(output.writePosition + bound / 8 + 64);
+
+    if (this->level == DEFLATE_STORE ||
+        (storedBits <= dynamicBits && storedBits <= fixedBits)) {
+      this->writeStored(last);
+    } else if (fixedBits <= dynamicBits) {
+      this->putBits(last | 1 << 1, 3);
+      this->writeTokens(nullptr, nullptr, nullptr, nullptr);
+    } else {
+      this->putBits(last | 2 << 1, 3);
+      this->putBits(nlit - 257, 5);
+      this->putBits(ndist - 1, 5);
+      this->putBits(nclen - 4, 4);
+      for (int i = 0; i < nclen; i++) this->putBits(clLengths[order[i]], 3);
+      for (int i = 0; i < runCount; i++) {
+        int symbol = runs[i] & 0xff;
+        this->putBits(clCodes[symbol], clLengths[symbol]);
+        if (symbol == 16) this->putBits(runs[i] >> 8, 2);
+        if (symbol == 17) this->putBits(runs[i] >> 8, 3);
+        if (symbol == 18) this->putBits(runs[i] >> 8, 7);
+      }
+      this->writeTokens(litLengths, litCodes, distLengths, distCodes);
+    }
+
+    this->tokenCount = 0;
+    this->blockStart = this->position;
+  }
+
+  void writeStored(bool last) {
+    auto &output = *this->output;
+    int start = this->blockStart;
+    int remaining = this->position - start;
+    do {
+      int n = remaining > 65535 ? 65535 : remaining;
+      remaining -= n;
+      this->putBits((last && !remaining) ? 1 : 0, 3);
+      // Byte align, then LEN and NLEN
+      this->putBits(0, (8 - (this->bitCount & 7)) & 7);
+      while (this->bitCount > 0) {
+        output.writeByte(this->bitBuf & 0xff);
+        this->bitBuf >>= 8;
+        this->bitCount -= 8;
+      }
+      this->bitBuf = 0;
+      this->bitCount = 0;
+      output.writeUShortLE(n);
+      output.writeUShortLE(~n);
+      output.write(this->window + start, n);
+      start += n;
+    } while (remaining > 0);
+  }
+
+  // Null tables select the fixed code
+  void writeTokens(const u8 *litLengths, const u16 *litCodes,
+                   const u8 *distLengths, const u16 *distCodes) {
+    auto &t = deflateTables;
+    u16 fixedLitCodes[288], fixedDistCodes[30];
+    u8 fixedLitLengths[288], fixedDistLengths[30];
+    if (!litLengths) {
+      for (int i = 0; i < 288; i++) {
+        fixedLitLengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+      }
+      for (int i = 0; i < 30; i++) fixedDistLengths[i] = 5;
+      canonicalCodes(fixedLitLengths, 288, fixedLitCodes);
+      canonicalCodes(fixedDistLengths, 30, fixedDistCodes);
+      litLengths = fixedLitLengths;
+      litCodes = fixedLitCodes;
+      distLengths = fixedDistLengths;
+      distCodes = fixedDistCodes;
+    }
+
+    for (int i = 0; i < this->tokenCount; i++) {
+      u32 token = this->tokens[i];
+      if (!(token & MATCH)) {
+        this->putBits(litCodes[token], litLengths[token]);
+        continue;
+      }
+      int lengthMinus3 = (token >> 16) & 0xff;
+      int distMinus1 = token & 0xffff;
+      int ls = t.lengthSymbol[lengthMinus3];
+      int ds = distanceSymbol(distMinus1);
+      this->putBits(litCodes[257 + ls], litLengths[257 + ls]);
+      if (t.lengthExtra[ls]) {
+        this->putBits(lengthMinus3 - t.lengthBase[ls], t.lengthExtra[ls]);
+      }
+      this->putBits(distCodes[ds], distLengths[ds]);
+      if (t.distExtra[ds]) {
+        this->putBits(distMinus1 - t.distBase[ds], t.distExtra[ds]);
+      }
+    }
+    this->putBits(litCodes[256], litLengths[256]);
+  }
+
+  // LSB-first canonical codes, as deflate writes them
+  static void canonicalCodes(const u8 *lengths, int count, u16 *codes) {
+    u16 nextCode[17]{0};
+    int lengthCounts[17]{0};
+    for (int i = 0; i < count; i++) lengthCounts[lengths[i]]++;
+    lengthCounts[0] = 0;
+    for (int len = 1; len < 16; len++) {
+      nextCode[len + 1] = (nextCode[len] + lengthCounts[len]) << 1;
+    }
+    for (int i = 0; i < count; i++) {
+      int len = lengths[i];
+      if (!len) continue;
+      u32 code = nextCode[len]++;
+      u32 reversed = 0;
+      for (int b = 0; b < len; b++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+      }
+      codes[i] = reversed;
+    }
+  }
+};
@@ -0,0 +1,442 @@
+#pragma once
+#include "../BinaryStream.h"
+#include "../Types.h"
+#include "Checksum.h"
+
+// A small, dependency free DEFLATE (RFC 1951) decoder with zlib (RFC 1950)
+// and gzip (RFC 1952) framing. Output goes straight into a BinaryStream, which
+// is grown as needed if it owns its buffer.
+
+enum InflateFormat : u8 {
+  INFLATE_RAW = 0,
+  INFLATE_ZLIB = 1,
+  INFLATE_GZIP = 2,
+  // Sniff zlib or gzip from the header bytes
+  INFLATE_AUTO = 3
+};
+
+enum InflateStatus : int {
+  INFLATE_OK = 0,
+  INFLATE_TRUNCATED = -1,
+  INFLATE_BAD_HEADER = -2,
+  INFLATE_BAD_BLOCK = -3,
+  INFLATE_BAD_CODE = -4,
+  INFLATE_BAD_DISTANCE = -5,
+  INFLATE_BAD_CHECKSUM = -6,
+  INFLATE_OUTPUT_FULL = -7
+};
+
+class Inflater {
+ public:
+  // Number of input bytes used by the last inflate() call, trailer included
+  int consumed = 0;
+
+  // Decompresses `length` bytes at `input`, appending to `output` at its
+  // writePosition.
+  int inflate(const u8 *input, int length, BinaryStream &output,
+              InflateFormat format = INFLATE_ZLIB) {
+    this->in = input;
+    this->inEnd = input + length;
+    this->bitBuf = 0;
+    this->bitCount = 0;
+    this->consumed = 0;
+
+    if (format == INFLATE_AUTO) {
+      if (length >= 2 && input[0] == 0x1f && input[1] == 0x8b) {
+        format = INFLATE_GZIP;
+      } else {
+        format = INFLATE_ZLIB;
+      }
+    }
+
+    int status;
+    if (format == INFLATE_ZLIB) {
+      status = this->readZlibHeader();
+    } else if (format == INFLATE_GZIP) {
+      status = this->readGzipHeader();
+    } else {
+      status = INFLATE_OK;
+    }
+    if (status != INFLATE_OK) return status;
+
+    int outStart = output.writePosition;
+    bool last = false;
+    while (!last) {
+      if (!this->need(3)) return INFLATE_TRUNCATED;
+      last = this->bits(1);
+      int type = this->bits(2);
+      if (type == 0) {
+        status = this->storedBlock(output);
+      } else if (type == 1) {
+        this->buildFixedTables();
+        status = this->huffmanBlock(output);
+      } else if (type == 2) {
+        status = this->readDynamicTables();
+        if (status == INFLATE_OK) status = this->huffmanBlock(output);
+      } else {
+        status = INFLATE_BAD_BLOCK;
+      }
+      if (status != INFLATE_OK) return status;
+    }
+
+    // Hand back any whole bytes still sitting in the bit buffer
+    this->alignToByte();
+    const u8 *produced = output.data + outStart;
+    int producedLength = output.writePosition - outStart;
+    if (format == INFLATE_ZLIB) {
+      if (this->inEnd - this->in < 4) return INFLATE_TRUNCATED;
+      u32 expected = (u32)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+      this->in += 4;
+      if (adler32(adler32Init, produced, producedLength) != expected) {
+        return INFLATE_BAD_CHECKSUM;
+      }
+    } else if (format == INFLATE_GZIP) {
+      if (this->inEnd - this->in < 8) return INFLATE_TRUNCATED;
+      u32 expected = in[0] | in[1] << 8 | in[2] << 16 | (u32)in[3] << 24;
+      u32 size = in[4] | in[5] << 8 | in[6] << 16 | (u32)in[7] << 24;
+      this->in += 8;
+      if (crc32(crc32Init, produced, producedLength) != expected ||
+          size != (u32)producedLength) {
+        return INFLATE_BAD_CHECKSUM;
+      }
+    }
+    this->consumed = length - (this->inEnd - this->in);
+    return INFLATE_OK;
+  }
+
+ private:
+  // Primary lookup widths; longer codes spill into per-prefix subtables
+  static const int LITLEN_BITS = 10;
+  static const int DIST_BITS = 8;
+  static const int MAX_CODE_BITS = 15;
+
+  // Table entries: low 16 bits are the symbol (or subtable offset), then the
+  // code length in bits. SUBTABLE marks a link, with its width in bits 24-27.
+  static const u32 SUBTABLE = 0x80000000;
+
+  const u8 *in = nullptr;
+  const u8 *inEnd = nullptr;
+  u64 bitBuf = 0;
+  int bitCount = 0;
+
+  u32 litlenTable[(1 << LITLEN_BITS) + 288 * (1 << (MAX_CODE_BITS - LITLEN_BITS))];
+  u32 distTable[(1 << DIST_BITS) + 32 * (1 << (MAX_CODE_BITS - DIST_BITS))];
+  bool fixedTablesLoaded = false;
+
+  void refill() {
+    if (this->inEnd - this->in >= 8) {
+      u64 word;
+      __builtin_memcpy(&word, this->in, 8);
+      this->bitBuf |= word << this->bitCount;
+      this->in += (63 - this->bitCount) >> 3;
+      this->bitCount |= 56;
+    } else {
+      while (this->bitCount <= 56 && this->in < this->inEnd) {
+        this->bitBuf |= (u64)*this->in++ << this->bitCount;
+        this->bitCount += 8;
+      }
+    }
+  }
+
+  bool need(int n) {
+    if (this->bitCount < n) this->refill();
+    return this->bitCount >= n;
+  }
+
+  // Callers must have checked need(n)
+  u32 bits(int n) {
+    u32 value = this->bitBuf & ((1ull << n) - 1);
+    this->bitBuf >>= n;
+    this->bitCount -= n;
+    return value;
+  }
+
+  // Drops the partial byte and rewinds the input over buffered whole bytes
+  void alignToByte() {
+    this->bitCount -= this->bitCount & 7;
+    this->in -= this->bitCount >> 3;
+    this->bitBuf = 0;
+    this->bitCount = 0;
+  }
+
+  int readZlibHeader() {
+    if (this->inEnd - this->in < 2) return INFLATE_TRUNCATED;
+    u8 cmf = this->in[0], flg = this->in[1];
+    if ((cmf & 0xf) != 8 || (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31) {
+      return INFLATE_BAD_HEADER;
+    }
+    // A preset dictionary is never used by Minecraft
+    if (flg & 0x20) return INFLATE_BAD_HEADER;
+    this->in += 2;
+    return INFLATE_OK;
+  }
+
+  int readGzipHeader() {
+    if (this->inEnd - this->in < 10) return INFLATE_TRUNCATED;
+    if (in[0] != 0x1f || in[1] != 0x8b || in[2] != 8) {
+      return INFLATE_BAD_HEADER;
+    }
+    u8 flags = in[3];
+    this->in += 10;
+    if (flags & 4) {  // FEXTRA
+      if (this->inEnd - this->in < 2) return INFLATE_TRUNCATED;
+      int extraLength = in[0] | in[1] << 8;
+      this->in += 2 + extraLength;
+    }
+    for (int flag = 8; flag <= 16; flag <<= 1) {  // FNAME, FCOMMENT
+      if (flags & flag) {
+        while (this->in < this->inEnd && *this->in) this->in++;
+        this->in++;
+      }
+    }
+    if (flags & 2) this->in += 2;  // FHCRC
+    if (this->in > this->inEnd) return INFLATE_TRUNCATED;
+    return INFLATE_OK;
+  }
+
+  int storedBlock(BinaryStream &output) {
+    this->alignToByte();
+    if (this->inEnd - this->in < 4) return INFLATE_TRUNCATED;
+    int len = in[0] | in[1] << 8;
+    int nlen = in[2] | in[3] << 8;
+    if (len != (~nlen & 0xffff)) return INFLATE_BAD_BLOCK;
+    this->in += 4;
+    if (this->inEnd - this->in < len) return INFLATE_TRUNCATED;
+    if (!output.reserve(output.writePosition + len)) return INFLATE_OUTPUT_FULL;
+    output.write((void *)this->in, len);
+    this->in += len;
+    return INFLATE_OK;
+  }
+
+  static u32 reverseBits(u32 code, int length) {
+    u32 result = 0;
+    for (int i = 0; i < length; i++) {
+      result = (result << 1) | (code & 1);
+      code >>= 1;
+    }
+    return result;
+  }
+
+  // Builds a two level decode table from canonical code lengths. Returns
+  // false for over-subscribed or (non-trivially) incomplete codes.
+  static bool buildTable(u32 *table, int primaryBits, const u8 *lengths,
+                         int count) {
+    u16 lengthCounts[MAX_CODE_BITS + 1]{0};
+    u16 nextCode[MAX_CODE_BITS + 2]{0};
+    for (int i = 0; i < count; i++) lengthCounts[lengths[i]]++;
+    lengthCounts[0] = 0;
+
+    int left = 1;
+    int maxLength = 0;
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+      left = (left << 1) - lengthCounts[len];
+      if (left < 0) return false;
+      if (lengthCounts[len]) maxLength = len;
+    }
+    // Incomplete codes are only legal when empty or a single one bit code
+    if (left > 0 && maxLength && !(maxLength == 1 && lengthCounts[1] == 1)) {
+      return false;
+    }
+
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+      nextCode[len + 1] = (nextCode[len] + lengthCounts[len]) << 1;
+    }
+    for (int i = 0; i < (1 << primaryBits); i++) table[i] = 0;
+
+    int subBits = maxLength > primaryBits ? maxLength - primaryBits : 0;
+    int subSize = 1 << subBits;
+    int nextSubtable = 1 << primaryBits;
+
+    for (int symbol = 0; symbol < count; symbol++) {
+      int len = lengths[symbol];
+      if (!len) continue;
+      u32 code = reverseBits(nextCode[len]++, len);
+      if (len <= primaryBits) {
+        u32 entry = symbol | len << 16;
+        for (u32 i = code; i < (1u << primaryBits); i += 1 << len) {
+          table[i] = entry;
+        }
+        continue;
+      }
+      u32 prefix = code & ((1 << primaryBits) - 1);
+      if (!(table[prefix] & SUBTABLE)) {
+        table[prefix] = SUBTABLE | subBits << 24 | nextSubtable;
+        for (int i = 0; i < subSize; i++) table[nextSubtable + i] = 0;
+        nextSubtable += subSize;
+      }
+      u32 *sub = table + (table[prefix] & 0xffff);
+      int subLen = len - primaryBits;
+      u32 entry = symbol | subLen << 16;
+      for (u32 i = code >> primaryBits; i < (u32)subSize; i += 1 << subLen) {
+        sub[i] = entry;
+      }
+    }
+    return true;
+  }
+
+  // Returns the decoded symbol, or -1 on a bad or truncated code
+  int decode(const u32 *table, int primaryBits) {
+    if (this->bitCount < MAX_CODE_BITS) this->refill();
+    u32 entry = table[this->bitBuf & ((1 << primaryBits) - 1)];
+    if (entry & SUBTABLE) {
+      int subBits = (entry >> 24) & 0xf;
+      const u32 *sub = table + (entry & 0xffff);
+      u32 next = sub[(this->bitBuf >> primaryBits) & ((1 << subBits) - 1)];
+      int subLen = (next >> 16) & 0xff;
+      if (!subLen || this->bitCount < primaryBits + subLen) return -1;
+      this->bitBuf >>= primaryBits + subLen;
+      this->bitCount -= primaryBits + subLen;
+      return next & 0xffff;
+    }
+    int len = (entry >> 16) & 0xff;
+    if (!len || this->bitCount < len) return -1;
+    this->bitBuf >>= len;
+    this->bitCount -= len;
+    return entry & 0xffff;
+  }
+
+  void buildFixedTables() {
+    if (this->fixedTablesLoaded) return;
+    u8 lengths[288 + 32];
+    int i = 0;
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < 288; i++) lengths[i] = 8;
+    for (; i < 288 + 32; i++) lengths[i] = 5;
+    buildTable(this->litlenTable, LITLEN_BITS, lengths, 288);
+    buildTable(this->distTable, DIST_BITS, lengths + 288, 32);
+    this->fixedTablesLoaded = true;
+  }
+
+  int readDynamicTables() {
+    static const u8 order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                 11, 4,  12, 3, 13, 2, 14, 1, 15};
+    this->fixedTablesLoaded = false;
+    if (!this->need(14)) return INFLATE_TRUNCATED;
+    int nlen = this->bits(5) + 257;
+    int ndist = this->bits(5) + 1;
+    int ncode = this->bits(4) + 4;
+    if (nlen > 286 || ndist > 30) return INFLATE_BAD_BLOCK;
+
+    u8 lengths[288 + 32]{0};
+    for (int i = 0; i < ncode; i++) {
+      if (!this->need(3)) return INFLATE_TRUNCATED;
+      lengths[order[i]] = this->bits(3);
+    }
+    // The code length code is at most 7 bits, so a flat table is enough
+    u32 codeTable[1 << 7];
+    if (!buildTable(codeTable, 7, lengths, 19)) return INFLATE_BAD_BLOCK;
+
+    for (int i = 0; i < 19; i++) lengths[i] = 0;
+    int index = 0;
+    while (index < nlen + ndist) {
+      int symbol = this->decode(codeTable, 7);
+      if (symbol < 0) return INFLATE_BAD_CODE;
+      if (symbol < 16) {
+        lengths[index++] = symbol;
+        continue;
+      }
+      int repeat, value = 0;
+      if (!this->need(7)) return INFLATE_TRUNCATED;
+      if (symbol == 16) {
+        if (!index) return INFLATE_BAD_BLOCK;
+        value = lengths[index - 1];
+        repeat = 3 + this->bits(2);
+      } else if (symbol == 17) {
+        repeat = 3 + this->bits(3);
+      } else {
+        repeat = 11 + this->bits(7);
+      }
+      if (index + repeat > nlen + ndist) return INFLATE_BAD_BLOCK;
+      while (repeat--) lengths[index++] = value;
+    }
+    if (!lengths[256]) return INFLATE_BAD_BLOCK;
+
+    // The distance lengths must start at their own offset for buildTable
+    u8 distLengths[32]{0};
+    for (int i = 0; i < ndist; i++) distLengths[i] = lengths[nlen + i];
+    for (int i = nlen; i < 288; i++) lengths[i] = 0;
+    if (!buildTable(this->litlenTable, LITLEN_BITS, lengths, nlen)) {
+      return INFLATE_BAD_BLOCK;
+    }
+    if (!buildTable(this->distTable, DIST_BITS, distLengths, ndist)) {
+      return INFLATE_BAD_BLOCK;
+    }
+    return INFLATE_OK;
+  }
+
+  int huffmanBlock(BinaryStream &output) {
+    static const u16 lengthBase[29] = {3,  4,  5,  6,   7,   8,   9,   10,
+                                       11, 13, 15, 17,  19,  23,  27,  31,
+                                       35, 43, 51, 59,  67,  83,  99,  115,
+                                       131, 163, 195, 227, 258};
+    static const u8 lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                       1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                       4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const u16 distBase[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const u8 distExtra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                     4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                     9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    while (true) {
+      int symbol = this->decode(this->litlenTable, LITLEN_BITS);
+      if (symbol < 0) return INFLATE_BAD_CODE;
+      if (symbol < 256) {
+        if (output.writePosition >= output.size &&
+            !output.reserve(output.writePosition + 1)) {
+          return INFLATE_OUTPUT_FULL;
+        }
+        output.data[output.writePosition++] = symbol;
+        continue;
+      }
+      if (symbol == 256) return INFLATE_OK;
+
+      symbol -= 257;
+      if (symbol >= 29) return INFLATE_BAD_CODE;
+      if (!this->need(lengthExtra[symbol])) return INFLATE_TRUNCATED;
+      int length = lengthBase[symbol] + this->bits(lengthExtra[symbol]);
+
+      int distSymbol = this->decode(this->distTable, DIST_BITS);
+      if (distSymbol < 0 || distSymbol >= 30) return INFLATE_BAD_CODE;
+      if (!this->need(distExtra[distSymbol])) return INFLATE_TRUNCATED;
+      int distance = distBase[distSymbol] + this->bits(distExtra[distSymbol]);
+
+      if (distance > output.writePosition) return INFLATE_BAD_DISTANCE;
+      if (output.writePosition + length > output.size &&
+          !output.reserve(output.writePosition + length)) {
+        return INFLATE_OUTPUT_FULL;
+      }
+
+      u8 *dst = output.data + output.writePosition;
+      const u8 *src = dst - distance;
+      output.writePosition += length;
+      if (distance >= 8 && output.writePosition + 8 <= output.size) {
+        // Non-overlapping in 8 byte steps; may write up to 7 bytes past the
+        // match, which the next symbols overwrite
+        u8 *end = dst + length;
+        do {
+          __builtin_memcpy(dst, src, 8);
+          dst += 8;
+          src += 8;
+        } while (dst < end);
+      } else if (distance == 1) {
+        // Runs are very common in packed section data
+        u8 value = *src;
+        for (int i = 0; i < length; i++) dst[i] = value;
+      } else {
+        for (int i = 0; i < length; i++) dst[i] = src[i];
+      }
+    }
+  }
+};
+
+// One-shot helper; the Inflater is ~45KB of tables so this lives on the stack
+inline int inflate(const u8 *input, int length, BinaryStream &output,
+                   InflateFormat format = INFLATE_ZLIB) {
+  Inflater inflater;
+  return inflater.inflate(input, length, output, format);
+}
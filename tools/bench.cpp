@@ -0,0 +1,213 @@
+// Chunk packet throughput in a native build: the built-in deflate levels
+// against zlib, and the batch calls' scaling with threads. With no arguments
+// it runs on generated terrain; otherwise each argument is a file holding one
+// uncompressed chunk packet body, as pc118_loadChunkPacket takes.
+//
+//   g++ -std=c++20 -O2 tools/bench.cpp -o bench -pthread
+//   (add -DWITH_ZLIB -lz to compare against zlib)
+//
+// The allocator (walloc) is wasm only and isn't measured here.
+#include <chrono>
+#include <random>
+#include <vector>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#include "../src/main.cpp"
+
+static double now() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Seconds per call of `run`, repeated for at least half a second
+template <typename Run>
+static double measure(Run run) {
+  run();
+  int calls = 0;
+  double start = now();
+  double elapsed;
+  do {
+    run();
+    calls++;
+    elapsed = now() - start;
+  } while (elapsed < 0.5);
+  return elapsed / calls;
+}
+
+// Stone with ores and caves up to around y = 64, a few layers of dirt and
+// grass, then air; roughly what a freshly generated chunk holds
+static ChunkColumn *generateColumn(int x, int z, std::mt19937 &rng) {
+  const int STONE = 1;
+  const int DIRT = 10;
+  const int GRASS = 9;
+  const int ORES[] = {31, 32, 33, 3609, 3610, 4274};
+  const int DEEPSLATE = 18683;
+  auto column = new ChunkColumn(nullptr, x, z);
+  for (int bx = 0; bx < 16; bx++) {
+    for (int bz = 0; bz < 16; bz++) {
+      int height = 60 + (int)(rng() % 8);
+      for (int y = -64; y <= height; y++) {
+        int state = y < 0 ? DEEPSLATE : STONE;
+        if (y > height - 4) state = y == height ? GRASS : DIRT;
+        if (rng() % 64 == 0) state = ORES[rng() % 6];
+        if (rng() % 24 == 0) state = 0;  // Caves
+        column->setBlockStateId({bx, y, bz}, state);
+      }
+      for (int y = height + 1; y < 320; y++) {
+        column->setSkyLight({bx, y, bz}, 15);
+      }
+    }
+  }
+  for (int i = 0; i < 64; i++) {
+    column->setBiomeId({(int)(rng() % 16), (int)(rng() % 384) - 64,
+                        (int)(rng() % 16)},
+                       (int)(rng() % 4));
+  }
+  column->skyLightMask = 0xffffff;
+  return column;
+}
+
+static bool readFile(const char *path, std::vector<u8> &contents) {
+  auto file = fopen(path, "rb");
+  if (!file) return false;
+  u8 buffer[65536];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    contents.insert(contents.end(), buffer, buffer + read);
+  }
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  std::vector<ChunkColumn *> columns;
+  std::vector<std::vector<u8>> packets;
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      std::vector<u8> packet;
+      ChunkColumn *column = nullptr;
+      if (readFile(argv[i], packet)) {
+        column = ChunkColumn::readChunkPacket(nullptr, packet.data(),
+                                              (int)packet.size());
+      }
+      if (!column) {
+        fprintf(stderr, "%s: not a chunk packet\n", argv[i]);
+        return 1;
+      }
+      columns.push_back(column);
+      packets.push_back(packet);
+    }
+  } else {
+    std::mt19937 rng(1);
+    for (int i = 0; i < 32; i++) {
+      auto column = generateColumn(i % 8, i / 8, rng);
+      u8 *packet;
+      int length;
+      column->writeChunkPacket(packet, length);
+      columns.push_back(column);
+      packets.emplace_back(packet, packet + length);
+      free(packet);
+    }
+  }
+  int count = (int)columns.size();
+  double totalBytes = 0;
+  for (auto &packet : packets) totalBytes += packet.size();
+  printf("%d packets, %.1f KB on average\n\n", count,
+         totalBytes / count / 1024);
+
+  printf("%-16s %8s %12s %12s\n", "compression", "ratio", "deflate MB/s",
+         "inflate MB/s");
+  const char *levelNames[] = {"store", "fast (RLE)", "balanced"};
+  for (int level = DEFLATE_STORE; level <= DEFLATE_BALANCED; level++) {
+    Deflater deflater((DeflateLevel)level);
+    std::vector<BinaryStream *> compressed;
+    double compressedBytes = 0;
+    for (auto &packet : packets) {
+      auto stream = new BinaryStream((int)packet.size() + 1024);
+      deflater.begin(*stream);
+      deflater.write(packet.data(), (int)packet.size());
+      deflater.finish();
+      compressedBytes += stream->writePosition;
+      compressed.push_back(stream);
+    }
+    double deflateTime = measure([&] {
+      for (auto &packet : packets) {
+        BinaryStream stream((int)packet.size() + 1024);
+        deflater.begin(stream);
+        deflater.write(packet.data(), (int)packet.size());
+        deflater.finish();
+      }
+    });
+    double inflateTime = measure([&] {
+      for (int i = 0; i < count; i++) {
+        BinaryStream output((int)packets[i].size());
+        inflate(compressed[i]->data, compressed[i]->writePosition, output);
+      }
+    });
+    printf("%-16s %8.2f %12.1f %12.1f\n", levelNames[level],
+           totalBytes / compressedBytes, totalBytes / deflateTime / 1e6,
+           totalBytes / inflateTime / 1e6);
+    for (auto stream : compressed) delete stream;
+  }
+#ifdef WITH_ZLIB
+  for (int level : {1, 6}) {
+    std::vector<u8> output(compressBound((uLong)totalBytes));
+    double compressedBytes = 0;
+    for (auto &packet : packets) {
+      uLongf length = (uLongf)output.size();
+      compress2(output.data(), &length, packet.data(), packet.size(), level);
+      compressedBytes += length;
+    }
+    double deflateTime = measure([&] {
+      for (auto &packet : packets) {
+        uLongf length = (uLongf)output.size();
+        compress2(output.data(), &length, packet.data(), packet.size(),
+                  level);
+      }
+    });
+    char name[32];
+    snprintf(name, sizeof(name), "zlib level %d", level);
+    printf("%-16s %8.2f %12.1f %12s\n", name, totalBytes / compressedBytes,
+           totalBytes / deflateTime / 1e6, "-");
+  }
+#endif
+
+  // Batches of every packet, at doubling thread counts up to one per core
+  std::vector<u8 *> buffers;
+  std::vector<int> lengths;
+  for (auto &packet : packets) {
+    buffers.push_back(packet.data());
+    lengths.push_back((int)packet.size());
+  }
+  std::vector<void *> loaded(count);
+  std::vector<u8 *> encoded(count);
+  std::vector<int> encodedLengths(count);
+  int cores = (int)std::thread::hardware_concurrency();
+  printf("\n%-8s %16s %16s %16s\n", "threads", "decode packets/s",
+         "encode packets/s", "(balanced)");
+  for (int threads = 1;; threads *= 2) {
+    if (threads > cores) threads = cores;
+    mcw_setThreadCount(threads);
+    double decodeTime = measure([&] {
+      pc118_loadChunkPacketBatch(buffers.data(), lengths.data(), count, 0,
+                                 loaded.data());
+      for (auto column : loaded) pc118_releaseChunk(column);
+    });
+    auto encode = [&](int level) {
+      return measure([&] {
+        pc118_writeChunkPacketBatch((void **)columns.data(), count, level,
+                                    encoded.data(), encodedLengths.data());
+        for (auto buffer : encoded) free(buffer);
+      });
+    };
+    double encodeTime = encode(-1);
+    double balancedTime = encode(DEFLATE_BALANCED);
+    printf("%-8d %16.0f %16.0f %16.0f\n", threads, count / decodeTime,
+           count / encodeTime, count / balancedTime);
+    if (threads == cores) break;
+  }
+
+  for (auto column : columns) delete column;
+  return 0;
+}
@@ -0,0 +1,585 @@
+// Round trips and malformed input for the decoders that take untrusted bytes:
+// chunk packets (plain and compressed), PacketRewriter, SnapshotFile, the
+// packet queue, Bedrock sub chunks and LevelChunks, NBT and the registry
+// blob. Every check of malformed input just has to be turned down without a
+// bad read, so build with the sanitizers:
+//
+//   g++ -std=c++20 -g -O1 -fsanitize=address,undefined tools/checkDecoders.cpp
+//       -o checkDecoders -pthread && ./checkDecoders
+//
+// Prints the failed checks and exits non-zero if there are any.
+#include <random>
+#include "../src/main.cpp"
+
+static int failures = 0;
+static std::mt19937 rng(1);
+
+#define CHECK(condition)                                          \
+  do {                                                            \
+    if (!(condition)) {                                           \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                 \
+    }                                                             \
+  } while (0)
+
+static int randomInt(int n) { return (int)(rng() % n); }
+
+static Vec3i randomPosition() {
+  return {randomInt(16), randomInt(384) - 64, randomInt(16)};
+}
+
+// A column with varied palettes (one section uniform, one past the palette
+// limit), biomes and light
+static ChunkColumn *makeColumn(int x, int z) {
+  auto column = new ChunkColumn(nullptr, x, z);
+  for (int i = 0; i < 20000; i++) {
+    column->setBlockStateId(randomPosition(), randomInt(40));
+  }
+  for (int i = 0; i < 4096; i++) {
+    column->setBlockStateId({i & 15, 16 + (i >> 8), (i >> 4) & 15}, i + 1);
+    column->setBlockStateId({i & 15, -48 + (i >> 8), (i >> 4) & 15}, 7);
+  }
+  for (int i = 0; i < 500; i++) column->setBiomeId(randomPosition(), randomInt(9));
+  for (int i = 0; i < 2000; i++) {
+    column->setSkyLight(randomPosition(), randomInt(16));
+    column->setBlockLight(randomPosition(), randomInt(16));
+  }
+  // A bit per section
+  column->skyLightMask = 0xffffff;
+  column->blockLightMask = 0xffffff;
+  return column;
+}
+
+static bool sameBytes(const u8 *a, int aLength, const u8 *b, int bLength) {
+  return aLength == bLength && !memcmp(a, b, aLength);
+}
+
+template <typename Protocol>
+static bool samePacket(ChunkColumn *a, ChunkColumn *b) {
+  u8 *aPacket;
+  u8 *bPacket;
+  int aLength;
+  int bLength;
+  a->writeChunkPacket<Protocol>(aPacket, aLength);
+  b->writeChunkPacket<Protocol>(bPacket, bLength);
+  bool same = sameBytes(aPacket, aLength, bPacket, bLength);
+  free(aPacket);
+  free(bPacket);
+  return same;
+}
+
+// Runs `decode` on prefixes of `data` and on copies with a few bits flipped.
+// It must not read out of bounds; whether it succeeds doesn't matter.
+template <typename Decode>
+static void mangle(const u8 *data, int length, int flips, Decode decode) {
+  auto copy = (u8 *)malloc(length + 1);
+  for (int cut = 0; cut < length; cut += 1 + cut / 16) {
+    // Exactly `cut` bytes, so ASan sees reads past the end
+    auto prefix = (u8 *)malloc(cut + 1);
+    memcpy(prefix, data, cut);
+    decode(prefix, cut);
+    free(prefix);
+  }
+  for (int i = 0; i < flips; i++) {
+    memcpy(copy, data, length);
+    for (int f = 0; f < 1 + i % 4; f++) {
+      copy[randomInt(length)] ^= 1 << randomInt(8);
+    }
+    decode(copy, length);
+  }
+  free(copy);
+}
+
+// The stream with the varint at `at` (`oldLength` bytes) replaced by `value`
+static BinaryStream *replaceVarInt(const u8 *data, int length, int at,
+                                   int oldLength, int value) {
+  auto stream = new BinaryStream(length + 5);
+  stream->write((void *)data, at);
+  stream->writeUVarInt((u32)value);
+  stream->write((void *)(data + at + oldLength), length - at - oldLength);
+  return stream;
+}
+
+template <typename Protocol>
+static void checkChunkPackets() {
+  auto column = makeColumn(3, -7);
+  auto decoded = new ChunkColumn(nullptr);
+
+  u8 *packet;
+  int length;
+  column->writeChunkPacket<Protocol>(packet, length);
+  CHECK(decoded->decodeInto<Protocol>(packet, length));
+  CHECK(samePacket<Protocol>(column, decoded));
+  mangle(packet, length, 1000, [&](u8 *data, int dataLength) {
+    decoded->decodeInto<Protocol>(data, dataLength);
+  });
+
+  // Terrain lengths that are negative or run past the packet
+  BinaryStream stream(packet, length);
+  stream.skip(8);
+  CHECK(skipNBT(stream, Protocol::NAMED_NBT_ROOT));
+  int at = stream.readPosition;
+  stream.readVarInt();
+  int varIntLength = stream.readPosition - at;
+  for (int terrainLength : {-1, -100000, length, 1 << 30, 0x7fffffff}) {
+    auto bad = replaceVarInt(packet, length, at, varIntLength, terrainLength);
+    CHECK(!decoded->decodeInto<Protocol>(bad->data, bad->writePosition));
+    delete bad;
+  }
+  free(packet);
+
+  for (int level = DEFLATE_STORE; level <= DEFLATE_BALANCED; level++) {
+    Deflater deflater((DeflateLevel)level);
+    column->writeCompressedChunkPacket<Protocol>(deflater, packet, length);
+    CHECK(decoded->decodeCompressedInto<Protocol>(packet, length));
+    CHECK(samePacket<Protocol>(column, decoded));
+    mangle(packet, length, level == DEFLATE_BALANCED ? 500 : 0,
+           [&](u8 *data, int dataLength) {
+             decoded->decodeCompressedInto<Protocol>(data, dataLength);
+           });
+
+    // The declared uncompressed length must match and be sane
+    BinaryStream framed(packet, length);
+    int dataLength = framed.readVarInt();
+    int headerLength = framed.readPosition;
+    for (int declared : {dataLength - 1, dataLength + 1, -7, 1 << 30}) {
+      auto bad = replaceVarInt(packet, length, 0, headerLength, declared);
+      CHECK(!decoded->decodeCompressedInto<Protocol>(bad->data,
+                                                     bad->writePosition));
+      delete bad;
+    }
+    free(packet);
+  }
+
+  delete decoded;
+  delete column;
+}
+
+// Sections the way a vanilla server sends them: over 256 states as 15 bit
+// global IDs with no palette, fewer with a palette at 4 bits or more, and the
+// words as big endian longs
+static void checkSectionFormat() {
+  BinaryStream direct(2 + 1 + 5 + 1024 * 8);
+  direct.writeShortBE(4096);
+  direct.writeByte(15);
+  direct.writeVarInt(1024);
+  for (int w = 0; w < 1024; w++) {
+    u64 word = 0;
+    for (int j = 0; j < 4; j++) word |= (u64)(1 + w * 4 + j) << (j * 15);
+    direct.writeULongBE(word);
+  }
+  auto section = new ChunkSection(nullptr);
+  BinaryStream directInput(direct.data, direct.writePosition);
+  CHECK(section->read(directInput));
+  CHECK(directInput.readPosition == direct.writePosition);
+  bool same = true;
+  for (int i = 0; i < 4096; i++) same &= section->blocks[i] == 1 + i;
+  CHECK(same);
+  BinaryStream written(2 + 1 + 5 + 4096 * 3 + 5 + 1024 * 8);
+  section->write(written);
+  CHECK(sameBytes(written.data, written.writePosition, direct.data,
+                  direct.writePosition));
+
+  // Two states, which would fit in 1 bit
+  BinaryStream indirect(2 + 1 + 1 + 2 + 2 + 256 * 8);
+  indirect.writeShortBE(2048);
+  indirect.writeByte(4);
+  indirect.writeVarInt(2);
+  indirect.writeVarInt(0);
+  indirect.writeVarInt(9);
+  indirect.writeVarInt(256);
+  for (int w = 0; w < 256; w++) indirect.writeULongBE(0x1010101010101010);
+  BinaryStream indirectInput(indirect.data, indirect.writePosition);
+  CHECK(section->read(indirectInput));
+  CHECK(section->getBlockStateId({1, 0, 0}) == 9);
+  CHECK(section->getBlockStateId({2, 0, 0}) == 0);
+  written.writePosition = 0;
+  section->write(written);
+  CHECK(written.data[2] == 4);
+  CHECK(section->occupiedBlocks == 2048);
+
+  // Data lengths that don't match the bits
+  indirect.data[3 + 4] = 255;
+  BinaryStream shortInput(indirect.data, indirect.writePosition);
+  CHECK(!section->read(shortInput));
+  delete section;
+}
+
+template <typename Protocol>
+static void checkRewriter() {
+  auto column = makeColumn(0, 0);
+  u8 *packet;
+  int length;
+  column->writeChunkPacket<Protocol>(packet, length);
+
+  PacketRewriter<Protocol> rewriter(nullptr);
+  CHECK(rewriter.load(packet, length));
+  for (int i = 0; i < 50; i++) {
+    auto position = randomPosition();
+    CHECK(rewriter.getBlockStateId(position.x, position.y, position.z) ==
+          column->getBlockStateId(position));
+    int stateId = randomInt(5000);
+    rewriter.setBlockStateId(position.x, position.y, position.z, stateId);
+    column->setBlockStateId(position, stateId);
+  }
+  BinaryStream rewritten(rewriter.getMaxSize());
+  rewriter.write(rewritten);
+  auto decoded = new ChunkColumn(nullptr);
+  CHECK(decoded->decodeInto<Protocol>(rewritten.data, rewritten.writePosition));
+  CHECK(samePacket<Protocol>(column, decoded));
+
+  mangle(packet, length, 500, [&](u8 *data, int dataLength) {
+    if (!rewriter.load(data, dataLength)) return;
+    for (int y = -64; y < 320; y += 16) rewriter.getBlockStateId(1, y, 2);
+    rewriter.setBlockStateId(1, 2, 3, 4);
+    BinaryStream output(rewriter.getMaxSize());
+    rewriter.write(output);
+  });
+
+  free(packet);
+  delete decoded;
+  delete column;
+}
+
+// Where the terrain starts and ends in a 1.18 chunk packet
+static void findTerrain(const u8 *packet, int length, out int &start,
+                        out int &end) {
+  BinaryStream stream((void *)packet, length);
+  stream.skip(8);
+  skipNBT(stream, true);
+  start = stream.readPosition;
+  int terrainLength = stream.readVarInt();
+  end = stream.readPosition + terrainLength;
+}
+
+// pc118_obfuscateChunkPacket must only touch the sections: everything before
+// and after the terrain comes out byte for byte, and the sections as
+// pc118_writeObfuscatedChunkPacket would write them from the column
+static void checkObfuscatePacket() {
+  auto column = makeColumn(5, 6);
+  const char tag[] = "\x0a\x00\x00\x00";
+  column->setBlockEntity({1, 2, 3}, BlockEntity((const i8 *)tag, 4));
+  column->setBlockEntity({15, 300, 0}, BlockEntity((const i8 *)tag, 4));
+  u8 *packet;
+  int length;
+  column->writeChunkPacket(packet, length);
+  int terrainStart, terrainEnd;
+  findTerrain(packet, length, terrainStart, terrainEnd);
+
+  int hidden[] = {12, 13, 100, 200, 3000};
+  int decoys[] = {20, 21, 22};
+  for (int mode : {ANTI_XRAY_HIDE, ANTI_XRAY_RANDOMIZE}) {
+    auto antiXray = pc118_newAntiXray(mode, nullptr);
+    pc118_configureAntiXray(antiXray, 64, 5, -1);
+    pc118_setAntiXrayStates(antiXray, 0, hidden, 5);
+    pc118_setAntiXrayStates(antiXray, 2, decoys, 3);
+
+    int obfuscatedLength;
+    auto obfuscated =
+        pc118_obfuscateChunkPacket(antiXray, packet, length, &obfuscatedLength);
+    CHECK(obfuscated);
+    if (!obfuscated) {
+      pc118_freeAntiXray(antiXray);
+      continue;
+    }
+    int start, end;
+    findTerrain(obfuscated, obfuscatedLength, start, end);
+    CHECK(sameBytes(obfuscated, start, packet, terrainStart));
+    CHECK(sameBytes(obfuscated + end, obfuscatedLength - end,
+                    packet + terrainEnd, length - terrainEnd));
+
+    int expectedLength;
+    auto expected =
+        pc118_writeObfuscatedChunkPacket(antiXray, column, &expectedLength);
+    CHECK(sameBytes(obfuscated, obfuscatedLength, expected, expectedLength));
+    CHECK(!sameBytes(obfuscated, obfuscatedLength, packet, length));
+    free(expected);
+    free(obfuscated);
+    pc118_freeAntiXray(antiXray);
+  }
+  free(packet);
+  delete column;
+}
+
+static void checkSnapshotFile() {
+  const int COUNT = 3;
+  ChunkColumn *columns[COUNT];
+  for (int i = 0; i < COUNT; i++) columns[i] = makeColumn(i, -i);
+  const char tag[] = "\x0a\x00\x00\x00";
+  columns[1]->setBlockEntity({1, 2, 3}, BlockEntity((const i8 *)tag, 4));
+
+  size_t size = SnapshotFile::getSize(columns, COUNT);
+  // open() wants 8 byte alignment, which malloc gives
+  auto file = (u8 *)malloc(size);
+  SnapshotFile::write(columns, COUNT, file);
+
+  {
+    SnapshotFile snapshot;
+    CHECK(snapshot.open(file, size, nullptr));
+    CHECK(snapshot.getColumnCount() == COUNT);
+    for (int i = 0; i < COUNT; i++) {
+      CHECK(snapshot.findColumn(i, -i) == i);
+      auto copied = snapshot.copyColumn(i);
+      auto loaded = snapshot.loadColumn(i);
+      CHECK(copied && samePacket<Protocol118>(columns[i], copied));
+      CHECK(loaded && samePacket<Protocol118>(columns[i], loaded));
+      // Writing to a column loaded in place copies the section first
+      if (loaded) loaded->setBlockStateId({0, 0, 0}, 999);
+      auto again = snapshot.copyColumn(i);
+      CHECK(again && samePacket<Protocol118>(columns[i], again));
+      delete copied;
+      delete loaded;
+      delete again;
+    }
+  }
+
+  // Any prefix of the file, and flipped bits, in a fresh copy each time as
+  // loading writes to it
+  auto copy = (u8 *)malloc(size);
+  auto tryFile = [&](size_t length) {
+    SnapshotFile snapshot;
+    if (!snapshot.open(copy, length, nullptr)) return;
+    for (int i = 0; i < snapshot.getColumnCount() && i < COUNT + 1; i++) {
+      delete snapshot.copyColumn(i);
+    }
+  };
+  for (size_t cut = 0; cut < size; cut += 1 + cut / 8) {
+    memcpy(copy, file, size);
+    tryFile(cut);
+  }
+  for (int i = 0; i < 300; i++) {
+    memcpy(copy, file, size);
+    // Mostly the header, index and record headers, where lengths live
+    size_t at = randomInt(4) ? randomInt(256) : randomInt((int)size);
+    copy[at] ^= 1 << randomInt(8);
+    tryFile(size);
+  }
+
+  // Column counts whose index would wrap around when multiplied out
+  for (int count : {0x10000000, 0x20000001, 0x7fffffff}) {
+    memcpy(copy, file, size);
+    ((int *)copy)[4] = count;
+    SnapshotFile snapshot;
+    CHECK(!snapshot.open(copy, size, nullptr));
+  }
+
+  free(copy);
+  free(file);
+  for (int i = 0; i < COUNT; i++) delete columns[i];
+}
+
+static void checkPacketQueue() {
+  auto column = makeColumn(5, 6);
+  u8 *packet;
+  int length;
+  column->writeChunkPacket(packet, length);
+
+  auto shared = (PacketQueueShared *)pc118_createQueue(1 << 20, 16);
+  CHECK(shared);
+  if (!shared) return;
+  auto queue = packetQueue;
+  u32 mask = shared->completionCapacity - 1;
+
+  // Takes every completion, checking the statuses in order
+  auto collect = [&](std::initializer_list<int> statuses) {
+    int drained = pc118_drainQueue(16);
+    CHECK(drained == (int)statuses.size());
+    for (int status : statuses) {
+      if (shared->completionTail == shared->completionHead) break;
+      auto &completion = shared->completions[shared->completionTail & mask];
+      CHECK(completion.status == status);
+      if (completion.column) {
+        CHECK(samePacket<Protocol118>(column, (ChunkColumn *)completion.column));
+        pc118_releaseChunk(completion.column);
+      }
+      shared->completionTail++;
+    }
+  };
+
+  CHECK(queue->push(1, 0, 0, packet, length));
+  CHECK(queue->push(2, PROTOCOL_1_18_2, 0, packet, length / 2));
+  CHECK(queue->push(3, 12345, 0, packet, length));
+  collect({QUEUE_OK, QUEUE_DECODE_FAILED, QUEUE_UNSUPPORTED_PROTOCOL});
+
+  // Frames as a buggy or hostile host might write them
+  for (int frameLength : {-5, 1 << 29, 64}) {
+    u32 offset = shared->frameHead & (shared->frameCapacity - 1);
+    auto header = (FrameHeader *)(shared->frames + offset);
+    *header = {frameLength, 9, 0, 0};
+    memset(header + 1, 0xff, 64);
+    // Claims more than was written, except for the last, which is garbage
+    shared->frameHead += sizeof(FrameHeader) + (frameLength == 64 ? 64 : 8);
+    collect({frameLength == 64 ? QUEUE_DECODE_FAILED : QUEUE_BAD_FRAME});
+    CHECK(shared->frameTail == shared->frameHead);
+  }
+  // Less than a frame header
+  shared->frameHead += 8;
+  collect({QUEUE_BAD_FRAME});
+  shared->frameHead += 1 << 24;
+  collect({QUEUE_BAD_FRAME});
+
+  // Still usable afterwards
+  CHECK(queue->push(4, 0, 0, packet, length));
+  collect({QUEUE_OK});
+
+  pc118_freeQueue();
+  free(packet);
+  delete column;
+}
+
+static void checkBedrock() {
+  LevelChunk chunk(nullptr, 1, 2);
+  for (int i = 0; i < 20000; i++) {
+    auto position = randomPosition();
+    chunk.setBlockId(position, randomInt(8) ? 0 : 1, randomInt(300));
+  }
+  for (int i = 0; i < 300; i++) chunk.setBiomeId(randomPosition(), randomInt(40));
+
+  for (int version : {8, 9}) {
+    BinaryStream payload(chunk.getPayloadMaxSize());
+    chunk.writePayload(payload, version);
+    int subChunkCount = chunk.getSubChunkCount();
+    LevelChunk decoded(nullptr);
+    BinaryStream input(payload.data, payload.writePosition);
+    CHECK(decoded.readPayload(input, subChunkCount));
+    BinaryStream again(decoded.getPayloadMaxSize());
+    decoded.writePayload(again, version);
+    CHECK(sameBytes(payload.data, payload.writePosition, again.data,
+                    again.writePosition));
+    mangle(payload.data, payload.writePosition, 300,
+           [&](u8 *data, int dataLength) {
+             BinaryStream stream(data, dataLength);
+             decoded.readPayload(stream, subChunkCount);
+           });
+    for (int count : {-1, LevelChunk::NUM_SUB_CHUNKS + 1}) {
+      BinaryStream stream(payload.data, payload.writePosition);
+      CHECK(!decoded.readPayload(stream, count));
+    }
+  }
+
+  // Disk sub chunks carry NBT block states
+  DiskPalette palette;
+  u8 air[] = {10, 0, 0, 8, 4, 0, 'n', 'a', 'm', 'e', 3, 0, 'a', 'i', 'r', 0};
+  u8 stone[] = {10, 0,   0,   8,   4,   0,   'n', 'a', 'm',
+                'e', 5, 0, 's', 't', 'o', 'n', 'e', 0};
+  CHECK(palette.add(air, sizeof(air)) == 0);
+  CHECK(palette.add(stone, sizeof(stone)) == 1);
+  LevelChunk disk(nullptr);
+  for (int i = 0; i < 4096; i++) {
+    disk.setBlockId({i & 15, i >> 8, (i >> 4) & 15}, 0, randomInt(2));
+  }
+  BinaryStream subChunk(disk.subChunks[LevelChunk::CO].getMaxSize() +
+                        4096 * sizeof(stone));
+  disk.writeSubChunk(subChunk, 0, 9, BEDROCK_DISK, &palette);
+  LevelChunk diskDecoded(nullptr);
+  BinaryStream input(subChunk.data, subChunk.writePosition);
+  CHECK(diskDecoded.readSubChunk(input, 0, BEDROCK_DISK, &palette));
+  CHECK(palette.count == 2);
+  CHECK(!memcmp(disk.subChunks[LevelChunk::CO].layers[0]->blocks,
+                diskDecoded.subChunks[LevelChunk::CO].layers[0]->blocks,
+                sizeof(ChunkSection::blocks)));
+  mangle(subChunk.data, subChunk.writePosition, 300,
+         [&](u8 *data, int dataLength) {
+           BinaryStream stream(data, dataLength);
+           diskDecoded.readSubChunk(stream, 0, BEDROCK_DISK, &palette);
+         });
+
+  BinaryStream data3D(chunk.getData3DMaxSize());
+  chunk.writeData3D(data3D);
+  LevelChunk heights(nullptr);
+  BinaryStream heightsInput(data3D.data, data3D.writePosition);
+  CHECK(heights.readData3D(heightsInput));
+  mangle(data3D.data, data3D.writePosition, 100, [&](u8 *data, int n) {
+    BinaryStream stream(data, n);
+    heights.readData3D(stream);
+  });
+}
+
+// A one block registry blob laid out as tools/genRegistry.js does, then with
+// each table moved out of the blob
+static void checkRegistry() {
+  u32 blob[29] = {};
+  auto header = (RegistryHeader *)blob;
+  auto bytes = (u8 *)blob;
+  *header = {REGISTRY_MAGIC, REGISTRY_VERSION, 1, 1, 0, 0,
+             72, 76, 80, 84, 88, 104, 104, 104, 1, 1, 108, 112};
+  bytes[72] = STATE_AIR | STATE_TRANSPARENT;
+  memcpy(bytes + 104, "\x03" "air", 4);
+  int length = sizeof(blob);
+
+  Registry registry;
+  CHECK(registry.load(bytes, length));
+  CHECK(registry.isAir(0));
+  CHECK(registry.findBlock("minecraft:air", 13) == 0);
+  for (int cut = 0; cut < length - 4; cut += 4) {
+    CHECK(!Registry().load(bytes, cut));
+  }
+
+  // Every offset field, pointed past the end, at the end of a u32's range
+  // and out of alignment
+  for (int field = 6; field < 18; field++) {
+    if (field == 14 || field == 15) continue;  // hashSize, hashBucketCount
+    u32 original = blob[field];
+    for (u32 offset : {(u32)length + 4, 0xfffffff0u, original + 1}) {
+      blob[field] = offset;
+      CHECK(!Registry().load(bytes, length));
+    }
+    blob[field] = original;
+  }
+  // Counts that overflow a u32 when multiplied out
+  for (int field : {2, 3, 4, 5, 14, 15}) {
+    u32 original = blob[field];
+    blob[field] = 0x80000001u;
+    CHECK(!Registry().load(bytes, length));
+    blob[field] = original;
+  }
+  header->hashBucketCount = 0;
+  CHECK(!Registry().load(bytes, length));
+}
+
+static void checkNBT() {
+  auto skips = [](std::initializer_list<int> bytes) {
+    u8 data[64];
+    int length = 0;
+    for (int byte : bytes) data[length++] = byte;
+    BinaryStream stream(data, length);
+    return skipNBT(stream, false);
+  };
+  CHECK(skips({10, 7, 0, 0, 0, 0, 0, 2, 1, 2, 0}));
+  CHECK(skips({10, 9, 0, 0, 0, 0, 0, 0, 0, 0}));
+  // Negative array lengths
+  CHECK(!skips({10, 7, 0, 0, 0xff, 0xff, 0xff, 0xf0, 0}));
+  CHECK(!skips({10, 11, 0, 0, 0x80, 0, 0, 0, 0}));
+  CHECK(!skips({10, 12, 0, 0, 0xff, 0xff, 0xff, 0xff, 0}));
+  // A long list of nothing
+  CHECK(!skips({10, 9, 0, 0, 0, 0x7f, 0xff, 0xff, 0xff, 0}));
+  CHECK(!skips({10, 99, 0}));
+
+  // Lists nested past the depth limit
+  static u8 deep[5 * 1000 + 1];
+  int length = 0;
+  deep[length++] = TAG_List;
+  for (int i = 0; i < 1000; i++) {
+    u8 level[] = {TAG_List, 0, 0, 0, 1};
+    memcpy(deep + length, level, sizeof(level));
+    length += sizeof(level);
+  }
+  BinaryStream stream(deep, length);
+  CHECK(!skipNBT(stream, false));
+}
+
+int main() {
+  checkChunkPackets<Protocol118>();
+  checkChunkPackets<ProtocolTraits<PROTOCOL_1_20_2>>();
+  checkSectionFormat();
+  checkRewriter<Protocol118>();
+  checkRewriter<ProtocolTraits<PROTOCOL_1_20_2>>();
+  checkObfuscatePacket();
+  checkSnapshotFile();
+  checkPacketQueue();
+  checkBedrock();
+  checkRegistry();
+  checkNBT();
+  printf("%d failed\n", failures);
+  return failures ? 1 : 0;
+}
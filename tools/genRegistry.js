@@ -0,0 +1,213 @@
+// Builds the block state registry blob read by src/Registry.h.
+//
+//   node tools/genRegistry.js <version | path/to/blocks.json> <out.bin>
+//
+// With a version, block data comes from the minecraft-data package. The
+// layout must match RegistryHeader, RegistryBlock and RegistryProperty.
+
+const fs = require('fs')
+
+const MAGIC = 0x4752434d
+const VERSION = 1
+
+const STATE_AIR = 1
+const STATE_SOLID = 2
+const STATE_FLUID = 4
+const STATE_TRANSPARENT = 8
+const STATE_OPAQUE_CUBE = 16
+
+const AIR_BLOCKS = ['air', 'cave_air', 'void_air']
+const FLUID_BLOCKS = ['water', 'lava', 'bubble_column']
+
+function loadBlocks (source) {
+  if (source.endsWith('.json')) return JSON.parse(fs.readFileSync(source, 'utf8'))
+  return require('minecraft-data')(source).blocksArray
+}
+
+// FNV-1a, must match registryHash() in Registry.h
+function hash (seed, bytes) {
+  let h = (2166136261 ^ seed) >>> 0
+  for (const b of bytes) {
+    h ^= b
+    h = Math.imul(h, 16777619) >>> 0
+  }
+  return h
+}
+
+function propertyValues (state) {
+  if (state.type === 'bool') return ['true', 'false']
+  if (state.values) return state.values.map(String)
+  return Array.from({ length: state.num_values }, (_, i) => String(i))
+}
+
+// Hash and displace: bucket keys by a first hash, then for the largest
+// buckets first find a seed that drops every key in an empty slot
+function buildPerfectHash (names) {
+  const size = Math.max(1, Math.ceil(names.length * 1.25))
+  const bucketCount = Math.max(1, Math.ceil(names.length / 4))
+  const keys = names.map(n => Buffer.from(n))
+  const buckets = Array.from({ length: bucketCount }, () => [])
+  keys.forEach((key, i) => buckets[hash(0, key) % bucketCount].push(i))
+
+  const slots = new Uint16Array(size).fill(0xffff)
+  const displacements = new Uint32Array(bucketCount)
+  const order = buckets.map((b, i) => i).sort((a, b) => buckets[b].length - buckets[a].length)
+  for (const bucket of order) {
+    const members = buckets[bucket]
+    if (!members.length) continue
+    for (let seed = 1; ; seed++) {
+      const taken = members.map(i => hash(seed, keys[i]) % size)
+      if (taken.some((slot, j) => slots[slot] !== 0xffff || taken.indexOf(slot) !== j)) continue
+      taken.forEach((slot, j) => { slots[slot] = members[j] })
+      displacements[bucket] = seed
+      break
+    }
+  }
+  return { size, bucketCount, slots, displacements }
+}
+
+function build (blocks) {
+  blocks = blocks.slice().sort((a, b) => a.minStateId - b.minStateId)
+  const stateCount = Math.max(...blocks.map(b => b.maxStateId)) + 1
+  if (blocks.length >= 0xffff || stateCount > 0xffff) throw new Error('too many blocks or states for u16 tables')
+
+  const strings = []
+  const stringOffsets = new Map()
+  let stringsLength = 0
+  function string (s) {
+    if (stringOffsets.has(s)) return stringOffsets.get(s)
+    const bytes = Buffer.from(s)
+    if (bytes.length > 255) throw new Error('string too long: ' + s)
+    const offset = stringsLength
+    strings.push(Buffer.from([bytes.length]), bytes)
+    stringsLength += bytes.length + 1
+    stringOffsets.set(s, offset)
+    return offset
+  }
+
+  const flags = new Uint8Array(stateCount)
+  const light = new Uint8Array(stateCount)
+  const stateBlocks = new Uint16Array(stateCount)
+  const stateProperties = new Uint32Array(stateCount)
+  const blockRecords = []
+  const propertyRecords = []
+  const values = []
+
+  blocks.forEach((block, index) => {
+    const props = block.states || []
+    const firstProperty = propertyRecords.length
+    let shift = 0
+    const layout = props.map(state => {
+      const names = propertyValues(state)
+      const bits = Math.max(1, Math.ceil(Math.log2(names.length)))
+      const record = { name: string(state.name), firstValue: values.length, valueCount: names.length, shift, bits }
+      for (const value of names) values.push(string(value))
+      propertyRecords.push(record)
+      shift += bits
+      return record
+    })
+    if (shift > 32) throw new Error(block.name + ' has more than 32 bits of properties')
+
+    let stateFlags = 0
+    if (AIR_BLOCKS.includes(block.name)) stateFlags |= STATE_AIR
+    if (FLUID_BLOCKS.includes(block.name)) stateFlags |= STATE_FLUID
+    if (block.boundingBox === 'block') stateFlags |= STATE_SOLID
+    if (block.transparent) stateFlags |= STATE_TRANSPARENT
+    if (block.boundingBox === 'block' && !block.transparent) stateFlags |= STATE_OPAQUE_CUBE
+    const stateLight = (Math.min(15, block.filterLight || 0) << 4) | Math.min(15, block.emitLight || 0)
+
+    for (let id = block.minStateId; id <= block.maxStateId; id++) {
+      flags[id] = stateFlags
+      light[id] = stateLight
+      stateBlocks[id] = index
+      // minecraft-data state ids are mixed radix with the last property
+      // varying fastest
+      let rest = id - block.minStateId
+      let packed = 0
+      for (let p = layout.length - 1; p >= 0; p--) {
+        packed |= (rest % layout[p].valueCount) << layout[p].shift
+        rest = Math.floor(rest / layout[p].valueCount)
+      }
+      stateProperties[id] = packed >>> 0
+    }
+
+    blockRecords.push({
+      name: string(block.name),
+      minStateId: block.minStateId,
+      maxStateId: block.maxStateId,
+      defaultStateId: block.defaultState ?? block.minStateId,
+      firstProperty,
+      propertyCount: layout.length
+    })
+  })
+
+  const perfectHash = buildPerfectHash(blocks.map(b => b.name))
+
+  // Lay the tables out after the header, each 4 byte aligned
+  const HEADER_SIZE = 18 * 4
+  let offset = HEADER_SIZE
+  const align = () => { offset = (offset + 3) & ~3 }
+  const place = (size) => { align(); const at = offset; offset += size; return at }
+  const layout = {
+    stateFlagsOffset: place(stateCount),
+    stateLightOffset: place(stateCount),
+    stateBlockOffset: place(stateCount * 2),
+    statePropertiesOffset: place(stateCount * 4),
+    blocksOffset: place(blockRecords.length * 16),
+    propertiesOffset: place(propertyRecords.length * 12),
+    valuesOffset: place(values.length * 4),
+    stringsOffset: place(stringsLength),
+    hashDisplacementsOffset: place(perfectHash.bucketCount * 4),
+    hashSlotsOffset: place(perfectHash.size * 2)
+  }
+  align()
+
+  const out = Buffer.alloc(offset)
+  const header = [
+    MAGIC, VERSION, stateCount, blockRecords.length, propertyRecords.length, values.length,
+    layout.stateFlagsOffset, layout.stateLightOffset, layout.stateBlockOffset, layout.statePropertiesOffset,
+    layout.blocksOffset, layout.propertiesOffset, layout.valuesOffset, layout.stringsOffset,
+    perfectHash.size, perfectHash.bucketCount, layout.hashDisplacementsOffset, layout.hashSlotsOffset
+  ]
+  header.forEach((value, i) => out.writeUInt32LE(value, i * 4))
+
+  Buffer.from(flags.buffer).copy(out, layout.stateFlagsOffset)
+  Buffer.from(light.buffer).copy(out, layout.stateLightOffset)
+  Buffer.from(stateBlocks.buffer).copy(out, layout.stateBlockOffset)
+  Buffer.from(stateProperties.buffer).copy(out, layout.statePropertiesOffset)
+  blockRecords.forEach((b, i) => {
+    const at = layout.blocksOffset + i * 16
+    out.writeUInt32LE(b.name, at)
+    out.writeUInt16LE(b.minStateId, at + 4)
+    out.writeUInt16LE(b.maxStateId, at + 6)
+    out.writeUInt16LE(b.defaultStateId, at + 8)
+    out.writeUInt16LE(b.firstProperty, at + 10)
+    out.writeUInt8(b.propertyCount, at + 12)
+  })
+  propertyRecords.forEach((p, i) => {
+    const at = layout.propertiesOffset + i * 12
+    out.writeUInt32LE(p.name, at)
+    out.writeUInt16LE(p.firstValue, at + 4)
+    out.writeUInt8(p.valueCount, at + 6)
+    out.writeUInt8(p.shift, at + 7)
+    out.writeUInt8(p.bits, at + 8)
+  })
+  values.forEach((v, i) => out.writeUInt32LE(v, layout.valuesOffset + i * 4))
+  Buffer.concat(strings).copy(out, layout.stringsOffset)
+  Buffer.from(perfectHash.displacements.buffer).copy(out, layout.hashDisplacementsOffset)
+  Buffer.from(perfectHash.slots.buffer).copy(out, layout.hashSlotsOffset)
+  return out
+}
+
+if (require.main === module) {
+  const [source, target] = process.argv.slice(2)
+  if (!source || !target) {
+    console.error('usage: node tools/genRegistry.js <version | blocks.json> <out.bin>')
+    process.exit(1)
+  }
+  const blob = build(loadBlocks(source))
+  fs.writeFileSync(target, blob)
+  console.log(`wrote ${target} (${blob.length} bytes)`)
+}
+
+module.exports = { build }